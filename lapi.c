@@ -383,10 +383,31 @@ LUA_API const char *lua_tolstring (lua_State *L, int idx, size_t *len) {
   }
   if (len != NULL)
     *len = vslen(o);
+  lua_lock(L);  /* 'luaS_terminate' may give the string a new buffer */
+  luaS_terminate(L, tsvalue(o));
+  lua_unlock(L);
   return svalue(o);
 }
 
 
+#if defined(LUA_USE_STRVIEWS)
+
+/*
+** Like 'lua_tolstring', but the bytes of a string may not end with a
+** '\0', and a later 'lua_tolstring' over the same string may move them.
+*/
+LUA_API const char *lua_tobytes (lua_State *L, int idx, size_t *len) {
+  const TValue *o = index2value(L, idx);
+  if (!ttisstring(o))
+    return lua_tolstring(L, idx, len);
+  if (len != NULL)
+    *len = vslen(o);
+  return svalue(o);
+}
+
+#endif
+
+
 LUA_API lua_Unsigned lua_rawlen (lua_State *L, int idx) {
   const TValue *o = index2value(L, idx);
   switch (ttypetag(o)) {
@@ -477,6 +498,11 @@ LUA_API void lua_pushinteger (lua_State *L, lua_Integer n) {
 LUA_API const char *lua_pushlstring (lua_State *L, const char *s, size_t len) {
   TString *ts;
   lua_lock(L);
+#if defined(LUA_USE_STRVIEWS)
+  if (len >= LUAI_MINVIEW)  /* large string? */
+    ts = luaS_newextlstr(L, s, len);  /* keep it where views can share it */
+  else
+#endif
   ts = (len == 0) ? luaS_new(L, "") : luaS_newlstr(L, s, len);
   setsvalue2s(L, L->top, ts);
   api_incr_top(L);
@@ -486,6 +512,29 @@ LUA_API const char *lua_pushlstring (lua_State *L, const char *s, size_t len) {
 }
 
 
+#if defined(LUA_USE_STRVIEWS)
+
+/*
+** Pushes on the stack the 'l' bytes of the string at index 'idx'
+** starting at position 'i' (from 0), sharing them when they are many.
+*/
+LUA_API void lua_pushsubstring (lua_State *L, int idx, size_t i, size_t l) {
+  const TValue *o;
+  TString *ts;
+  lua_lock(L);
+  o = index2value(L, idx);
+  api_check(L, ttisstring(o), "string expected");
+  api_check(L, i <= vslen(o) && l <= vslen(o) - i, "invalid substring");
+  ts = (l == 0) ? luaS_new(L, "") : luaS_sub(L, tsvalue(o), i, l);
+  setsvalue2s(L, L->top, ts);
+  api_incr_top(L);
+  luaC_checkGC(L);
+  lua_unlock(L);
+}
+
+#endif
+
+
 LUA_API const char *lua_pushstring (lua_State *L, const char *s) {
   lua_lock(L);
   if (s == NULL)
@@ -503,6 +552,47 @@ LUA_API const char *lua_pushstring (lua_State *L, const char *s) {
 }
 
 
+#if defined(LUA_USE_APPENDSTR)
+
+/*
+** Make '*b' (NULL for a new buffer) a buffer with room for 'size'
+** bytes, keeping its first 'len' ones, and return its bytes. Strings
+** pushed from the buffer keep their bytes: the caller may write only
+** after 'len', and the buffer moves when 'len' is shorter than some
+** of them.
+*/
+LUA_API char *lua_resizestrbuf (lua_State *L, void **b, size_t len,
+                                                 size_t size) {
+  char *res;
+  StrBuf *buf = cast(StrBuf *, *b);
+  lua_lock(L);
+  res = luaS_resizestrbuf(L, &buf, len, size);
+  *b = buf;
+  lua_unlock(L);
+  return res;
+}
+
+
+LUA_API void lua_pushstrbuf (lua_State *L, void *b, size_t len) {
+  TString *ts;
+  lua_lock(L);
+  ts = luaS_newstrbuf(L, cast(StrBuf *, b), len);
+  setsvalue2s(L, L->top, ts);
+  api_incr_top(L);
+  luaC_checkGC(L);
+  lua_unlock(L);
+}
+
+
+LUA_API void lua_freestrbuf (lua_State *L, void *b) {
+  lua_lock(L);
+  luaS_freestrbuf(L, cast(StrBuf *, b));
+  lua_unlock(L);
+}
+
+#endif
+
+
 LUA_API const char *lua_pushvfstring (lua_State *L, const char *fmt,
                                       va_list argp) {
   const char *ret;
@@ -583,6 +673,12 @@ LUA_API int lua_pushthread (lua_State *L) {
 */
 
 
+/* get the global table (from the registry) into 'gt' */
+#define getGtable(L,gt)  \
+	luaH_getint(hvalue(&G(L)->l_registry), LUA_RIDX_GLOBALS, gt)
+
+
+
 static int auxgetstr (lua_State *L, const TValue *t, const char *k) {
   const TValue *slot;
   TString *str = luaS_new(L, k);
@@ -601,9 +697,10 @@ static int auxgetstr (lua_State *L, const TValue *t, const char *k) {
 
 
 LUA_API int lua_getglobal (lua_State *L, const char *name) {
-  Table *reg = hvalue(&G(L)->l_registry);
+  TValue gt;
   lua_lock(L);
-  return auxgetstr(L, luaH_getint(reg, LUA_RIDX_GLOBALS), name);
+  getGtable(L, &gt);
+  return auxgetstr(L, &gt, name);
 }
 
 
@@ -612,10 +709,7 @@ LUA_API int lua_gettable (lua_State *L, int idx) {
   TValue *t;
   lua_lock(L);
   t = index2value(L, idx);
-  if (luaV_fastget(L, t, s2v(L->top - 1), slot, luaH_get)) {
-    setobj2s(L, L->top - 1, slot);
-  }
-  else
+  if (!luaV_fastgetv(L, t, s2v(L->top - 1), s2v(L->top - 1), slot, luaH_get))
     luaV_finishget(L, t, s2v(L->top - 1), L->top - 1, slot);
   lua_unlock(L);
   return ttype(s2v(L->top - 1));
@@ -631,12 +725,11 @@ LUA_API int lua_getfield (lua_State *L, int idx, const char *k) {
 LUA_API int lua_geti (lua_State *L, int idx, lua_Integer n) {
   TValue *t;
   const TValue *slot;
+  int ok;
   lua_lock(L);
   t = index2value(L, idx);
-  if (luaV_fastgeti(L, t, n, slot)) {
-    setobj2s(L, L->top, slot);
-  }
-  else {
+  luaV_fastgeti(L, t, n, s2v(L->top), slot, ok);
+  if (!ok) {
     TValue aux;
     setivalue(&aux, n);
     luaV_finishget(L, t, &aux, L->top, slot);
@@ -647,11 +740,13 @@ LUA_API int lua_geti (lua_State *L, int idx, lua_Integer n) {
 }
 
 
-static int finishrawget (lua_State *L, const TValue *val) {
-  if (isempty(val))  /* avoid copying empty items to the stack */
+/*
+** Finish a raw get that has already copied the value (if 'found') to
+** the top of the stack.
+*/
+static int finishrawget (lua_State *L, int found) {
+  if (!found)  /* no value? */
     setnilvalue(s2v(L->top));
-  else
-    setobj2s(L, L->top, val);
   api_incr_top(L);
   lua_unlock(L);
   return ttype(s2v(L->top - 1));
@@ -667,13 +762,14 @@ static Table *gettable (lua_State *L, int idx) {
 
 LUA_API int lua_rawget (lua_State *L, int idx) {
   Table *t;
-  const TValue *val;
+  int found;
   lua_lock(L);
   api_checknelems(L, 1);
   t = gettable(L, idx);
-  val = luaH_get(t, s2v(L->top - 1));
+  /* result goes over the key */
+  found = luaH_get(t, s2v(L->top - 1), s2v(L->top - 1));
   L->top--;  /* remove key */
-  return finishrawget(L, val);
+  return finishrawget(L, found);
 }
 
 
@@ -681,7 +777,7 @@ LUA_API int lua_rawgeti (lua_State *L, int idx, lua_Integer n) {
   Table *t;
   lua_lock(L);
   t = gettable(L, idx);
-  return finishrawget(L, luaH_getint(t, n));
+  return finishrawget(L, luaH_getint(t, n, s2v(L->top)));
 }
 
 
@@ -691,7 +787,7 @@ LUA_API int lua_rawgetp (lua_State *L, int idx, const void *p) {
   lua_lock(L);
   t = gettable(L, idx);
   setpvalue(&k, cast_voidp(p));
-  return finishrawget(L, luaH_get(t, &k));
+  return finishrawget(L, luaH_get(t, &k, s2v(L->top)));
 }
 
 
@@ -781,9 +877,10 @@ static void auxsetstr (lua_State *L, const TValue *t, const char *k) {
 
 
 LUA_API void lua_setglobal (lua_State *L, const char *name) {
-  Table *reg = hvalue(&G(L)->l_registry);
+  TValue gt;
   lua_lock(L);  /* unlock done in 'auxsetstr' */
-  auxsetstr(L, luaH_getint(reg, LUA_RIDX_GLOBALS), name);
+  getGtable(L, &gt);
+  auxsetstr(L, &gt, name);
 }
 
 
@@ -793,10 +890,7 @@ LUA_API void lua_settable (lua_State *L, int idx) {
   lua_lock(L);
   api_checknelems(L, 2);
   t = index2value(L, idx);
-  if (luaV_fastget(L, t, s2v(L->top - 2), slot, luaH_get)) {
-    luaV_finishfastset(L, t, slot, s2v(L->top - 1));
-  }
-  else
+  if (!luaV_fastset(L, t, s2v(L->top - 2), slot, luaH_pset, s2v(L->top - 1)))
     luaV_finishset(L, t, s2v(L->top - 2), s2v(L->top - 1), slot);
   L->top -= 2;  /* pop index and value */
   lua_unlock(L);
@@ -815,10 +909,7 @@ LUA_API void lua_seti (lua_State *L, int idx, lua_Integer n) {
   lua_lock(L);
   api_checknelems(L, 1);
   t = index2value(L, idx);
-  if (luaV_fastgeti(L, t, n, slot)) {
-    luaV_finishfastset(L, t, slot, s2v(L->top - 1));
-  }
-  else {
+  if (!luaV_fastseti(L, t, n, slot, s2v(L->top - 1))) {
     TValue aux;
     setivalue(&aux, n);
     luaV_finishset(L, t, &aux, s2v(L->top - 1), slot);
@@ -830,12 +921,10 @@ LUA_API void lua_seti (lua_State *L, int idx, lua_Integer n) {
 
 LUA_API void lua_rawset (lua_State *L, int idx) {
   Table *t;
-  TValue *slot;
   lua_lock(L);
   api_checknelems(L, 2);
   t = gettable(L, idx);
-  slot = luaH_set(L, t, s2v(L->top - 2));
-  setobj2t(L, slot, s2v(L->top - 1));
+  luaH_set(L, t, s2v(L->top - 2), s2v(L->top - 1));
   invalidateTMcache(t);
   luaC_barrierback(L, obj2gco(t), s2v(L->top - 1));
   L->top -= 2;
@@ -857,13 +946,12 @@ LUA_API void lua_rawseti (lua_State *L, int idx, lua_Integer n) {
 
 LUA_API void lua_rawsetp (lua_State *L, int idx, const void *p) {
   Table *t;
-  TValue k, *slot;
+  TValue k;
   lua_lock(L);
   api_checknelems(L, 1);
   t = gettable(L, idx);
   setpvalue(&k, cast_voidp(p));
-  slot = luaH_set(L, t, &k);
-  setobj2t(L, slot, s2v(L->top - 1));
+  luaH_set(L, t, &k, s2v(L->top - 1));
   luaC_barrierback(L, obj2gco(t), s2v(L->top - 1));
   L->top--;
   lua_unlock(L);
@@ -1034,12 +1122,11 @@ LUA_API int lua_load (lua_State *L, lua_Reader reader, void *data,
   if (status == LUA_OK) {  /* no errors? */
     LClosure *f = clLvalue(s2v(L->top - 1));  /* get newly created function */
     if (f->nupvalues >= 1) {  /* does it have an upvalue? */
-      /* get global table from registry */
-      Table *reg = hvalue(&G(L)->l_registry);
-      const TValue *gt = luaH_getint(reg, LUA_RIDX_GLOBALS);
+      TValue gt;
+      getGtable(L, &gt);  /* get global table from registry */
       /* set global table as 1st upvalue of 'f' (may be LUA_ENV) */
-      setobj(L, f->upvals[0]->v, gt);
-      luaC_barrier(L, f->upvals[0], gt);
+      setobj(L, f->upvals[0]->v, &gt);
+      luaC_barrier(L, f->upvals[0], &gt);
     }
   }
   lua_unlock(L);
@@ -1161,6 +1248,81 @@ LUA_API int lua_gc (lua_State *L, int what, ...) {
       res = (oldmode == KGC_GEN) ? LUA_GCGEN : LUA_GCINC;
       break;
     }
+    case LUA_GCMARKERS: {
+      int data = va_arg(argp, int);
+#if defined(LUA_USE_PARALLELMARK)
+      res = luaC_setmarkers(L, data);
+#else
+      UNUSED(data);
+      res = 1;  /* collector always marks with one thread */
+#endif
+      break;
+    }
+    case LUA_GCBUDGET: {
+      int data = va_arg(argp, int);
+#if defined(LUA_USE_GCBUDGET)
+      res = cast_int(g->gcbudget);
+      if (data >= 0)
+        g->gcbudget = cast_uint(data);
+#else
+      UNUSED(data);
+      res = 0;  /* steps have no time budget */
+#endif
+      break;
+    }
+    case LUA_GCSTATS: {
+      int on = va_arg(argp, int);
+      lua_GCStats *stats = va_arg(argp, lua_GCStats *);
+#if defined(LUA_USE_GCSTATS)
+      res = g->gcstatson;
+      if (stats != NULL)
+        *stats = g->gcstats;
+      if (on > 0) {  /* (re)start statistics? */
+        memset(&g->gcstats, 0, sizeof(g->gcstats));
+        g->gcstatson = 1;
+      }
+      else if (on == 0)
+        g->gcstatson = 0;
+#else
+      UNUSED(on); UNUSED(stats);
+      res = -1;  /* no statistics */
+#endif
+      break;
+    }
+    case LUA_GCFINBUDGET: {
+      int data = va_arg(argp, int);
+#if defined(LUA_USE_FINBATCH)
+      res = cast_int(g->gcfinbudget);
+      if (data >= 0)
+        g->gcfinbudget = cast_uint(data);
+#else
+      UNUSED(data);
+      res = 0;  /* finalizers have no time budget */
+#endif
+      break;
+    }
+    case LUA_GCDEFERFIN: {
+      int data = va_arg(argp, int);
+#if defined(LUA_USE_FINBATCH)
+      res = g->gcdeferfin;
+      if (data >= 0)
+        g->gcdeferfin = (data != 0);
+#else
+      UNUSED(data);
+      res = 0;  /* finalizers are never deferred */
+#endif
+      break;
+    }
+    case LUA_GCRUNFIN: {
+      int data = va_arg(argp, int);
+#if defined(LUA_USE_FINBATCH)
+      res = luaC_runfinalizers(L, (data > 0) ? cast_uint(data) : 0);
+#else
+      UNUSED(data);
+      res = (g->tobefnz != NULL);  /* the collector will call them */
+#endif
+      break;
+    }
     default: res = -1;  /* invalid option */
   }
   va_end(argp);
@@ -1227,6 +1389,26 @@ LUA_API void lua_len (lua_State *L, int idx) {
 }
 
 
+#if defined(LUA_USE_FASTHASH)
+
+/*
+** Set how long strings are hashed and return the previous mode, or -1
+** if some live long string already has its hash (and so the mode
+** cannot change).
+*/
+LUA_API int lua_hashmode (lua_State *L, int mode) {
+  int res;
+  lua_lock(L);
+  api_check(L, mode == LUA_HASHSAMPLE || mode == LUA_HASHALL,
+               "invalid hash mode");
+  res = luaS_hashmode(L, mode);
+  lua_unlock(L);
+  return res;
+}
+
+#endif
+
+
 LUA_API lua_Alloc lua_getallocf (lua_State *L, void **ud) {
   lua_Alloc f;
   lua_lock(L);
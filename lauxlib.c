@@ -935,6 +935,362 @@ static void *l_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
 }
 
 
+#if defined(LUA_USE_POOLALLOC) && !defined(LUA_USE_BGSWEEP)
+
+/*
+** {======================================================
+** Pooled allocator
+** =======================================================
+*/
+
+/*
+** Blocks up to POOLMAX bytes come from slabs of POOLSLAB bytes. Each
+** slab holds blocks of a single size class (a multiple of POOLGRAIN)
+** and of a single kind: the tag the core gives when it creates a block
+** (the type of the new object, or 0 for other blocks), so that objects
+** of the same kind stay together. Slabs are aligned to their size, so
+** the slab of a block comes from its address. They are carved from
+** chunks of POOLCHUNK slabs allocated with 'malloc'; chunks with no
+** slab in use go back to 'malloc'. Larger blocks use 'realloc' and
+** 'free' directly.
+**
+** Lua assumes that shrinking a block never fails, but a large block
+** shrunk to POOLMAX bytes or less must move to a slab. So the pool
+** keeps an empty slab in reserve, which only such moves can take.
+**
+** A pool serves a single state and has no locks. It is freed together
+** with its last block, when 'lua_close' frees the state.
+*/
+
+#define POOLGRAIN	16
+#define POOLMAX		256
+#define POOLSLAB	(1u << 14)
+#define POOLCHUNK	32
+
+/* number of size classes */
+#define NCLASSES	(POOLMAX / POOLGRAIN)
+
+/* number of kinds: basic types, upvalues, and prototypes */
+#define NKINDS		(LUA_NUMTAGS + 2)
+
+#define sizeclass(sz)	(((sz) - 1) / POOLGRAIN)
+
+
+typedef struct Slab {
+  struct Slab *next, *prev;  /* in list of available or of empty slabs */
+  struct Chunk *chunk;  /* chunk containing this slab */
+  void *free;  /* list of freed blocks */
+  char *top;  /* first block never used */
+  char *end;  /* end of last block */
+  unsigned int nused;  /* number of blocks in use */
+  unsigned int size;  /* size of its blocks */
+  int kind;
+} Slab;
+
+
+typedef struct Chunk {
+  struct Chunk *next, *prev;
+  char *slabs;  /* first slab (aligned) */
+  int nused;  /* number of slabs in use */
+} Chunk;
+
+
+typedef struct Pool {
+  Slab *avail[NKINDS][NCLASSES];  /* slabs with free blocks */
+  Slab *empty;  /* slabs not in use */
+  Chunk *chunks;
+  int nempty;  /* number of slabs in 'empty' */
+  int started;  /* true after first allocation */
+  size_t nblocks;  /* number of blocks in use */
+  size_t requested;  /* bytes requested in slab blocks */
+  size_t used;  /* bytes used by slab blocks */
+  size_t large;  /* bytes in large blocks */
+  size_t nlarge;  /* number of large blocks */
+  size_t kindblocks[NKINDS];  /* number of slab blocks of each kind */
+  size_t kindbytes[NKINDS];  /* bytes requested in slab blocks of each kind */
+} Pool;
+
+
+/* start of the blocks in a slab */
+#define SLABHEAD	((sizeof(Slab) + POOLGRAIN - 1) / POOLGRAIN * POOLGRAIN)
+
+#define slabof(b)  \
+	((Slab *)((size_t)(b) & ~(size_t)(POOLSLAB - 1)))
+
+
+static void linkslab (Slab **list, Slab *s) {
+  s->prev = NULL;
+  s->next = *list;
+  if (*list != NULL)
+    (*list)->prev = s;
+  *list = s;
+}
+
+
+static void unlinkslab (Slab **list, Slab *s) {
+  if (s->prev != NULL)
+    s->prev->next = s->next;
+  else
+    *list = s->next;
+  if (s->next != NULL)
+    s->next->prev = s->prev;
+}
+
+
+static int newchunk (Pool *p) {
+  char *mem = (char *)malloc(sizeof(Chunk) + (POOLCHUNK + 1) * POOLSLAB);
+  Chunk *c = (Chunk *)mem;
+  int i;
+  if (mem == NULL)
+    return 0;
+  c->slabs = (char *)(((size_t)(mem + sizeof(Chunk)) + POOLSLAB - 1) &
+                      ~(size_t)(POOLSLAB - 1));
+  c->nused = 0;
+  c->prev = NULL;
+  c->next = p->chunks;
+  if (p->chunks != NULL)
+    p->chunks->prev = c;
+  p->chunks = c;
+  for (i = 0; i < POOLCHUNK; i++) {
+    Slab *s = (Slab *)(c->slabs + i * POOLSLAB);
+    s->chunk = c;
+    linkslab(&p->empty, s);
+  }
+  p->nempty += POOLCHUNK;
+  return 1;
+}
+
+
+/*
+** Release chunk 'c', with no slab in use, if there will still be an
+** empty slab in reserve.
+*/
+static void freechunk (Pool *p, Chunk *c) {
+  int i;
+  if (p->nempty - POOLCHUNK < 1)
+    return;  /* keep it */
+  for (i = 0; i < POOLCHUNK; i++)
+    unlinkslab(&p->empty, (Slab *)(c->slabs + i * POOLSLAB));
+  p->nempty -= POOLCHUNK;
+  if (c->prev != NULL)
+    c->prev->next = c->next;
+  else
+    p->chunks = c->next;
+  if (c->next != NULL)
+    c->next->prev = c->prev;
+  free(c);
+}
+
+
+/*
+** Get a slab for blocks of class 'cls' and kind 'kind'. Only when
+** 'reserve' is true can it take the last empty slab.
+*/
+static Slab *newslab (Pool *p, int kind, int cls, int reserve) {
+  Slab *s;
+  unsigned int size = (cls + 1) * POOLGRAIN;
+  if (p->nempty <= 1 && !newchunk(p) && !(reserve && p->nempty == 1))
+    return NULL;
+  s = p->empty;
+  unlinkslab(&p->empty, s);
+  p->nempty--;
+  s->chunk->nused++;
+  s->free = NULL;
+  s->top = (char *)s + SLABHEAD;
+  s->end = s->top + (POOLSLAB - SLABHEAD) / size * size;
+  s->nused = 0;
+  s->size = size;
+  s->kind = kind;
+  linkslab(&p->avail[kind][cls], s);
+  return s;
+}
+
+
+static void *poolmalloc (Pool *p, size_t size, int kind, int reserve) {
+  void *b;
+  if (size > POOLMAX) {
+    b = malloc(size);
+    if (b == NULL)
+      return NULL;
+    p->large += size;
+    p->nlarge++;
+  }
+  else {
+    int cls = sizeclass(size);
+    Slab *s = p->avail[kind][cls];
+    if (s == NULL && (s = newslab(p, kind, cls, reserve)) == NULL)
+      return NULL;
+    if (s->free != NULL) {  /* reuse a freed block? */
+      b = s->free;
+      s->free = *(void **)b;
+    }
+    else {  /* use a new block */
+      b = s->top;
+      s->top += s->size;
+    }
+    if (++s->nused == (unsigned int)((s->end - ((char *)s + SLABHEAD)) /
+                                     s->size))
+      unlinkslab(&p->avail[kind][cls], s);  /* slab is full */
+    p->requested += size;
+    p->used += s->size;
+    p->kindblocks[kind]++;
+    p->kindbytes[kind] += size;
+  }
+  p->nblocks++;
+  p->started = 1;
+  return b;
+}
+
+
+static void freepool (Pool *p) {
+  while (p->chunks != NULL) {
+    Chunk *c = p->chunks;
+    p->chunks = c->next;
+    free(c);
+  }
+  free(p);
+}
+
+
+static void poolfree (Pool *p, void *b, size_t size) {
+  if (size > POOLMAX) {
+    free(b);
+    p->large -= size;
+    p->nlarge--;
+  }
+  else {
+    Slab *s = slabof(b);
+    int cls = sizeclass(s->size);
+    if (s->free == NULL && s->top == s->end)  /* slab was full? */
+      linkslab(&p->avail[s->kind][cls], s);  /* now it has a free block */
+    *(void **)b = s->free;
+    s->free = b;
+    p->requested -= size;
+    p->used -= s->size;
+    p->kindblocks[s->kind]--;
+    p->kindbytes[s->kind] -= size;
+    if (--s->nused == 0) {  /* slab is empty? */
+      Chunk *c = s->chunk;
+      unlinkslab(&p->avail[s->kind][cls], s);
+      linkslab(&p->empty, s);
+      p->nempty++;
+      if (--c->nused == 0)
+        freechunk(p, c);
+    }
+  }
+  if (--p->nblocks == 0)  /* freed the state itself? */
+    freepool(p);
+}
+
+
+static void *pool_alloc (void *ud, void *ptr, size_t osize, size_t nsize) {
+  Pool *p = (Pool *)ud;
+  if (ptr == NULL) {  /* new block? ('osize' is its kind) */
+    if (nsize == 0) return NULL;
+    return poolmalloc(p, nsize, (osize < NKINDS) ? (int)osize : 0, 0);
+  }
+  else if (nsize == 0) {
+    poolfree(p, ptr, osize);
+    return NULL;
+  }
+  else if (osize > POOLMAX && nsize > POOLMAX) {  /* both large? */
+    void *b = realloc(ptr, nsize);
+    if (b != NULL)
+      p->large = p->large - osize + nsize;
+    return b;
+  }
+  else if (osize <= POOLMAX && nsize <= POOLMAX &&
+           sizeclass(osize) == sizeclass(nsize)) {  /* same block fits? */
+    Slab *s = slabof(ptr);
+    p->requested = p->requested - osize + nsize;
+    p->kindbytes[s->kind] = p->kindbytes[s->kind] - osize + nsize;
+    return ptr;
+  }
+  else {  /* move block */
+    int kind = (osize <= POOLMAX) ? slabof(ptr)->kind : 0;
+    void *b = poolmalloc(p, nsize, kind, nsize < osize);
+    if (b != NULL) {
+      memcpy(b, ptr, (osize < nsize) ? osize : nsize);
+      poolfree(p, ptr, osize);
+    }
+    return b;
+  }
+}
+
+
+static Pool *newpool (void) {
+  Pool *p = (Pool *)malloc(sizeof(Pool));
+  if (p != NULL) {
+    memset(p, 0, sizeof(Pool));
+    if (!newchunk(p)) {  /* need the reserve slab from the start */
+      free(p);
+      return NULL;
+    }
+  }
+  return p;
+}
+
+
+static void setstat (lua_State *L, const char *name, size_t v) {
+  lua_pushinteger(L, (lua_Integer)v);
+  lua_setfield(L, -2, name);
+}
+
+
+/*
+** Push a table with statistics about the pool of state 'L': counts of
+** chunks, slabs, and blocks; bytes in slabs, requested by the blocks in
+** them, and taken by those blocks (with their size classes); number and
+** bytes of large blocks; and, in field 'kinds', blocks and requested
+** bytes by kind of object.
+*/
+LUALIB_API int luaL_poolstats (lua_State *L) {
+  void *ud;
+  Pool *p;
+  Chunk *c;
+  int i, nchunks = 0, nslabs = 0;
+  if (lua_getallocf(L, &ud) != pool_alloc)
+    return 0;  /* state does not use a pool */
+  p = (Pool *)ud;
+  for (c = p->chunks; c != NULL; c = c->next) {
+    nchunks++;
+    nslabs += c->nused;
+  }
+  lua_createtable(L, 0, 9);
+  setstat(L, "chunks", nchunks);
+  setstat(L, "slabs", nslabs);
+  setstat(L, "slabbytes", (size_t)nslabs * POOLSLAB);
+  setstat(L, "blocks", p->nblocks - p->nlarge);
+  setstat(L, "requested", p->requested);
+  setstat(L, "used", p->used);
+  setstat(L, "large", p->large);
+  setstat(L, "nlarge", p->nlarge);
+  lua_createtable(L, 0, NKINDS);
+  for (i = 0; i < NKINDS; i++) {
+    const char *name = (i == 0) ? "other"
+                     : (i < LUA_NUMTAGS) ? lua_typename(L, i)
+                     : (i == LUA_NUMTAGS) ? "upvalue" : "proto";
+    lua_createtable(L, 0, 2);
+    setstat(L, "blocks", p->kindblocks[i]);
+    setstat(L, "bytes", p->kindbytes[i]);
+    lua_setfield(L, -2, name);
+  }
+  lua_setfield(L, -2, "kinds");
+  return 1;
+}
+
+/* }====================================================== */
+
+#else
+
+LUALIB_API int luaL_poolstats (lua_State *L) {
+  (void)L;
+  return 0;  /* no pools */
+}
+
+#endif
+
+
 static int panic (lua_State *L) {
   lua_writestringerror("PANIC: unprotected error in call to Lua API (%s)\n",
                         lua_tostring(L, -1));
@@ -943,7 +1299,19 @@ static int panic (lua_State *L) {
 
 
 LUALIB_API lua_State *luaL_newstate (void) {
+#if defined(LUA_USE_POOLALLOC) && !defined(LUA_USE_BGSWEEP)
+  Pool *p = newpool();
+  lua_State *L;
+  if (p == NULL)  /* cannot create a pool? */
+    L = lua_newstate(l_alloc, NULL);  /* use plain allocator */
+  else {
+    L = lua_newstate(pool_alloc, p);
+    if (L == NULL && !p->started)  /* pool not freed with the state? */
+      freepool(p);
+  }
+#else
   lua_State *L = lua_newstate(l_alloc, NULL);
+#endif
   if (L) lua_atpanic(L, &panic);
   return L;
 }
@@ -176,13 +176,67 @@ static int pushmode (lua_State *L, int oldmode) {
 }
 
 
+/* push a table with times (in seconds) for each phase */
+static void pushphasetimes (lua_State *L, const lua_Integer *t) {
+  static const char *const phases[LUA_GCNPHASES] = {
+    "propagate", "atomic", "sweep", "callfin"};
+  int i;
+  lua_createtable(L, 0, LUA_GCNPHASES);
+  for (i = 0; i < LUA_GCNPHASES; i++) {
+    lua_pushnumber(L, (lua_Number)t[i] / 1e9);
+    lua_setfield(L, -2, phases[i]);
+  }
+}
+
+
+static void setintfield (lua_State *L, const char *k, lua_Integer v) {
+  lua_pushinteger(L, v);
+  lua_setfield(L, -2, k);
+}
+
+
+static int pushgcstats (lua_State *L) {
+  lua_GCStats s;
+  int on = lua_gc(L, LUA_GCSTATS, -1, &s);
+  int i;
+  if (on < 0) {  /* no statistics? */
+    lua_pushnil(L);
+    return 1;
+  }
+  lua_createtable(L, 0, 11);
+  lua_pushboolean(L, on);
+  lua_setfield(L, -2, "on");
+  pushphasetimes(L, s.phasetime);
+  lua_setfield(L, -2, "time");
+  pushphasetimes(L, s.phasemax);
+  lua_setfield(L, -2, "maxtime");
+  setintfield(L, "cycles", s.ncycles);
+  setintfield(L, "minors", s.nminor);
+  setintfield(L, "majors", s.nmajor);
+  setintfield(L, "freed", s.freed);
+  setintfield(L, "lastfreed", s.lastfreed);
+  setintfield(L, "pauses", s.npauses);
+  lua_pushnumber(L, (lua_Number)s.maxpause / 1e9);
+  lua_setfield(L, -2, "maxpause");
+  lua_createtable(L, LUA_GCNBUCKETS, 0);  /* pause histogram */
+  for (i = 0; i < LUA_GCNBUCKETS; i++) {
+    lua_pushinteger(L, s.pauses[i]);
+    lua_rawseti(L, -2, i + 1);
+  }
+  lua_setfield(L, -2, "histogram");
+  return 1;
+}
+
+
 static int luaB_collectgarbage (lua_State *L) {
   static const char *const opts[] = {"stop", "restart", "collect",
-    "count", "step", "setpause", "setstepmul",
-    "isrunning", "generational", "incremental", NULL};
+    "count", "step", "setpause", "setstepmul", "isrunning",
+    "generational", "incremental", "markers", "budget", "stats",
+    "finbudget", "deferfinalizers", "runfinalizers", NULL};
   static const int optsnum[] = {LUA_GCSTOP, LUA_GCRESTART, LUA_GCCOLLECT,
     LUA_GCCOUNT, LUA_GCSTEP, LUA_GCSETPAUSE, LUA_GCSETSTEPMUL,
-    LUA_GCISRUNNING, LUA_GCGEN, LUA_GCINC};
+    LUA_GCISRUNNING, LUA_GCGEN, LUA_GCINC, LUA_GCMARKERS, LUA_GCBUDGET,
+    LUA_GCSTATS, LUA_GCFINBUDGET, LUA_GCDEFERFIN, LUA_GCRUNFIN};
   int o = optsnum[luaL_checkoption(L, 1, "collect", opts)];
   switch (o) {
     case LUA_GCCOUNT: {
@@ -198,12 +252,40 @@ static int luaB_collectgarbage (lua_State *L) {
       return 1;
     }
     case LUA_GCSETPAUSE:
-    case LUA_GCSETSTEPMUL: {
+    case LUA_GCSETSTEPMUL:
+    case LUA_GCMARKERS: {
       int p = (int)luaL_optinteger(L, 2, 0);
       int previous = lua_gc(L, o, p);
       lua_pushinteger(L, previous);
       return 1;
     }
+    case LUA_GCBUDGET:
+    case LUA_GCFINBUDGET: {
+      int b = (int)luaL_optinteger(L, 2, -1);  /* default only queries */
+      lua_pushinteger(L, lua_gc(L, o, b));
+      return 1;
+    }
+    case LUA_GCDEFERFIN: {
+      int d = lua_isnoneornil(L, 2) ? -1 : lua_toboolean(L, 2);
+      lua_pushboolean(L, lua_gc(L, o, d));  /* previous state */
+      return 1;
+    }
+    case LUA_GCRUNFIN: {
+      int b = (int)luaL_optinteger(L, 2, 0);
+      lua_pushboolean(L, !lua_gc(L, o, b));  /* true if none pending */
+      return 1;
+    }
+    case LUA_GCSTATS: {
+      int res;
+      if (lua_isnoneornil(L, 2))  /* no argument? */
+        return pushgcstats(L);
+      res = lua_gc(L, o, lua_toboolean(L, 2), (lua_GCStats *)NULL);
+      if (res < 0)  /* no statistics? */
+        lua_pushnil(L);
+      else
+        lua_pushboolean(L, res);  /* previous state */
+      return 1;
+    }
     case LUA_GCISRUNNING: {
       int res = lua_gc(L, o);
       lua_pushboolean(L, res);
@@ -507,10 +507,11 @@ static void freeexps (FuncState *fs, expdesc *e1, expdesc *e2) {
 static int addk (FuncState *fs, TValue *key, TValue *v) {
   lua_State *L = fs->ls->L;
   Proto *f = fs->f;
-  TValue *idx = luaH_set(L, fs->ls->h, key);  /* index scanner table */
+  TValue idx;
   int k, oldsize;
-  if (ttisinteger(idx)) {  /* is there an index there? */
-    k = cast_int(ivalue(idx));
+  /* query scanner table; is there an index there? */
+  if (luaH_get(fs->ls->h, key, &idx) && ttisinteger(&idx)) {
+    k = cast_int(ivalue(&idx));
     /* correct value? (warning: must distinguish floats from integers!) */
     if (k < fs->nk && ttypetag(&f->k[k]) == ttypetag(v) &&
                       luaV_rawequalobj(&f->k[k], v))
@@ -521,7 +522,8 @@ static int addk (FuncState *fs, TValue *key, TValue *v) {
   k = fs->nk;
   /* numerical value does not need GC barrier;
      table has no metatable, so it does not need to invalidate cache */
-  setivalue(idx, k);
+  setivalue(&idx, k);
+  luaH_set(L, fs->ls->h, key, &idx);  /* index scanner table */
   luaM_growvector(L, f->k, k, f->sizek, TValue, MAXARG_Ax, "constants");
   while (oldsize < f->sizek) setnilvalue(&f->k[oldsize++]);
   setobj(L, &f->k[k], v);
@@ -549,7 +551,7 @@ int luaK_stringK (FuncState *fs, TString *s) {
 */
 static int luaK_intK (FuncState *fs, lua_Integer n) {
   TValue k, o;
-  setpvalue(&k, cast_voidp(cast_sizet(n)));
+  setpvalue(&k, cast_voidp(cast_sizet(l_castS2U(n))));
   setivalue(&o, n);
   return addk(fs, &k, &o);
 }
@@ -135,7 +135,7 @@ l_noret luaD_throw (lua_State *L, int errcode) {
 
 
 int luaD_rawrunprotected (lua_State *L, Pfunc f, void *ud) {
-  unsigned short oldnCcalls = L->nCcalls - L->nci;
+  unsigned short oldnCcalls = L->nCcalls;
   struct lua_longjmp lj;
   lj.status = LUA_OK;
   lj.previous = L->errorJmp;  /* chain new error handler */
@@ -144,7 +144,7 @@ int luaD_rawrunprotected (lua_State *L, Pfunc f, void *ud) {
     (*f)(L, ud);
   );
   L->errorJmp = lj.previous;  /* restore old error handler */
-  L->nCcalls = oldnCcalls + L->nci;
+  L->nCcalls = oldnCcalls;
   return lj.status;
 }
 
@@ -437,12 +437,14 @@ void luaD_pretailcall (lua_State *L, CallInfo *ci, StkId func, int narg1) {
 
 
 /*
-** Call a function (C or Lua). The function to be called is at *func.
-** The arguments are on the stack, right after the function.
-** When returns, all the results are on the stack, starting at the original
+** Prepares the call to a function (C or Lua). For C functions, also do
+** the call. The function to be called is at '*func'.  The arguments are
+** on the stack, right after the function.  Returns the CallInfo to be
+** executed, if it was a Lua function. Otherwise (a C function) returns
+** NULL, with all the results on the stack, starting at the original
 ** function position.
 */
-void luaD_call (lua_State *L, StkId func, int nresults) {
+CallInfo *luaD_precall (lua_State *L, StkId func, int nresults) {
   lua_CFunction f;
   TValue *funcv = s2v(func);
   switch (ttypetag(funcv)) {
@@ -470,7 +472,7 @@ void luaD_call (lua_State *L, StkId func, int nresults) {
       lua_lock(L);
       api_checknelems(L, n);
       luaD_poscall(L, ci, n);
-      break;
+      return NULL;
     }
     case LUA_TLCL: {  /* Lua function */
       CallInfo *ci;
@@ -488,18 +490,36 @@ void luaD_call (lua_State *L, StkId func, int nresults) {
       for (; narg < nfixparams; narg++)
         setnilvalue(s2v(L->top++));  /* complete missing arguments */
       lua_assert(ci->top <= L->stack_last);
-      luaV_execute(L, ci);  /* run the function */
-      break;
+      return ci;
     }
     default: {  /* not a function */
       luaD_tryfuncTM(L, func);  /* try to get '__call' metamethod */
-      luaD_call(L, func, nresults);  /* now it must be a function */
-      break;
+      return luaD_precall(L, func, nresults);  /* now it must be a function */
     }
   }
 }
 
 
+/*
+** Call a function (C or Lua). The function to be called is at *func.
+** The arguments are on the stack, right after the function.
+** When returns, all the results are on the stack, starting at the original
+** function position. A Lua function runs in a new invocation of
+** 'luaV_execute', marked as "fresh" so that its return ends that
+** invocation; Lua functions called from there reuse the same C frame.
+*/
+void luaD_call (lua_State *L, StkId func, int nresults) {
+  CallInfo *ci;
+  luaE_incCcalls(L);
+  luaE_setdirty(L);
+  if ((ci = luaD_precall(L, func, nresults)) != NULL) {  /* Lua function? */
+    ci->callstatus = CIST_FRESH;  /* mark that it is a "fresh" execute */
+    luaV_execute(L, ci);  /* call it */
+  }
+  L->nCcalls--;
+}
+
+
 /*
 ** Similar to 'luaD_call', but does not allow yields during the call
 */
@@ -656,6 +676,7 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs,
   L->nCcalls = (from) ? from->nCcalls + 1 : 1;
   if (L->nCcalls >= LUAI_MAXCCALLS)
     return resume_error(L, "C stack overflow", nargs);
+  luaE_setdirty(L);
   luai_userstateresume(L, nargs);
   L->nny = 0;  /* allow yields */
   api_checknelems(L, (L->status == LUA_OK) ? nargs + 1 : nargs);
@@ -676,6 +697,10 @@ LUA_API int lua_resume (lua_State *L, lua_State *from, int nargs,
   }
   *nresults = (status == LUA_YIELD) ? L->ci->u2.nyield
                                     : cast_int(L->top - (L->ci->func + 1));
+#if defined(LUA_USE_DIRTYTHREADS)
+  L->gcparked = (status == LUA_YIELD);  /* parked until it runs again */
+  L->gcepoch = G(L)->gcepoch - 1;  /* but not traversed as such yet */
+#endif
   L->nny = oldnny;  /* restore 'nny' */
   L->nCcalls--;
   lua_unlock(L);
@@ -15,6 +15,7 @@
 #include "lua.h"
 
 #include "lobject.h"
+#include "lopcodes.h"
 #include "lstate.h"
 #include "lundump.h"
 
@@ -97,9 +98,18 @@ static void DumpString (const TString *s, DumpState *D) {
 }
 
 
+/*
+** Dump the code of a function with the generic forms of any quickened
+** instructions, so that binary chunks never contain quickened opcodes.
+*/
 static void DumpCode (const Proto *f, DumpState *D) {
+  int pc;
   DumpInt(f->sizecode, D);
-  DumpVector(f->code, f->sizecode, D);
+  for (pc = 0; pc < f->sizecode; pc++) {
+    Instruction i = f->code[pc];
+    SET_OPCODE(i, GET_GENOPCODE(i));
+    DumpVar(i, D);
+  }
 }
 
 
@@ -16,6 +16,7 @@
 
 #include "lfunc.h"
 #include "lgc.h"
+#include "ljit.h"
 #include "lmem.h"
 #include "lobject.h"
 #include "lstate.h"
@@ -103,6 +104,12 @@ void luaF_close (lua_State *L, StkId level) {
       gray2black(uv);  /* closed upvalues cannot be gray */
     luaC_barrier(L, uv, slot);
   }
+#if defined(LUA_USE_DIRTYTHREADS)
+  if (L->openupval == NULL && G(L)->twups == L) {  /* first in 'twups'? */
+    G(L)->twups = L->twups;  /* no need to keep it there */
+    L->twups = L;  /* mark that it is out of list */
+  }
+#endif
 }
 
 
@@ -114,6 +121,7 @@ Proto *luaF_newproto (lua_State *L) {
   f->p = NULL;
   f->sizep = 0;
   f->code = NULL;
+  f->icache = NULL;
   f->cache = NULL;
   f->cachemiss = 0;
   f->sizecode = 0;
@@ -131,18 +139,39 @@ Proto *luaF_newproto (lua_State *L) {
   f->linedefined = 0;
   f->lastlinedefined = 0;
   f->source = NULL;
+#if defined(LUA_USE_JIT)
+  f->jit = NULL;
+  f->jitcount = 0;
+#endif
   return f;
 }
 
 
+/*
+** Create the inline caches of a prototype, one entry for each of its
+** instructions. Must be called after its code is complete.
+*/
+void luaF_newicache (lua_State *L, Proto *f) {
+  int i;
+  f->icache = luaM_newvector(L, f->sizecode, unsigned int);
+  for (i = 0; i < f->sizecode; i++)
+    f->icache[i] = 0;
+}
+
+
 void luaF_freeproto (lua_State *L, Proto *f) {
   luaM_freearray(L, f->code, f->sizecode);
+  if (f->icache != NULL)  /* caches may not have been created yet */
+    luaM_freearray(L, f->icache, f->sizecode);
   luaM_freearray(L, f->p, f->sizep);
   luaM_freearray(L, f->k, f->sizek);
   luaM_freearray(L, f->lineinfo, f->sizelineinfo);
   luaM_freearray(L, f->abslineinfo, f->sizeabslineinfo);
   luaM_freearray(L, f->locvars, f->sizelocvars);
   luaM_freearray(L, f->upvalues, f->sizeupvalues);
+#if defined(LUA_USE_JIT)
+  luaJ_freecode(L, f);
+#endif
   luaM_free(L, f);
 }
 
@@ -12,6 +12,17 @@
 #include <stdio.h>
 #include <string.h>
 
+#if defined(LUA_USE_PARALLELMARK) || defined(LUA_USE_BGSWEEP)
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#endif
+
+#if defined(LUA_USE_GCBUDGET) || defined(LUA_USE_GCSTATS) ||  \
+    defined(LUA_USE_FINBATCH)
+#include <time.h>
+#endif
+
 #include "lua.h"
 
 #include "ldebug.h"
@@ -59,6 +70,31 @@
 #define PAUSEADJ		100
 
 
+/* number of slots in the array and hash parts of 'h' */
+#define numslots(h)	(luaH_realasize(h) + sizenode(h))
+
+
+#if defined(LUA_USE_CARDS)
+/*
+** Cards of large tables (see 'traversecards'): a table has a card for
+** each CARDSIZE slots plus a last card for the whole table.
+*/
+#define CARDBITS	7
+#define CARDSIZE	(1u << CARDBITS)
+
+/* minimum number of slots for a table to get cards */
+#define CARDMIN		(8 * CARDSIZE)
+
+#define CARDNEW		1	/* card marked in this cycle */
+#define CARDOLD		2	/* card marked in the previous cycle */
+
+/* number of cards of table 'h' (not counting the whole-table card) */
+#define ncards(h)	((numslots(h) + CARDSIZE - 1) >> CARDBITS)
+
+#define wholecard(h)	((h)->cards[ncards(h)])
+#endif
+
+
 /* mask to erase all color bits (plus gen. related stuff) */
 #define maskcolors	(~(bitmask(BLACKBIT) | WHITEBITS | AGEBITS))
 
@@ -102,6 +138,501 @@ static void reallymarkobject (global_State *g, GCObject *o);
 static lu_mem atomic (lua_State *L);
 
 
+
+/*
+** {======================================================
+** Statistics
+** =======================================================
+*/
+
+#if defined(LUA_USE_GCSTATS) || defined(LUA_USE_FINBATCH)
+
+/* current time in nanoseconds */
+static l_mem gcnanotime (void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return cast(l_mem, ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+#endif
+
+
+#if defined(LUA_USE_GCSTATS)
+
+/*
+** Statistics time each pause (a call to 'luaC_step', 'luaC_fullgc',
+** or 'luaC_changemode') and split it among the phases of the
+** collection. The clock is read only at the start and end of a pause
+** and when the collector tells ('statphase') that the phase changed.
+** Nested calls (e.g., an emergency collection inside a finalizer) are
+** part of the outer pause. Freed memory is measured by the changes in
+** 'GCdebt' during sweeps.
+*/
+
+
+/* phase of the collection in state 'g->gcstate' */
+static int phaseof (global_State *g) {
+  switch (g->gcstate) {
+    case GCSatomic: return LUA_GCPATOMIC;
+    case GCSswpallgc: case GCSswpfinobj: case GCSswptobefnz:
+    case GCSswpend: return LUA_GCPSWEEP;
+    case GCScallfin: return LUA_GCPCALLFIN;
+    default: return LUA_GCPPROPAGATE;
+  }
+}
+
+
+/* account the time in the current phase until 'now' */
+static void chargephase (global_State *g, l_mem now) {
+  lua_GCStats *s = &g->gcstats;
+  l_mem t = now - g->gcphasestart;
+  s->phasetime[g->gcphase] += t;
+  g->gcphasetime += t;
+  if (g->gcphasetime > s->phasemax[g->gcphase])
+    s->phasemax[g->gcphase] = g->gcphasetime;
+  g->gcphasestart = now;
+}
+
+
+static void statphase_ (global_State *g, int phase) {
+  if (phase != g->gcphase) {
+    chargephase(g, gcnanotime());
+    g->gcphase = cast_byte(phase);
+    g->gcphasetime = 0;
+  }
+}
+
+
+static void statbegin (global_State *g) {
+  if (g->gcstatlevel > 0)  /* nested call? */
+    g->gcstatlevel++;
+  else if (g->gcstatson) {
+    g->gcstatlevel = 1;
+    g->gcphase = cast_byte(phaseof(g));
+    g->gcpausestart = g->gcphasestart = gcnanotime();
+    g->gcphasetime = 0;
+  }
+}
+
+
+static void statend (global_State *g) {
+  if (g->gcstatlevel > 0 && --g->gcstatlevel == 0) {
+    lua_GCStats *s = &g->gcstats;
+    l_mem now = gcnanotime();
+    l_mem pause = now - g->gcpausestart;
+    l_mem us;
+    int b = 0;
+    chargephase(g, now);
+    for (us = pause / 1000; us > 0 && b < LUA_GCNBUCKETS - 1; us >>= 1)
+      b++;  /* bucket of pauses shorter than 2^b microseconds */
+    s->pauses[b]++;
+    s->npauses++;
+    if (pause > s->maxpause)
+      s->maxpause = pause;
+  }
+}
+
+
+/* a collection finished; count it in 'counter' */
+static void statcycle_ (global_State *g, lua_Integer *counter) {
+  if (g->gcstatson) {
+    (*counter)++;
+    g->gcstats.lastfreed = g->gccyclefreed;
+    g->gcstats.freed += g->gccyclefreed;
+  }
+  g->gccyclefreed = 0;
+}
+
+
+#define statphase(g,p)  \
+	((g)->gcstatlevel > 0 ? statphase_(g,p) : (void)0)
+#define statcycle(g,c)	statcycle_(g, &(g)->gcstats.c)
+#define statfreed(g,n)	((g)->gccyclefreed += (n))
+
+#else
+
+#define statbegin(g)	((void)0)
+#define statend(g)	((void)0)
+#define statphase(g,p)	((void)0)
+#define statcycle(g,c)	((void)0)
+#define statfreed(g,n)	((void)(n))
+
+#endif
+
+/* }====================================================== */
+
+
+/*
+** {======================================================
+** Nursery
+** =======================================================
+*/
+
+#if defined(LUA_USE_NURSERY)
+
+/*
+** In generational mode, new objects up to NURSERYMAX bytes are bumped
+** from arenas of ARENASIZE bytes instead of coming one by one from the
+** allocator. Objects do not move (C code keeps pointers to them), so
+** survivors stay in their arenas. To reuse the space of the dead ones,
+** each arena is divided into lines of LINESIZE bytes with a count of
+** the objects using each line, and objects are bumped along runs of
+** free lines (as in Immix). An arena with at least RECYCLEMIN free
+** lines goes to a list of arenas to be reused; an arena with no
+** objects goes back to the allocator.
+**
+** Objects in arenas count in 'GCdebt' with their own sizes, as any
+** other object; the arenas themselves are allocated directly, like the
+** blocks for helper threads. The blocks freed by 'luaM_free_' are
+** checked against a hash map from aligned windows of ARENASIZE bytes
+** to the arenas overlapping them (each arena overlaps at most two
+** windows).
+*/
+
+#define ARENABITS	16
+#define ARENASIZE	(cast_sizet(1) << ARENABITS)
+
+#define LINEBITS	8
+#define LINESIZE	(1 << LINEBITS)
+#define NLINES		(1 << (ARENABITS - LINEBITS))
+
+#define RECYCLEMIN	(NLINES / 8)
+
+#define NURSERYMAX	256
+
+#define NURSERYALIGN	sizeof(MaxAlign)
+
+#define arenaalign(sz)	(((sz) + NURSERYALIGN - 1) & ~(NURSERYALIGN - 1))
+
+/* start of the objects in an arena */
+#define ARENAHEAD	arenaalign(sizeof(Arena))
+
+/* line of address 'p' in arena 'a' */
+#define lineof(a,p)	cast_int((cast_charp(p) - cast_charp(a)) >> LINEBITS)
+
+#define window(p)	(cast_sizet(p) >> ARENABITS)
+
+/* (windows of consecutive arenas are consecutive; spread them) */
+#define hashwindow(n,w)	((((w) * 0x9E3779B9u) >> 16) & ((n)->size - 1))
+
+
+/* type with the maximum alignment (for objects in arenas) */
+typedef union MaxAlign {
+  LUAI_MAXALIGN;
+} MaxAlign;
+
+
+typedef struct Arena {
+  struct Arena *next, *prev;  /* in list of arenas to reuse */
+  size_t nlive;  /* number of objects alive in the arena */
+  int nfree;  /* number of free lines */
+  lu_byte listed;  /* true if in list of arenas to reuse */
+  unsigned short lines[NLINES];  /* objects using each line */
+} Arena;
+
+
+typedef struct WindowSlot {
+  size_t w;  /* window */
+  Arena *a;  /* arena overlapping it (NULL for an empty slot) */
+} WindowSlot;
+
+
+typedef struct Nursery {
+  Arena *current;  /* arena for new objects */
+  char *top;  /* next free byte in current run of free lines */
+  char *limit;  /* end of current run */
+  Arena *reuse;  /* list of arenas with free lines */
+  WindowSlot *map;  /* hash map from windows to arenas */
+  int size;  /* size of 'map' (a power of 2) */
+  int nmap;  /* number of entries in 'map' */
+} Nursery;
+
+
+static void mapinsert (Nursery *n, size_t w, Arena *a) {
+  int i = cast_int(hashwindow(n, w));
+  while (n->map[i].a != NULL)
+    i = (i + 1) & (n->size - 1);
+  n->map[i].w = w;
+  n->map[i].a = a;
+  n->nmap++;
+}
+
+
+/*
+** Remove entry for window 'w' and arena 'a', moving back the entries
+** after it that would not be found otherwise (linear probing).
+*/
+static void mapremove (Nursery *n, size_t w, Arena *a) {
+  int mask = n->size - 1;
+  int i = cast_int(hashwindow(n, w));
+  int j;
+  while (n->map[i].a != a || n->map[i].w != w)
+    i = (i + 1) & mask;
+  for (j = (i + 1) & mask; n->map[j].a != NULL; j = (j + 1) & mask) {
+    int k = cast_int(hashwindow(n, n->map[j].w));
+    if ((j > i) ? (k <= i || k > j) : (k <= i && k > j)) {
+      n->map[i] = n->map[j];  /* move it to the hole */
+      i = j;
+    }
+  }
+  n->map[i].a = NULL;
+  n->nmap--;
+}
+
+
+/*
+** Find the arena containing block 'b', or NULL if 'b' is not in an
+** arena.
+*/
+static Arena *findarena (Nursery *n, void *b) {
+  size_t w = window(b);
+  int i = cast_int(hashwindow(n, w));
+  for (; n->map[i].a != NULL; i = (i + 1) & (n->size - 1)) {
+    Arena *a = n->map[i].a;
+    if (n->map[i].w == w && cast_charp(a) <= cast_charp(b) &&
+        cast_charp(b) < cast_charp(a) + ARENASIZE)
+      return a;
+  }
+  return NULL;
+}
+
+
+static void maparena (Nursery *n, Arena *a, int insert) {
+  size_t w0 = window(a);
+  size_t w1 = window(cast_charp(a) + ARENASIZE - 1);
+  if (insert) {
+    mapinsert(n, w0, a);
+    if (w1 != w0) mapinsert(n, w1, a);
+  }
+  else {
+    mapremove(n, w0, a);
+    if (w1 != w0) mapremove(n, w1, a);
+  }
+}
+
+
+/*
+** Make room in the map for the two entries of a new arena. Return
+** false if there is no memory for that.
+*/
+static int growmap (global_State *g, Nursery *n) {
+  if (4 * (n->nmap + 2) > 3 * n->size) {  /* too full? */
+    WindowSlot *old = n->map;
+    int oldsize = n->size;
+    int i;
+    n->map = cast(WindowSlot *, (*g->frealloc)(g->ud, NULL, 0,
+                                  2 * oldsize * sizeof(WindowSlot)));
+    if (n->map == NULL) {
+      n->map = old;
+      return 0;
+    }
+    n->size = 2 * oldsize;
+    n->nmap = 0;
+    for (i = 0; i < n->size; i++)
+      n->map[i].a = NULL;
+    for (i = 0; i < oldsize; i++) {
+      if (old[i].a != NULL)
+        mapinsert(n, old[i].w, old[i].a);
+    }
+    (*g->frealloc)(g->ud, old, oldsize * sizeof(WindowSlot), 0);
+  }
+  return 1;
+}
+
+
+static void unlistarena (Nursery *n, Arena *a) {
+  if (a->prev != NULL)
+    a->prev->next = a->next;
+  else
+    n->reuse = a->next;
+  if (a->next != NULL)
+    a->next->prev = a->prev;
+  a->listed = 0;
+}
+
+
+static void listarena (Nursery *n, Arena *a) {
+  a->prev = NULL;
+  a->next = n->reuse;
+  if (n->reuse != NULL)
+    n->reuse->prev = a;
+  n->reuse = a;
+  a->listed = 1;
+}
+
+
+static void freearena (global_State *g, Nursery *n, Arena *a) {
+  if (a->listed)
+    unlistarena(n, a);
+  maparena(n, a, 0);
+  (*g->frealloc)(g->ud, a, ARENASIZE, 0);
+}
+
+
+/*
+** Make the first run of free lines in arena 'a' starting at line 'l'
+** the current run. Return false if there is no such run.
+*/
+static int findrun (Nursery *n, Arena *a, int l) {
+  int e;
+  while (l < NLINES && a->lines[l] != 0)
+    l++;
+  if (l == NLINES)
+    return 0;
+  for (e = l + 1; e < NLINES && a->lines[e] == 0; e++) ;
+  n->current = a;
+  n->top = cast_charp(a) + l * LINESIZE;
+  n->limit = cast_charp(a) + e * LINESIZE;
+  return 1;
+}
+
+
+static Arena *newarena (global_State *g, Nursery *n) {
+  Arena *a;
+  int l;
+  if (!growmap(g, n))
+    return NULL;
+  a = cast(Arena *, (*g->frealloc)(g->ud, NULL, 0, ARENASIZE));
+  if (a == NULL)
+    return NULL;
+  a->nlive = 0;
+  a->listed = 0;
+  for (l = 0; l < NLINES; l++)
+    a->lines[l] = 0;
+  for (l = 0; l <= lineof(a, cast_charp(a) + ARENAHEAD - 1); l++)
+    a->lines[l] = 1;  /* lines with the header are never free */
+  a->nfree = NLINES - l;
+  maparena(n, a, 1);
+  return a;
+}
+
+
+static Nursery *newnursery (global_State *g) {
+  Nursery *n = cast(Nursery *, (*g->frealloc)(g->ud, NULL, 0,
+                                                sizeof(Nursery)));
+  if (n != NULL) {
+    n->map = cast(WindowSlot *, (*g->frealloc)(g->ud, NULL, 0,
+                                                 4 * sizeof(WindowSlot)));
+    if (n->map == NULL) {
+      (*g->frealloc)(g->ud, n, sizeof(Nursery), 0);
+      return NULL;
+    }
+    n->map[0].a = n->map[1].a = n->map[2].a = n->map[3].a = NULL;
+    n->size = 4;
+    n->nmap = 0;
+    n->current = n->reuse = NULL;
+    n->top = n->limit = NULL;
+  }
+  return n;
+}
+
+
+/*
+** Find a new run of free lines: after the current run, in an arena to
+** be reused, or in a new arena. Return false if there is no memory for
+** a new arena.
+*/
+static int nextrun (global_State *g, Nursery *n) {
+  Arena *a = n->current;
+  if (a != NULL) {
+    if (findrun(n, a, (a->nlive == 0) ? 0 : lineof(a, n->limit)))
+      return 1;
+    n->current = NULL;  /* done with it */
+    if (a->nfree >= RECYCLEMIN)  /* freed lines before current run? */
+      listarena(n, a);
+  }
+  while ((a = n->reuse) != NULL) {
+    unlistarena(n, a);
+    if (findrun(n, a, 0))
+      return 1;
+  }
+  a = newarena(g, n);
+  return (a != NULL && findrun(n, a, 0));
+}
+
+
+/*
+** Allocate an object of size 'sz' in the nursery. Return NULL if there
+** is no memory for that, so that the object goes to the allocator.
+*/
+static GCObject *nurseryalloc (lua_State *L, size_t sz) {
+  global_State *g = G(L);
+  Nursery *n = g->nursery;
+  Arena *a;
+  char *o;
+  int l;
+  if (n == NULL && (n = g->nursery = newnursery(g)) == NULL)
+    return NULL;
+  while (cast_sizet(n->limit - n->top) < sz) {
+    if (!nextrun(g, n))
+      return NULL;
+  }
+  a = n->current;
+  o = n->top;
+  n->top += arenaalign(sz);  /* (runs have aligned sizes) */
+  for (l = lineof(a, o); l <= lineof(a, o + sz - 1); l++) {
+    if (a->lines[l]++ == 0)
+      a->nfree--;
+  }
+  a->nlive++;
+  g->GCdebt += sz;
+  return cast(GCObject *, o);
+}
+
+
+/*
+** If block 'b', with size 'osize', is an object in an arena, free it
+** and return true.
+*/
+int luaC_nurseryfree (lua_State *L, void *b, size_t osize) {
+  global_State *g = G(L);
+  Nursery *n = g->nursery;
+  Arena *a = findarena(n, b);
+  int l;
+  if (a == NULL)
+    return 0;
+  lua_assert(a->nlive > 0);
+  for (l = lineof(a, b); l <= lineof(a, cast_charp(b) + osize - 1); l++) {
+    lua_assert(a->lines[l] > 0);
+    if (--a->lines[l] == 0)
+      a->nfree++;
+  }
+  a->nlive--;
+  g->GCdebt -= osize;
+  if (a != n->current) {
+    if (a->nlive == 0)
+      freearena(g, n, a);
+    else if (!a->listed && a->nfree >= RECYCLEMIN)
+      listarena(n, a);
+  }
+  return 1;
+}
+
+
+#define innursery(g,o)	((g)->nursery != NULL && findarena((g)->nursery, o))
+
+
+/*
+** Free the nursery, after all objects are dead.
+*/
+static void freenursery (global_State *g) {
+  Nursery *n = g->nursery;
+  if (n != NULL) {
+    if (n->current != NULL)
+      freearena(g, n, n->current);
+    lua_assert(n->reuse == NULL && n->nmap == 0);
+    g->nursery = NULL;
+    (*g->frealloc)(g->ud, n->map, n->size * sizeof(WindowSlot), 0);
+    (*g->frealloc)(g->ud, n, sizeof(Nursery), 0);
+  }
+}
+
+#endif
+
+/* }====================================================== */
+
+
+
 /*
 ** {======================================================
 ** Generic functions
@@ -144,6 +675,15 @@ static GCObject **getgclist (GCObject *o) {
 #define linkobjgclist(o,p) (*getgclist(o) = (p), (p) = obj2gco(o))
 
 
+#if defined(LUA_USE_PARALLELMARK) || defined(LUA_USE_BGSWEEP)
+/* operations on data shared with helper threads */
+#define atomicload(p)	__atomic_load_n(p, __ATOMIC_SEQ_CST)
+#define atomicstore(p,v)	__atomic_store_n(p, v, __ATOMIC_SEQ_CST)
+#define atomicadd(p,v)	__atomic_add_fetch(p, v, __ATOMIC_SEQ_CST)
+#define atomicswap(p,v)	__atomic_exchange_n(p, v, __ATOMIC_SEQ_CST)
+#endif
+
+
 
 /*
 ** Clear keys for empty entries in tables. If entry is empty
@@ -207,9 +747,18 @@ void luaC_barrier_ (lua_State *L, GCObject *o, GCObject *v) {
 */
 void luaC_barrierback_ (lua_State *L, GCObject *o) {
   global_State *g = G(L);
+  int inlist = (getage(o) == G_TOUCHED2);  /* already in gray list? */
   lua_assert(isblack(o) && !isdead(g, o));
+#if !defined(LUA_USE_CARDS)
   lua_assert(g->gckind != KGC_GEN || (isold(o) && getage(o) != G_TOUCHED1));
-  if (getage(o) != G_TOUCHED2)  /* not already in gray list? */
+#else
+  lua_assert(g->gckind != KGC_GEN || isold(o));
+  if (o->tt == LUA_TTABLE && gco2t(o)->cards != NULL)
+    wholecard(gco2t(o)) |= CARDNEW;  /* store may be anywhere */
+  if (g->gckind == KGC_GEN && getage(o) == G_TOUCHED1)
+    inlist = 1;  /* a table marked only in its cards */
+#endif
+  if (!inlist)
     linkobjgclist(o, g->grayagain);  /* link it in 'grayagain' */
   black2gray(o);  /* make table gray (again) */
   setage(o, G_TOUCHED1);  /* touched in current cycle */
@@ -253,7 +802,12 @@ void luaC_fix (lua_State *L, GCObject *o) {
 */
 GCObject *luaC_newobj (lua_State *L, int tt, size_t sz) {
   global_State *g = G(L);
-  GCObject *o = cast(GCObject *, luaM_newobject(L, novariant(tt), sz));
+  GCObject *o;
+#if defined(LUA_USE_NURSERY)
+  if (g->gckind != KGC_GEN || sz > NURSERYMAX ||
+      (o = nurseryalloc(L, sz)) == NULL)
+#endif
+  o = cast(GCObject *, luaM_newobject(L, novariant(tt), sz));
   o->marked = luaC_white(g);
   o->tt = tt;
   o->next = g->allgc;
@@ -272,6 +826,72 @@ GCObject *luaC_newobj (lua_State *L, int tt, size_t sz) {
 */
 
 
+#if defined(LUA_USE_EPHEMERONMAP)
+/*
+** Entries of ephemeron tables waiting for their keys to be marked,
+** indexed by key (see 'convergeephemerons'). 'keys' is an open-address
+** hash of the white keys; each one heads a list of the values waiting
+** for it. 'ready' is a stack of the keys already marked whose values
+** were not marked yet. 'now' lists the values whose keys were already
+** marked when their entries were added.
+*/
+typedef struct EphKey {
+  GCObject *key;
+  int first;  /* first entry waiting for this key */
+} EphKey;
+
+typedef struct EphEntry {
+  GCObject *value;
+  int next;  /* next entry waiting for the same key (-1 ends the list) */
+} EphEntry;
+
+typedef struct EphMap {
+  EphKey *keys;
+  EphEntry *entries;
+  int *ready;  /* (same size of 'entries', as no key is pushed twice) */
+  int lsize;  /* log2 of the size of 'keys' */
+  int nkeys;  /* number of keys in 'keys' */
+  int nentries;  /* number of entries in use */
+  int size;  /* size of 'entries' and 'ready' */
+  int nready;
+  int now;
+} EphMap;
+
+
+#define ephhash(m,o)  \
+	cast_int((point2uint(o) * 2654435769u) >> (32 - (m)->lsize))
+
+
+/* find the slot of key 'o' in 'm' (or the empty slot where it goes) */
+static int ephslot (EphMap *m, GCObject *o) {
+  int mask = (1 << m->lsize) - 1;
+  int i = ephhash(m, o) & mask;
+  while (m->keys[i].key != NULL && m->keys[i].key != o)
+    i = (i + 1) & mask;
+  return i;
+}
+
+
+/*
+** Object 'o' is being marked: if some entry is waiting for it, its
+** values can be marked now.
+*/
+static void ephready (EphMap *m, GCObject *o) {
+  int i = ephslot(m, o);
+  if (m->keys[i].key != NULL)
+    m->ready[m->nready++] = i;
+}
+
+#define checkephmap(g,o)  \
+	((g)->ephmap != NULL ? ephready((g)->ephmap, o) : (void)0)
+
+#else
+
+#define checkephmap(g,o)	((void)0)
+
+#endif
+
+
 /*
 ** Mark an object. Userdata, strings, and closed upvalues are visited
 ** and turned black here. Other objects are marked gray and added
@@ -281,6 +901,7 @@ GCObject *luaC_newobj (lua_State *L, int tt, size_t sz) {
 */
 static void reallymarkobject (global_State *g, GCObject *o) {
   white2gray(o);
+  checkephmap(g, o);
   switch (o->tt) {
     case LUA_TSHRSTR:
     case LUA_TLNGSTR: {
@@ -323,6 +944,31 @@ static void markmt (global_State *g) {
 }
 
 
+#if defined(LUA_USE_SHAPES)
+/*
+** mark the keys of all shapes. (A shape can outlive the tables that
+** used it, while its parent has other transitions, so its keys are not
+** kept alive by any table.) The tree is traversed in depth-first order
+** without recursion, moving through 'child', 'sibling', and 'parent'.
+*/
+static void markshapes (global_State *g) {
+  Shape *s = g->rootshape.child;
+  while (s != NULL) {
+    markobject(g, s->keys[s->nkeys - 1]);  /* mark the key it adds */
+    if (s->child != NULL)
+      s = s->child;
+    else {
+      while (s->sibling == NULL && s->parent != &g->rootshape)
+        s = s->parent;  /* go back until a node with a next sibling */
+      s = s->sibling;  /* (NULL when back to the root) */
+    }
+  }
+}
+#else
+#define markshapes(g)	((void)0)
+#endif
+
+
 /*
 ** mark all objects in list of being-finalized
 */
@@ -367,12 +1013,35 @@ static int remarkupvals (global_State *g) {
 }
 
 
+#if defined(LUA_USE_DIRTYTHREADS)
+/*
+** A coroutine is "parked" from its yield until it runs again (or has a
+** local changed by the debug API). The API can change only the current
+** frame of a parked coroutine, and other threads can change only the
+** values of its open upvalues. So, if it was parked when traversed in
+** this marking, the final traversal needs to visit only those. Each
+** marking (from its restart or from the last atomic phase) has a new
+** number in 'g->gcepoch'.
+*/
+#define isclean(g,th)	((th)->gcparked && (th)->gcepoch == (g)->gcepoch)
+
+#define nextepoch(g)	((g)->gcepoch++)
+#else
+#define nextepoch(g)	((void)0)
+#endif
+
+
 /*
 ** mark root set and reset all gray lists, to start a new collection
 */
 static void restartcollection (global_State *g) {
   g->gray = g->grayagain = NULL;
   g->weak = g->allweak = g->ephemeron = g->protogray = NULL;
+  nextepoch(g);
+#if defined(LUA_USE_GCBUDGET)
+  g->gcpremarked = 0;
+  g->gcpartial = NULL;
+#endif
   markobject(g, g->mainthread);
   markvalue(g, &g->l_registry);
   markmt(g);
@@ -395,20 +1064,32 @@ static void restartcollection (global_State *g) {
 ** put it in 'weak' list, to be cleared.
 */
 static void traverseweakvalue (global_State *g, Table *h) {
-  Node *n, *limit = gnodelast(h);
+  Table *hp = h;  /* hash part being traversed */
+  Node *n, *limit;
   /* if there is array part, assume it may have white values (it is not
      worth traversing it now just to check) */
   int hasclears = (h->alimit > 0);
-  for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
-    if (isempty(gval(n)))  /* entry is empty? */
-      clearkey(n);  /* clear its key */
-    else {
-      lua_assert(!keyisnil(n));
-      markkey(g, n);
-      if (!hasclears && iscleared(g, gcvalueN(gval(n))))  /* a white value? */
+  do {  /* traverse hash part(s) */
+    for (n = gnode(hp, 0), limit = gnodelast(hp); n < limit; n++) {
+      if (isempty(gval(n)))  /* entry is empty? */
+        clearkey(n);  /* clear its key */
+      else {
+        lua_assert(!keyisnil(n));
+        markkey(g, n);
+        if (!hasclears && iscleared(g, gcvalueN(gval(n))))  /* white value? */
+          hasclears = 1;  /* table will have to be cleared */
+      }
+    }
+  } while ((hp = nexthashpart(hp)) != NULL);
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(h)) {  /* keys in the shape are marked by 'markshapes' */
+    int i;
+    for (i = 0; !hasclears && i < h->shape->nkeys; i++) {
+      if (iscleared(g, gcvalueN(&h->slots[i])))  /* a white value? */
         hasclears = 1;  /* table will have to be cleared */
     }
   }
+#endif
   if (g->gcstate == GCSatomic && hasclears)
     linkgclist(h, g->weak);  /* has to be cleared later */
   else
@@ -431,30 +1112,45 @@ static int traverseephemeron (global_State *g, Table *h) {
   int marked = 0;  /* true if an object is marked in this traversal */
   int hasclears = 0;  /* true if table has white keys */
   int hasww = 0;  /* true if table has entry "white-key -> white-value" */
-  Node *n, *limit = gnodelast(h);
+  Table *hp = h;  /* hash part being traversed */
+  Node *n, *limit;
   unsigned int i;
   unsigned int asize = luaH_realasize(h);
   /* traverse array part */
   for (i = 0; i < asize; i++) {
-    if (valiswhite(&h->array[i])) {
+    TValue v;
+    arr2obj(h, i, &v);
+    if (valiswhite(&v)) {
       marked = 1;
-      reallymarkobject(g, gcvalue(&h->array[i]));
+      reallymarkobject(g, gcvalue(&v));
     }
   }
-  /* traverse hash part */
-  for (n = gnode(h, 0); n < limit; n++) {
-    if (isempty(gval(n)))  /* entry is empty? */
-      clearkey(n);  /* clear its key */
-    else if (iscleared(g, gckeyN(n))) {  /* key is not marked (yet)? */
-      hasclears = 1;  /* table must be cleared */
-      if (valiswhite(gval(n)))  /* value not marked yet? */
-        hasww = 1;  /* white-white entry */
+  do {  /* traverse hash part(s) */
+    for (n = gnode(hp, 0), limit = gnodelast(hp); n < limit; n++) {
+      if (isempty(gval(n)))  /* entry is empty? */
+        clearkey(n);  /* clear its key */
+      else if (iscleared(g, gckeyN(n))) {  /* key is not marked (yet)? */
+        hasclears = 1;  /* table must be cleared */
+        if (valiswhite(gval(n)))  /* value not marked yet? */
+          hasww = 1;  /* white-white entry */
+      }
+      else if (valiswhite(gval(n))) {  /* value not marked yet? */
+        marked = 1;
+        reallymarkobject(g, gcvalue(gval(n)));  /* mark it now */
+      }
     }
-    else if (valiswhite(gval(n))) {  /* value not marked yet? */
-      marked = 1;
-      reallymarkobject(g, gcvalue(gval(n)));  /* mark it now */
+  } while ((hp = nexthashpart(hp)) != NULL);
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(h)) {  /* keys in a shape are strings, so never cleared */
+    int j;
+    for (j = 0; j < h->shape->nkeys; j++) {
+      if (valiswhite(&h->slots[j])) {
+        marked = 1;
+        reallymarkobject(g, gcvalue(&h->slots[j]));
+      }
     }
   }
+#endif
   /* link table into proper list */
   if (g->gcstate == GCSpropagate)
     linkgclist(h, g->grayagain);  /* must retraverse it in atomic phase */
@@ -470,58 +1166,398 @@ static int traverseephemeron (global_State *g, Table *h) {
 }
 
 
+#if defined(LUA_USE_CARDS)
+/*
+** Create the cards for a table being traversed whole. (Failing to
+** create them is not an error.) If the table was touched in this cycle,
+** it has to be traversed whole again in the next cycle, so its
+** whole-table card is marked.
+*/
+static void newcards (global_State *g, Table *h) {
+  size_t n = ncards(h) + 1;
+  lu_byte *cards = cast(lu_byte *, (*g->frealloc)(g->ud, NULL, 0, n));
+  if (cards != NULL) {
+    memset(cards, 0, n);
+    if (getage(h) == G_TOUCHED1)
+      cards[n - 1] = CARDNEW;
+    g->GCdebt += n;
+    h->cards = cards;
+  }
+}
+#endif
+
+
 static void traversestrongtable (global_State *g, Table *h) {
-  Node *n, *limit = gnodelast(h);
+  Table *hp = h;  /* hash part being traversed */
+  Node *n, *limit;
   unsigned int i;
   unsigned int asize = luaH_realasize(h);
-  for (i = 0; i < asize; i++)  /* traverse array part */
-    markvalue(g, &h->array[i]);
-  for (n = gnode(h, 0); n < limit; n++) {  /* traverse hash part */
-    if (isempty(gval(n)))  /* entry is empty? */
-      clearkey(n);  /* clear its key */
-    else {
-      lua_assert(!keyisnil(n));
-      markkey(g, n);
-      markvalue(g, gval(n));
+  for (i = 0; i < asize; i++) {  /* traverse array part */
+    TValue v;
+    arr2obj(h, i, &v);
+    markvalue(g, &v);
+  }
+  do {  /* traverse hash part(s) */
+    for (n = gnode(hp, 0), limit = gnodelast(hp); n < limit; n++) {
+      if (isempty(gval(n)))  /* entry is empty? */
+        clearkey(n);  /* clear its key */
+      else {
+        lua_assert(!keyisnil(n));
+        markkey(g, n);
+        markvalue(g, gval(n));
+      }
     }
+  } while ((hp = nexthashpart(hp)) != NULL);
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(h)) {  /* traverse slots */
+    int j;
+    for (j = 0; j < h->shape->nkeys; j++)
+      markvalue(g, &h->slots[j]);
   }
+#endif
   if (g->gckind == KGC_GEN) {
+#if defined(LUA_USE_CARDS)
+    if (h->cards == NULL && numslots(h) >= CARDMIN &&
+        numslots(h) <= cast_uint(MAX_INT) && nexthashpart(h) == NULL)
+      newcards(g, h);
+#endif
     linkgclist(h, g->grayagain);  /* keep it in some gray list */
     black2gray(h);
   }
 }
 
 
-static lu_mem traversetable (global_State *g, Table *h) {
-  const char *weakkey, *weakvalue;
-  const TValue *mode = gfasttm(g, h->metatable, TM_MODE);
-  markobjectN(g, h->metatable);
-  if (mode && ttisstring(mode) &&  /* is there a weak mode? */
-      ((weakkey = strchr(svalue(mode), 'k')),
-       (weakvalue = strchr(svalue(mode), 'v')),
-       (weakkey || weakvalue))) {  /* is really weak? */
-    black2gray(h);  /* keep table gray */
-    if (!weakkey)  /* strong keys? */
-      traverseweakvalue(g, h);
-    else if (!weakvalue)  /* strong values? */
-      traverseephemeron(g, h);
-    else  /* all weak */
-      linkgclist(h, g->allweak);  /* nothing to traverse now */
-  }
-  else  /* not weak */
-    traversestrongtable(g, h);
+/*
+** Amount of work done when traversing table 'h'.
+*/
+static lu_mem tablework (Table *h) {
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(h))
+    return 1 + h->alimit + 2 * allocsizenode(h) + h->shape->nkeys;
+#endif
+#if defined(LUA_USE_INCRHASH)
+  if (h->oldhash != NULL)
+    return 1 + h->alimit + 2 * (allocsizenode(h) + sizenode(h->oldhash));
+#endif
   return 1 + h->alimit + 2 * allocsizenode(h);
 }
 
 
+#if defined(LUA_USE_GCBUDGET) || defined(LUA_USE_CARDS)
+
 /*
-** Check the cache of a prototype, to keep invariants. If the
-** cache is white, clear it. (A cache should not prevent the
-** collection of its reference.) Otherwise, if in generational
-** mode, check the generational invariant. If the cache is old,
-** everything is ok. If the prototype is 'old0', everything
-** is ok too. (It will naturally be visited again.) If the
-** prototype is older than 'old0', then its cache (which is new)
+** Traverse slots 'i' up to 'limit' (not included) of strong table 'h',
+** counting the slots of its array part first and then its nodes.
+*/
+static void traverseslots (global_State *g, Table *h, unsigned int i,
+                                                      unsigned int limit) {
+  unsigned int asize = luaH_realasize(h);
+  for (; i < limit && i < asize; i++) {  /* traverse array slots */
+    TValue v;
+    arr2obj(h, i, &v);
+    markvalue(g, &v);
+  }
+  for (; i < limit; i++) {  /* traverse nodes */
+    Node *nd = gnode(h, i - asize);
+    if (isempty(gval(nd)))  /* entry is empty? */
+      clearkey(nd);  /* clear its key */
+    else {
+      markkey(g, nd);
+      markvalue(g, gval(nd));
+    }
+  }
+}
+
+#endif
+
+
+#if defined(LUA_USE_GCBUDGET)
+
+/*
+** When steps have a time budget, a large strong table is traversed in
+** parts of PARTIALCHUNK slots (array slots first, then nodes), one part
+** per step, staying black meanwhile. If a white value goes to a part
+** already traversed, the back barrier puts the table in 'grayagain', to
+** be traversed again in the atomic phase, so its partial traversal can
+** stop. The same is done when the table moves its entries (a resize),
+** as entries not traversed yet could go to a part already traversed.
+*/
+
+#define PARTIALCHUNK	1024
+
+
+static int canpartial (global_State *g, Table *h) {
+  return (g->gcbudget > 0 && g->gckind == KGC_INC &&
+          g->gcstate == GCSpropagate && g->gcpartial == NULL &&
+          numslots(h) > 2 * PARTIALCHUNK &&
+          nexthashpart(h) == NULL && !isshaped(h));
+}
+
+
+/*
+** Traverse the next part of the table being traversed in parts.
+*/
+static lu_mem partialstep (global_State *g) {
+  Table *h = g->gcpartial;
+  unsigned int n = numslots(h);
+  unsigned int i = g->gcpartialpos;
+  unsigned int limit = (n - i > PARTIALCHUNK) ? i + PARTIALCHUNK : n;
+  if (!isblack(h)) {  /* table went to 'grayagain'? */
+    g->gcpartial = NULL;  /* no need to go on */
+    return 0;
+  }
+  traverseslots(g, h, i, limit);
+  g->gcpartialpos = limit;
+  if (limit == n)  /* traversed everything? */
+    g->gcpartial = NULL;
+  return limit - i;
+}
+
+
+static void finishpartial (global_State *g) {
+  while (g->gcpartial != NULL)
+    partialstep(g);
+}
+
+#endif
+
+
+#if defined(LUA_USE_CARDS)
+
+/*
+** In generational mode, a large table has a card for each CARDSIZE
+** slots (array slots first, then nodes), plus a last card for the
+** whole table. A back barrier for a store whose place is known marks
+** only the card of that place and keeps the table black, so that
+** later stores into the table also go through the barrier; other back
+** barriers mark the whole-table card (and make the table gray). A
+** young collection traverses a touched table only in the cards marked
+** in this cycle or in the previous one (whose values may still be
+** young), unless its whole-table card is marked. Any change in the
+** layout of a table frees its cards; they are created again when the
+** table is traversed whole.
+*/
+
+void luaC_freecards (lua_State *L, Table *t) {
+  luaM_freemem(L, t->cards, ncards(t) + 1);
+  t->cards = NULL;
+}
+
+
+/*
+** A touched table in generational mode keeps marks only from this and
+** the previous cycle: when it goes from 'touched1' to 'touched2', its
+** new marks become old ones and its old marks are dropped; when it goes
+** to 'old', all its marks are dropped.
+*/
+static void agecards (Table *h, int clear) {
+  if (h->cards != NULL) {
+    unsigned int i;
+    unsigned int n = ncards(h);
+    for (i = 0; i <= n; i++)
+      h->cards[i] = (clear || !(h->cards[i] & CARDNEW)) ? 0 : CARDOLD;
+  }
+}
+
+
+static int cantraversecards (global_State *g, Table *h) {
+  return (g->gckind == KGC_GEN && h->cards != NULL &&
+          (getage(h) == G_TOUCHED1 || getage(h) == G_TOUCHED2) &&
+          wholecard(h) == 0);
+}
+
+
+/*
+** Traverse the marked cards of a touched table. (Like
+** 'traversestrongtable', it keeps the table gray in 'grayagain'.)
+*/
+static lu_mem traversecards (global_State *g, Table *h) {
+  unsigned int n = numslots(h);
+  unsigned int nc = ncards(h);
+  unsigned int c;
+  lu_mem work = 1 + nc / 16;
+  for (c = 0; c < nc; c++) {
+    if (h->cards[c] != 0) {  /* marked card? */
+      unsigned int i = c << CARDBITS;
+      unsigned int limit = (n - i > CARDSIZE) ? i + CARDSIZE : n;
+      traverseslots(g, h, i, limit);
+      work += 2 * (limit - i);
+    }
+  }
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(h)) {  /* slots are not in the cards */
+    int j;
+    for (j = 0; j < h->shape->nkeys; j++)
+      markvalue(g, &h->slots[j]);
+  }
+#endif
+  linkgclist(h, g->grayagain);
+  black2gray(h);
+  return work;
+}
+
+
+/*
+** A store may mark only a card of a table that is old or touched. An
+** 'old0' or 'old1' table may still point to young objects anywhere, so
+** it must be traversed whole in its next collection.
+*/
+#define cancard(g,t)  \
+	((g)->gckind == KGC_GEN && (t)->cards != NULL && getage(t) >= G_OLD)
+
+
+/*
+** Mark the card for slot 'i' of an old table 't' that is black.
+*/
+static void markcard (global_State *g, Table *t, unsigned int i) {
+  lua_assert(isblack(t) && isold(t) && i < numslots(t));
+  t->cards[i >> CARDBITS] |= CARDNEW;
+  if (getage(t) != G_TOUCHED1) {  /* first barrier in this cycle? */
+    if (getage(t) != G_TOUCHED2)  /* not already in gray list? */
+      linkgclist(t, g->grayagain);  /* link it in 'grayagain' */
+    setage(t, G_TOUCHED1);  /* touched in current cycle */
+  }
+}
+
+
+void luaC_barrierindex_ (lua_State *L, Table *t, unsigned int i) {
+  global_State *g = G(L);
+  if (cancard(g, t))
+    markcard(g, t, i);
+  else
+    luaC_barrierback_(L, obj2gco(t));
+}
+
+
+void luaC_barrierslot_ (lua_State *L, Table *t, const TValue *slot) {
+  global_State *g = G(L);
+  Node *n = nodefromval(slot);
+  if (cancard(g, t) &&
+      gnode(t, 0) <= n && n < gnode(t, sizenode(t)))  /* slot is a node? */
+    markcard(g, t, luaH_realasize(t) + cast_uint(n - gnode(t, 0)));
+  else
+    luaC_barrierback_(L, obj2gco(t));
+}
+
+
+void luaC_barrierkey_ (lua_State *L, Table *t, const TValue *key) {
+  global_State *g = G(L);
+  int i;
+  if (cancard(g, t) && (i = luaH_slotindex(t, key)) >= 0)
+    markcard(g, t, cast_uint(i));
+  else
+    luaC_barrierback_(L, obj2gco(t));
+}
+
+
+/*
+** Table 't' is moving its entries, so its cards would not match them
+** anymore; the table will be traversed whole until it gets new cards.
+*/
+void luaC_tablemoved_ (lua_State *L, Table *t) {
+#if defined(LUA_USE_GCBUDGET)
+  if (G(L)->gcpartial == t && isblack(t))
+    luaC_barrierback_(L, obj2gco(t));
+#endif
+  if (t->cards != NULL)
+    luaC_freecards(L, t);
+}
+
+
+/*
+** Node 'from' of table 't' is moving to node 'to': the card of 'to'
+** gets the marks of the card of 'from'.
+*/
+void luaC_nodemoved_ (lua_State *L, Table *t, Node *from, Node *to) {
+#if defined(LUA_USE_GCBUDGET)
+  if (G(L)->gcpartial == t && isblack(t))
+    luaC_barrierback_(L, obj2gco(t));
+#else
+  UNUSED(L);
+#endif
+  if (t->cards != NULL) {
+    unsigned int asize = luaH_realasize(t);
+    unsigned int f = asize + cast_uint(from - gnode(t, 0));
+    unsigned int i = asize + cast_uint(to - gnode(t, 0));
+    t->cards[i >> CARDBITS] |= t->cards[f >> CARDBITS];
+  }
+}
+
+#else
+
+#define cantraversecards(g,h)	0
+#define traversecards(g,h)	0
+#define agecards(h,clear)	((void)0)
+
+#endif
+
+
+#if defined(LUA_USE_APPENDSTR)
+
+/*
+** Like 'strchr' over the weak mode 'ts', which may not end with a '\0'
+** (see 'lstring.c'); the collector cannot give it a buffer of its own.
+*/
+static const char *modechr (TString *ts, int c) {
+  const char *s = getstr(ts);
+  size_t l = tsslen(ts);
+  size_t i;
+  for (i = 0; i < l && s[i] != '\0'; i++) {
+    if (s[i] == c)
+      return s + i;
+  }
+  return NULL;
+}
+
+#else
+
+#define modechr(ts,c)	strchr(getstr(ts), c)
+
+#endif
+
+
+static lu_mem traversetable (global_State *g, Table *h) {
+  const char *weakkey, *weakvalue;
+  const TValue *mode = gfasttm(g, h->metatable, TM_MODE);
+  markobjectN(g, h->metatable);
+#if defined(LUA_USE_SIZEHINTS)
+  markobjectN(g, h->site);  /* keep its size hint alive */
+#endif
+  if (mode && ttisstring(mode) &&  /* is there a weak mode? */
+      ((weakkey = modechr(tsvalue(mode), 'k')),
+       (weakvalue = modechr(tsvalue(mode), 'v')),
+       (weakkey || weakvalue))) {  /* is really weak? */
+    black2gray(h);  /* keep table gray */
+    if (!weakkey)  /* strong keys? */
+      traverseweakvalue(g, h);
+    else if (!weakvalue)  /* strong values? */
+      traverseephemeron(g, h);
+    else  /* all weak */
+      linkgclist(h, g->allweak);  /* nothing to traverse now */
+  }
+#if defined(LUA_USE_GCBUDGET)
+  else if (canpartial(g, h)) {  /* strong, but too large for one step? */
+    g->gcpartial = h;
+    g->gcpartialpos = 0;
+    return 1 + partialstep(g);
+  }
+#endif
+  else if (cantraversecards(g, h))  /* only parts of it were touched? */
+    return traversecards(g, h);
+  else  /* not weak */
+    traversestrongtable(g, h);
+  return tablework(h);
+}
+
+
+/*
+** Check the cache of a prototype, to keep invariants. If the
+** cache is white, clear it. (A cache should not prevent the
+** collection of its reference.) Otherwise, if in generational
+** mode, check the generational invariant. If the cache is old,
+** everything is ok. If the prototype is 'old0', everything
+** is ok too. (It will naturally be visited again.) If the
+** prototype is older than 'old0', then its cache (which is new)
 ** must be visited again in the next collection, so the prototype
 ** goes to the 'protogray' list. (If the prototype has a cache,
 ** it is already immutable and does not need other barriers;
@@ -536,126 +1572,837 @@ static void checkprotocache (global_State *g, Proto *p) {
       black2gray(p);  /* make prototype gray */
     }
   }
-  p->cachemiss = 0;  /* restart counting */
+  p->cachemiss = 0;  /* restart counting */
+}
+
+
+/*
+** Traverse a prototype. (While a prototype is being build, its
+** arrays can be larger than needed; the extra slots are filled with
+** NULL, so the use of 'markobjectN')
+*/
+static int traverseproto (global_State *g, Proto *f) {
+  int i;
+  checkprotocache(g, f);
+  markobjectN(g, f->source);
+  for (i = 0; i < f->sizek; i++)  /* mark literals */
+    markvalue(g, &f->k[i]);
+  for (i = 0; i < f->sizeupvalues; i++)  /* mark upvalue names */
+    markobjectN(g, f->upvalues[i].name);
+  for (i = 0; i < f->sizep; i++)  /* mark nested protos */
+    markobjectN(g, f->p[i]);
+  for (i = 0; i < f->sizelocvars; i++)  /* mark local-variable names */
+    markobjectN(g, f->locvars[i].varname);
+  return 1 + f->sizek + f->sizeupvalues + f->sizep + f->sizelocvars;
+}
+
+
+static int traverseCclosure (global_State *g, CClosure *cl) {
+  int i;
+  for (i = 0; i < cl->nupvalues; i++)  /* mark its upvalues */
+    markvalue(g, &cl->upvalue[i]);
+  return 1 + cl->nupvalues;
+}
+
+/*
+** Traverse a Lua closure, marking its prototype and its upvalues.
+** (Both can be NULL while closure is being created.)
+*/
+static int traverseLclosure (global_State *g, LClosure *cl) {
+  int i;
+  markobjectN(g, cl->p);  /* mark its prototype */
+  for (i = 0; i < cl->nupvalues; i++) {  /* visit its upvalues */
+    UpVal *uv = cl->upvals[i];
+    markobjectN(g, uv);  /* mark upvalue */
+  }
+  return 1 + cl->nupvalues;
+}
+
+
+/*
+** Traverse a thread, marking the elements in the stack up to its top
+** and cleaning the rest of the stack in the final traversal.
+** That ensures that the entire stack have valid (non-dead) objects.
+*/
+static int traversethread (global_State *g, lua_State *th) {
+  StkId o = th->stack;
+  if (o == NULL)
+    return 1;  /* stack not completely built yet */
+  lua_assert(g->gcstate == GCSatomic ||
+             th->openupval == NULL || isintwups(th));
+#if defined(LUA_USE_DIRTYTHREADS)
+  if (g->gcstate == GCSatomic && isclean(g, th)) {
+    UpVal *uv;
+    for (uv = th->openupval; uv != NULL; uv = uv->u.open.next)
+      markvalue(g, uv->v);  /* may have been changed by other threads */
+    o = th->ci->func;  /* only its current frame may have changed */
+  }
+#endif
+  for (; o < th->top; o++)  /* mark live elements in the stack */
+    markvalue(g, s2v(o));
+  if (g->gcstate == GCSatomic) {  /* final traversal? */
+    StkId lim = th->stack + th->stacksize;  /* real end of stack */
+    for (; o < lim; o++)  /* clear not-marked stack slice */
+      setnilvalue(s2v(o));
+    /* 'remarkupvals' may have removed thread from 'twups' list */
+    if (!isintwups(th) && th->openupval != NULL) {
+      th->twups = g->twups;  /* link it back to the list */
+      g->twups = th;
+    }
+#if defined(LUA_USE_DIRTYTHREADS)
+    th->gcepoch = g->gcepoch - 1;  /* a past marking */
+#endif
+  }
+  else {
+#if defined(LUA_USE_DIRTYTHREADS)
+    if (th->gcparked)
+      th->gcepoch = g->gcepoch;  /* traversed while parked */
+#endif
+    if (!g->gcemergency)
+      luaD_shrinkstack(th); /* do not change stack in emergency cycle */
+  }
+  return 1 + th->stacksize;
+}
+
+
+static int traverseudata (global_State *g, Udata *u) {
+  int i;
+  markobjectN(g, u->metatable);  /* mark its metatable */
+  for (i = 0; i < u->nuvalue; i++)
+    markvalue(g, &u->uv[i].uv);
+  return 1 + u->nuvalue;
+}
+
+
+/*
+** traverse one gray object, turning it to black (except for threads,
+** which are always gray).
+*/
+static lu_mem propagatemark (global_State *g) {
+  GCObject *o = g->gray;
+  gray2black(o);
+  g->gray = *getgclist(o);  /* remove from 'gray' list */
+  switch (o->tt) {
+    case LUA_TTABLE: return traversetable(g, gco2t(o));
+    case LUA_TUSERDATA: return traverseudata(g, gco2u(o));
+    case LUA_TLCL: return traverseLclosure(g, gco2lcl(o));
+    case LUA_TCCL: return traverseCclosure(g, gco2ccl(o));
+    case LUA_TPROTO: return traverseproto(g, gco2p(o));
+    case LUA_TTHREAD: {
+      lua_State *th = gco2th(o);
+      linkgclist(th, g->grayagain);  /* insert into 'grayagain' list */
+      black2gray(o);
+      return traversethread(g, th);
+    }
+    default: lua_assert(0); return 0;
+  }
+}
+
+
+#if defined(LUA_USE_PARALLELMARK)
+
+/*
+** {======================================================
+** Parallel marking
+** =======================================================
+*/
+
+/*
+** Sometimes a propagation must go through a long gray list in one go:
+** in a full collection and in the atomic phase of the incremental
+** collector. If it is still going after PARMARKMIN objects, the
+** collecting thread and 'g->gcmarkers - 1' helper threads finish it
+** together. The helpers are created at the first such round and then
+** wait for the next ones.
+**
+** Each marker keeps a private gray list. When that list has more than
+** PUBLISHMIN objects and its 'shared' list is empty, the marker moves
+** some of its objects to 'shared'. Markers with no work take the whole
+** 'shared' list of another marker. The marker that clears the white
+** bits of an object owns it, so 'marked' fields change only through
+** atomic operations while markers run.
+**
+** Markers neither allocate memory nor touch the global gray lists.
+** So they leave threads and tables with a '__mode' field in their
+** 'deferred' lists, and the collecting thread traverses those objects
+** afterwards in the usual way. The mutator does not run during any of
+** this.
+*/
+
+/* objects traversed serially before using the markers */
+#define PARMARKMIN	1000
+
+/* private gray objects a marker keeps before sharing some */
+#define PUBLISHMIN	64
+
+/* maximum number of objects shared at once */
+#define PUBLISHMAX	256
+
+/* maximum number of markers */
+#define MAXMARKERS	64
+
+
+/* access to the color bits of objects while markers run */
+#define pmarked(o)	__atomic_load_n(&(o)->marked, __ATOMIC_RELAXED)
+#define piswhite(o)	(pmarked(o) & WHITEBITS)
+#define pgray2black(o)  \
+	((void)__atomic_fetch_or(&(o)->marked, bitmask(BLACKBIT), __ATOMIC_RELAXED))
+
+#define pvaliswhite(v)	(iscollectable(v) && piswhite(gcvalue(v)))
+#define pkeyiswhite(n)	(keyiscollectable(n) && piswhite(gckey(n)))
+
+#define pmarkvalue(m,v)	{ checkconsistency(v); \
+  if (pvaliswhite(v)) pmarkobject(m, gcvalue(v)); }
+
+#define pmarkkey(m,n)	{ if (pkeyiswhite(n)) pmarkobject(m, gckey(n)); }
+
+#define pmarkobjectN(m,t)	{ if ((t) && piswhite(t)) pmarkobject(m, obj2gco(t)); }
+
+
+typedef struct Marker {
+  GCObject *gray;  /* private list of gray objects */
+  GCObject *deferred;  /* objects left to the collecting thread */
+  GCObject *shared;  /* gray objects other markers can take */
+  int ngray;  /* number of objects in 'gray' */
+  int nshared;  /* number of objects in 'shared' */
+  lu_mem work;  /* work done in current round */
+  struct GCMarkers *ms;
+  pthread_mutex_t lock;  /* protects 'shared' */
+  pthread_t thread;
+} Marker;
+
+
+typedef struct GCMarkers {
+  global_State *g;
+  int n;  /* number of markers (marker 0 is the collecting thread) */
+  int active;  /* number of markers that may still share objects */
+  int running;  /* number of helpers still in current round */
+  unsigned int round;  /* incremented to start a new round */
+  int quit;  /* true when helpers must finish */
+  pthread_mutex_t lock;  /* protects 'running', 'round', and 'quit' */
+  pthread_cond_t start;  /* signals a new round (or 'quit') to helpers */
+  pthread_cond_t done;  /* signals the end of a round to marker 0 */
+  Marker m[1];  /* actually 'n' markers */
+} GCMarkers;
+
+
+#define sizemarkers(n)	(offsetof(GCMarkers, m) + (n) * sizeof(Marker))
+
+
+/*
+** Mark object 'o', if this marker is the first one to reach it.
+*/
+static void pmarkobject (Marker *m, GCObject *o) {
+  if (!(__atomic_fetch_and(&o->marked, cast_byte(~WHITEBITS),
+                           __ATOMIC_RELAXED) & WHITEBITS))
+    return;  /* another marker got it first */
+  switch (o->tt) {
+    case LUA_TSHRSTR:
+    case LUA_TLNGSTR: {
+      pgray2black(o);
+      break;
+    }
+    case LUA_TUPVAL: {
+      UpVal *uv = gco2upv(o);
+      if (!upisopen(uv))  /* open upvalues are kept gray */
+        pgray2black(o);
+      pmarkvalue(m, uv->v);  /* mark its content */
+      break;
+    }
+    case LUA_TUSERDATA: {
+      Udata *u = gco2u(o);
+      if (u->nuvalue == 0) {  /* no user values? */
+        pmarkobjectN(m, u->metatable);  /* mark its metatable */
+        pgray2black(o);  /* nothing else to mark */
+        break;
+      }
+      /* else... */
+    }  /* FALLTHROUGH */
+    default: {
+      linkobjgclist(o, m->gray);
+      m->ngray++;
+      break;
+    }
+  }
+}
+
+
+/*
+** Like 'gfasttm(g, mt, TM_MODE)' (only checking for a non-nil field),
+** but does not update the cache in 'mt->flags', which other markers may
+** be reading.
+*/
+static int hasmode (global_State *g, Table *mt) {
+  return (mt != NULL && !(mt->flags & bitmask(TM_MODE)) &&
+          !notm(luaH_getshortstr(mt, g->tmname[TM_MODE])));
+}
+
+
+/* same as 'traversestrongtable' */
+static lu_mem ptraversetable (Marker *m, Table *h) {
+  Table *hp = h;  /* hash part being traversed */
+  Node *n, *limit;
+  unsigned int i;
+  unsigned int asize = luaH_realasize(h);
+  pmarkobjectN(m, h->metatable);
+#if defined(LUA_USE_SIZEHINTS)
+  pmarkobjectN(m, h->site);
+#endif
+  for (i = 0; i < asize; i++) {  /* traverse array part */
+    TValue v;
+    arr2obj(h, i, &v);
+    pmarkvalue(m, &v);
+  }
+  do {  /* traverse hash part(s) */
+    for (n = gnode(hp, 0), limit = gnodelast(hp); n < limit; n++) {
+      if (isempty(gval(n))) {  /* entry is empty? */
+        if (pkeyiswhite(n))
+          setdeadkey(n);  /* unused and unmarked key; remove it */
+      }
+      else {
+        lua_assert(!keyisnil(n));
+        pmarkkey(m, n);
+        pmarkvalue(m, gval(n));
+      }
+    }
+  } while ((hp = nexthashpart(hp)) != NULL);
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(h)) {  /* traverse slots */
+    int j;
+    for (j = 0; j < h->shape->nkeys; j++)
+      pmarkvalue(m, &h->slots[j]);
+  }
+#endif
+  return tablework(h);
+}
+
+
+/* same as 'traverseproto' (in incremental mode) */
+static lu_mem ptraverseproto (Marker *m, Proto *f) {
+  int i;
+  if (f->cache && piswhite(f->cache))
+    f->cache = NULL;  /* allow cache to be collected */
+  f->cachemiss = 0;  /* restart counting */
+  pmarkobjectN(m, f->source);
+  for (i = 0; i < f->sizek; i++)  /* mark literals */
+    pmarkvalue(m, &f->k[i]);
+  for (i = 0; i < f->sizeupvalues; i++)  /* mark upvalue names */
+    pmarkobjectN(m, f->upvalues[i].name);
+  for (i = 0; i < f->sizep; i++)  /* mark nested protos */
+    pmarkobjectN(m, f->p[i]);
+  for (i = 0; i < f->sizelocvars; i++)  /* mark local-variable names */
+    pmarkobjectN(m, f->locvars[i].varname);
+  return 1 + f->sizek + f->sizeupvalues + f->sizep + f->sizelocvars;
+}
+
+
+/*
+** Traverse gray object 'o', turning it black, or leave it for the
+** collecting thread.
+*/
+static void ptraverse (Marker *m, GCObject *o) {
+  int i;
+  switch (o->tt) {
+    case LUA_TTABLE: {
+      Table *h = gco2t(o);
+      if (hasmode(m->ms->g, h->metatable))
+        break;  /* maybe weak; leave it */
+      pgray2black(o);
+      m->work += ptraversetable(m, h);
+      return;
+    }
+    case LUA_TUSERDATA: {
+      Udata *u = gco2u(o);
+      pgray2black(o);
+      pmarkobjectN(m, u->metatable);
+      for (i = 0; i < u->nuvalue; i++)
+        pmarkvalue(m, &u->uv[i].uv);
+      m->work += 1 + u->nuvalue;
+      return;
+    }
+    case LUA_TLCL: {
+      LClosure *cl = gco2lcl(o);
+      pgray2black(o);
+      pmarkobjectN(m, cl->p);
+      for (i = 0; i < cl->nupvalues; i++)
+        pmarkobjectN(m, cl->upvals[i]);
+      m->work += 1 + cl->nupvalues;
+      return;
+    }
+    case LUA_TCCL: {
+      CClosure *cl = gco2ccl(o);
+      pgray2black(o);
+      for (i = 0; i < cl->nupvalues; i++)
+        pmarkvalue(m, &cl->upvalue[i]);
+      m->work += 1 + cl->nupvalues;
+      return;
+    }
+    case LUA_TPROTO: {
+      pgray2black(o);
+      m->work += ptraverseproto(m, gco2p(o));
+      return;
+    }
+    default: break;  /* threads */
+  }
+  linkobjgclist(o, m->deferred);  /* still gray */
+}
+
+
+/*
+** Move some objects from the private gray list of 'm' to its shared
+** list.
+*/
+static void publish (Marker *m) {
+  GCObject *first = m->gray;
+  GCObject *last = first;
+  int n = m->ngray / 2;
+  int i;
+  if (n > PUBLISHMAX) n = PUBLISHMAX;
+  for (i = 1; i < n; i++)
+    last = *getgclist(last);
+  m->gray = *getgclist(last);
+  m->ngray -= n;
+  pthread_mutex_lock(&m->lock);
+  *getgclist(last) = m->shared;
+  m->shared = first;
+  atomicadd(&m->nshared, n);
+  pthread_mutex_unlock(&m->lock);
+}
+
+
+/*
+** Marker 'm' (with an empty gray list) takes all objects shared by
+** marker 'v'. Returns true if it got any.
+*/
+static int take (Marker *m, Marker *v) {
+  pthread_mutex_lock(&v->lock);
+  m->gray = v->shared;
+  m->ngray = v->nshared;
+  v->shared = NULL;
+  atomicstore(&v->nshared, 0);
+  pthread_mutex_unlock(&v->lock);
+  return (m->gray != NULL);
+}
+
+
+/*
+** Find more work for marker 'm'. A marker stops being active when it
+** has no objects; only active markers share objects, so when no marker
+** is active and all shared lists are empty, marking is over. (A marker
+** counts itself as active again before trying to take objects.)
+*/
+static int getwork (Marker *m) {
+  GCMarkers *ms = m->ms;
+  int i;
+  if (atomicload(&m->nshared) > 0 && take(m, m))  /* get back own work */
+    return 1;
+  atomicadd(&ms->active, -1);
+  for (;;) {
+    int empty = 1;  /* true if all shared lists are empty */
+    int idle = (atomicload(&ms->active) == 0);
+    for (i = 0; i < ms->n; i++) {
+      Marker *v = &ms->m[i];
+      if (atomicload(&v->nshared) > 0) {
+        empty = 0;
+        atomicadd(&ms->active, 1);
+        if (take(m, v))
+          return 1;
+        atomicadd(&ms->active, -1);
+      }
+    }
+    if (idle && empty)
+      return 0;  /* nothing else to do */
+    sched_yield();
+  }
+}
+
+
+static void drain (Marker *m) {
+  do {
+    while (m->gray != NULL) {
+      GCObject *o = m->gray;
+      m->gray = *getgclist(o);  /* remove from 'gray' list */
+      m->ngray--;
+      ptraverse(m, o);
+      if (m->ngray > PUBLISHMIN && atomicload(&m->nshared) == 0)
+        publish(m);  /* let other markers take part of its work */
+    }
+  } while (getwork(m));
+}
+
+
+static void *helper (void *ud) {
+  Marker *m = cast(Marker *, ud);
+  GCMarkers *ms = m->ms;
+  unsigned int round = 0;
+  pthread_mutex_lock(&ms->lock);
+  for (;;) {
+    while (ms->round == round && !ms->quit)
+      pthread_cond_wait(&ms->start, &ms->lock);
+    if (ms->quit)
+      break;
+    round = ms->round;
+    pthread_mutex_unlock(&ms->lock);
+    drain(m);
+    pthread_mutex_lock(&ms->lock);
+    if (--ms->running == 0)
+      pthread_cond_signal(&ms->done);
+  }
+  pthread_mutex_unlock(&ms->lock);
+  return NULL;
+}
+
+
+static void freemarkers (global_State *g, GCMarkers *ms) {
+  int i;
+  pthread_mutex_lock(&ms->lock);
+  ms->quit = 1;
+  pthread_cond_broadcast(&ms->start);
+  pthread_mutex_unlock(&ms->lock);
+  for (i = 1; i < ms->n; i++)
+    pthread_join(ms->m[i].thread, NULL);
+  for (i = 0; i < ms->n; i++)
+    pthread_mutex_destroy(&ms->m[i].lock);
+  pthread_cond_destroy(&ms->done);
+  pthread_cond_destroy(&ms->start);
+  pthread_mutex_destroy(&ms->lock);
+  (*g->frealloc)(g->ud, ms, sizemarkers(g->gcmarkers), 0);
+  g->GCdebt -= sizemarkers(g->gcmarkers);
+}
+
+
+/*
+** Create the markers for 'g'. The block is allocated directly, as this
+** happens in the middle of a collection (so 'luaM_' functions, which
+** can collect garbage, cannot be used). Helper threads block all
+** signals, which must go to the threads running Lua. Returns false if
+** it could not create any helper.
+*/
+static int createmarkers (global_State *g) {
+  GCMarkers *ms;
+  sigset_t all, old;
+  int i;
+  ms = cast(GCMarkers *, (*g->frealloc)(g->ud, NULL, 0,
+                                        sizemarkers(g->gcmarkers)));
+  if (ms == NULL)
+    return 0;
+  g->GCdebt += sizemarkers(g->gcmarkers);
+  ms->g = g;
+  ms->n = 1;
+  ms->round = 0;
+  ms->quit = 0;
+  pthread_mutex_init(&ms->lock, NULL);
+  pthread_cond_init(&ms->start, NULL);
+  pthread_cond_init(&ms->done, NULL);
+  for (i = 0; i < g->gcmarkers; i++) {
+    ms->m[i].ms = ms;
+    ms->m[i].shared = NULL;
+    ms->m[i].nshared = 0;
+    pthread_mutex_init(&ms->m[i].lock, NULL);
+  }
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  while (ms->n < g->gcmarkers) {
+    Marker *m = &ms->m[ms->n];
+    if (pthread_create(&m->thread, NULL, helper, m) != 0)
+      break;  /* work with the helpers created so far */
+    ms->n++;
+  }
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  g->markers = ms;
+  if (ms->n == 1) {  /* could not create any helper? */
+    freemarkers(g, ms);
+    g->markers = NULL;
+    g->gcmarkers = 1;  /* do not try again */
+    return 0;
+  }
+  return 1;
+}
+
+
+/*
+** Markers can be used only by the incremental collector; the
+** generational one keeps gray objects in global lists.
+*/
+static int usemarkers (global_State *g) {
+  return (g->gckind == KGC_INC && g->gcmarkers > 1 &&
+#if defined(LUA_USE_EPHEMERONMAP)
+          g->ephmap == NULL &&  /* markers do not check the map */
+#endif
+          (g->markers != NULL || createmarkers(g)));
+}
+
+
+/*
+** Traverse all objects in the gray list (and what they reach) with all
+** markers. Objects left by the markers go back to the gray list.
+*/
+static lu_mem parallelmark (global_State *g) {
+  GCMarkers *ms = g->markers;
+  GCObject *o;
+  lu_mem work = 0;
+  int i;
+  for (i = 0; i < ms->n; i++) {
+    ms->m[i].gray = ms->m[i].deferred = NULL;
+    ms->m[i].ngray = 0;
+    ms->m[i].work = 0;
+  }
+  for (o = g->gray; o != NULL; o = *getgclist(o))
+    ms->m[0].ngray++;
+  ms->m[0].gray = g->gray;  /* collecting thread starts with everything */
+  g->gray = NULL;
+  pthread_mutex_lock(&ms->lock);
+  ms->active = ms->n;
+  ms->running = ms->n - 1;
+  ms->round++;
+  pthread_cond_broadcast(&ms->start);
+  pthread_mutex_unlock(&ms->lock);
+  drain(&ms->m[0]);
+  pthread_mutex_lock(&ms->lock);
+  while (ms->running > 0)  /* wait for all helpers */
+    pthread_cond_wait(&ms->done, &ms->lock);
+  pthread_mutex_unlock(&ms->lock);
+  for (i = 0; i < ms->n; i++) {  /* collect results */
+    work += ms->m[i].work;
+    while ((o = ms->m[i].deferred) != NULL) {
+      ms->m[i].deferred = *getgclist(o);
+      linkobjgclist(o, g->gray);
+    }
+  }
+  return work;
 }
 
 
 /*
-** Traverse a prototype. (While a prototype is being build, its
-** arrays can be larger than needed; the extra slots are filled with
-** NULL, so the use of 'markobjectN')
+** Set the number of markers (including the collecting thread) for
+** next collections. Returns the previous number.
 */
-static int traverseproto (global_State *g, Proto *f) {
-  int i;
-  checkprotocache(g, f);
-  markobjectN(g, f->source);
-  for (i = 0; i < f->sizek; i++)  /* mark literals */
-    markvalue(g, &f->k[i]);
-  for (i = 0; i < f->sizeupvalues; i++)  /* mark upvalue names */
-    markobjectN(g, f->upvalues[i].name);
-  for (i = 0; i < f->sizep; i++)  /* mark nested protos */
-    markobjectN(g, f->p[i]);
-  for (i = 0; i < f->sizelocvars; i++)  /* mark local-variable names */
-    markobjectN(g, f->locvars[i].varname);
-  return 1 + f->sizek + f->sizeupvalues + f->sizep + f->sizelocvars;
+int luaC_setmarkers (lua_State *L, int n) {
+  global_State *g = G(L);
+  int res = g->gcmarkers;
+  if (n > 0) {
+    if (g->markers != NULL) {
+      freemarkers(g, g->markers);
+      g->markers = NULL;
+    }
+    g->gcmarkers = cast_byte((n < MAXMARKERS) ? n : MAXMARKERS);
+  }
+  return res;
 }
 
+/* }====================================================== */
+
+#endif
 
-static int traverseCclosure (global_State *g, CClosure *cl) {
-  int i;
-  for (i = 0; i < cl->nupvalues; i++)  /* mark its upvalues */
-    markvalue(g, &cl->upvalue[i]);
-  return 1 + cl->nupvalues;
+
+static lu_mem propagateall (global_State *g) {
+  lu_mem tot = 0;
+#if defined(LUA_USE_PARALLELMARK)
+  int n = 0;  /* objects traversed serially */
+  while (g->gray) {
+    if (n++ == PARMARKMIN && usemarkers(g)) {
+      tot += parallelmark(g);
+      n = 0;  /* objects left by markers start a new count */
+    }
+    else
+      tot += propagatemark(g);
+  }
+#else
+  while (g->gray)
+    tot += propagatemark(g);
+#endif
+  return tot;
 }
 
+
+#if defined(LUA_USE_EPHEMERONMAP)
+
+/* limit for the number of entries in an 'EphMap' */
+#define MAXEPHENTRIES	(INT_MAX / 4)
+
+
 /*
-** Traverse a Lua closure, marking its prototype and its upvalues.
-** (Both can be NULL while closure is being created.)
+** Call 'f' for each non-empty entry with a white value in the hash
+** parts of the tables in list 'l'.
 */
-static int traverseLclosure (global_State *g, LClosure *cl) {
-  int i;
-  markobjectN(g, cl->p);  /* mark its prototype */
-  for (i = 0; i < cl->nupvalues; i++) {  /* visit its upvalues */
-    UpVal *uv = cl->upvals[i];
-    markobjectN(g, uv);  /* mark upvalue */
-  }
-  return 1 + cl->nupvalues;
-}
+#define foreachpending(g,l,n,f) {  \
+	GCObject *l_ = (l);  \
+	for (; l_ != NULL; l_ = gco2t(l_)->gclist) {  \
+	  Table *hp_ = gco2t(l_);  \
+	  do {  \
+	    Node *lim_ = gnodelast(hp_);  \
+	    for (n = gnode(hp_, 0); n < lim_; n++)  \
+	      if (!isempty(gval(n)) && valiswhite(gval(n))) { f; }  \
+	  } while ((hp_ = nexthashpart(hp_)) != NULL);  \
+	} }
 
 
 /*
-** Traverse a thread, marking the elements in the stack up to its top
-** and cleaning the rest of the stack in the final traversal.
-** That ensures that the entire stack have valid (non-dead) objects.
+** The memory of an 'EphMap' is asked directly to the allocator, as the
+** collector cannot raise errors; when there is no memory, convergence
+** falls back to the iterative method.
 */
-static int traversethread (global_State *g, lua_State *th) {
-  StkId o = th->stack;
-  if (o == NULL)
-    return 1;  /* stack not completely built yet */
-  lua_assert(g->gcstate == GCSatomic ||
-             th->openupval == NULL || isintwups(th));
-  for (; o < th->top; o++)  /* mark live elements in the stack */
-    markvalue(g, s2v(o));
-  if (g->gcstate == GCSatomic) {  /* final traversal? */
-    StkId lim = th->stack + th->stacksize;  /* real end of stack */
-    for (; o < lim; o++)  /* clear not-marked stack slice */
-      setnilvalue(s2v(o));
-    /* 'remarkupvals' may have removed thread from 'twups' list */
-    if (!isintwups(th) && th->openupval != NULL) {
-      th->twups = g->twups;  /* link it back to the list */
-      g->twups = th;
+static void *ephrealloc (global_State *g, void *b, size_t os, size_t ns) {
+  return (*g->frealloc)(g->ud, b, os, ns);
+}
+
+
+static void freeephmap (global_State *g, EphMap *m) {
+  ephrealloc(g, m->keys, sizeof(EphKey) << m->lsize, 0);
+  ephrealloc(g, m->entries, m->size * sizeof(EphEntry), 0);
+  ephrealloc(g, m->ready, m->size * sizeof(int), 0);
+  ephrealloc(g, m, sizeof(EphMap), 0);
+}
+
+
+/* resize the hash of keys of 'm' to '2^lsize' slots */
+static int resizeephkeys (global_State *g, EphMap *m, int lsize) {
+  EphKey *old = m->keys;
+  int oldlsize = m->lsize;
+  int i;
+  EphKey *keys = cast(EphKey *,
+                      ephrealloc(g, NULL, 0, sizeof(EphKey) << lsize));
+  if (keys == NULL)
+    return 0;
+  memset(keys, 0, sizeof(EphKey) << lsize);
+  m->keys = keys;
+  m->lsize = lsize;
+  if (old != NULL) {
+    for (i = 0; i < (1 << oldlsize); i++) {
+      if (old[i].key != NULL)
+        keys[ephslot(m, old[i].key)] = old[i];
     }
+    ephrealloc(g, old, sizeof(EphKey) << oldlsize, 0);
   }
-  else if (!g->gcemergency)
-    luaD_shrinkstack(th); /* do not change stack in emergency cycle */
-  return 1 + th->stacksize;
+  return 1;
 }
 
 
-static int traverseudata (global_State *g, Udata *u) {
-  int i;
-  markobjectN(g, u->metatable);  /* mark its metatable */
-  for (i = 0; i < u->nuvalue; i++)
-    markvalue(g, &u->uv[i].uv);
-  return 1 + u->nuvalue;
+/* make room in 'm' for 'n' more entries (and keys) */
+static int growephmap (global_State *g, EphMap *m, size_t n) {
+  size_t needed = cast_sizet(m->nentries) + n;
+  int lsize;
+  if (needed > MAXEPHENTRIES)
+    return 0;
+  if (needed > cast_sizet(m->size)) {
+    size_t size = cast_sizet(m->size) * 2;
+    void *b;
+    if (size < needed) size = needed;
+    b = ephrealloc(g, m->entries, m->size * sizeof(EphEntry),
+                                  size * sizeof(EphEntry));
+    if (b == NULL) return 0;
+    m->entries = cast(EphEntry *, b);
+    b = ephrealloc(g, m->ready, m->size * sizeof(int), size * sizeof(int));
+    if (b == NULL) {  /* keep 'size' valid for both arrays */
+      m->entries = cast(EphEntry *, ephrealloc(g, m->entries,
+                   size * sizeof(EphEntry), m->size * sizeof(EphEntry)));
+      return 0;
+    }
+    m->ready = cast(int *, b);
+    m->size = cast_int(size);
+  }
+  lsize = luaO_ceillog2(cast_uint(m->nkeys + n)) + 1;  /* at most half full */
+  return (lsize <= m->lsize || resizeephkeys(g, m, lsize));
 }
 
 
 /*
-** traverse one gray object, turning it to black (except for threads,
-** which are always gray).
+** Add to map 'm' all entries with white values in the tables in list
+** 'l'. Returns false if there is no memory for them.
 */
-static lu_mem propagatemark (global_State *g) {
-  GCObject *o = g->gray;
-  gray2black(o);
-  g->gray = *getgclist(o);  /* remove from 'gray' list */
-  switch (o->tt) {
-    case LUA_TTABLE: return traversetable(g, gco2t(o));
-    case LUA_TUSERDATA: return traverseudata(g, gco2u(o));
-    case LUA_TLCL: return traverseLclosure(g, gco2lcl(o));
-    case LUA_TCCL: return traverseCclosure(g, gco2ccl(o));
-    case LUA_TPROTO: return traverseproto(g, gco2p(o));
-    case LUA_TTHREAD: {
-      lua_State *th = gco2th(o);
-      linkgclist(th, g->grayagain);  /* insert into 'grayagain' list */
-      black2gray(o);
-      return traversethread(g, th);
+static int addephtables (global_State *g, EphMap *m, GCObject *l) {
+  Node *n;
+  size_t count = 0;
+  foreachpending(g, l, n, count++);
+  if (count == 0)
+    return 1;
+  if (!growephmap(g, m, count))
+    return 0;
+  foreachpending(g, l, n, {
+    GCObject *key = gckeyN(n);
+    int *list = &m->now;
+    if (iscleared(g, key)) {  /* key not marked yet? */
+      int i = ephslot(m, key);
+      if (m->keys[i].key == NULL) {  /* new key? */
+        m->keys[i].key = key;
+        m->keys[i].first = -1;
+        m->nkeys++;
+      }
+      list = &m->keys[i].first;
     }
-    default: lua_assert(0); return 0;
+    m->entries[m->nentries].value = gcvalue(gval(n));
+    m->entries[m->nentries].next = *list;
+    *list = m->nentries++;
+  });
+  return 1;
+}
+
+
+/* mark the values in list 'e' of map 'm' */
+static void markephlist (global_State *g, EphMap *m, int e) {
+  for (; e != -1; e = m->entries[e].next) {
+    GCObject *v = m->entries[e].value;
+    if (iswhite(v))
+      reallymarkobject(g, v);
   }
 }
 
 
-static lu_mem propagateall (global_State *g) {
-  lu_mem tot = 0;
-  while (g->gray)
-    tot += propagatemark(g);
-  return tot;
+/*
+** Mark the values of all entries whose keys get marked, in time
+** linear in the number of entries. Each key enters the 'ready' stack
+** only once, when 'reallymarkobject' marks it. (With parallel marking,
+** markers do not check the map, so they are not used while it is
+** active.) Ephemeron tables first traversed during a round are added
+** to the map for the next one. The final pass in 'convergeephemerons'
+** links the tables to their proper lists and catches any entry this
+** method may have missed.
+*/
+static void convergebymap (global_State *g) {
+  GCObject *done = NULL;  /* tables already in the map */
+  GCObject **tail = &done;
+  EphMap *m;
+  if (g->ephemeron == NULL)
+    return;
+  m = cast(EphMap *, ephrealloc(g, NULL, 0, sizeof(EphMap)));
+  if (m == NULL)
+    return;
+  m->keys = NULL; m->entries = NULL; m->ready = NULL;
+  m->lsize = m->nkeys = m->nentries = m->size = m->nready = 0;
+  m->now = -1;
+  while (g->ephemeron != NULL) {
+    GCObject *l = g->ephemeron;
+    if (!addephtables(g, m, l))
+      break;  /* no more memory */
+    g->ephemeron = NULL;  /* to collect tables traversed in this round */
+    g->ephmap = m;
+    markephlist(g, m, m->now);
+    m->now = -1;
+    for (;;) {
+      while (m->nready > 0)
+        markephlist(g, m, m->keys[m->ready[--m->nready]].first);
+      if (g->gray == NULL)
+        break;
+      propagateall(g);
+    }
+    g->ephmap = NULL;
+    *tail = l;  /* append tables of this round to 'done' */
+    while (*tail != NULL)
+      tail = &gco2t(*tail)->gclist;
+  }
+  freeephmap(g, m);
+  *tail = g->ephemeron;  /* join tables not in the map */
+  g->ephemeron = done;
 }
 
+#endif
+
 
 static void convergeephemerons (global_State *g) {
   int changed;
+#if defined(LUA_USE_EPHEMERONMAP)
+  convergebymap(g);
+#endif
   do {
     GCObject *w;
     GCObject *next = g->ephemeron;  /* get ephemeron list */
@@ -700,14 +2447,16 @@ static void clearprotolist (global_State *g) {
 static void clearbykeys (global_State *g, GCObject *l) {
   for (; l; l = gco2t(l)->gclist) {
     Table *h = gco2t(l);
-    Node *limit = gnodelast(h);
-    Node *n;
-    for (n = gnode(h, 0); n < limit; n++) {
-      if (iscleared(g, gckeyN(n)))  /* unmarked key? */
-        setempty(gval(n));  /* remove entry */
-      if (isempty(gval(n)))  /* is entry empty? */
-        clearkey(n);  /* clear its key */
-    }
+    Table *hp = h;  /* hash part being cleared */
+    Node *n, *limit;
+    do {  /* traverse hash part(s) */
+      for (n = gnode(hp, 0), limit = gnodelast(hp); n < limit; n++) {
+        if (iscleared(g, gckeyN(n)))  /* unmarked key? */
+          setempty(gval(n));  /* remove entry */
+        if (isempty(gval(n)))  /* is entry empty? */
+          clearkey(n);  /* clear its key */
+      }
+    } while ((hp = nexthashpart(hp)) != NULL);
   }
 }
 
@@ -719,20 +2468,33 @@ static void clearbykeys (global_State *g, GCObject *l) {
 static void clearbyvalues (global_State *g, GCObject *l, GCObject *f) {
   for (; l != f; l = gco2t(l)->gclist) {
     Table *h = gco2t(l);
-    Node *n, *limit = gnodelast(h);
+    Table *hp = h;  /* hash part being cleared */
+    Node *n, *limit;
     unsigned int i;
     unsigned int asize = luaH_realasize(h);
     for (i = 0; i < asize; i++) {
-      TValue *o = &h->array[i];
-      if (iscleared(g, gcvalueN(o)))  /* value was collected? */
-        setempty(o);  /* remove entry */
-    }
-    for (n = gnode(h, 0); n < limit; n++) {
-      if (iscleared(g, gcvalueN(gval(n))))  /* unmarked value? */
-        setempty(gval(n));  /* remove entry */
-      if (isempty(gval(n)))  /* is entry empty? */
-        clearkey(n);  /* clear its key */
+      TValue o;
+      arr2obj(h, i, &o);
+      if (iscleared(g, gcvalueN(&o)))  /* value was collected? */
+        setarrayempty(h, i);  /* remove entry */
+    }
+    do {  /* traverse hash part(s) */
+      for (n = gnode(hp, 0), limit = gnodelast(hp); n < limit; n++) {
+        if (iscleared(g, gcvalueN(gval(n))))  /* unmarked value? */
+          setempty(gval(n));  /* remove entry */
+        if (isempty(gval(n)))  /* is entry empty? */
+          clearkey(n);  /* clear its key */
+      }
+    } while ((hp = nexthashpart(hp)) != NULL);
+#if defined(LUA_USE_SHAPES)
+    if (isshaped(h)) {
+      int j;
+      for (j = 0; j < h->shape->nkeys; j++) {
+        if (iscleared(g, gcvalueN(&h->slots[j])))  /* unmarked value? */
+          setempty(&h->slots[j]);  /* remove entry */
+      }
     }
+#endif
   }
 }
 
@@ -774,6 +2536,12 @@ static void freeobj (lua_State *L, GCObject *o) {
       luaM_freemem(L, o, sizelstring(gco2ts(o)->shrlen));
       break;
     case LUA_TLNGSTR:
+#if defined(LUA_USE_APPENDSTR)
+      if (isextstr(gco2ts(o))) {  /* string in a buffer? */
+        luaS_freeextstr(L, gco2ts(o));
+        break;
+      }
+#endif
       luaM_freemem(L, o, sizelstring(gco2ts(o)->u.lnglen));
       break;
     default: lua_assert(0);
@@ -781,6 +2549,236 @@ static void freeobj (lua_State *L, GCObject *o) {
 }
 
 
+#if defined(LUA_USE_BGSWEEP)
+
+/*
+** {======================================================
+** Background sweeping
+** =======================================================
+*/
+
+/*
+** The sweep still unlinks dead objects from their lists, but a sweeper
+** thread releases their memory. Before handing an object over, the
+** collector detaches it from everything still alive: a short string
+** leaves the string table (and becomes a long string of the same
+** size), an open upvalue leaves the list of its thread (and becomes
+** closed), and a table releases its shape. Objects go to the sweeper
+** in batches of at least MINBATCH. Threads are still freed right away,
+** as well as any object while more than MAXPENDING objects wait for
+** the sweeper.
+**
+** The sweeper frees objects with 'freeobj' through a state of its own,
+** whose 'GCdebt' counts the bytes it frees; the collector moves that
+** count to its debt and estimate at each step. Memory being freed then
+** counts as in use until it is really released. A full collection
+** waits for the sweeper, so that an emergency collection does release
+** memory. The allocation function must be thread safe, as the sweeper
+** calls it to free blocks.
+*/
+
+#define MAXPENDING	100000
+
+/* dead objects collected before handing them over to the sweeper */
+#define MINBATCH	2000
+
+
+typedef struct Sweeper {
+  lua_State l;  /* state used to free objects (only 'l_G' is set) */
+  global_State g;  /* only 'frealloc', 'ud', 'GCdebt', and 'nursery' used */
+  GCObject *batch;  /* dead objects not yet given to the sweeper */
+  GCObject *batchlast;  /* last object in 'batch' */
+  int nbatch;  /* number of objects in 'batch' */
+  int npending;  /* objects given to the sweeper and not yet freed */
+  l_mem freed;  /* bytes freed not yet seen by the collector (negative) */
+  GCObject *list;  /* objects the sweeper must free */
+  int quit;  /* true when the sweeper must finish */
+  pthread_mutex_t lock;  /* protects 'list' and 'quit' */
+  pthread_cond_t work;  /* signals a new 'list' (or 'quit') */
+  pthread_cond_t idle;  /* signals that 'npending' dropped to zero */
+  pthread_t thread;
+} Sweeper;
+
+
+static void *sweeper (void *ud) {
+  Sweeper *s = cast(Sweeper *, ud);
+  pthread_mutex_lock(&s->lock);
+  for (;;) {
+    GCObject *o;
+    int n = 0;
+    while (s->list == NULL && !s->quit)
+      pthread_cond_wait(&s->work, &s->lock);
+    if (s->list == NULL)
+      break;  /* quitting with nothing else to free */
+    o = s->list;
+    s->list = NULL;
+    pthread_mutex_unlock(&s->lock);
+    while (o != NULL) {
+      GCObject *next = o->next;
+      freeobj(&s->l, o);
+      o = next;
+      n++;
+    }
+    atomicadd(&s->freed, s->g.GCdebt);
+    s->g.GCdebt = 0;
+    pthread_mutex_lock(&s->lock);
+    if (atomicadd(&s->npending, -n) == 0)
+      pthread_cond_broadcast(&s->idle);
+  }
+  pthread_mutex_unlock(&s->lock);
+  return NULL;
+}
+
+
+/*
+** Free dead object 'o', now or in the sweeper.
+*/
+static void freedead (lua_State *L, GCObject *o) {
+  Sweeper *s = G(L)->sweeper;
+  if (s == NULL || o->tt == LUA_TTHREAD ||
+#if defined(LUA_USE_NURSERY)
+      innursery(G(L), o) ||  /* arenas belong to the collector */
+#endif
+#if defined(LUA_USE_APPENDSTR)
+      /* buffers are shared with live strings */
+      (o->tt == LUA_TLNGSTR && isextstr(gco2ts(o))) ||
+#endif
+      atomicload(&s->npending) + s->nbatch >= MAXPENDING) {
+    freeobj(L, o);
+    return;
+  }
+  switch (o->tt) {  /* detach it from live objects */
+    case LUA_TSHRSTR: {
+      TString *ts = gco2ts(o);
+      luaS_remove(L, ts);  /* remove it from hash table */
+      ts->u.lnglen = ts->shrlen;  /* 'freeobj' will not see it as short */
+      ts->tt = LUA_TLNGSTR;
+      break;
+    }
+    case LUA_TUPVAL: {
+      UpVal *uv = gco2upv(o);
+      if (upisopen(uv)) {
+        luaF_unlinkupval(uv);
+        uv->v = &uv->u.value;  /* now it is closed */
+      }
+      break;
+    }
+#if defined(LUA_USE_SHAPES)
+    case LUA_TTABLE: {
+      luaH_releaseshape(L, gco2t(o));
+      break;
+    }
+#endif
+    default: break;
+  }
+  o->next = s->batch;
+  if (s->batch == NULL)
+    s->batchlast = o;
+  s->batch = o;
+  s->nbatch++;
+}
+
+
+/*
+** Give pending dead objects to the sweeper and account for the memory
+** it has freed. With 'wait', also wait until it frees everything.
+*/
+static void syncsweeper (global_State *g, int wait) {
+  Sweeper *s = g->sweeper;
+  l_mem freed;
+  if (s == NULL)
+    return;
+  if (s->nbatch >= MINBATCH || wait) {
+    pthread_mutex_lock(&s->lock);
+    if (s->batch != NULL) {
+      s->batchlast->next = s->list;
+      s->list = s->batch;
+      atomicadd(&s->npending, s->nbatch);
+      pthread_cond_signal(&s->work);
+      s->batch = NULL;
+      s->nbatch = 0;
+    }
+    while (wait && atomicload(&s->npending) > 0)
+      pthread_cond_wait(&s->idle, &s->lock);
+    pthread_mutex_unlock(&s->lock);
+  }
+  freed = atomicswap(&s->freed, 0);
+  g->GCdebt += freed;
+  g->GCestimate += freed;
+  statfreed(g, -freed);
+}
+
+
+/*
+** Free everything still pending and destroy the sweeper.
+*/
+static void stopsweeper (global_State *g, int running) {
+  Sweeper *s = g->sweeper;
+  if (running) {
+    syncsweeper(g, 1);
+    pthread_mutex_lock(&s->lock);
+    s->quit = 1;
+    pthread_cond_signal(&s->work);
+    pthread_mutex_unlock(&s->lock);
+    pthread_join(s->thread, NULL);
+  }
+  pthread_cond_destroy(&s->idle);
+  pthread_cond_destroy(&s->work);
+  pthread_mutex_destroy(&s->lock);
+  g->sweeper = NULL;
+  (*g->frealloc)(g->ud, s, sizeof(Sweeper), 0);
+  g->GCdebt -= sizeof(Sweeper);
+}
+
+/*
+** Create the sweeper of a new state. The state keeps sweeping by
+** itself if that is not possible. (The block is allocated directly,
+** like the one for markers.)
+*/
+void luaC_startsweeper (lua_State *L) {
+  global_State *g = G(L);
+  Sweeper *s;
+  sigset_t all, old;
+  int err;
+  s = cast(Sweeper *, (*g->frealloc)(g->ud, NULL, 0, sizeof(Sweeper)));
+  if (s == NULL)
+    return;
+  g->GCdebt += sizeof(Sweeper);
+  s->l.l_G = &s->g;
+  s->g.frealloc = g->frealloc;
+  s->g.ud = g->ud;
+  s->g.GCdebt = 0;
+#if defined(LUA_USE_NURSERY)
+  s->g.nursery = NULL;
+#endif
+  s->batch = s->list = NULL;
+  s->nbatch = s->npending = 0;
+  s->freed = 0;
+  s->quit = 0;
+  pthread_mutex_init(&s->lock, NULL);
+  pthread_cond_init(&s->work, NULL);
+  pthread_cond_init(&s->idle, NULL);
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old);
+  err = pthread_create(&s->thread, NULL, sweeper, s);
+  pthread_sigmask(SIG_SETMASK, &old, NULL);
+  g->sweeper = s;
+  if (err != 0)
+    stopsweeper(g, 0);
+}
+
+
+/* }====================================================== */
+
+#else
+
+#define freedead(L,o)	freeobj(L,o)
+#define syncsweeper(g,w)	((void)0)
+
+#endif
+
+
+
 /*
 ** sweep at most 'countin' elements from a list of GCObjects erasing dead
 ** objects, where a dead object is one marked with the old (non current)
@@ -799,7 +2797,7 @@ static GCObject **sweeplist (lua_State *L, GCObject **p, int countin,
     int marked = curr->marked;
     if (isdeadm(ow, marked)) {  /* is 'curr' dead? */
       *p = curr->next;  /* remove 'curr' from list */
-      freeobj(L, curr);  /* erase 'curr' */
+      freedead(L, curr);  /* erase 'curr' */
     }
     else {  /* change mark to 'white' */
       curr->marked = cast_byte((marked & maskcolors) | white);
@@ -862,43 +2860,111 @@ static GCObject *udata2finalize (global_State *g) {
 }
 
 
-static void dothecall (lua_State *L, void *ud) {
-  UNUSED(ud);
-  luaD_callnoyield(L, L->top - 2, 0);
+/*
+** A batch of objects from the head of 'tobefnz' whose finalizers run
+** in one protected call: objects with the same metatable as the first
+** one, up to 'n' objects (or until 'deadline', if not zero). Each
+** object leaves the list just before its finalizer is called, so an
+** error in a finalizer leaves the rest of the batch in the list.
+** (Without LUA_USE_FINBATCH, a batch has only one object.)
+*/
+typedef struct FinBatch {
+  Table *mt;  /* metatable of the objects in the batch */
+  int n;  /* maximum number of objects in the batch */
+  int done;  /* number of objects already finalized */
+  l_mem deadline;  /* time limit for the batch (0 for none) */
+} FinBatch;
+
+
+/* metatable of an object to be finalized (a table or a userdata) */
+#define finmetatable(o)  \
+	((o)->tt == LUA_TTABLE ? gco2t(o)->metatable : gco2u(o)->metatable)
+
+
+#if defined(LUA_USE_FINBATCH)
+
+/* the clock is checked after every FINCHECK finalizers in a batch */
+#define FINCHECK	8
+
+#define outoftime(b)  \
+	((b)->deadline != 0 && (b)->done % FINCHECK == 0 &&  \
+	 gcnanotime() >= (b)->deadline)
+
+#define samebatch(g,b)  \
+	((b)->done < (b)->n && (g)->tobefnz != NULL &&  \
+	 finmetatable((g)->tobefnz) == (b)->mt && !outoftime(b))
+
+#else
+
+#define samebatch(g,b)	0
+
+#endif
+
+
+static void dothecalls (lua_State *L, void *ud) {
+  global_State *g = G(L);
+  FinBatch *b = cast(FinBatch *, ud);
+  do {
+    TValue v;
+    const TValue *tm;
+    setgcovalue(L, &v, udata2finalize(g));
+    b->done++;
+    tm = luaT_gettmbyobj(L, &v, TM_GC);
+    if (tm != NULL && ttisfunction(tm)) {  /* is there a finalizer? */
+      setobj2s(L, L->top, tm);  /* push finalizer... */
+      setobj2s(L, L->top + 1, &v);  /* ... and its argument */
+      L->top += 2;  /* and (next line) call the finalizer */
+      luaD_callnoyield(L, L->top - 2, 0);
+    }
+  } while (samebatch(g, b));
 }
 
 
-static void GCTM (lua_State *L, int propagateerrors) {
+/*
+** Call the finalizers of a batch of at most 'n' objects (see
+** 'FinBatch'). Return the number of objects finalized.
+*/
+static int GCTM (lua_State *L, int n, l_mem deadline, int propagateerrors) {
   global_State *g = G(L);
+  GCObject *o = g->tobefnz;
   const TValue *tm;
   TValue v;
   lua_assert(!g->gcemergency);
-  setgcovalue(L, &v, udata2finalize(g));
+  setgcovalue(L, &v, o);
   tm = luaT_gettmbyobj(L, &v, TM_GC);
-  if (tm != NULL && ttisfunction(tm)) {  /* is there a finalizer? */
+  if (tm == NULL || !ttisfunction(tm)) {  /* no finalizer? */
+    udata2finalize(g);  /* just remove the object from the list */
+    return 1;
+  }
+  else {
     int status;
     lu_byte oldah = L->allowhook;
     int running  = g->gcrunning;
+    FinBatch b;
+    b.mt = finmetatable(o);
+    b.n = n;
+    b.done = 0;
+    b.deadline = deadline;
     L->allowhook = 0;  /* stop debug hooks during GC metamethod */
     g->gcrunning = 0;  /* avoid GC steps */
-    setobj2s(L, L->top, tm);  /* push finalizer... */
-    setobj2s(L, L->top + 1, &v);  /* ... and its argument */
-    L->top += 2;  /* and (next line) call the finalizer */
     L->ci->callstatus |= CIST_FIN;  /* will run a finalizer */
-    status = luaD_pcall(L, dothecall, NULL, savestack(L, L->top - 2), 0);
+    status = luaD_pcall(L, dothecalls, &b, savestack(L, L->top), 0);
     L->ci->callstatus &= ~CIST_FIN;  /* not running a finalizer anymore */
     L->allowhook = oldah;  /* restore hooks */
     g->gcrunning = running;  /* restore state */
     if (status != LUA_OK && propagateerrors) {  /* error while running __gc? */
       if (status == LUA_ERRRUN) {  /* is there an error object? */
-        const char *msg = (ttisstring(s2v(L->top - 1)))
-                            ? svalue(s2v(L->top - 1))
-                            : "no message";
+        const char *msg = "no message";
+        if (ttisstring(s2v(L->top - 1))) {
+          luaS_terminate(L, tsvalue(s2v(L->top - 1)));
+          msg = svalue(s2v(L->top - 1));
+        }
         luaO_pushfstring(L, "error in __gc metamethod (%s)", msg);
         status = LUA_ERRGCMM;  /* error in __gc metamethod */
       }
       luaD_throw(L, status);  /* re-throw error */
     }
+    return b.done;
   }
 }
 
@@ -909,8 +2975,8 @@ static void GCTM (lua_State *L, int propagateerrors) {
 static int runafewfinalizers (lua_State *L, int n) {
   global_State *g = G(L);
   int i;
-  for (i = 0; i < n && g->tobefnz; i++)
-    GCTM(L, 1);  /* call one finalizer */
+  for (i = 0; i < n && g->tobefnz; )
+    i += GCTM(L, n - i, 0, 1);  /* call a batch of finalizers */
   return i;
 }
 
@@ -921,9 +2987,67 @@ static int runafewfinalizers (lua_State *L, int n) {
 static void callallpendingfinalizers (lua_State *L, int propagateerrors) {
   global_State *g = G(L);
   while (g->tobefnz)
-    GCTM(L, propagateerrors);
+    GCTM(L, MAX_INT, 0, propagateerrors);
+}
+
+
+#if defined(LUA_USE_FINBATCH)
+
+/*
+** Call pending finalizers for up to 'budget' microseconds (at least
+** one batch). Return the number of objects finalized.
+*/
+static int runfinalizersfor (lua_State *L, unsigned int budget) {
+  global_State *g = G(L);
+  l_mem deadline = gcnanotime() + cast(l_mem, budget) * 1000;
+  int n = 0;
+  do {
+    n += GCTM(L, MAX_INT, deadline, 1);
+  } while (g->tobefnz && gcnanotime() < deadline);
+  return n;
+}
+
+
+/*
+** Call the finalizers pending in a collector step: none, when they
+** were deferred to 'luaC_runfinalizers'; otherwise, as many as the
+** budget for finalizers allows ('n' without a budget).
+*/
+static int stepfinalizers (lua_State *L, int n) {
+  global_State *g = G(L);
+  if (g->gcdeferfin)
+    return 0;
+  else if (g->gcfinbudget > 0)
+    return runfinalizersfor(L, g->gcfinbudget);
+  else
+    return runafewfinalizers(L, n);
+}
+
+
+/*
+** Call pending finalizers for up to 'budget' microseconds (all of
+** them if 'budget' is zero). Return true if some are still pending.
+*/
+int luaC_runfinalizers (lua_State *L, unsigned int budget) {
+  global_State *g = G(L);
+  if (g->tobefnz != NULL) {
+    if (budget == 0)
+      callallpendingfinalizers(L, 1);
+    else
+      runfinalizersfor(L, budget);
+  }
+  return (g->tobefnz != NULL);
 }
 
+#define findeferred(g)	((g)->gcdeferfin)
+
+#else
+
+#define stepfinalizers(L,n)	runafewfinalizers(L, n)
+#define findeferred(g)	0
+
+#endif
+
 
 /*
 ** find last 'next' field in list 'p' list (to add elements in its end)
@@ -1019,7 +3143,7 @@ static void sweep2old (lua_State *L, GCObject **p) {
     if (iswhite(curr)) {  /* is 'curr' dead? */
       lua_assert(isdead(G(L), curr));
       *p = curr->next;  /* remove 'curr' from list */
-      freeobj(L, curr);  /* erase 'curr' */
+      freedead(L, curr);  /* erase 'curr' */
     }
     else {  /* all surviving objects become old */
       setage(curr, G_OLD);
@@ -1053,7 +3177,7 @@ static GCObject **sweepgen (lua_State *L, global_State *g, GCObject **p,
     if (iswhite(curr)) {  /* is 'curr' dead? */
       lua_assert(!isold(curr) && isdead(g, curr));
       *p = curr->next;  /* remove 'curr' from list */
-      freeobj(L, curr);  /* erase 'curr' */
+      freedead(L, curr);  /* erase 'curr' */
     }
     else {  /* correct mark and age */
       if (getage(curr) == G_NEW)
@@ -1095,13 +3219,18 @@ static GCObject **correctgraylist (GCObject **p) {
           lua_assert(isgray(curr));
           gray2black(curr);  /* make it black, for next barrier */
           changeage(curr, G_TOUCHED1, G_TOUCHED2);
+          if (curr->tt == LUA_TTABLE)
+            agecards(gco2t(curr), 0);
           p = next;  /* go to next element */
         }
         else {
           if (!iswhite(curr)) {
             lua_assert(isold(curr));
-            if (getage(curr) == G_TOUCHED2)
+            if (getage(curr) == G_TOUCHED2) {
               changeage(curr, G_TOUCHED2, G_OLD);
+              if (curr->tt == LUA_TTABLE)
+                agecards(gco2t(curr), 1);
+            }
             gray2black(curr);  /* make it black */
           }
           *p = *next;  /* remove 'curr' from gray list */
@@ -1165,7 +3294,7 @@ static void finishgencycle (lua_State *L, global_State *g) {
   checkSizes(L, g);
   g->gcstate = GCSpropagate;  /* skip restart */
   if (!g->gcemergency)
-    callallpendingfinalizers(L, 1);
+    stepfinalizers(L, MAX_INT);
 }
 
 
@@ -1178,10 +3307,13 @@ static void finishgencycle (lua_State *L, global_State *g) {
 */
 static void youngcollection (lua_State *L, global_State *g) {
   GCObject **psurvival;  /* to point to first non-dead survival object */
+  l_mem olddebt = g->GCdebt;
   lua_assert(g->gcstate == GCSpropagate);
+  statphase(g, LUA_GCPATOMIC);
   markold(g, g->survival, g->reallyold);
   markold(g, g->finobj, g->finobjrold);
   atomic(L);
+  statphase(g, LUA_GCPSWEEP);
 
   /* sweep nursery and get a pointer to its last live element */
   psurvival = sweepgen(L, g, &g->allgc, g->survival);
@@ -1200,7 +3332,10 @@ static void youngcollection (lua_State *L, global_State *g) {
   g->finobjsur = g->finobj;  /* all news are survivals */
 
   sweepgen(L, g, &g->tobefnz, NULL);
+  statfreed(g, olddebt - g->GCdebt);
+  statcycle(g, nminor);
 
+  statphase(g, LUA_GCPCALLFIN);
   finishgencycle(L, g);
 }
 
@@ -1211,9 +3346,13 @@ static void youngcollection (lua_State *L, global_State *g) {
 ** objects into old and finishes the collection.
 */
 static void entergen (lua_State *L, global_State *g) {
+  l_mem olddebt;
   luaC_runtilstate(L, bitmask(GCSpause));  /* prepare to start a new cycle */
   luaC_runtilstate(L, bitmask(GCSpropagate));  /* start new cycle */
+  statphase(g, LUA_GCPATOMIC);
   atomic(L);
+  statphase(g, LUA_GCPSWEEP);
+  olddebt = g->GCdebt;
   /* sweep all elements making them old */
   sweep2old(L, &g->allgc);
   /* everything alive now is old */
@@ -1224,9 +3363,12 @@ static void entergen (lua_State *L, global_State *g) {
   g->finobjrold = g->finobjold = g->finobjsur = g->finobj;
 
   sweep2old(L, &g->tobefnz);
+  statfreed(g, olddebt - g->GCdebt);
+  statcycle(g, nmajor);
 
   g->gckind = KGC_GEN;
   g->GCestimate = gettotalbytes(g);  /* base for memory control */
+  statphase(g, LUA_GCPCALLFIN);
   finishgencycle(L, g);
 }
 
@@ -1253,10 +3395,12 @@ static void enterinc (global_State *g) {
 void luaC_changemode (lua_State *L, int newmode) {
   global_State *g = G(L);
   if (newmode != g->gckind) {
+    statbegin(g);
     if (newmode == KGC_GEN)  /* entering generational mode? */
       entergen(L, g);
     else
       enterinc(g);  /* entering incremental mode */
+    statend(g);
   }
 }
 
@@ -1334,6 +3478,9 @@ static void setpause (global_State *g) {
 static void entersweep (lua_State *L) {
   global_State *g = G(L);
   g->gcstate = GCSswpallgc;
+#if defined(LUA_USE_GCBUDGET)
+  g->gcpartial = NULL;  /* (a full collection may cut a cycle short) */
+#endif
   lua_assert(g->sweepgc == NULL);
   g->sweepgc = sweeptolive(L, &g->allgc);
 }
@@ -1358,6 +3505,10 @@ static void deletelist (lua_State *L, GCObject *p, GCObject *limit) {
 */
 void luaC_freeallobjects (lua_State *L) {
   global_State *g = G(L);
+#if defined(LUA_USE_BGSWEEP)
+  if (g->sweeper != NULL)
+    stopsweeper(g, 1);  /* free pending objects; sweep all the rest here */
+#endif
   luaC_changemode(L, KGC_INC);
   separatetobefnz(g, 1);  /* separate all objects with finalizers */
   lua_assert(g->finobj == NULL);
@@ -1366,6 +3517,12 @@ void luaC_freeallobjects (lua_State *L) {
   deletelist(L, g->finobj, NULL);
   deletelist(L, g->fixedgc, NULL);  /* collect fixed objects */
   lua_assert(g->strt.nuse == 0);
+#if defined(LUA_USE_NURSERY)
+  freenursery(g);
+#endif
+#if defined(LUA_USE_PARALLELMARK)
+  luaC_setmarkers(L, 1);  /* stop helper threads */
+#endif
 }
 
 
@@ -1377,11 +3534,15 @@ static lu_mem atomic (lua_State *L) {
   g->grayagain = NULL;
   lua_assert(g->ephemeron == NULL && g->weak == NULL);
   lua_assert(!iswhite(g->mainthread));
+#if defined(LUA_USE_GCBUDGET)
+  finishpartial(g);  /* (before changing the state) */
+#endif
   g->gcstate = GCSatomic;
   markobject(g, L);  /* mark running thread */
   /* registry and global metatables may be changed by API */
   markvalue(g, &g->l_registry);
   markmt(g);  /* mark global metatables */
+  markshapes(g);  /* mark keys of all shapes */
   /* remark occasional upvalues of (maybe) dead threads */
   work += remarkupvals(g);
   work += propagateall(g);  /* propagate changes */
@@ -1407,6 +3568,7 @@ static lu_mem atomic (lua_State *L) {
   luaS_clearcache(g);
   clearprotolist(g);
   g->currentwhite = cast_byte(otherwhite(g));  /* flip current white */
+  nextepoch(g);
   lua_assert(g->gray == NULL);
   return work;  /* estimate of slots marked by 'atomic' */
 }
@@ -1419,6 +3581,8 @@ static int sweepstep (lua_State *L, global_State *g,
     int count;
     g->sweepgc = sweeplist(L, g->sweepgc, GCSWEEPMAX, &count);
     g->GCestimate += g->GCdebt - olddebt;  /* update estimate */
+    statfreed(g, olddebt - g->GCdebt);
+    syncsweeper(g, 0);  /* give dead objects to the sweeper */
     return count;
   }
   else {  /* enter next state */
@@ -1433,11 +3597,22 @@ static lu_mem singlestep (lua_State *L) {
   global_State *g = G(L);
   switch (g->gcstate) {
     case GCSpause: {
+      statphase(g, LUA_GCPPROPAGATE);
       restartcollection(g);
       g->gcstate = GCSpropagate;
       return 1;
     }
     case GCSpropagate: {
+#if defined(LUA_USE_GCBUDGET)
+      if (g->gcpartial != NULL)  /* a table being traversed in parts? */
+        return partialstep(g);
+      if (g->gray == NULL && g->gcbudget > 0 && !g->gcpremarked) {
+        /* traverse objects in 'grayagain' before the atomic phase */
+        g->gcpremarked = 1;
+        g->gray = g->grayagain;
+        g->grayagain = NULL;
+      }
+#endif
       if (g->gray == NULL) {  /* no more gray objects? */
         g->gcstate = GCSenteratomic;  /* finish propagate phase */
         return 0;
@@ -1446,8 +3621,11 @@ static lu_mem singlestep (lua_State *L) {
         return propagatemark(g);  /* traverse one gray object */
     }
     case GCSenteratomic: {
-      lu_mem work = propagateall(g);  /* make sure gray list is empty */
+      lu_mem work;
+      statphase(g, LUA_GCPATOMIC);
+      work = propagateall(g);  /* make sure gray list is empty */
       work += atomic(L);  /* work is what was traversed by 'atomic' */
+      statphase(g, LUA_GCPSWEEP);
       entersweep(L);
       g->GCestimate = gettotalbytes(g);  /* first estimate */;
       return work;
@@ -1463,15 +3641,17 @@ static lu_mem singlestep (lua_State *L) {
     }
     case GCSswpend: {  /* finish sweeps */
       checkSizes(L, g);
+      statphase(g, LUA_GCPCALLFIN);
       g->gcstate = GCScallfin;
       return 0;
     }
     case GCScallfin: {  /* call remaining finalizers */
-      if (g->tobefnz && !g->gcemergency) {
-        int n = runafewfinalizers(L, GCFINMAX);
+      if (g->tobefnz && !g->gcemergency && !findeferred(g)) {
+        int n = stepfinalizers(L, GCFINMAX);
         return n * GCFINALIZECOST;
       }
       else {  /* emergency mode or no more finalizers */
+        statcycle(g, ncycles);
         g->gcstate = GCSpause;  /* finish collection */
         return 0;
       }
@@ -1492,6 +3672,61 @@ void luaC_runtilstate (lua_State *L, int statesmask) {
 }
 
 
+#if defined(LUA_USE_GCBUDGET)
+
+/*
+** With a time budget ('gcbudget', in microseconds), an incremental
+** step also stops when it runs out of time; the debt left is then
+** forgiven, so that the program does not go back to the collector
+** right away. A step reads the clock every BUDGETCHECK units of work.
+** Large tables are traversed in parts and 'grayagain' is traversed
+** before the atomic phase, to shorten that phase; still, the atomic
+** phase, a string-table resize, and a finalizer run as single steps.
+** (Minor collections in generational mode are not bounded either.)
+*/
+
+#define BUDGETCHECK	128
+
+
+static void gcclock (struct timespec *ts) {
+  clock_gettime(CLOCK_MONOTONIC, ts);
+}
+
+
+/* microseconds since 'start' */
+static l_mem gcelapsed (const struct timespec *start) {
+  struct timespec now;
+  gcclock(&now);
+  return cast(l_mem, now.tv_sec - start->tv_sec) * 1000000 +
+         (now.tv_nsec - start->tv_nsec) / 1000;
+}
+
+
+/*
+** Run single steps while '*debt' is above '-stepsize', until a pause
+** or the end of the time budget. Return false if out of time.
+*/
+static int budgetstep (lua_State *L, global_State *g, l_mem *debt,
+                                                      l_mem stepsize) {
+  struct timespec start;
+  lu_mem sincecheck = 0;
+  gcclock(&start);
+  do {
+    lu_mem work = singlestep(L);
+    *debt -= work;
+    sincecheck += work + 1;  /* (some steps do no work) */
+    if (sincecheck >= BUDGETCHECK) {
+      sincecheck = 0;
+      if (gcelapsed(&start) >= cast(l_mem, g->gcbudget))
+        return (*debt <= -stepsize || g->gcstate == GCSpause);
+    }
+  } while (*debt > -stepsize && g->gcstate != GCSpause);
+  return 1;
+}
+
+#endif
+
+
 /*
 ** Performs a basic incremental step. The debt and step size are
 ** converted from bytes to "units of work"; then the function loops
@@ -1505,6 +3740,13 @@ static void incstep (lua_State *L, global_State *g) {
   l_mem stepsize = (g->gcstepsize <= log2maxs(l_mem))
                  ? ((cast(l_mem, 1) << g->gcstepsize) / WORK2MEM) * stepmul
                  : MAX_LMEM;  /* overflow; keep maximum value */
+#if defined(LUA_USE_GCBUDGET)
+  if (g->gcbudget > 0) {
+    if (!budgetstep(L, g, &debt, stepsize))
+      debt = -stepsize;  /* out of time; let the program run a whole step */
+  }
+  else
+#endif
   do {  /* repeat until pause or enough "credit" (negative debt) */
     lu_mem work = singlestep(L);  /* perform one single step */
     debt -= work;
@@ -1522,11 +3764,14 @@ static void incstep (lua_State *L, global_State *g) {
 */
 void luaC_step (lua_State *L) {
   global_State *g = G(L);
+  syncsweeper(g, 0);  /* account for memory freed by the sweeper */
   if (g->gcrunning) {  /* running? */
+    statbegin(g);
     if (g->gckind == KGC_INC)
       incstep(L, g);
     else
       genstep(L, g);
+    statend(g);
   }
 }
 
@@ -1543,6 +3788,10 @@ static void fullinc (lua_State *L, global_State *g) {
     entersweep(L); /* sweep everything to turn them back to white */
   /* finish any pending sweep phase to start a new cycle */
   luaC_runtilstate(L, bitmask(GCSpause));
+#if defined(LUA_USE_PARALLELMARK)
+  luaC_runtilstate(L, bitmask(GCSpropagate));  /* start new cycle */
+  propagateall(g);  /* mark in one go, so that markers can help */
+#endif
   luaC_runtilstate(L, bitmask(GCScallfin));  /* run up to finalizers */
   /* estimate must be correct after a full GC cycle */
   lua_assert(g->GCestimate == gettotalbytes(g));
@@ -1560,10 +3809,13 @@ void luaC_fullgc (lua_State *L, int isemergency) {
   global_State *g = G(L);
   lua_assert(!g->gcemergency);
   g->gcemergency = isemergency;  /* set flag */
+  statbegin(g);
   if (g->gckind == KGC_INC)
     fullinc(L, g);
   else
     fullgen(L, g);
+  syncsweeper(g, 1);  /* make sure garbage is really freed */
+  statend(g);
   g->gcemergency = 0;
 }
 
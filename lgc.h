@@ -137,6 +137,11 @@
 /* how much to allocate before next GC step (log2) */
 #define LUAI_GCSTEPSIZE 13      /* 8 KB */
 
+/* number of threads marking in parallel (see 'lgc.c') */
+#if !defined(LUAI_GCMARKERS)
+#define LUAI_GCMARKERS	4
+#endif
+
 
 /*
 ** Does one step of collection when debt becomes positive. 'pre'/'pos'
@@ -178,6 +183,61 @@ LUAI_FUNC void luaC_barrierback_ (lua_State *L, GCObject *o);
 LUAI_FUNC void luaC_protobarrier_ (lua_State *L, Proto *p);
 LUAI_FUNC void luaC_checkfinalizer (lua_State *L, GCObject *o, Table *mt);
 LUAI_FUNC void luaC_changemode (lua_State *L, int newmode);
+#if defined(LUA_USE_PARALLELMARK)
+LUAI_FUNC int luaC_setmarkers (lua_State *L, int n);
+#endif
+#if defined(LUA_USE_BGSWEEP)
+LUAI_FUNC void luaC_startsweeper (lua_State *L);
+#endif
+#if defined(LUA_USE_CARDS)
+LUAI_FUNC void luaC_barrierindex_ (lua_State *L, Table *t, unsigned int i);
+LUAI_FUNC void luaC_barrierslot_ (lua_State *L, Table *t, const TValue *slot);
+LUAI_FUNC void luaC_barrierkey_ (lua_State *L, Table *t, const TValue *key);
+LUAI_FUNC void luaC_tablemoved_ (lua_State *L, Table *t);
+LUAI_FUNC void luaC_nodemoved_ (lua_State *L, Table *t, Node *from, Node *to);
+LUAI_FUNC void luaC_freecards (lua_State *L, Table *t);
+
+/*
+** Back barriers for a store into table 't' when the place written is
+** known: its position 'i' (array slots first, then nodes), the written
+** 'slot', or the 'key' of the entry.
+*/
+#define luaC_barrierindex(L,t,i,v) (  \
+	(iscollectable(v) && isblack(t) && iswhite(gcvalue(v))) ? \
+	luaC_barrierindex_(L,t,i) : cast_void(0))
+
+#define luaC_barrierslot(L,t,slot,v) (  \
+	(iscollectable(v) && isblack(t) && iswhite(gcvalue(v))) ? \
+	luaC_barrierslot_(L,t,slot) : cast_void(0))
+
+#define luaC_barrierkey(L,t,k,v) (  \
+	(iscollectable(v) && isblack(t) && iswhite(gcvalue(v))) ? \
+	luaC_barrierkey_(L,t,k) : cast_void(0))
+
+/* table 't' is moving its entries (see 'lgc.c') */
+#define luaC_tablemoved(L,t)	luaC_tablemoved_(L,t)
+/* node 'from' of table 't' is moving to 'to' */
+#define luaC_nodemoved(L,t,from,to)	luaC_nodemoved_(L,t,from,to)
+#else
+#define luaC_barrierindex(L,t,i,v)	luaC_barrierback(L,obj2gco(t),v)
+#define luaC_barrierslot(L,t,slot,v)	luaC_barrierback(L,obj2gco(t),v)
+#define luaC_barrierkey(L,t,k,v)	luaC_barrierback(L,obj2gco(t),v)
+#if defined(LUA_USE_GCBUDGET)
+/* table 't' is moving its entries (see 'lgc.c') */
+#define luaC_tablemoved(L,t)  \
+	((G(L)->gcpartial == (t) && isblack(t)) ?  \
+	  luaC_barrierback_(L, obj2gco(t)) : cast_void(0))
+#else
+#define luaC_tablemoved(L,t)	((void)0)
+#endif
+#define luaC_nodemoved(L,t,from,to)	luaC_tablemoved(L,t)
+#endif
+#if defined(LUA_USE_FINBATCH)
+LUAI_FUNC int luaC_runfinalizers (lua_State *L, unsigned int budget);
+#endif
+#if defined(LUA_USE_NURSERY)
+LUAI_FUNC int luaC_nurseryfree (lua_State *L, void *b, size_t osize);
+#endif
 
 
 #endif
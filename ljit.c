@@ -0,0 +1,1679 @@
+/*
+** $Id: ljit.c $
+** Baseline compiler from Lua bytecode to native code
+** See Copyright Notice in lua.h
+*/
+
+#define ljit_c
+#define LUA_CORE
+
+#if !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE		/* for 'MAP_ANONYMOUS' */
+#endif
+
+#include "lprefix.h"
+
+
+#include "lua.h"
+
+#include "ljit.h"
+
+
+#if defined(LUA_USE_JIT)
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "ldebug.h"
+#include "ldo.h"
+#include "lfunc.h"
+#include "lgc.h"
+#include "lobject.h"
+#include "lopcodes.h"
+#include "lstate.h"
+#include "lstring.h"
+#include "ltable.h"
+#include "ltm.h"
+#include "lvm.h"
+
+
+/*
+** {==================================================================
+** Overview
+** ===================================================================
+**
+** A function is compiled, instruction by instruction, into x86-64 code
+** that follows the interpreter: each instruction becomes a fixed
+** template, with no analysis across instructions. Moves, loads,
+** integer and float arithmetic, comparisons against integers, tests,
+** jumps, and numeric 'for' loops are done inline (with type checks);
+** everything else, and the slow paths of those templates, call a C
+** helper with the same semantics as the interpreter.
+**
+** Native code keeps 'L' in 'rbx', 'ci' in 'r13', and 'base' in 'r12'.
+** It reloads 'base' after each helper, as helpers can reallocate the
+** stack. Each instruction has an entry point, so that the interpreter
+** can enter native code at any 'savedpc': at the start of a call, after
+** a Lua callee returns, or at a loop back edge.
+**
+** Helpers return LUAJ_CONTINUE or LUAJ_BRANCH to go on in native code;
+** any other result goes back to 'luaV_execute', which calls Lua
+** functions, finishes returns, and runs the function in the interpreter
+** when hooks are on (LUAJ_EXIT). Native code never runs with hooks:
+** helpers that can run arbitrary code and loop back edges exit when
+** 'L->hookmask' is set.
+**
+** Errors are raised with 'longjmp' across native frames, which keep no
+** state of their own; so, Lua must be compiled as C to use this option.
+** ===================================================================
+*/
+
+
+#if !defined(__x86_64__)
+#error "LUA_USE_JIT needs an x86-64 processor"
+#endif
+
+
+/* native code and entry points of a prototype (all in one 'mmap' block) */
+typedef struct JitCode {
+  size_t size;  /* size of the whole block */
+  lu_byte *mcode;  /* native code */
+  unsigned int entry[1];  /* offset in 'mcode' of each instruction */
+} JitCode;
+
+
+/* native code is called as a function with this type */
+typedef int (*JitFunction) (lua_State *L, CallInfo *ci, const lu_byte *entry);
+
+
+/* }================================================================== */
+
+
+
+/*
+** {==================================================================
+** Helpers: (slow paths of) instructions called from native code
+** ===================================================================
+*/
+
+/* arguments for all helpers ('pc' is the instruction being executed) */
+#define HARGS	lua_State *L, CallInfo *ci, Instruction i, const Instruction *pc
+
+typedef int (*Helper) (HARGS);
+
+
+#define hbase(ci)	((ci)->func + 1)
+#define hproto(ci)	(clLvalue(s2v((ci)->func))->p)
+
+#define RA(i)	(base+GETARG_A(i))
+#define RB(i)	(base+GETARG_B(i))
+#define vRB(i)	s2v(RB(i))
+#define KB(i)	(k+GETARG_B(i))
+#define RC(i)	(base+GETARG_C(i))
+#define vRC(i)	s2v(RC(i))
+#define KC(i)	(k+GETARG_C(i))
+#define RKC(i)	((TESTARG_k(i)) ? k + GETARG_C(i) : s2v(base + GETARG_C(i)))
+
+/* inline cache of the current instruction */
+#define ICACHE(p)	(&(p)->icache[pc - (p)->code])
+
+
+/* same as in the interpreter */
+#define savepc(L)	(ci->u.l.savedpc = pc + 1)
+#define savestate(L,ci)		(savepc(L), L->top = ci->top)
+#define Protect(exp)	(savestate(L,ci), (exp))
+#define ProtectNT(exp)	(savepc(L), (exp))
+
+#define checkGC(L,c)  \
+	{ luaC_condGC(L, L->top = (c), (void)0);  \
+	  luai_threadyield(L); }
+
+
+/*
+** Result of an instruction that may have run arbitrary code: if that
+** code turned on hooks, go on in the interpreter.
+*/
+#define done(L)	((L)->hookmask ? (savepc(L), LUAJ_EXIT) : LUAJ_CONTINUE)
+
+
+/*
+** Result of a test instruction: LUAJ_BRANCH to do the jump that follows
+** it, LUAJ_CONTINUE to skip that jump.
+*/
+static int condjump (lua_State *L, CallInfo *ci, Instruction i,
+                     const Instruction *pc, int cond) {
+  int jump = (cond == GETARG_k(i));
+  if (L->hookmask) {  /* hooks turned on? */
+    ci->u.l.savedpc = pc + (jump ? 1 : 2);
+    return LUAJ_EXIT;
+  }
+  return (jump ? LUAJ_BRANCH : LUAJ_CONTINUE);
+}
+
+
+static int h_setupval (HARGS) {
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  UpVal *uv = clLvalue(s2v(ci->func))->upvals[GETARG_B(i)];
+  UNUSED(pc);
+  setobj(L, uv->v, s2v(ra));
+  luaC_barrier(L, uv, s2v(ra));
+  return LUAJ_CONTINUE;
+}
+
+
+static int h_gettabup (HARGS) {
+  LClosure *cl = clLvalue(s2v(ci->func));
+  TValue *k = cl->p->k;
+  StkId ra = hbase(ci) + GETARG_A(i);
+  const TValue *slot;
+  TValue *upval = cl->upvals[GETARG_B(i)]->v;
+  TValue *rc = KC(i);
+  TString *key = tsvalue(rc);  /* key must be a string */
+  if (luaV_fastgetIC(L, upval, key, slot, ICACHE(cl->p))) {
+    setobj2s(L, ra, slot);
+    return LUAJ_CONTINUE;
+  }
+  Protect(luaV_finishget(L, upval, rc, ra, slot));
+  return done(L);
+}
+
+
+static int h_gettable (HARGS) {
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  const TValue *slot;
+  TValue *rb = vRB(i);
+  TValue *rc = vRC(i);
+  int ok;
+  if (ttisinteger(rc)) {  /* fast track for integers? */
+    luaV_fastgeti(L, rb, ivalue(rc), s2v(ra), slot, ok);
+  }
+  else
+    ok = luaV_fastgetv(L, rb, rc, s2v(ra), slot, luaH_get);
+  if (ok)
+    return LUAJ_CONTINUE;
+  Protect(luaV_finishget(L, rb, rc, ra, slot));
+  return done(L);
+}
+
+
+static int h_geti (HARGS) {
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  const TValue *slot;
+  TValue *rb = vRB(i);
+  int c = GETARG_C(i);
+  int ok;
+  luaV_fastgeti(L, rb, c, s2v(ra), slot, ok);
+  if (ok)
+    return LUAJ_CONTINUE;
+  else {
+    TValue key;
+    setivalue(&key, c);
+    Protect(luaV_finishget(L, rb, &key, ra, slot));
+    return done(L);
+  }
+}
+
+
+static int h_getfield (HARGS) {
+  Proto *p = hproto(ci);
+  TValue *k = p->k;
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  const TValue *slot;
+  TValue *rb = vRB(i);
+  TValue *rc = KC(i);
+  TString *key = tsvalue(rc);  /* key must be a string */
+  if (luaV_fastgetIC(L, rb, key, slot, ICACHE(p))) {
+    setobj2s(L, ra, slot);
+    return LUAJ_CONTINUE;
+  }
+  Protect(luaV_finishget(L, rb, rc, ra, slot));
+  return done(L);
+}
+
+
+static int h_settabup (HARGS) {
+  LClosure *cl = clLvalue(s2v(ci->func));
+  TValue *k = cl->p->k;
+  StkId base = hbase(ci);
+  const TValue *slot;
+  TValue *upval = cl->upvals[GETARG_A(i)]->v;
+  TValue *rb = KB(i);
+  TValue *rc = RKC(i);
+  TString *key = tsvalue(rb);  /* key must be a string */
+  if (luaV_fastget(L, upval, key, slot, luaH_getshortstr)) {
+    luaV_finishfastset(L, upval, slot, rc);
+    return LUAJ_CONTINUE;
+  }
+  Protect(luaV_finishset(L, upval, rb, rc, slot));
+  return done(L);
+}
+
+
+static int h_settable (HARGS) {
+  TValue *k = hproto(ci)->k;
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  const TValue *slot;
+  TValue *rb = vRB(i);  /* key (table is in 'ra') */
+  TValue *rc = RKC(i);  /* value */
+  if (ttisinteger(rb)  /* fast track for integers? */
+      ? luaV_fastseti(L, s2v(ra), ivalue(rb), slot, rc)
+      : luaV_fastset(L, s2v(ra), rb, slot, luaH_pset, rc))
+    return LUAJ_CONTINUE;
+  Protect(luaV_finishset(L, s2v(ra), rb, rc, slot));
+  return done(L);
+}
+
+
+static int h_seti (HARGS) {
+  TValue *k = hproto(ci)->k;
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  const TValue *slot;
+  int c = GETARG_B(i);
+  TValue *rc = RKC(i);
+  if (luaV_fastseti(L, s2v(ra), c, slot, rc))
+    return LUAJ_CONTINUE;
+  else {
+    TValue key;
+    setivalue(&key, c);
+    Protect(luaV_finishset(L, s2v(ra), &key, rc, slot));
+    return done(L);
+  }
+}
+
+
+static int h_setfield (HARGS) {
+  TValue *k = hproto(ci)->k;
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  const TValue *slot;
+  TValue *rb = KB(i);
+  TValue *rc = RKC(i);
+  TString *key = tsvalue(rb);  /* key must be a string */
+  if (luaV_fastget(L, s2v(ra), key, slot, luaH_getshortstr)) {
+    luaV_finishfastset(L, s2v(ra), slot, rc);
+    return LUAJ_CONTINUE;
+  }
+  Protect(luaV_finishset(L, s2v(ra), rb, rc, slot));
+  return done(L);
+}
+
+
+static int h_newtable (HARGS) {
+  StkId ra = hbase(ci) + GETARG_A(i);
+  int b = GETARG_B(i);
+  int c = GETARG_C(i);
+  Table *t;
+  savepc(L);
+  L->top = ci->top;  /* correct top in case of GC */
+  t = luaH_new(L);  /* memory allocation */
+  sethvalue2s(L, ra, t);
+#if defined(LUA_USE_SIZEHINTS)
+  luaH_presize(L, t, hproto(ci), cast_int(pc - hproto(ci)->code),
+               luaO_fb2int(b), luaO_fb2int(c));  /* idem */
+#else
+  if (b != 0 || c != 0)
+    luaH_resize(L, t, luaO_fb2int(b), luaO_fb2int(c));  /* idem */
+#endif
+  checkGC(L, ra + 1);
+  return done(L);
+}
+
+
+static int h_self (HARGS) {
+  Proto *p = hproto(ci);
+  TValue *k = p->k;
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  const TValue *slot;
+  TValue *rb = vRB(i);
+  TValue *rc = RKC(i);
+  TString *key = tsvalue(rc);  /* key must be a string */
+  setobj2s(L, ra + 1, rb);
+  if (ttisshrstring(rc)  /* common case: short-string method name? */
+      ? luaV_fastgetIC(L, rb, key, slot, ICACHE(p))
+      : luaV_fastget(L, rb, key, slot, luaH_getstr)) {
+    setobj2s(L, ra, slot);
+    return LUAJ_CONTINUE;
+  }
+  Protect(luaV_finishget(L, rb, rc, ra, slot));
+  return done(L);
+}
+
+
+/*
+** Arithmetic with an immediate operand, following the interpreter:
+** 'iop' for integers, 'fop' for floats, and 'flip' for the order of
+** the operands of a metamethod.
+*/
+#define arithI(L,iop,fop,ev,flip) {  \
+  StkId base = hbase(ci);  \
+  StkId ra = RA(i);  \
+  TValue *rb = vRB(i);  \
+  int ic = GETARG_sC(i);  \
+  lua_Number nb;  \
+  if (ttisinteger(rb)) {  \
+    setivalue(s2v(ra), iop(L, ivalue(rb), ic));  \
+  }  \
+  else if (tonumberns(rb, nb)) {  \
+    setfltvalue(s2v(ra), fop(L, nb, cast_num(ic)));  \
+  }  \
+  else {  \
+    Protect(luaT_trybiniTM(L, rb, ic, flip, ra, ev));  \
+    return done(L);  \
+  }  \
+  return LUAJ_CONTINUE; }
+
+
+/* float arithmetic with an immediate operand */
+#define arithIf(L,fop,ev) {  \
+  StkId base = hbase(ci);  \
+  StkId ra = RA(i);  \
+  TValue *rb = vRB(i);  \
+  int ic = GETARG_sC(i);  \
+  lua_Number nb;  \
+  if (tonumberns(rb, nb)) {  \
+    setfltvalue(s2v(ra), fop(L, nb, cast_num(ic)));  \
+  }  \
+  else {  \
+    Protect(luaT_trybiniTM(L, rb, ic, 0, ra, ev));  \
+    return done(L);  \
+  }  \
+  return LUAJ_CONTINUE; }
+
+
+/* arithmetic with two register operands, following the interpreter */
+#define arith(L,iop,fop,ev) {  \
+  StkId base = hbase(ci);  \
+  StkId ra = RA(i);  \
+  TValue *rb = vRB(i);  \
+  TValue *rc = vRC(i);  \
+  lua_Number nb; lua_Number nc;  \
+  if (ttisinteger(rb) && ttisinteger(rc)) {  \
+    setivalue(s2v(ra), iop(L, ivalue(rb), ivalue(rc)));  \
+  }  \
+  else if (tonumberns(rb, nb) && tonumberns(rc, nc)) {  \
+    setfltvalue(s2v(ra), fop(L, nb, nc));  \
+  }  \
+  else {  \
+    Protect(luaT_trybinTM(L, rb, rc, ra, ev));  \
+    return done(L);  \
+  }  \
+  return LUAJ_CONTINUE; }
+
+
+/* float arithmetic with two register operands */
+#define arithf(L,fop,ev) {  \
+  StkId base = hbase(ci);  \
+  StkId ra = RA(i);  \
+  TValue *rb = vRB(i);  \
+  TValue *rc = vRC(i);  \
+  lua_Number nb; lua_Number nc;  \
+  if (tonumberns(rb, nb) && tonumberns(rc, nc)) {  \
+    setfltvalue(s2v(ra), fop(L, nb, nc));  \
+  }  \
+  else {  \
+    Protect(luaT_trybinTM(L, rb, rc, ra, ev));  \
+    return done(L);  \
+  }  \
+  return LUAJ_CONTINUE; }
+
+
+/* bitwise operation with two register operands */
+#define bitwise(L,op,ev) {  \
+  StkId base = hbase(ci);  \
+  StkId ra = RA(i);  \
+  TValue *rb = vRB(i);  \
+  TValue *rc = vRC(i);  \
+  lua_Integer ib; lua_Integer ic;  \
+  if (tointegerns(rb, &ib) && tointegerns(rc, &ic)) {  \
+    setivalue(s2v(ra), op(ib, ic));  \
+  }  \
+  else {  \
+    Protect(luaT_trybinTM(L, rb, rc, ra, ev));  \
+    return done(L);  \
+  }  \
+  return LUAJ_CONTINUE; }
+
+
+/* bitwise operation with a constant operand */
+#define bitwiseK(L,op,ev) {  \
+  TValue *k = hproto(ci)->k;  \
+  StkId base = hbase(ci);  \
+  StkId ra = RA(i);  \
+  TValue *p1 = vRB(i);  \
+  TValue *p2 = KC(i);  \
+  lua_Integer i1;  \
+  if (tointegerns(p1, &i1)) {  \
+    setivalue(s2v(ra), op(i1, ivalue(p2)));  \
+  }  \
+  else {  \
+    Protect(luaT_trybinassocTM(L, p1, p2, ra, TESTARG_k(i), ev));  \
+    return done(L);  \
+  }  \
+  return LUAJ_CONTINUE; }
+
+
+#define l_iadd(L,a,b)	intop(+, a, b)
+#define l_isub(L,a,b)	intop(-, a, b)
+#define l_imul(L,a,b)	intop(*, a, b)
+#define l_band(a,b)	intop(&, a, b)
+#define l_bor(a,b)	intop(|, a, b)
+#define l_bxor(a,b)	intop(^, a, b)
+#define l_shl(a,b)	luaV_shiftl(a, b)
+#define l_shr(a,b)	luaV_shiftl(a, -(b))
+
+
+static lua_Number l_nummod (lua_State *L, lua_Number a, lua_Number b) {
+  lua_Number m;
+  UNUSED(L);
+  luai_nummod(L, a, b, m);
+  return m;
+}
+
+
+static int h_addi (HARGS) arithI(L, l_iadd, luai_numadd, TM_ADD, GETARG_k(i))
+static int h_subi (HARGS) arithI(L, l_isub, luai_numsub, TM_SUB, 0)
+static int h_muli (HARGS) arithI(L, l_imul, luai_nummul, TM_MUL, GETARG_k(i))
+static int h_modi (HARGS) arithI(L, luaV_mod, l_nummod, TM_MOD, 0)
+static int h_powi (HARGS) arithIf(L, luai_numpow, TM_POW)
+static int h_divi (HARGS) arithIf(L, luai_numdiv, TM_DIV)
+static int h_idivi (HARGS) arithI(L, luaV_div, luai_numdiv, TM_IDIV, 0)
+
+static int h_add (HARGS) arith(L, l_iadd, luai_numadd, TM_ADD)
+static int h_sub (HARGS) arith(L, l_isub, luai_numsub, TM_SUB)
+static int h_mul (HARGS) arith(L, l_imul, luai_nummul, TM_MUL)
+static int h_mod (HARGS) arith(L, luaV_mod, l_nummod, TM_MOD)
+static int h_pow (HARGS) arithf(L, luai_numpow, TM_POW)
+static int h_div (HARGS) arithf(L, luai_numdiv, TM_DIV)
+static int h_idiv (HARGS) arith(L, luaV_div, luai_numidiv, TM_IDIV)
+
+static int h_band (HARGS) bitwise(L, l_band, TM_BAND)
+static int h_bor (HARGS) bitwise(L, l_bor, TM_BOR)
+static int h_bxor (HARGS) bitwise(L, l_bxor, TM_BXOR)
+static int h_shl (HARGS) bitwise(L, l_shl, TM_SHL)
+static int h_shr (HARGS) bitwise(L, l_shr, TM_SHR)
+
+static int h_bandk (HARGS) bitwiseK(L, l_band, TM_BAND)
+static int h_bork (HARGS) bitwiseK(L, l_bor, TM_BOR)
+static int h_bxork (HARGS) bitwiseK(L, l_bxor, TM_BXOR)
+
+
+static int h_shri (HARGS) {
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  TValue *rb = vRB(i);
+  int ic = GETARG_sC(i);
+  lua_Integer ib;
+  if (tointegerns(rb, &ib)) {
+    setivalue(s2v(ra), luaV_shiftl(ib, -ic));
+    return LUAJ_CONTINUE;
+  }
+  else {
+    TMS ev = TM_SHR;
+    if (TESTARG_k(i)) {
+      ic = -ic;  ev = TM_SHL;
+    }
+    Protect(luaT_trybiniTM(L, rb, ic, 0, ra, ev));
+    return done(L);
+  }
+}
+
+
+static int h_shli (HARGS) {
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  TValue *rb = vRB(i);
+  int ic = GETARG_sC(i);
+  lua_Integer ib;
+  if (tointegerns(rb, &ib)) {
+    setivalue(s2v(ra), luaV_shiftl(ic, ib));
+    return LUAJ_CONTINUE;
+  }
+  Protect(luaT_trybiniTM(L, rb, ic, 1, ra, TM_SHL));
+  return done(L);
+}
+
+
+static int h_unm (HARGS) {
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  TValue *rb = vRB(i);
+  lua_Number nb;
+  if (ttisinteger(rb)) {
+    lua_Integer ib = ivalue(rb);
+    setivalue(s2v(ra), intop(-, 0, ib));
+  }
+  else if (tonumberns(rb, nb)) {
+    setfltvalue(s2v(ra), luai_numunm(L, nb));
+  }
+  else {
+    Protect(luaT_trybinTM(L, rb, rb, ra, TM_UNM));
+    return done(L);
+  }
+  return LUAJ_CONTINUE;
+}
+
+
+static int h_bnot (HARGS) {
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  TValue *rb = vRB(i);
+  lua_Integer ib;
+  if (tointegerns(rb, &ib)) {
+    setivalue(s2v(ra), intop(^, ~l_castS2U(0), ib));
+    return LUAJ_CONTINUE;
+  }
+  Protect(luaT_trybinTM(L, rb, rb, ra, TM_BNOT));
+  return done(L);
+}
+
+
+static int h_not (HARGS) {
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  TValue *rb = vRB(i);
+  int nrb = l_isfalse(rb);  /* next assignment may change this value */
+  UNUSED(L); UNUSED(pc);
+  setbvalue(s2v(ra), nrb);
+  return LUAJ_CONTINUE;
+}
+
+
+static int h_len (HARGS) {
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  Protect(luaV_objlen(L, ra, vRB(i)));
+  return done(L);
+}
+
+
+static int h_concat (HARGS) {
+  StkId ra = hbase(ci) + GETARG_A(i);
+  int n = GETARG_B(i);  /* number of elements to concatenate */
+  L->top = ra + n;  /* mark the end of concat operands */
+  ProtectNT(luaV_concat(L, n));
+  checkGC(L, L->top); /* 'luaV_concat' ensures correct top */
+  return done(L);
+}
+
+
+static int h_close (HARGS) {
+  UNUSED(pc);
+  luaF_close(L, hbase(ci) + GETARG_A(i));
+  return LUAJ_CONTINUE;
+}
+
+
+static int h_eq (HARGS) {
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  int cond;
+  Protect(cond = luaV_equalobj(L, s2v(ra), vRB(i)));
+  return condjump(L, ci, i, pc, cond);
+}
+
+
+static int h_lt (HARGS) {
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  int cond;
+  Protect(cond = luaV_lessthan(L, s2v(ra), vRB(i)));
+  return condjump(L, ci, i, pc, cond);
+}
+
+
+static int h_le (HARGS) {
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  int cond;
+  Protect(cond = luaV_lessequal(L, s2v(ra), vRB(i)));
+  return condjump(L, ci, i, pc, cond);
+}
+
+
+static int h_eqk (HARGS) {
+  TValue *k = hproto(ci)->k;
+  StkId ra = hbase(ci) + GETARG_A(i);
+  /* basic types do not use '__eq'; we can use raw equality */
+  int cond = luaV_equalobj(NULL, s2v(ra), KB(i));
+  return condjump(L, ci, i, pc, cond);
+}
+
+
+/*
+** Comparison with an immediate operand, following the interpreter
+** ('inv' tells whether the immediate is the left operand)
+*/
+#define cmpI(L,op,fop,ev,inv) {  \
+  StkId ra = hbase(ci) + GETARG_A(i);  \
+  int im = GETARG_sB(i);  \
+  int cond;  \
+  if (ttisinteger(s2v(ra)))  \
+    cond = (inv) ? op(im, ivalue(s2v(ra))) : op(ivalue(s2v(ra)), im);  \
+  else if (ttisfloat(s2v(ra)))  \
+    cond = (inv) ? fop(cast_num(im), fltvalue(s2v(ra)))  \
+                 : fop(fltvalue(s2v(ra)), cast_num(im));  \
+  else  \
+    Protect(cond = luaT_callorderiTM(L, s2v(ra), im, inv, ev));  \
+  return condjump(L, ci, i, pc, cond); }
+
+#define l_lt(a,b)	((a) < (b))
+#define l_le(a,b)	((a) <= (b))
+
+static int h_lti (HARGS) cmpI(L, l_lt, luai_numlt, TM_LT, 0)
+static int h_lei (HARGS) cmpI(L, l_le, luai_numle, TM_LE, 0)
+static int h_gti (HARGS) cmpI(L, l_lt, luai_numlt, TM_LT, 1)
+static int h_gei (HARGS) cmpI(L, l_le, luai_numle, TM_LE, 1)
+
+
+static int h_eqi (HARGS) {
+  StkId ra = hbase(ci) + GETARG_A(i);
+  int im = GETARG_sB(i);
+  int cond;
+  if (ttisinteger(s2v(ra)))
+    cond = (ivalue(s2v(ra)) == im);
+  else if (ttisfloat(s2v(ra)))
+    cond = luai_numeq(fltvalue(s2v(ra)), cast_num(im));
+  else
+    cond = 0;  /* other types cannot be equal to a number */
+  return condjump(L, ci, i, pc, cond);
+}
+
+
+static int h_testset (HARGS) {
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  TValue *rb = vRB(i);
+  if (l_isfalse(rb) == GETARG_k(i))
+    return condjump(L, ci, i, pc, !GETARG_k(i));  /* skip the jump */
+  else {
+    setobj2s(L, ra, rb);
+    return condjump(L, ci, i, pc, GETARG_k(i));  /* do the jump */
+  }
+}
+
+
+static int h_call (HARGS) {
+  StkId ra = hbase(ci) + GETARG_A(i);
+  int b = GETARG_B(i);
+  int nresults = GETARG_C(i) - 1;
+  if (b != 0)  /* fixed number of arguments? */
+    L->top = ra + b;  /* top signals number of arguments */
+  /* else previous instruction set top */
+  savepc(L);  /* in case of errors */
+  if (luaD_precall(L, ra, nresults) == NULL)
+    return done(L);  /* C call; nothing else to be done */
+  else
+    return LUAJ_CALL;  /* let 'luaV_execute' run the Lua function */
+}
+
+
+static int h_tailcall (HARGS) {
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  int b = GETARG_B(i);  /* number of arguments + 1 (function) */
+  int delta = 0;  /* virtual 'func' - real 'func' (vararg functions) */
+  if (b != 0)
+    L->top = ra + b;
+  else  /* previous instruction set top */
+    b = cast_int(L->top - ra);
+  savepc(ci);
+  if (TESTARG_k(i)) {
+    int nparams1 = GETARG_C(i);
+    if (nparams1)  /* vararg function? */
+      delta = ci->u.l.nextraargs + nparams1;
+    luaF_close(L, base);  /* close upvalues from current call */
+  }
+  if (!ttisfunction(s2v(ra))) {  /* not a function? */
+    luaD_tryfuncTM(L, ra);  /* try '__call' metamethod */
+    b++;  /* there is now one extra argument */
+  }
+  if (!ttisLclosure(s2v(ra))) {  /* C function? */
+    luaD_call(L, ra, LUA_MULTRET);  /* call it */
+    ra = hbase(ci) + GETARG_A(i);  /* stack may have been relocated */
+    ci->func -= delta;
+    luaD_poscall(L, ci, cast_int(L->top - ra));
+    return LUAJ_RETURN;
+  }
+  else {  /* Lua tail call */
+    ci->func -= delta;
+    luaD_pretailcall(L, ci, ra, b);  /* prepare call frame */
+    return LUAJ_CALL;  /* execute the callee */
+  }
+}
+
+
+static int h_return (HARGS) {
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  int n = GETARG_B(i) - 1;  /* number of results */
+  if (n < 0)  /* not fixed? */
+    n = cast_int(L->top - ra);  /* get what is available */
+  else
+    L->top = ra + n;  /* set call for 'luaD_poscall' */
+  if (TESTARG_k(i)) {
+    int nparams1 = GETARG_C(i);
+    if (nparams1)  /* vararg function? */
+      ci->func -= ci->u.l.nextraargs + nparams1;
+    luaF_close(L, base);  /* there may be open upvalues */
+  }
+  savepc(L);
+  luaD_poscall(L, ci, n);
+  return LUAJ_RETURN;
+}
+
+
+static int h_return0 (HARGS) {
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  if (L->hookmask) {
+    L->top = ra;
+    savepc(L);
+    luaD_poscall(L, ci, 0);  /* no hurry... */
+  }
+  else {
+    int nres = ci->nresults;
+    L->ci = ci->previous;  /* back to caller */
+    L->top = base - 1;
+    while (nres-- > 0)
+      setnilvalue(s2v(L->top++));  /* all results are nil */
+  }
+  return LUAJ_RETURN;
+}
+
+
+static int h_return1 (HARGS) {
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  if (L->hookmask) {
+    L->top = ra + 1;
+    savepc(L);
+    luaD_poscall(L, ci, 1);  /* no hurry... */
+  }
+  else {
+    int nres = ci->nresults;
+    L->ci = ci->previous;  /* back to caller */
+    if (nres == 0)
+      L->top = base - 1;  /* asked for no results */
+    else {
+      setobjs2s(L, base - 1, ra);  /* at least this result */
+      L->top = base;
+      while (--nres > 0)  /* complete missing results */
+        setnilvalue(s2v(L->top++));
+    }
+  }
+  return LUAJ_RETURN;
+}
+
+
+/* float loop of OP_FORLOOP (integer loops are done inline) */
+static int h_forloop (HARGS) {
+  StkId ra = hbase(ci) + GETARG_A(i);
+  lua_Number step = fltvalue(s2v(ra + 2));
+  lua_Number limit = fltvalue(s2v(ra + 1));
+  lua_Number idx = fltvalue(s2v(ra));
+  UNUSED(L); UNUSED(pc);
+  idx = luai_numadd(L, idx, step);  /* inc. index */
+  if (luai_numlt(0, step) ? luai_numle(idx, limit)
+                          : luai_numle(limit, idx)) {
+    chgfltvalue(s2v(ra), idx);  /* update internal index... */
+    setfltvalue(s2v(ra + 3), idx);  /* ...and external index */
+    return LUAJ_BRANCH;  /* jump back */
+  }
+  return LUAJ_CONTINUE;
+}
+
+
+static int h_forprep1 (HARGS) {
+  StkId ra = hbase(ci) + GETARG_A(i);
+  TValue *init = s2v(ra);
+  TValue *plimit = s2v(ra + 1);
+  lua_Integer ilimit, initv;
+  int stopnow;
+  if (unlikely(!luaV_forlimit(plimit, &ilimit, 1, &stopnow))) {
+      savestate(L, ci);  /* for the error message */
+      luaG_runerror(L, "'for' limit must be a number");
+  }
+  initv = (stopnow ? 0 : ivalue(init));
+  setivalue(plimit, ilimit);
+  setivalue(init, intop(-, initv, 1));
+  return LUAJ_CONTINUE;
+}
+
+
+static int h_forprep (HARGS) {
+  StkId ra = hbase(ci) + GETARG_A(i);
+  TValue *init = s2v(ra);
+  TValue *plimit = s2v(ra + 1);
+  TValue *pstep = s2v(ra + 2);
+  lua_Integer ilimit;
+  int stopnow;
+  if (ttisinteger(init) && ttisinteger(pstep) &&
+      luaV_forlimit(plimit, &ilimit, ivalue(pstep), &stopnow)) {
+    /* all values are integer */
+    lua_Integer initv = (stopnow ? 0 : ivalue(init));
+    setivalue(plimit, ilimit);
+    setivalue(init, intop(-, initv, ivalue(pstep)));
+  }
+  else {  /* try making all values floats */
+    lua_Number ninit; lua_Number nlimit; lua_Number nstep;
+    savestate(L, ci);  /* in case of errors */
+    if (unlikely(!tonumber(plimit, &nlimit)))
+      luaG_runerror(L, "'for' limit must be a number");
+    setfltvalue(plimit, nlimit);
+    if (unlikely(!tonumber(pstep, &nstep)))
+      luaG_runerror(L, "'for' step must be a number");
+    setfltvalue(pstep, nstep);
+    if (unlikely(!tonumber(init, &ninit)))
+      luaG_runerror(L, "'for' initial value must be a number");
+    setfltvalue(init, luai_numsub(L, ninit, nstep));
+  }
+  return LUAJ_CONTINUE;
+}
+
+
+static int h_tforcall (HARGS) {
+  StkId ra = hbase(ci) + GETARG_A(i);
+  StkId cb = ra + 3;  /* call base */
+  setobjs2s(L, cb+2, ra+2);
+  setobjs2s(L, cb+1, ra+1);
+  setobjs2s(L, cb, ra);
+  L->top = cb + 3;  /* func. + 2 args (state and index) */
+  Protect(luaD_call(L, cb, GETARG_C(i)));
+  return done(L);
+}
+
+
+static int h_tforloop (HARGS) {
+  StkId ra = hbase(ci) + GETARG_A(i);
+  UNUSED(L); UNUSED(pc);
+  if (!ttisnil(s2v(ra + 1))) {  /* continue loop? */
+    setobjs2s(L, ra, ra + 1);  /* save control variable */
+    return LUAJ_BRANCH;  /* jump back */
+  }
+  return LUAJ_CONTINUE;
+}
+
+
+static int h_setlist (HARGS) {
+  StkId ra = hbase(ci) + GETARG_A(i);
+  int n = GETARG_B(i);
+  int c = GETARG_C(i);
+  unsigned int last;
+  Table *h;
+  if (n == 0)
+    n = cast_int(L->top - ra) - 1;
+  else
+    L->top = ci->top;  /* correct top in case of GC */
+  if (c == 0)
+    c = GETARG_Ax(*(pc + 1));
+  savepc(L);
+  h = hvalue(s2v(ra));
+  last = ((c-1)*LFIELDS_PER_FLUSH) + n;
+  if (last > luaH_realasize(h))  /* needs more space? */
+    luaH_resizearray(L, h, last);  /* preallocate it at once */
+  for (; n > 0; n--) {
+    TValue *val = s2v(ra + n);
+    obj2arr(h, last - 1, val);
+    last--;
+    luaC_barrierindex(L, h, last, val);
+  }
+  return LUAJ_CONTINUE;
+}
+
+
+static int h_closure (HARGS) {
+  LClosure *cl = clLvalue(s2v(ci->func));
+  StkId base = hbase(ci);
+  StkId ra = RA(i);
+  savestate(L, ci);  /* in case of allocation errors */
+  luaV_closure(L, cl, cl->p->p[GETARG_Bx(i)], base, ra);
+  checkGC(L, ra + 1);
+  return done(L);
+}
+
+
+static int h_vararg (HARGS) {
+  StkId ra = hbase(ci) + GETARG_A(i);
+  int n = GETARG_C(i) - 1;  /* required results */
+  Protect(luaT_getvarargs(L, ci, ra, n));
+  return done(L);
+}
+
+
+static int h_prepvararg (HARGS) {
+  if (L->hookmask) {  /* must call the hook after adjusting? */
+    ci->u.l.savedpc = pc;  /* let the interpreter do it all */
+    return LUAJ_EXIT;
+  }
+  luaT_adjustvarargs(L, GETARG_A(i), ci, hproto(ci));
+  return LUAJ_CONTINUE;
+}
+
+
+/*
+** Helper for an instruction. The ones handled inline ('compileinst')
+** call it only for their slow paths.
+*/
+static Helper gethelper (OpCode op) {
+  switch (op) {
+    case OP_SETUPVAL: return h_setupval;
+    case OP_GETTABUP: return h_gettabup;
+    case OP_GETTABLE: return h_gettable;
+    case OP_GETI: return h_geti;
+    case OP_GETFIELD: return h_getfield;
+    case OP_SETTABUP: return h_settabup;
+    case OP_SETTABLE: return h_settable;
+    case OP_SETI: return h_seti;
+    case OP_SETFIELD: return h_setfield;
+    case OP_NEWTABLE: return h_newtable;
+    case OP_SELF: return h_self;
+    case OP_ADDI: return h_addi;
+    case OP_SUBI: return h_subi;
+    case OP_MULI: return h_muli;
+    case OP_MODI: return h_modi;
+    case OP_POWI: return h_powi;
+    case OP_DIVI: return h_divi;
+    case OP_IDIVI: return h_idivi;
+    case OP_BANDK: return h_bandk;
+    case OP_BORK: return h_bork;
+    case OP_BXORK: return h_bxork;
+    case OP_SHRI: return h_shri;
+    case OP_SHLI: return h_shli;
+    case OP_ADD: return h_add;
+    case OP_SUB: return h_sub;
+    case OP_MUL: return h_mul;
+    case OP_MOD: return h_mod;
+    case OP_POW: return h_pow;
+    case OP_DIV: return h_div;
+    case OP_IDIV: return h_idiv;
+    case OP_BAND: return h_band;
+    case OP_BOR: return h_bor;
+    case OP_BXOR: return h_bxor;
+    case OP_SHL: return h_shl;
+    case OP_SHR: return h_shr;
+    case OP_UNM: return h_unm;
+    case OP_BNOT: return h_bnot;
+    case OP_NOT: return h_not;
+    case OP_LEN: return h_len;
+    case OP_CONCAT: return h_concat;
+    case OP_CLOSE: return h_close;
+    case OP_EQ: return h_eq;
+    case OP_LT: return h_lt;
+    case OP_LE: return h_le;
+    case OP_EQK: return h_eqk;
+    case OP_EQI: return h_eqi;
+    case OP_LTI: return h_lti;
+    case OP_LEI: return h_lei;
+    case OP_GTI: return h_gti;
+    case OP_GEI: return h_gei;
+    case OP_TESTSET: return h_testset;
+    case OP_CALL: return h_call;
+    case OP_TAILCALL: return h_tailcall;
+    case OP_RETURN: return h_return;
+    case OP_RETURN0: return h_return0;
+    case OP_RETURN1: return h_return1;
+    case OP_FORLOOP: return h_forloop;
+    case OP_FORPREP1: return h_forprep1;
+    case OP_FORPREP: return h_forprep;
+    case OP_TFORCALL: return h_tforcall;
+    case OP_TFORLOOP: return h_tforloop;
+    case OP_SETLIST: return h_setlist;
+    case OP_CLOSURE: return h_closure;
+    case OP_VARARG: return h_vararg;
+    case OP_PREPVARARG: return h_prepvararg;
+    default: lua_assert(0); return NULL;
+  }
+}
+
+/* }================================================================== */
+
+
+
+/*
+** {==================================================================
+** x86-64 code emission
+** ===================================================================
+*/
+
+/* registers */
+#define RAX	0
+#define RCX	1
+#define RDX	2
+#define RBX	3	/* 'L' */
+#define RSP	4
+#define RSI	6
+#define RDI	7
+#define R12	12	/* 'base' */
+#define R13	13	/* 'ci' */
+#define XMM0	0
+
+/* condition codes */
+#define CC_E	0x4
+#define CC_NE	0x5
+#define CC_A	0x7
+#define CC_L	0xC
+#define CC_GE	0xD
+#define CC_LE	0xE
+#define CC_G	0xF
+
+/* negation of a condition code */
+#define CC_NOT(cc)	((cc) ^ 1)
+
+/* unconditional jump */
+#define JMP	(-1)
+
+/* opcodes (two-byte opcodes are prefixed with 0x0F) */
+#define X_ADD	0x03	/* add r, r/m */
+#define X_ADDRM	0x01	/* add r/m, r */
+#define X_SUB	0x2B	/* sub r, r/m */
+#define X_IMUL	0x0FAF	/* imul r, r/m */
+#define X_CMP	0x3B	/* cmp r, r/m */
+#define X_TEST	0x85	/* test r/m, r */
+#define X_LOAD	0x8B	/* mov r, r/m */
+#define X_STORE	0x89	/* mov r/m, r */
+#define X_LEA	0x8D	/* lea r, m */
+#define X_GRP1	0x81	/* (add/cmp) r/m, imm32 */
+#define X_GRP1B	0x80	/* (cmp) r/m8, imm8 */
+#define X_GRP1S	0x83	/* (cmp) r/m32, imm8 */
+#define X_MOVB	0xC6	/* mov r/m8, imm8 */
+#define X_MOVD	0xC7	/* mov r/m32, imm32 */
+#define X_TESTB	0xF6	/* test r/m8, imm8 */
+#define X_MOVSD	0x0F10	/* movsd xmm, m (with prefix 0xF2) */
+#define X_MOVSDS	0x0F11	/* movsd m, xmm (with prefix 0xF2) */
+#define X_ADDSD	0x0F58
+#define X_SUBSD	0x0F5C
+#define X_MULSD	0x0F59
+
+/* extensions in the 'reg' field for group opcodes */
+#define G_ADD	0
+#define G_CMP	7
+
+
+/* offset of a register and of its tag in the stack frame */
+#define SLOT(r)		cast_int((r) * sizeof(StackValue))
+#define TAG(r)		(SLOT(r) + cast_int(offsetof(TValue, tt_)))
+
+
+typedef struct JitState {
+  Proto *p;
+  lu_byte *mc;  /* code buffer (NULL when only measuring the code) */
+  unsigned int *entry;  /* entry points (NULL when only measuring) */
+  size_t n;  /* current size of the code */
+  size_t epilogue;  /* offset of the code that returns to C */
+} JitState;
+
+
+static void emitb (JitState *J, int b) {
+  if (J->mc != NULL)
+    J->mc[J->n] = cast_byte(b);
+  J->n++;
+}
+
+
+static void emit32 (JitState *J, unsigned int x) {
+  int k;
+  for (k = 0; k < 4; k++, x >>= 8)
+    emitb(J, cast_int(x & 0xff));
+}
+
+
+static void emit64 (JitState *J, size_t x) {
+  emit32(J, cast_uint(x & 0xffffffffu));
+  emit32(J, cast_uint(x >> 32));
+}
+
+
+static void emitrex (JitState *J, int w, int reg, int rm) {
+  int rex = 0x40 | (w << 3) | ((reg & 8) >> 1) | ((rm & 8) >> 3);
+  if (rex != 0x40)
+    emitb(J, rex);
+}
+
+
+static void emitop (JitState *J, int op) {
+  if (op > 0xff)  /* two-byte opcode? */
+    emitb(J, op >> 8);
+  emitb(J, op & 0xff);
+}
+
+
+/* instruction 'op' with operands 'reg' and '[base + disp]' */
+static void emitmem (JitState *J, int w, int op, int reg, int base,
+                     int disp) {
+  emitrex(J, w, reg, base);
+  emitop(J, op);
+  emitb(J, 0x80 | ((reg & 7) << 3) | (base & 7));  /* disp32 */
+  if ((base & 7) == RSP)  /* 'rsp' and 'r12' need a SIB byte */
+    emitb(J, 0x24);
+  emit32(J, cast_uint(disp));
+}
+
+
+/* instruction 'op' with register operands 'reg' and 'rm' */
+static void emitreg (JitState *J, int w, int op, int reg, int rm) {
+  emitrex(J, w, reg, rm);
+  emitop(J, op);
+  emitb(J, 0xC0 | ((reg & 7) << 3) | (rm & 7));
+}
+
+
+/* mov reg, imm64 */
+static void emitmovimm (JitState *J, int reg, size_t x) {
+  emitrex(J, 1, 0, reg);
+  emitb(J, 0xB8 | (reg & 7));
+  emit64(J, x);
+}
+
+
+/* scalar-double instruction 'op' between 'xmm0' and a stack slot */
+static void emitsse (JitState *J, int op, int disp) {
+  emitb(J, 0xF2);
+  emitmem(J, 0, op, XMM0, R12, disp);
+}
+
+
+/* jump (conditional, unless 'cc' is JMP) to code offset 'target' */
+static void emitjump (JitState *J, int cc, size_t target) {
+  if (cc == JMP)
+    emitb(J, 0xE9);
+  else {
+    emitb(J, 0x0F);
+    emitb(J, 0x80 | cc);
+  }
+  emit32(J, cast_uint(cast(ptrdiff_t, target) -
+                      cast(ptrdiff_t, J->n + 4)));
+}
+
+
+/* jump to a place not yet emitted; returns the jump to be patched */
+static size_t emitfwd (JitState *J, int cc) {
+  emitjump(J, cc, J->n);
+  return J->n - 4;
+}
+
+
+/* make forward jump 'jmp' go to the current position */
+static void patchhere (JitState *J, size_t jmp) {
+  if (J->mc != NULL) {
+    unsigned int d = cast_uint(J->n - (jmp + 4));
+    int k;
+    for (k = 0; k < 4; k++, d >>= 8)
+      J->mc[jmp + k] = cast_byte(d & 0xff);
+  }
+}
+
+
+/* code offset of instruction 'pc' */
+static size_t target (JitState *J, int pc) {
+  return (J->entry != NULL) ? J->entry[pc] : 0;
+}
+
+
+/* base = ci->func + 1 */
+static void emitloadbase (JitState *J) {
+  emitmem(J, 1, X_LOAD, R12, R13, cast_int(offsetof(CallInfo, func)));
+  emitmem(J, 1, X_LEA, R12, R12, SLOT(1));
+}
+
+
+/* cmp byte [base + disp], tag */
+static void emitchecktag (JitState *J, int disp, int tag) {
+  emitmem(J, 0, X_GRP1B, G_CMP, R12, disp);
+  emitb(J, tag);
+}
+
+
+/* mov byte [base + disp], tag */
+static void emitsettag (JitState *J, int disp, int tag) {
+  emitmem(J, 0, X_MOVB, 0, R12, disp);
+  emitb(J, tag);
+}
+
+
+/* copy the value at '[src + disp]' to register 'a' */
+static void emitcopy (JitState *J, int a, int src, int disp) {
+  emitmem(J, 1, X_LOAD, RCX, src, disp);
+  emitmem(J, 1, X_LOAD, RDX, src, disp + 8);
+  emitmem(J, 1, X_STORE, RCX, R12, SLOT(a));
+  emitmem(J, 1, X_STORE, RDX, R12, SLOT(a) + 8);
+}
+
+
+/* leave native code to go on interpreting at instruction 'pc' */
+static void emitexit (JitState *J, int pc) {
+  emitmovimm(J, RAX, cast(size_t, J->p->code + pc));
+  emitmem(J, 1, X_STORE, RAX, R13, cast_int(offsetof(CallInfo, u.l.savedpc)));
+  emitb(J, 0xB8);  /* mov eax, LUAJ_EXIT */
+  emit32(J, LUAJ_EXIT);
+  emitjump(J, JMP, J->epilogue);
+}
+
+
+/*
+** Go to instruction 'dest' from instruction 'pc'. Back edges check
+** for hooks, so that they can stop loops.
+*/
+static void emitgoto (JitState *J, int pc, int dest) {
+  if (dest <= pc) {
+    emitmem(J, 0, X_GRP1S, G_CMP, RBX, cast_int(offsetof(lua_State, hookmask)));
+    emitb(J, 0);  /* cmp dword [L->hookmask], 0 */
+    emitjump(J, CC_E, target(J, dest));
+    emitexit(J, dest);
+  }
+  else
+    emitjump(J, JMP, target(J, dest));
+}
+
+
+/*
+** Call the helper for instruction 'i' at 'pc', reload 'base', and
+** leave native code if the helper asks so. Leaves the flags set by
+** 'cmp eax, LUAJ_BRANCH'.
+*/
+static void emithelper (JitState *J, Instruction i, int pc) {
+  Helper h = gethelper(GET_GENOPCODE(i));
+  emitreg(J, 1, X_STORE, RBX, RDI);  /* mov rdi, rbx */
+  emitreg(J, 1, X_STORE, R13, RSI);  /* mov rsi, r13 */
+  emitb(J, 0xBA);  /* mov edx, i */
+  emit32(J, i);
+  emitmovimm(J, RCX, cast(size_t, J->p->code + pc));
+  emitmovimm(J, RAX, cast(size_t, h));
+  emitb(J, 0xFF); emitb(J, 0xD0);  /* call rax */
+  emitloadbase(J);
+  emitb(J, 0x83); emitb(J, 0xF8); emitb(J, LUAJ_BRANCH);  /* cmp eax, 1 */
+  emitjump(J, CC_A, J->epilogue);
+}
+
+
+/* helper for a test instruction, followed by its two outcomes */
+static void emitcondhelper (JitState *J, Instruction i, int pc) {
+  emithelper(J, i, pc);
+  emitjump(J, CC_E, target(J, pc + 1));  /* do the jump */
+  emitjump(J, JMP, target(J, pc + 2));  /* skip the jump */
+}
+
+
+/*
+** OP_ADD/OP_SUB/OP_MUL: inline code for two integers or two floats
+*/
+static void emitarith (JitState *J, Instruction i, int pc, int iop,
+                       int fop) {
+  int a = SLOT(GETARG_A(i));
+  int b = SLOT(GETARG_B(i));
+  int c = SLOT(GETARG_C(i));
+  size_t notint, slow1, slow2, slow3;
+  emitchecktag(J, TAG(GETARG_B(i)), LUA_TNUMINT);
+  notint = emitfwd(J, CC_NE);
+  emitchecktag(J, TAG(GETARG_C(i)), LUA_TNUMINT);
+  slow1 = emitfwd(J, CC_NE);
+  emitmem(J, 1, X_LOAD, RAX, R12, b);
+  emitmem(J, 1, iop, RAX, R12, c);
+  emitmem(J, 1, X_STORE, RAX, R12, a);
+  emitsettag(J, TAG(GETARG_A(i)), LUA_TNUMINT);
+  emitjump(J, JMP, target(J, pc + 1));
+  patchhere(J, notint);
+  emitchecktag(J, TAG(GETARG_B(i)), LUA_TNUMFLT);
+  slow2 = emitfwd(J, CC_NE);
+  emitchecktag(J, TAG(GETARG_C(i)), LUA_TNUMFLT);
+  slow3 = emitfwd(J, CC_NE);
+  emitsse(J, X_MOVSD, b);
+  emitsse(J, fop, c);
+  emitsse(J, X_MOVSDS, a);
+  emitsettag(J, TAG(GETARG_A(i)), LUA_TNUMFLT);
+  emitjump(J, JMP, target(J, pc + 1));
+  patchhere(J, slow1);
+  patchhere(J, slow2);
+  patchhere(J, slow3);
+  emithelper(J, i, pc);
+}
+
+
+/* OP_ADDI: inline code for an integer */
+static void emitaddi (JitState *J, Instruction i, int pc) {
+  size_t slow;
+  emitchecktag(J, TAG(GETARG_B(i)), LUA_TNUMINT);
+  slow = emitfwd(J, CC_NE);
+  emitmem(J, 1, X_LOAD, RAX, R12, SLOT(GETARG_B(i)));
+  emitreg(J, 1, X_GRP1, G_ADD, RAX);  /* add rax, sC */
+  emit32(J, cast_uint(GETARG_sC(i)));
+  emitmem(J, 1, X_STORE, RAX, R12, SLOT(GETARG_A(i)));
+  emitsettag(J, TAG(GETARG_A(i)), LUA_TNUMINT);
+  emitjump(J, JMP, target(J, pc + 1));
+  patchhere(J, slow);
+  emithelper(J, i, pc);
+}
+
+
+/*
+** OP_LT/OP_LE (with 'imm' false) and comparisons with immediates: inline
+** code for integers. 'cc' is the condition for the comparison to be
+** true.
+*/
+static void emitcmp (JitState *J, Instruction i, int pc, int cc, int imm) {
+  size_t slow1, slow2 = 0;
+  emitchecktag(J, TAG(GETARG_A(i)), LUA_TNUMINT);
+  slow1 = emitfwd(J, CC_NE);
+  if (!imm) {
+    emitchecktag(J, TAG(GETARG_B(i)), LUA_TNUMINT);
+    slow2 = emitfwd(J, CC_NE);
+  }
+  emitmem(J, 1, X_LOAD, RAX, R12, SLOT(GETARG_A(i)));
+  if (imm) {
+    emitreg(J, 1, X_GRP1, G_CMP, RAX);  /* cmp rax, sB */
+    emit32(J, cast_uint(GETARG_sB(i)));
+  }
+  else
+    emitmem(J, 1, X_CMP, RAX, R12, SLOT(GETARG_B(i)));
+  /* do the jump if condition equals 'k' */
+  emitjump(J, GETARG_k(i) ? cc : CC_NOT(cc), target(J, pc + 1));
+  emitjump(J, JMP, target(J, pc + 2));
+  patchhere(J, slow1);
+  if (!imm)
+    patchhere(J, slow2);
+  emitcondhelper(J, i, pc);
+}
+
+
+/* OP_TEST: done inline */
+static void emittest (JitState *J, Instruction i, int pc) {
+  int a = GETARG_A(i);
+  /* targets when register is true and when it is false */
+  size_t t = target(J, pc + (GETARG_k(i) ? 1 : 2));
+  size_t f = target(J, pc + (GETARG_k(i) ? 2 : 1));
+  emitmem(J, 0, X_TESTB, 0, R12, TAG(a));  /* nil (any variant)? */
+  emitb(J, 0x0F);
+  emitjump(J, CC_E, f);
+  emitchecktag(J, TAG(a), LUA_TBOOLEAN);
+  emitjump(J, CC_NE, t);
+  emitmem(J, 0, X_GRP1S, G_CMP, R12, SLOT(a));  /* false? */
+  emitb(J, 0);
+  emitjump(J, CC_E, f);
+  emitjump(J, JMP, t);
+}
+
+
+/* store 'rax' as the integer index (internal and external) of a loop */
+static void emitloopindex (JitState *J, int a) {
+  emitmem(J, 1, X_STORE, RAX, R12, SLOT(a));
+  emitmem(J, 1, X_STORE, RAX, R12, SLOT(a + 3));
+  emitsettag(J, TAG(a + 3), LUA_TNUMINT);
+}
+
+
+/* OP_FORLOOP1: done inline */
+static void emitforloop1 (JitState *J, Instruction i, int pc) {
+  int a = GETARG_A(i);
+  emitmem(J, 1, X_LOAD, RAX, R12, SLOT(a));
+  emitreg(J, 1, X_GRP1, G_ADD, RAX);  /* add rax, 1 */
+  emit32(J, 1);
+  emitmem(J, 1, X_CMP, RAX, R12, SLOT(a + 1));
+  emitjump(J, CC_G, target(J, pc + 1));  /* idx > limit: loop ends */
+  emitloopindex(J, a);
+  emitgoto(J, pc, pc + 1 - GETARG_Bx(i));
+}
+
+
+/* OP_FORLOOP: inline code for integer loops */
+static void emitforloop (JitState *J, Instruction i, int pc) {
+  int a = GETARG_A(i);
+  size_t slow, negstep, cont, back;
+  emitchecktag(J, TAG(a), LUA_TNUMINT);
+  slow = emitfwd(J, CC_NE);
+  emitmem(J, 1, X_LOAD, RAX, R12, SLOT(a));
+  emitmem(J, 1, X_LOAD, RCX, R12, SLOT(a + 2));  /* step */
+  emitreg(J, 1, X_ADDRM, RCX, RAX);  /* add rax, rcx */
+  emitreg(J, 1, X_TEST, RCX, RCX);
+  negstep = emitfwd(J, CC_LE);
+  emitmem(J, 1, X_CMP, RAX, R12, SLOT(a + 1));
+  emitjump(J, CC_G, target(J, pc + 1));  /* idx > limit: loop ends */
+  cont = emitfwd(J, JMP);
+  patchhere(J, negstep);
+  emitmem(J, 1, X_CMP, RAX, R12, SLOT(a + 1));
+  emitjump(J, CC_L, target(J, pc + 1));  /* idx < limit: loop ends */
+  patchhere(J, cont);
+  emitloopindex(J, a);
+  back = emitfwd(J, JMP);
+  patchhere(J, slow);
+  emithelper(J, i, pc);  /* float loop */
+  emitjump(J, CC_NE, target(J, pc + 1));  /* loop ends */
+  patchhere(J, back);
+  emitgoto(J, pc, pc + 1 - GETARG_Bx(i));
+}
+
+
+static void compileinst (JitState *J, int pc) {
+  Proto *p = J->p;
+  Instruction i = p->code[pc];
+  int a = GETARG_A(i);
+  switch (GET_GENOPCODE(i)) {
+    case OP_MOVE: {
+      emitcopy(J, a, R12, SLOT(GETARG_B(i)));
+      break;
+    }
+    case OP_LOADI: {
+      lua_Integer b = GETARG_sBx(i);
+      emitmovimm(J, RAX, cast(size_t, l_castS2U(b)));
+      emitmem(J, 1, X_STORE, RAX, R12, SLOT(a));
+      emitsettag(J, TAG(a), LUA_TNUMINT);
+      break;
+    }
+    case OP_LOADF: {
+      lua_Number b = cast_num(GETARG_sBx(i));
+      size_t bits;
+      memcpy(&bits, &b, sizeof(bits));
+      emitmovimm(J, RAX, bits);
+      emitmem(J, 1, X_STORE, RAX, R12, SLOT(a));
+      emitsettag(J, TAG(a), LUA_TNUMFLT);
+      break;
+    }
+    case OP_LOADK: {
+      emitmovimm(J, RAX, cast(size_t, p->k + GETARG_Bx(i)));
+      emitcopy(J, a, RAX, 0);
+      break;
+    }
+    case OP_LOADKX: {
+      emitmovimm(J, RAX, cast(size_t, p->k + GETARG_Ax(p->code[pc + 1])));
+      emitcopy(J, a, RAX, 0);
+      emitjump(J, JMP, target(J, pc + 2));
+      break;
+    }
+    case OP_LOADBOOL: {
+      emitmem(J, 0, X_MOVD, 0, R12, SLOT(a));
+      emit32(J, cast_uint(GETARG_B(i)));
+      emitsettag(J, TAG(a), LUA_TBOOLEAN);
+      if (GETARG_C(i))  /* skip next instruction? */
+        emitjump(J, JMP, target(J, pc + 2));
+      break;
+    }
+    case OP_LOADNIL: {
+      int b = GETARG_B(i);
+      do {
+        emitsettag(J, TAG(a++), LUA_TNIL);
+      } while (b--);
+      break;
+    }
+    case OP_GETUPVAL: {
+      emitmem(J, 1, X_LOAD, RAX, R13, cast_int(offsetof(CallInfo, func)));
+      emitmem(J, 1, X_LOAD, RAX, RAX, 0);  /* closure */
+      emitmem(J, 1, X_LOAD, RAX, RAX, cast_int(offsetof(LClosure, upvals) +
+                                       GETARG_B(i) * sizeof(UpVal *)));
+      emitmem(J, 1, X_LOAD, RAX, RAX, cast_int(offsetof(UpVal, v)));
+      emitcopy(J, a, RAX, 0);
+      break;
+    }
+    case OP_ADD: {
+      emitarith(J, i, pc, X_ADD, X_ADDSD);
+      break;
+    }
+    case OP_SUB: {
+      emitarith(J, i, pc, X_SUB, X_SUBSD);
+      break;
+    }
+    case OP_MUL: {
+      emitarith(J, i, pc, X_IMUL, X_MULSD);
+      break;
+    }
+    case OP_ADDI: {
+      emitaddi(J, i, pc);
+      break;
+    }
+    case OP_JMP: {
+      emitgoto(J, pc, pc + 1 + GETARG_sJ(i));
+      break;
+    }
+    case OP_LT: emitcmp(J, i, pc, CC_L, 0); break;
+    case OP_LE: emitcmp(J, i, pc, CC_LE, 0); break;
+    case OP_EQI: emitcmp(J, i, pc, CC_E, 1); break;
+    case OP_LTI: emitcmp(J, i, pc, CC_L, 1); break;
+    case OP_LEI: emitcmp(J, i, pc, CC_LE, 1); break;
+    case OP_GTI: emitcmp(J, i, pc, CC_G, 1); break;
+    case OP_GEI: emitcmp(J, i, pc, CC_GE, 1); break;
+    case OP_EQ: case OP_EQK: case OP_TESTSET: {
+      emitcondhelper(J, i, pc);
+      break;
+    }
+    case OP_TEST: {
+      emittest(J, i, pc);
+      break;
+    }
+    case OP_FORLOOP1: {
+      emitforloop1(J, i, pc);
+      break;
+    }
+    case OP_FORLOOP: {
+      emitforloop(J, i, pc);
+      break;
+    }
+    case OP_FORPREP1: case OP_FORPREP: {
+      emithelper(J, i, pc);
+      emitjump(J, JMP, target(J, pc + 1 + GETARG_Bx(i)));
+      break;
+    }
+    case OP_TFORLOOP: {
+      emithelper(J, i, pc);
+      emitjump(J, CC_NE, target(J, pc + 1));  /* loop ends */
+      emitgoto(J, pc, pc + 1 - GETARG_Bx(i));
+      break;
+    }
+    case OP_SETLIST: {
+      emithelper(J, i, pc);
+      if (GETARG_C(i) == 0)  /* skip extra argument */
+        emitjump(J, JMP, target(J, pc + 2));
+      break;
+    }
+    case OP_EXTRAARG: {
+      break;  /* never executed */
+    }
+    default: {
+      emithelper(J, i, pc);
+      break;
+    }
+  }
+}
+
+
+/*
+** Generate the code for 'J->p': a prologue that saves callee-saved
+** registers, loads 'L', 'ci', and 'base', and jumps to the entry point
+** given as third argument; the epilogue that returns to C; and the
+** code of each instruction.
+*/
+static void compileproto (JitState *J) {
+  int pc;
+  J->n = 0;
+  emitb(J, 0x53);  /* push rbx */
+  emitb(J, 0x41); emitb(J, 0x54);  /* push r12 */
+  emitb(J, 0x41); emitb(J, 0x55);  /* push r13 (stack is now aligned) */
+  emitreg(J, 1, X_STORE, RDI, RBX);  /* mov rbx, rdi */
+  emitreg(J, 1, X_STORE, RSI, R13);  /* mov r13, rsi */
+  emitloadbase(J);
+  emitb(J, 0xFF); emitb(J, 0xE2);  /* jmp rdx */
+  J->epilogue = J->n;
+  emitb(J, 0x41); emitb(J, 0x5D);  /* pop r13 */
+  emitb(J, 0x41); emitb(J, 0x5C);  /* pop r12 */
+  emitb(J, 0x5B);  /* pop rbx */
+  emitb(J, 0xC3);  /* ret */
+  for (pc = 0; pc < J->p->sizecode; pc++) {
+    if (J->entry != NULL)
+      J->entry[pc] = cast_uint(J->n);
+    compileinst(J, pc);
+  }
+}
+
+/* }================================================================== */
+
+
+
+/*
+** Compile prototype 'p'. The code size does not depend on jump
+** distances, so a first pass measures it and, once the block exists, a
+** second pass computes the entry points used by the third one. Returns
+** false if there is no memory for native code.
+*/
+int luaJ_compile (lua_State *L, Proto *p) {
+  JitState J;
+  JitCode *jc;
+  void *block;
+  size_t hsize, size;
+  UNUSED(L);
+  lua_assert(sizeof(StackValue) == 16 && sizeof(l_signalT) == 4);
+  J.p = p;
+  J.mc = NULL;
+  J.entry = NULL;
+  compileproto(&J);  /* measure code */
+  hsize = offsetof(JitCode, entry) + p->sizecode * sizeof(unsigned int);
+  hsize = (hsize + 15) & ~cast_sizet(15);  /* align code */
+  size = hsize + J.n;
+  block = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (block == MAP_FAILED) {
+    p->jitcount = -MAX_INT;  /* do not try again soon */
+    return 0;
+  }
+  jc = cast(JitCode *, block);
+  jc->size = size;
+  jc->mcode = cast(lu_byte *, block) + hsize;
+  J.mc = jc->mcode;
+  J.entry = jc->entry;
+  compileproto(&J);  /* compute entry points */
+  compileproto(&J);  /* final code */
+  lua_assert(hsize + J.n == size);
+  if (mprotect(block, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(block, size);
+    p->jitcount = -MAX_INT;
+    return 0;
+  }
+  p->jit = jc;
+  return 1;
+}
+
+
+/*
+** Run the native code of the function running in 'ci' (which must
+** have been compiled) from its current 'savedpc'.
+*/
+int luaJ_execute (lua_State *L, CallInfo *ci) {
+  Proto *p = clLvalue(s2v(ci->func))->p;
+  JitCode *jc = p->jit;
+  JitFunction f = cast(JitFunction, cast(size_t, jc->mcode));
+  lua_assert(jc != NULL && L->hookmask == 0);
+  return (*f)(L, ci, jc->mcode + jc->entry[ci->u.l.savedpc - p->code]);
+}
+
+
+void luaJ_freecode (lua_State *L, Proto *p) {
+  UNUSED(L);
+  if (p->jit != NULL)
+    munmap(p->jit, p->jit->size);
+}
+
+#endif
@@ -0,0 +1,52 @@
+/*
+** $Id: ljit.h $
+** Baseline compiler from Lua bytecode to native code
+** See Copyright Notice in lua.h
+*/
+
+#ifndef ljit_h
+#define ljit_h
+
+
+#include "lobject.h"
+#include "lstate.h"
+
+
+#if defined(LUA_USE_JIT)
+
+/*
+** Results of 'luaJ_execute' (and of the helpers called by native code;
+** LUAJ_CONTINUE and LUAJ_BRANCH never leave native code)
+*/
+#define LUAJ_CONTINUE	0	/* go on to the next instruction */
+#define LUAJ_BRANCH	1	/* take the branch of the instruction */
+#define LUAJ_EXIT	2	/* go on in the interpreter at 'savedpc' */
+#define LUAJ_CALL	3	/* run the Lua function at 'L->ci' */
+#define LUAJ_RETURN	4	/* function returned (as in 'luaD_poscall') */
+
+
+/*
+** Number of calls plus loop iterations that a function must run in the
+** interpreter before it is compiled
+*/
+#if !defined(LUAJ_HOTCOUNT)
+#define LUAJ_HOTCOUNT	100
+#endif
+
+
+/*
+** Count one more call or loop iteration of prototype 'p', compiling it
+** when it gets hot. True if 'p' has native code.
+*/
+#define luaJ_hot(L,p)  \
+	((p)->jit != NULL ||  \
+	 (++(p)->jitcount == LUAJ_HOTCOUNT && luaJ_compile(L, p)))
+
+
+LUAI_FUNC int luaJ_compile (lua_State *L, Proto *p);
+LUAI_FUNC int luaJ_execute (lua_State *L, CallInfo *ci);
+LUAI_FUNC void luaJ_freecode (lua_State *L, Proto *p);
+
+#endif
+
+#endif
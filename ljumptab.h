@@ -94,6 +94,16 @@ static void *disptab[] = {
 &&L_OP_CLOSURE,
 &&L_OP_VARARG,
 &&L_OP_PREPVARARG,
-&&L_OP_EXTRAARG
+&&L_OP_EXTRAARG,
+&&L_OP_ADDINT,
+&&L_OP_SUBINT,
+&&L_OP_MULINT,
+&&L_OP_ADDFLT,
+&&L_OP_SUBFLT,
+&&L_OP_MULFLT,
+&&L_OP_ADDIINT,
+&&L_OP_LTINT,
+&&L_OP_LEINT,
+&&L_OP_GETARRAY
 
 };
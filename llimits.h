@@ -277,6 +277,19 @@ typedef unsigned long Instruction;
 #endif
 
 
+/*
+** these macros allow user-specific actions (e.g., statistics) on hits
+** and misses of the inline caches for field accesses.
+*/
+#if !defined(luai_icachehit)
+#define luai_icachehit(L)		((void)L)
+#endif
+
+#if !defined(luai_icachemiss)
+#define luai_icachemiss(L)		((void)L)
+#endif
+
+
 
 /*
 ** The luai_num* macros define the primitive operations over numbers.
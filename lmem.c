@@ -109,6 +109,10 @@ l_noret luaM_toobig (lua_State *L) {
 void luaM_free_ (lua_State *L, void *block, size_t osize) {
   global_State *g = G(L);
   lua_assert((block == 0) == (block == NULL));
+#if defined(LUA_USE_NURSERY)
+  if (g->nursery != NULL && luaC_nurseryfree(L, block, osize))
+    return;  /* object in an arena */
+#endif
   (*g->frealloc)(g->ud, block, osize, 0);
   g->GCdebt -= osize;
 }
@@ -29,6 +29,56 @@
 #include "lvm.h"
 
 
+#if defined(LUA_NANBOXING)
+
+LUAI_DDEF const lu_byte luaO_nbtag[16] = {
+  LUA_TNUMFLT, LUA_TNIL, LUA_TEMPTY, LUA_TABSTKEY, LUA_TBOOLEAN,
+  LUA_TLIGHTUSERDATA, LUA_TNUMINT, LUA_TLCF, ctb(LUA_TLCL), ctb(LUA_TCCL),
+  ctb(LUA_TSHRSTR), ctb(LUA_TLNGSTR), ctb(LUA_TTABLE), ctb(LUA_TUSERDATA),
+  ctb(LUA_TTHREAD), LUA_TNIL  /* last code is not used */
+};
+
+
+/*
+** Unbox a value (for keys in table nodes)
+*/
+Value luaO_nbvalue (const TValue *o) {
+  Value v;
+  switch (ttypetag(o)) {
+    case LUA_TNUMFLT: v.n = fltvalue(o); break;
+    case LUA_TNUMINT: v.i = ivalue(o); break;
+    case LUA_TBOOLEAN: v.b = bvalue(o); break;
+    case LUA_TLIGHTUSERDATA: v.p = pvalue(o); break;
+    case LUA_TLCF: v.f = fvalue(o); break;
+    default: v.gc = iscollectable(o) ? gcvalue(o) : NULL; break;
+  }
+  return v;
+}
+
+
+/*
+** Box value 'v' with raw tag 'tt'
+*/
+void luaO_nbsetvalue (TValue *o, int tt, Value v) {
+  switch (tt) {
+    case LUA_TNUMFLT: setfltvalue(o, v.n); break;
+    case LUA_TNUMINT: setivalue(o, v.i); break;
+    case LUA_TBOOLEAN: setbvalue(o, v.b); break;
+    case LUA_TLIGHTUSERDATA: setpvalue(o, v.p); break;
+    case LUA_TLCF: setfvalue(o, v.f); break;
+    default: {
+      if (tt & BIT_ISCOLLECTABLE)
+        setgcval_(o, v.gc, tt);
+      else  /* some kind of nil */
+        settt_(o, tt);
+      break;
+    }
+  }
+}
+
+#endif
+
+
 /*
 ** converts an integer to a "floating point byte", represented as
 ** (eeeeexxx), where the real value is (1xxx) * 2^(eeeee - 1) if
@@ -55,8 +55,22 @@ typedef union Value {
 ** an actual value plus a tag with its type.
 */
 
+#if !defined(LUA_NANBOXING)
+
 #define TValuefields	Value value_; lu_byte tt_
 
+#else
+
+/* a value "boxed" in a 'double' (see section "NaN Boxing") */
+typedef union NBValue {
+  size_t b;  /* bits of the box */
+  lua_Number n;  /* float numbers */
+} NBValue;
+
+#define TValuefields	NBValue nb_
+
+#endif
+
 typedef struct TValue {
   TValuefields;
 } TValue;
@@ -96,6 +110,10 @@ typedef struct TValue {
 /* Macros to set values */
 #define settt_(o,t)	((o)->tt_=(t))
 
+/* access and set the object of a collectable value */
+#define gcval_(o)	(val_(o).gc)
+#define setgcval_(o,x,t)	(val_(o).gc = (x), settt_(o, t))
+
 
 #define setobj(L,obj1,obj2) \
 	{ TValue *io1=(obj1); const TValue *io2=(obj2); \
@@ -176,10 +194,16 @@ typedef StackValue *StkId;  /* index to stack elements */
 */
 #define isempty(v)		ttisnil(v)
 
+/* test whether a tag denotes an empty value */
+#define tagisempty(tag)		(novariant(tag) == LUA_TNIL)
+
 
 /* macro defining a value corresponding to an absent key */
 #define ABSTKEYCONSTANT		{NULL}, LUA_TABSTKEY
 
+/* macro defining an empty value (for the dummy node of tables) */
+#define EMPTYCONSTANT		{NULL}, LUA_TEMPTY
+
 
 /* mark an entry as empty */
 #define setempty(v)		settt_(v, LUA_TEMPTY)
@@ -217,11 +241,11 @@ typedef StackValue *StkId;  /* index to stack elements */
 
 #define ttisthread(o)		checktag((o), ctb(LUA_TTHREAD))
 
-#define thvalue(o)	check_exp(ttisthread(o), gco2th(val_(o).gc))
+#define thvalue(o)	check_exp(ttisthread(o), gco2th(gcval_(o)))
 
 #define setthvalue(L,obj,x) \
   { TValue *io = (obj); lua_State *x_ = (x); \
-    val_(io).gc = obj2gco(x_); settt_(io, ctb(LUA_TTHREAD)); \
+    setgcval_(io, obj2gco(x_), ctb(LUA_TTHREAD)); \
     checkliveness(L,io); }
 
 #define setthvalue2s(L,o,t)	setthvalue(L,s2v(o),t)
@@ -256,13 +280,13 @@ typedef struct GCObject {
 /* mark a tag as collectable */
 #define ctb(t)			((t) | BIT_ISCOLLECTABLE)
 
-#define gcvalue(o)	check_exp(iscollectable(o), val_(o).gc)
+#define gcvalue(o)	check_exp(iscollectable(o), gcval_(o))
 
 #define gcvalueraw(v)	((v).gc)
 
 #define setgcovalue(L,obj,x) \
   { TValue *io = (obj); GCObject *i_g=(x); \
-    val_(io).gc = i_g; settt_(io, ctb(i_g->tt)); }
+    setgcval_(io, i_g, ctb(i_g->tt)); }
 
 /* }================================================================== */
 
@@ -320,11 +344,11 @@ typedef struct GCObject {
 
 #define tsvalueraw(v)	(gco2ts((v).gc))
 
-#define tsvalue(o)	check_exp(ttisstring(o), gco2ts(val_(o).gc))
+#define tsvalue(o)	check_exp(ttisstring(o), gco2ts(gcval_(o)))
 
 #define setsvalue(L,obj,x) \
   { TValue *io = (obj); TString *x_ = (x); \
-    val_(io).gc = obj2gco(x_); settt_(io, ctb(x_->tt)); \
+    setgcval_(io, obj2gco(x_), ctb(x_->tt)); \
     checkliveness(L,io); }
 
 /* set a string to the stack */
@@ -359,6 +383,58 @@ typedef union UTString {
 } UTString;
 
 
+#if defined(LUA_USE_APPENDSTR)
+
+/*
+** Buffer shared by long strings built by concatenation (see 'lstring.c').
+** Each string in it is a prefix of the bytes in 'data' (or, with
+** LUA_USE_STRVIEWS, any part of the first 'used' ones); the string
+** ending at 'used' may grow in place, unless a library holds the buffer.
+*/
+typedef struct StrBuf {
+  size_t size;  /* bytes available in 'data' (not counting the '\0') */
+  size_t used;  /* length of the longest string in the buffer */
+  size_t nref;  /* number of strings (and holder) using the buffer */
+  lu_byte held;  /* true while a library writes into the buffer */
+  char data[1];
+} StrBuf;
+
+/*
+** A long string with 'shrlen' equal to EXTSTR keeps, after its header,
+** an 'ExtStr' with its buffer instead of its bytes. (Short strings never
+** have that length.)
+*/
+#define EXTSTR		255
+
+typedef struct ExtStr {
+  StrBuf *buf;
+#if defined(LUA_USE_STRVIEWS)
+  size_t off;  /* position of the string in the buffer */
+#endif
+} ExtStr;
+
+#define isextstr(ts)	((ts)->shrlen == EXTSTR)
+#define extstr(ts)	cast(ExtStr *, cast_charp((ts)) + sizeof(UTString))
+#define extbuf(ts)	(extstr(ts)->buf)
+
+#if defined(LUA_USE_STRVIEWS)
+#define extoff(ts)	(extstr(ts)->off)
+#else
+#define extoff(ts)	cast(size_t, 0)  /* strings are prefixes of buffers */
+#endif
+
+/*
+** Get the actual string (array of bytes) from a 'TString'.
+** (Access to 'extra' ensures that value is really a 'TString'.)
+** The bytes of a string in a buffer may not end with a '\0'.
+*/
+#define getstr(ts)  \
+  check_exp(sizeof((ts)->extra), \
+    isextstr(ts) ? extbuf(ts)->data + extoff(ts)  \
+                 : cast_charp((ts)) + sizeof(UTString))
+
+#else
+
 /*
 ** Get the actual string (array of bytes) from a 'TString'.
 ** (Access to 'extra' ensures that value is really a 'TString'.)
@@ -366,6 +442,8 @@ typedef union UTString {
 #define getstr(ts)  \
   check_exp(sizeof((ts)->extra), cast_charp((ts)) + sizeof(UTString))
 
+#endif
+
 
 /* get the actual string (array of bytes) from a Lua value */
 #define svalue(o)       getstr(tsvalue(o))
@@ -389,7 +467,7 @@ typedef union UTString {
 #define ttisfulluserdata(o)	checktype((o), LUA_TUSERDATA)
 
 #define pvalue(o)	check_exp(ttislightuserdata(o), val_(o).p)
-#define uvalue(o)	check_exp(ttisfulluserdata(o), gco2u(val_(o).gc))
+#define uvalue(o)	check_exp(ttisfulluserdata(o), gco2u(gcval_(o)))
 
 #define pvalueraw(v)	((v).p)
 
@@ -398,7 +476,7 @@ typedef union UTString {
 
 #define setuvalue(L,obj,x) \
   { TValue *io = (obj); Udata *x_ = (x); \
-    val_(io).gc = obj2gco(x_); settt_(io, ctb(LUA_TUSERDATA)); \
+    setgcval_(io, obj2gco(x_), ctb(LUA_TUSERDATA)); \
     checkliveness(L,io); }
 
 
@@ -518,6 +596,7 @@ typedef struct Proto {
   TValue *k;  /* constants used by the function */
   struct LClosure *cache;  /* last-created closure with this prototype */
   Instruction *code;  /* opcodes */
+  unsigned int *icache;  /* per-instruction inline caches (see 'lvm.c') */
   struct Proto **p;  /* functions defined inside the function */
   Upvaldesc *upvalues;  /* upvalue information */
   ls_byte *lineinfo;  /* information about source lines (debug information) */
@@ -525,6 +604,10 @@ typedef struct Proto {
   LocVar *locvars;  /* information about local variables (debug information) */
   TString  *source;  /* used for debug information */
   GCObject *gclist;
+#if defined(LUA_USE_JIT)
+  struct JitCode *jit;  /* native code (see 'ljit.c') */
+  int jitcount;  /* calls and loop iterations before compiling */
+#endif
 } Proto;
 
 /* }================================================================== */
@@ -549,16 +632,16 @@ typedef struct Proto {
 
 #define isLfunction(o)	ttisLclosure(o)
 
-#define clvalue(o)	check_exp(ttisclosure(o), gco2cl(val_(o).gc))
-#define clLvalue(o)	check_exp(ttisLclosure(o), gco2lcl(val_(o).gc))
+#define clvalue(o)	check_exp(ttisclosure(o), gco2cl(gcval_(o)))
+#define clLvalue(o)	check_exp(ttisLclosure(o), gco2lcl(gcval_(o)))
 #define fvalue(o)	check_exp(ttislcf(o), val_(o).f)
-#define clCvalue(o)	check_exp(ttisCclosure(o), gco2ccl(val_(o).gc))
+#define clCvalue(o)	check_exp(ttisCclosure(o), gco2ccl(gcval_(o)))
 
 #define fvalueraw(v)	((v).f)
 
 #define setclLvalue(L,obj,x) \
   { TValue *io = (obj); LClosure *x_ = (x); \
-    val_(io).gc = obj2gco(x_); settt_(io, ctb(LUA_TLCL)); \
+    setgcval_(io, obj2gco(x_), ctb(LUA_TLCL)); \
     checkliveness(L,io); }
 
 #define setclLvalue2s(L,o,cl)	setclLvalue(L,s2v(o),cl)
@@ -568,7 +651,7 @@ typedef struct Proto {
 
 #define setclCvalue(L,obj,x) \
   { TValue *io = (obj); CClosure *x_ = (x); \
-    val_(io).gc = obj2gco(x_); settt_(io, ctb(LUA_TCCL)); \
+    setgcval_(io, obj2gco(x_), ctb(LUA_TCCL)); \
     checkliveness(L,io); }
 
 
@@ -624,11 +707,11 @@ typedef union Closure {
 
 #define ttistable(o)		checktag((o), ctb(LUA_TTABLE))
 
-#define hvalue(o)	check_exp(ttistable(o), gco2t(val_(o).gc))
+#define hvalue(o)	check_exp(ttistable(o), gco2t(gcval_(o)))
 
 #define sethvalue(L,obj,x) \
   { TValue *io = (obj); Table *x_ = (x); \
-    val_(io).gc = obj2gco(x_); settt_(io, ctb(LUA_TTABLE)); \
+    setgcval_(io, obj2gco(x_), ctb(LUA_TTABLE)); \
     checkliveness(L,io); }
 
 #define sethvalue2s(L,o,h)	sethvalue(L,s2v(o),h)
@@ -679,16 +762,62 @@ typedef union Node {
 #define setnorealasize(t)	((t)->marked |= BITRAS)
 
 
+#if defined(LUA_USE_SHAPES)
+
+/*
+** A shape lists the short-string keys of a table in insertion order;
+** the value for 'keys[i]' is in the i-th slot of every table with that
+** shape. Shapes form a tree of transitions ('child' is the first shape
+** obtained by adding one more key to this one, and 'sibling' links the
+** transitions from the same parent), so tables that get the same keys
+** in the same order share their shapes. Shapes are not collectable
+** objects: 'nref' counts the tables and transitions using a shape, which
+** is freed when that count drops to zero.
+*/
+typedef struct Shape {
+  struct Shape *parent;
+  struct Shape *child;  /* first transition from this shape */
+  struct Shape *sibling;  /* next transition from 'parent' */
+  unsigned int nref;  /* number of references to this shape */
+  lu_byte nkeys;  /* number of keys */
+  TString *keys[1];  /* keys, in insertion order */
+} Shape;
+
+#endif
+
+
 typedef struct Table {
   CommonHeader;
   lu_byte flags;  /* 1<<p means tagmethod(p) is not present */
   lu_byte lsizenode;  /* log2 of size of 'node' array */
+#if defined(LUA_USE_SHAPES)
+  lu_byte sizeslots;  /* size of 'slots' array */
+#endif
   unsigned int alimit;  /* "limit" of 'array' array */
-  TValue *array;  /* array part */
+  Value *array;  /* array part (see 'ltable.h') */
   Node *node;
+#if !defined(LUA_USE_SWISSTABLE)
   Node *lastfree;  /* any free position is before this position */
+#else
+  lu_byte *ctrl;  /* control bytes for 'node' (see 'ltable.c') */
+  unsigned int growthleft;  /* number of free nodes still usable */
+#endif
   struct Table *metatable;
   GCObject *gclist;
+#if defined(LUA_USE_INCRHASH)
+  struct Table *oldhash;  /* old hash part, while growing incrementally */
+#endif
+#if defined(LUA_USE_SIZEHINTS)
+  struct Proto *site;  /* function that created the table, if any */
+  int sitepc;  /* index of the OP_NEWTABLE that created it in 'site' */
+#endif
+#if defined(LUA_USE_SHAPES)
+  Shape *shape;  /* shape of the table, or NULL if it uses 'node' */
+  TValue *slots;  /* values for the keys in 'shape' */
+#endif
+#if defined(LUA_USE_CARDS)
+  lu_byte *cards;  /* dirty marks for parts of the table (see 'lgc.c') */
+#endif
 } Table;
 
 
@@ -724,6 +853,184 @@ typedef struct Table {
 /* }================================================================== */
 
 
+/*
+** {==================================================================
+** NaN Boxing
+** ===================================================================
+*/
+
+#if defined(LUA_NANBOXING)
+
+/*
+** Each value is a 'double': a float is itself (with all NaNs
+** normalized to a positive one), and all other values are negative
+** NaNs carrying a 4-bit code for their tag (bits 48-51) and a 48-bit
+** payload (a pointer, a 32-bit integer, or a boolean). The box with
+** code 0 is minus infinity, so codes start at 1. Collectable values
+** have the highest codes, so that a single comparison tests for them.
+*/
+
+#define NBCNIL		1
+#define NBCEMPTY	2
+#define NBCABSTKEY	3
+#define NBCBOOLEAN	4
+#define NBCLIGHTUD	5
+#define NBCNUMINT	6
+#define NBCLCF		7
+#define NBCLCL		8	/* first collectable code */
+#define NBCCCL		9
+#define NBCSHRSTR	10
+#define NBCLNGSTR	11
+#define NBCTABLE	12
+#define NBCUSERDATA	13
+#define NBCTHREAD	14
+
+/* code of a raw tag (a constant expression when 't' is a constant) */
+#define NBCODE(t)  \
+  ((t) == LUA_TNIL ? NBCNIL : (t) == LUA_TEMPTY ? NBCEMPTY :  \
+   (t) == LUA_TABSTKEY ? NBCABSTKEY : (t) == LUA_TBOOLEAN ? NBCBOOLEAN :  \
+   (t) == LUA_TLIGHTUSERDATA ? NBCLIGHTUD :  \
+   (t) == LUA_TNUMINT ? NBCNUMINT : (t) == LUA_TLCF ? NBCLCF :  \
+   (t) == ctb(LUA_TLCL) ? NBCLCL : (t) == ctb(LUA_TCCL) ? NBCCCL :  \
+   (t) == ctb(LUA_TSHRSTR) ? NBCSHRSTR :  \
+   (t) == ctb(LUA_TLNGSTR) ? NBCLNGSTR :  \
+   (t) == ctb(LUA_TTABLE) ? NBCTABLE :  \
+   (t) == ctb(LUA_TUSERDATA) ? NBCUSERDATA : NBCTHREAD)
+
+/* raw tag for each code (code 0 stands for floats) */
+LUAI_DDEC(const lu_byte luaO_nbtag[16];)
+
+
+#define NBPAYLOAD	((cast_sizet(1) << 48) - 1)
+
+/* top 16 bits of a box with code 'c' */
+#define NBHEAD(c)	(0xFFF0 | (c))
+
+/* box with code 'c' and payload 'p' */
+#define nbbox(c,p)	((cast_sizet(NBHEAD(c)) << 48) | cast_sizet(p))
+
+/* normalized NaN, for floats */
+#define NBNAN		(cast_sizet(0x7FF8) << 48)
+
+#define nbhead(o)	((o)->nb_.b >> 48)
+#define nbpayload(o)	((o)->nb_.b & NBPAYLOAD)
+#define nbisfloat(o)	(nbhead(o) <= NBHEAD(0))
+#define nbcode(o)	(nbisfloat(o) ? 0 : cast_int(nbhead(o) & 0xF))
+
+
+#undef val_
+#undef valraw
+
+#undef rawtt
+#define rawtt(o)	(luaO_nbtag[nbcode(o)])
+
+#undef checktag
+#define checktag(o,t)  \
+	((t) == LUA_TNUMFLT ? nbisfloat(o) : nbhead(o) == NBHEAD(NBCODE(t)))
+
+#undef settt_
+#define settt_(o,t)	((o)->nb_.b = nbbox(NBCODE(t), 0))
+
+#undef gcval_
+#define gcval_(o)	cast(GCObject *, nbpayload(o))
+
+#undef setgcval_
+#define setgcval_(o,x,t)	((o)->nb_.b = nbbox(NBCODE(t), (x)))
+
+#undef setobj
+#define setobj(L,obj1,obj2) \
+	{ TValue *io1=(obj1); const TValue *io2=(obj2); \
+	  io1->nb_ = io2->nb_; \
+	  (void)L; checkliveness(L,io1); lua_assert(!isreallyempty(io1)); }
+
+
+#undef ABSTKEYCONSTANT
+#define ABSTKEYCONSTANT		{nbbox(NBCABSTKEY, 0)}
+
+#undef EMPTYCONSTANT
+#define EMPTYCONSTANT		{nbbox(NBCEMPTY, 0)}
+
+#undef ttisnil
+#define ttisnil(v)	(nbhead(v) - NBHEAD(NBCNIL) <= NBCABSTKEY - NBCNIL)
+
+#undef iscollectable
+#define iscollectable(o)	(nbhead(o) >= NBHEAD(NBCLCL))
+
+#undef ttisnumber
+#define ttisnumber(o)	(nbisfloat(o) || ttisinteger(o))
+
+
+#undef bvalue
+#define bvalue(o)	check_exp(ttisboolean(o), cast_int(nbpayload(o)))
+
+#undef setbvalue
+#define setbvalue(obj,x) \
+  { TValue *io=(obj); io->nb_.b = nbbox(NBCBOOLEAN, (x) != 0); }
+
+#undef fltvalue
+#define fltvalue(o)	check_exp(ttisfloat(o), (o)->nb_.n)
+
+#undef setfltvalue
+#define setfltvalue(obj,x) \
+  { TValue *io=(obj); lua_Number n_=(x); \
+    if (luai_numisnan(n_)) io->nb_.b = NBNAN; else io->nb_.n = n_; }
+
+#undef chgfltvalue
+#define chgfltvalue(obj,x) \
+  { TValue *io_=(obj); lua_assert(ttisfloat(io_)); setfltvalue(io_, x); }
+
+#undef ivalue
+#define ivalue(o)  \
+	check_exp(ttisinteger(o), l_castU2S(cast(lua_Unsigned, (o)->nb_.b)))
+
+#undef setivalue
+#define setivalue(obj,x) \
+  { TValue *io=(obj); io->nb_.b = nbbox(NBCNUMINT, l_castS2U(x)); }
+
+#undef chgivalue
+#define chgivalue(obj,x) \
+  { TValue *io_=(obj); lua_assert(ttisinteger(io_)); setivalue(io_, x); }
+
+#undef pvalue
+#define pvalue(o)  \
+	check_exp(ttislightuserdata(o), cast_voidp(nbpayload(o)))
+
+#undef setpvalue
+#define setpvalue(obj,x) \
+  { TValue *io=(obj); void *p_=(x); \
+    lua_assert((cast_sizet(p_) & ~NBPAYLOAD) == 0); \
+    io->nb_.b = nbbox(NBCLIGHTUD, p_); }
+
+#undef fvalue
+#define fvalue(o)	check_exp(ttislcf(o), cast(lua_CFunction, nbpayload(o)))
+
+#undef setfvalue
+#define setfvalue(obj,x) \
+  { TValue *io=(obj); io->nb_.b = nbbox(NBCLCF, (x)); }
+
+
+/* keys in nodes keep their tag and 'Value' separated */
+#undef setnodekey
+#define setnodekey(L,node,obj) \
+	{ Node *n_=(node); const TValue *io_=(obj); \
+	  n_->u.key_val = luaO_nbvalue(io_); n_->u.key_tt = rawtt(io_); \
+	  (void)L; checkliveness(L,io_); }
+
+#undef getnodekey
+#define getnodekey(L,obj,node) \
+	{ TValue *io_=(obj); const Node *n_=(node); \
+	  luaO_nbsetvalue(io_, n_->u.key_tt, n_->u.key_val); \
+	  (void)L; checkliveness(L,io_); }
+
+
+LUAI_FUNC Value luaO_nbvalue (const TValue *o);
+LUAI_FUNC void luaO_nbsetvalue (TValue *o, int tt, Value v);
+
+#endif
+
+/* }================================================================== */
+
+
 
 /*
 ** 'module' operation for hashing (size is always a power of 2)
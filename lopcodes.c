@@ -97,6 +97,16 @@ LUAI_DDEF const char *const luaP_opnames[NUM_OPCODES+1] = {
   "VARARG",
   "PREPVARARG",
   "EXTRAARG",
+  "ADDINT",
+  "SUBINT",
+  "MULINT",
+  "ADDFLT",
+  "SUBFLT",
+  "MULFLT",
+  "ADDIINT",
+  "LTINT",
+  "LEINT",
+  "GETARRAY",
   NULL
 };
 
@@ -182,5 +192,30 @@ LUAI_DDEF const lu_byte luaP_opmodes[NUM_OPCODES] = {
  ,opmode(1, 0, 0, 1, iABC)		/* OP_VARARG */
  ,opmode(0, 0, 0, 1, iABC)		/* OP_PREPVARARG */
  ,opmode(0, 0, 0, 0, iAx)		/* OP_EXTRAARG */
+ ,opmode(0, 0, 0, 1, iABC)		/* OP_ADDINT */
+ ,opmode(0, 0, 0, 1, iABC)		/* OP_SUBINT */
+ ,opmode(0, 0, 0, 1, iABC)		/* OP_MULINT */
+ ,opmode(0, 0, 0, 1, iABC)		/* OP_ADDFLT */
+ ,opmode(0, 0, 0, 1, iABC)		/* OP_SUBFLT */
+ ,opmode(0, 0, 0, 1, iABC)		/* OP_MULFLT */
+ ,opmode(0, 0, 0, 1, iABC)		/* OP_ADDIINT */
+ ,opmode(0, 0, 1, 0, iABC)		/* OP_LTINT */
+ ,opmode(0, 0, 1, 0, iABC)		/* OP_LEINT */
+ ,opmode(0, 0, 0, 1, iABC)		/* OP_GETARRAY */
+};
+
+
+/* generic opcode of each quickened opcode (ORDER OP) */
+LUAI_DDEF const lu_byte luaP_genericop[NUM_OPCODES - OP_FIRSTQUICK] = {
+   OP_ADD		/* OP_ADDINT */
+  ,OP_SUB		/* OP_SUBINT */
+  ,OP_MUL		/* OP_MULINT */
+  ,OP_ADD		/* OP_ADDFLT */
+  ,OP_SUB		/* OP_SUBFLT */
+  ,OP_MUL		/* OP_MULFLT */
+  ,OP_ADDI		/* OP_ADDIINT */
+  ,OP_LT		/* OP_LTINT */
+  ,OP_LE		/* OP_LEINT */
+  ,OP_GETTABLE		/* OP_GETARRAY */
 };
 
@@ -292,11 +292,34 @@ OP_VARARG,/*	A C  	R(A), R(A+1), ..., R(A+C-2) = vararg		*/
 
 OP_PREPVARARG,/*A 	(adjust vararg parameters)			*/
 
-OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
+OP_EXTRAARG,/*	Ax	extra (larger) argument for previous opcode	*/
+
+/* quickened opcodes (see 'lvm.c'); never generated by the compiler */
+OP_ADDINT,/*	A B C	R(A) := R(B) + R(C)  (integers)	*/
+OP_SUBINT,/*	A B C	R(A) := R(B) - R(C)  (integers)	*/
+OP_MULINT,/*	A B C	R(A) := R(B) * R(C)  (integers)	*/
+OP_ADDFLT,/*	A B C	R(A) := R(B) + R(C)  (floats)	*/
+OP_SUBFLT,/*	A B C	R(A) := R(B) - R(C)  (floats)	*/
+OP_MULFLT,/*	A B C	R(A) := R(B) * R(C)  (floats)	*/
+OP_ADDIINT,/*	A B sC	R(A) := R(B) + C  (integer)	*/
+OP_LTINT,/*	A B	if ((R(A) <  R(B)) ~= k) then pc++  (integers)	*/
+OP_LEINT,/*	A B	if ((R(A) <= R(B)) ~= k) then pc++  (integers)	*/
+OP_GETARRAY/*	A B C	R(A) := R(B)[R(C)]  (array part)	*/
 } OpCode;
 
 
-#define NUM_OPCODES	(cast_int(OP_EXTRAARG) + 1)
+#define NUM_OPCODES	(cast_int(OP_GETARRAY) + 1)
+
+/* first quickened opcode */
+#define OP_FIRSTQUICK	OP_ADDINT
+
+#define isquickop(o)	((o) >= OP_FIRSTQUICK)
+
+/* generic opcode of a (possibly quickened) opcode */
+#define genericop(o)  \
+	(isquickop(o) ? cast(OpCode, luaP_genericop[(o) - OP_FIRSTQUICK]) : (o))
+
+#define GET_GENOPCODE(i)	genericop(GET_OPCODE(i))
 
 
 
@@ -321,6 +344,12 @@ OP_EXTRAARG/*	Ax	extra (larger) argument for previous opcode	*/
 
   (*) All 'skips' (pc++) assume that next instruction is a jump.
 
+  (*) A quickened opcode is a type-specialized variant of a generic one,
+  with the same arguments. The interpreter rewrites instructions into
+  their quickened forms while running, and back into the generic forms
+  when their type guards fail. Code outside the interpreter should use
+  'GET_GENOPCODE' to inspect instructions.
+
   (*) In instructions OP_RETURN/OP_TAILCALL, 'k' specifies that the
   function either builds upvalues, which may need to be closed, or is
   vararg, which must be corrected before returning. When 'k' is true,
@@ -358,6 +387,8 @@ LUAI_DDEC(const lu_byte luaP_opmodes[NUM_OPCODES];)
 #define opmode(ot,it,t,a,m) (((ot)<<6) | ((it)<<5) | ((t)<<4) | ((a)<<3) | (m))
 
 
+LUAI_DDEC(const lu_byte luaP_genericop[NUM_OPCODES - OP_FIRSTQUICK];)
+
 LUAI_DDEC(const char *const luaP_opnames[NUM_OPCODES+1];)  /* opcode names */
 
 
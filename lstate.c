@@ -115,9 +115,7 @@ void luaE_incCcalls (lua_State *L) {
 
 
 CallInfo *luaE_extendCI (lua_State *L) {
-  CallInfo *ci;
-  luaE_incCcalls(L);
-  ci = luaM_new(L, CallInfo);
+  CallInfo *ci = luaM_new(L, CallInfo);
   lua_assert(L->ci->next == NULL);
   L->ci->next = ci;
   ci->previous = L->ci;
@@ -135,13 +133,11 @@ void luaE_freeCI (lua_State *L) {
   CallInfo *ci = L->ci;
   CallInfo *next = ci->next;
   ci->next = NULL;
-  L->nCcalls -= L->nci;  /* to subtract removed elements from 'nCcalls' */
   while ((ci = next) != NULL) {
     next = ci->next;
     luaM_free(L, ci);
     L->nci--;
   }
-  L->nCcalls += L->nci;  /* to subtract removed elements from 'nCcalls' */
 }
 
 
@@ -151,7 +147,6 @@ void luaE_freeCI (lua_State *L) {
 void luaE_shrinkCI (lua_State *L) {
   CallInfo *ci = L->ci;
   CallInfo *next2;  /* next's next */
-  L->nCcalls -= L->nci;  /* to subtract removed elements from 'nCcalls' */
   /* while there are two nexts */
   while (ci->next != NULL && (next2 = ci->next->next) != NULL) {
     luaM_free(L, ci->next);  /* free next */
@@ -160,7 +155,6 @@ void luaE_shrinkCI (lua_State *L) {
     next2->previous = ci;
     ci = next2;  /* keep next's next */
   }
-  L->nCcalls += L->nci;  /* to subtract removed elements from 'nCcalls' */
 }
 
 
@@ -253,6 +247,10 @@ static void preinit_thread (lua_State *L, global_State *g) {
   L->nny = 1;
   L->status = LUA_OK;
   L->errfunc = 0;
+#if defined(LUA_USE_DIRTYTHREADS)
+  L->gcparked = 0;
+  L->gcepoch = 0;
+#endif
 }
 
 
@@ -342,6 +340,47 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
   g->gray = g->grayagain = NULL;
   g->weak = g->ephemeron = g->allweak = g->protogray = NULL;
   g->twups = NULL;
+#if defined(LUA_USE_PARALLELMARK)
+  g->gcmarkers = LUAI_GCMARKERS;
+  g->markers = NULL;
+#endif
+#if defined(LUA_USE_BGSWEEP)
+  g->sweeper = NULL;
+#endif
+#if defined(LUA_USE_GCBUDGET)
+  g->gcbudget = 0;
+  g->gcpremarked = 0;
+  g->gcpartial = NULL;
+  g->gcpartialpos = 0;
+#endif
+#if defined(LUA_USE_NURSERY)
+  g->nursery = NULL;
+#endif
+#if defined(LUA_USE_DIRTYTHREADS)
+  g->gcepoch = 1;
+#endif
+#if defined(LUA_USE_FINBATCH)
+  g->gcfinbudget = 0;
+  g->gcdeferfin = 0;
+#endif
+#if defined(LUA_USE_GCSTATS)
+  g->gcstatson = g->gcstatlevel = 0;
+  g->gcphase = LUA_GCPPROPAGATE;
+  g->gcphasestart = g->gcpausestart = g->gcphasetime = 0;
+  g->gccyclefreed = 0;
+  memset(&g->gcstats, 0, sizeof(g->gcstats));
+#endif
+#if defined(LUA_USE_EPHEMERONMAP)
+  g->ephmap = NULL;
+#endif
+#if defined(LUA_USE_FASTHASH)
+  g->hashmode = LUA_HASHSAMPLE;
+#endif
+#if defined(LUA_USE_SHAPES)
+  g->rootshape.parent = g->rootshape.child = g->rootshape.sibling = NULL;
+  g->rootshape.nref = 1;  /* never freed */
+  g->rootshape.nkeys = 0;
+#endif
   g->totalbytes = sizeof(LG);
   g->GCdebt = 0;
   setivalue(&g->nilvalue, 0);  /* to signal that state is not yet built */
@@ -356,6 +395,10 @@ LUA_API lua_State *lua_newstate (lua_Alloc f, void *ud) {
     close_state(L);
     L = NULL;
   }
+#if defined(LUA_USE_BGSWEEP)
+  else
+    luaC_startsweeper(L);
+#endif
   return L;
 }
 
@@ -125,6 +125,7 @@ typedef struct CallInfo {
 #define CIST_LEQ	(1<<6)  /* using __lt for __le */
 #define CIST_FIN	(1<<7)  /* call is running a finalizer */
 #define CIST_TRAN	(1<<8)	/* 'ci' has transfer information */
+#define CIST_FRESH	(1<<9)	/* call is running on a fresh 'luaV_execute' */
 
 /* active function is a Lua function */
 #define isLua(ci)	(!((ci)->callstatus & CIST_C))
@@ -185,6 +186,48 @@ typedef struct global_State {
   TString *tmname[TM_N];  /* array with tag-method names */
   struct Table *mt[LUA_NUMTAGS];  /* metatables for basic types */
   TString *strcache[STRCACHE_N][STRCACHE_M];  /* cache for strings in API */
+#if defined(LUA_USE_PARALLELMARK)
+  lu_byte gcmarkers;  /* number of threads marking in parallel */
+  struct GCMarkers *markers;  /* helper threads (see 'lgc.c') */
+#endif
+#if defined(LUA_USE_BGSWEEP)
+  struct Sweeper *sweeper;  /* thread freeing dead objects (see 'lgc.c') */
+#endif
+#if defined(LUA_USE_GCBUDGET)
+  unsigned int gcbudget;  /* time limit for a step, in microseconds */
+  lu_byte gcpremarked;  /* true if 'grayagain' was traversed early */
+  struct Table *gcpartial;  /* table being traversed in parts */
+  unsigned int gcpartialpos;  /* next slot to traverse in 'gcpartial' */
+#endif
+#if defined(LUA_USE_NURSERY)
+  struct Nursery *nursery;  /* arenas for young objects (see 'lgc.c') */
+#endif
+#if defined(LUA_USE_DIRTYTHREADS)
+  unsigned int gcepoch;  /* number of the current marking (see 'lgc.c') */
+#endif
+#if defined(LUA_USE_FINBATCH)
+  unsigned int gcfinbudget;  /* time for finalizers in a step, in us */
+  lu_byte gcdeferfin;  /* true if finalizers wait for 'luaC_runfinalizers' */
+#endif
+#if defined(LUA_USE_GCSTATS)
+  lu_byte gcstatson;  /* true if collecting statistics */
+  lu_byte gcstatlevel;  /* nesting of calls to the collector being timed */
+  lu_byte gcphase;  /* phase being timed */
+  l_mem gcphasestart;  /* when the timing of 'gcphase' started */
+  l_mem gcpausestart;  /* when the current pause started */
+  l_mem gcphasetime;  /* time in 'gcphase' in the current pause */
+  l_mem gccyclefreed;  /* bytes freed in the current collection */
+  lua_GCStats gcstats;
+#endif
+#if defined(LUA_USE_EPHEMERONMAP)
+  struct EphMap *ephmap;  /* pending ephemeron entries (see 'lgc.c') */
+#endif
+#if defined(LUA_USE_FASTHASH)
+  lu_byte hashmode;  /* how long strings are hashed (see 'lua_hashmode') */
+#endif
+#if defined(LUA_USE_SHAPES)
+  Shape rootshape;  /* shape without keys (root of all transitions) */
+#endif
 } global_State;
 
 
@@ -215,6 +258,10 @@ struct lua_State {
   unsigned short nCcalls;  /* number of nested C calls */
   l_signalT hookmask;
   lu_byte allowhook;
+#if defined(LUA_USE_DIRTYTHREADS)
+  lu_byte gcparked;  /* true if suspended and not run since then */
+  unsigned int gcepoch;  /* marking in which it was traversed parked */
+#endif
 };
 
 
@@ -259,6 +306,17 @@ union GCUnion {
 #define obj2gco(v)	check_exp((v)->tt >= LUA_TSTRING, &(cast_u(v)->gc))
 
 
+/*
+** thread 'L' is running code or having its frames changed by the debug
+** API, so it is not parked anymore (see 'lgc.c')
+*/
+#if defined(LUA_USE_DIRTYTHREADS)
+#define luaE_setdirty(L)	((L)->gcparked = 0)
+#else
+#define luaE_setdirty(L)	((void)0)
+#endif
+
+
 /* actual number of total bytes allocated */
 #define gettotalbytes(g)	cast(lu_mem, (g)->totalbytes + (g)->GCdebt)
 
@@ -10,6 +10,8 @@
 #include "lprefix.h"
 
 
+#include <limits.h>
+#include <stddef.h>
 #include <string.h>
 
 #include "lua.h"
@@ -24,7 +26,8 @@
 
 /*
 ** Lua will use at most ~(2^LUAI_HASHLIMIT) bytes from a string to
-** compute its hash
+** compute its hash. (With LUA_USE_FASTHASH, it uses all bytes of short
+** strings and, by default, ~(2^LUAI_HASHLIMIT) words of long ones.)
 */
 #if !defined(LUAI_HASHLIMIT)
 #define LUAI_HASHLIMIT		5
@@ -44,12 +47,154 @@
 int luaS_eqlngstr (TString *a, TString *b) {
   size_t len = a->u.lnglen;
   lua_assert(a->tt == LUA_TLNGSTR && b->tt == LUA_TLNGSTR);
+#if defined(LUA_USE_APPENDSTR)
+  if (isextstr(a) && isextstr(b) &&
+      extbuf(a) == extbuf(b) && extoff(a) == extoff(b))
+    return (len == b->u.lnglen);  /* starting at the same byte */
+#endif
   return (a == b) ||  /* same instance or... */
     ((len == b->u.lnglen) &&  /* equal length and ... */
      (memcmp(getstr(a), getstr(b), len) == 0));  /* equal contents */
 }
 
 
+#if defined(LUA_USE_FASTHASH)  /* { */
+
+/* an integer type with at least 64 bits (see 'luaconf.h') */
+#if (LONG_MAX >> 31 >> 31) >= 1
+#define HashWord	unsigned long
+#else
+#define HashWord	unsigned long long
+#endif
+
+/*
+** Hash reading eight bytes at a time, in two independent lanes, each
+** one keyed by the seed. Each word goes into its lane by a xor and an
+** odd multiplication, and a shift folds the high bits of the product
+** back into the low ones, so that the result depends on the seed in a
+** nonlinear way. (The value of a word depends on the byte order of the
+** machine, but all hashes of a state are computed the same way.)
+*/
+
+#define HK0	0x9e3779b97f4a7c15u
+#define HK1	0xbf58476d1ce4e5b9u
+#define HK2	0x94d049bb133111ebu
+
+/* mix word 'w' into lane 'h' using constant 'k' */
+#define hashmix(h,w,k)	((h) = ((h) ^ (w)) * (k), (h) ^= (h) >> 32)
+
+/* read the eight bytes at 'p' as a word */
+static HashWord loadword (const char *p) {
+  HashWord w = 0;
+  memcpy(&w, p, 8);
+  return w;
+}
+
+
+static unsigned int hashfinish (HashWord a, HashWord b) {
+  HashWord h = a ^ (b << 23) ^ (b >> 41);
+  hashmix(h, 0, HK0);
+  hashmix(h, 0, HK1);
+  return cast_uint(h & 0xffffffffu);
+}
+
+
+unsigned int luaS_hash (const char *str, size_t l, unsigned int seed) {
+  HashWord a = (seed ^ HK0) * HK1;
+  HashWord b = ((seed ^ HK1) * HK2) ^ l;
+  for (; l >= 16; str += 16, l -= 16) {
+    hashmix(a, loadword(str), HK2);
+    hashmix(b, loadword(str + 8), HK0);
+  }
+  if (l >= 8) {
+    hashmix(a, loadword(str), HK2);
+    str += 8; l -= 8;
+  }
+  if (l > 0) {  /* last bytes? */
+    HashWord w = 0;
+    memcpy(&w, str, l);
+    hashmix(b, w, HK0);
+  }
+  return hashfinish(a, b);
+}
+
+
+/*
+** Hash of a long string computed from a sample of its bytes: about
+** 2^LUAI_HASHLIMIT words spread over it, plus its last word and its
+** length.
+*/
+static unsigned int hashsample (const char *str, size_t l,
+                                unsigned int seed) {
+  size_t step = l >> LUAI_HASHLIMIT;
+  size_t i;
+  HashWord a, b;
+  if (step < 16)  /* short enough? */
+    return luaS_hash(str, l, seed);  /* hash all its bytes */
+  a = (seed ^ HK0) * HK1;
+  b = ((seed ^ HK1) * HK2) ^ l;
+  for (i = 0; i < l - 8; i += step)
+    hashmix(a, loadword(str + i), HK2);
+  hashmix(b, loadword(str + l - 8), HK0);
+  return hashfinish(a, b);
+}
+
+
+/*
+** A long string keeps in 'extra' whether it has its hash (LNGHASHED)
+** and, while it has not, whether that hash will use all its bytes
+** (LNGHASHALL) or a sample of them (LNGHASHSAMPLE). The mode of new
+** strings comes from 'g->hashmode'.
+*/
+#define LNGHASHSAMPLE	0
+#define LNGHASHED	1
+#define LNGHASHALL	2
+
+#define lngextra(g)  \
+	cast_byte((g)->hashmode == LUA_HASHALL ? LNGHASHALL : LNGHASHSAMPLE)
+
+
+unsigned int luaS_hashlongstr (TString *ts) {
+  lua_assert(ts->tt == LUA_TLNGSTR);
+  if (ts->extra != LNGHASHED) {  /* no hash? */
+    size_t l = ts->u.lnglen;
+    ts->hash = (ts->extra == LNGHASHALL)
+             ? luaS_hash(getstr(ts), l, ts->hash)
+             : hashsample(getstr(ts), l, ts->hash);
+    ts->extra = LNGHASHED;  /* now it has its hash */
+  }
+  return ts->hash;
+}
+
+
+/*
+** Change how long strings are hashed. The hashes of the strings that
+** are keys in tables cannot change, so that it is an error to change
+** the mode after some live long string has its hash.
+*/
+int luaS_hashmode (lua_State *L, int mode) {
+  global_State *g = G(L);
+  int old = g->hashmode;
+  GCObject *o;
+  if (mode == old)
+    return old;
+  luaC_fullgc(L, 0);  /* remove dead strings */
+  for (o = g->allgc; o != NULL; o = o->next) {
+    if (o->tt == LUA_TLNGSTR && gco2ts(o)->extra == LNGHASHED)
+      return -1;  /* cannot change mode */
+  }
+  g->hashmode = cast_byte(mode);
+  for (o = g->allgc; o != NULL; o = o->next) {
+    if (o->tt == LUA_TLNGSTR)
+      gco2ts(o)->extra = lngextra(g);
+  }
+  return old;
+}
+
+#else  /* }{ */
+
+#define lngextra(g)	0  /* 'extra' of a long string without its hash */
+
 unsigned int luaS_hash (const char *str, size_t l, unsigned int seed) {
   unsigned int h = seed ^ cast_uint(l);
   size_t step = (l >> LUAI_HASHLIMIT) + 1;
@@ -68,6 +213,8 @@ unsigned int luaS_hashlongstr (TString *ts) {
   return ts->hash;
 }
 
+#endif  /* } */
+
 
 static void tablerehash (TString **vect, int osize, int nsize) {
   int i;
@@ -159,6 +306,9 @@ static TString *createstrobj (lua_State *L, size_t l, int tag, unsigned int h) {
   ts = gco2ts(o);
   ts->hash = h;
   ts->extra = 0;
+#if defined(LUA_USE_APPENDSTR)
+  ts->shrlen = 0;  /* not in a buffer (short strings set it later) */
+#endif
   getstr(ts)[l] = '\0';  /* ending 0 */
   return ts;
 }
@@ -167,10 +317,241 @@ static TString *createstrobj (lua_State *L, size_t l, int tag, unsigned int h) {
 TString *luaS_createlngstrobj (lua_State *L, size_t l) {
   TString *ts = createstrobj(L, l, LUA_TLNGSTR, G(L)->seed);
   ts->u.lnglen = l;
+#if defined(LUA_USE_FASTHASH)
+  ts->extra = lngextra(G(L));  /* how its hash will be computed */
+#endif
+  return ts;
+}
+
+
+#if defined(LUA_USE_APPENDSTR)
+
+/*
+** Appending to a long string copies it, so that a loop accumulating a
+** string with 's = s .. x' takes quadratic time. Instead, a long
+** concatenation whose first operand is a long string keeps its result
+** in a 'StrBuf', a buffer that other strings may share: each string in
+** a buffer is a prefix of its bytes. When the first operand is the
+** longest string in its buffer ('used') and the buffer has room for
+** the result, the new bytes go right after it and the result shares
+** the buffer; otherwise the result gets a new buffer, twice its size
+** when the first operand was already in a buffer, so that repeated
+** appends take amortized linear time.
+**
+** As a string in a buffer may be followed by the bytes of a longer
+** string, it may not end with a '\0'. Places that need that ending
+** call 'luaS_terminate', which gives the string a buffer of its own
+** ('luaS_detach'). Strings in buffers are always long strings, and
+** each one holds a reference to its buffer.
+**
+** A library may also hold a buffer and write into it (see
+** 'lua_resizestrbuf'), handing prefixes of its bytes out as strings
+** without copying them. While it holds the buffer, no string grows in
+** it, and the library writes only after the longest string handed out.
+**
+** With LUA_USE_STRVIEWS, long strings pushed by the API keep their
+** bytes in buffers when they are large, and a large slice of a string
+** in a buffer ('luaS_sub') is a view into it, with its own offset
+** ('extoff'). The buffer lives while any of its strings does. A view
+** used as a new table key gets its own bytes ('luaS_terminate'), so
+** that keys do not keep large buffers alive. (A view ending with a '\0'
+** keeps sharing them, as C code may hold a pointer to its bytes.)
+*/
+
+#define sizestrbuf(n)	(offsetof(StrBuf, data) + ((n) + 1) * sizeof(char))
+
+
+static StrBuf *newstrbuf (lua_State *L, size_t size) {
+  StrBuf *buf;
+  if (unlikely(size >= MAX_SIZE - sizeof(StrBuf)))
+    luaM_toobig(L);
+  buf = cast(StrBuf *, luaM_malloc_(L, sizestrbuf(size), 0));
+  buf->size = size;
+  buf->used = 0;
+  buf->nref = 0;
+  buf->held = 0;
+  return buf;
+}
+
+
+static void releasestrbuf (lua_State *L, StrBuf *buf) {
+  if (buf != NULL && --buf->nref == 0)
+    luaM_freemem(L, buf, sizestrbuf(buf->size));
+}
+
+
+/*
+** Create a string of length 'l' in a buffer, still without the buffer.
+*/
+static TString *newextstr (lua_State *L, size_t l) {
+  GCObject *o = luaC_newobj(L, LUA_TLNGSTR, sizeextstr);
+  TString *ts = gco2ts(o);
+  ts->hash = G(L)->seed;
+  ts->extra = lngextra(G(L));
+  ts->shrlen = EXTSTR;
+  ts->u.lnglen = l;
+  extbuf(ts) = NULL;
+#if defined(LUA_USE_STRVIEWS)
+  extoff(ts) = 0;
+#endif
+  return ts;
+}
+
+
+/*
+** Create a string of length 'l' whose first bytes are those of long
+** string 'a'; the caller fills the other ones. The string goes to the
+** top of the stack while its buffer is allocated, so there must be
+** room for it there.
+*/
+TString *luaS_append (lua_State *L, TString *a, size_t l) {
+  size_t la = a->u.lnglen;
+  StrBuf *buf = isextstr(a) ? extbuf(a) : NULL;
+  size_t off = (buf != NULL) ? extoff(a) : 0;
+  TString *ts;
+  lua_assert(a->tt == LUA_TLNGSTR && la < l);
+  ts = newextstr(L, l);
+  if (buf == NULL || buf->held || buf->used != off + la ||
+      buf->size - off < l) {
+    size_t size = (buf != NULL && l <= MAX_SIZE / 4) ? l * 2 : l;
+    setsvalue2s(L, L->top, ts);  /* anchor new string */
+    L->top++;
+    buf = newstrbuf(L, size);
+    L->top--;
+    memcpy(buf->data, getstr(a), la * sizeof(char));
+    off = 0;
+  }
+  buf->used = off + l;
+  buf->data[off + l] = '\0';  /* ending 0 */
+  buf->nref++;
+  extbuf(ts) = buf;
+#if defined(LUA_USE_STRVIEWS)
+  extoff(ts) = off;
+#endif
   return ts;
 }
 
 
+/*
+** Give string 'ts' a buffer of its own, ending with a '\0'.
+*/
+void luaS_detach (lua_State *L, TString *ts) {
+  size_t l = ts->u.lnglen;
+  StrBuf *buf = newstrbuf(L, l);
+  lua_assert(isextstr(ts));
+  memcpy(buf->data, getstr(ts), l * sizeof(char));
+  buf->data[l] = '\0';
+  buf->used = l;
+  buf->nref = 1;
+  releasestrbuf(L, extbuf(ts));
+  extbuf(ts) = buf;
+#if defined(LUA_USE_STRVIEWS)
+  extoff(ts) = 0;
+#endif
+}
+
+
+/*
+** Make '*pb' a held buffer with room for 'size' bytes whose first 'len'
+** bytes are those of the old one. The old buffer stays if it is large
+** enough and no string handed out from it goes beyond 'len'.
+*/
+char *luaS_resizestrbuf (lua_State *L, StrBuf **pb, size_t len,
+                                          size_t size) {
+  StrBuf *buf = *pb;
+  lua_assert(len <= size);
+  if (buf == NULL || buf->size < size || len < buf->used) {
+    StrBuf *nb = newstrbuf(L, size);
+    nb->nref = 1;  /* the holder */
+    nb->held = 1;
+    if (buf != NULL) {
+      memcpy(nb->data, buf->data, len * sizeof(char));
+      luaS_freestrbuf(L, buf);
+    }
+    *pb = buf = nb;
+  }
+  return buf->data;
+}
+
+
+/*
+** Create a string with the first 'l' bytes of held buffer 'buf'.
+*/
+TString *luaS_newstrbuf (lua_State *L, StrBuf *buf, size_t l) {
+  TString *ts;
+  lua_assert(buf->held && l <= buf->size);
+  if (l <= LUAI_MAXSHORTLEN)  /* short strings are always internalized */
+    return luaS_newlstr(L, buf->data, l);
+  ts = newextstr(L, l);
+  if (buf->used < l)
+    buf->used = l;
+  buf->nref++;
+  extbuf(ts) = buf;
+  return ts;
+}
+
+
+/*
+** Release held buffer 'buf'. Strings still in it may grow there now.
+*/
+void luaS_freestrbuf (lua_State *L, StrBuf *buf) {
+  lua_assert(buf->held);
+  buf->held = 0;
+  releasestrbuf(L, buf);
+}
+
+
+void luaS_freeextstr (lua_State *L, TString *ts) {
+  releasestrbuf(L, extbuf(ts));
+  luaM_freemem(L, ts, sizeextstr);
+}
+
+
+#if defined(LUA_USE_STRVIEWS)
+
+/*
+** Create a long string with the 'l' bytes at 'str' in a buffer of its
+** own, so that its large slices can share them. As in 'luaS_append',
+** there must be room at the top of the stack for the new string.
+*/
+TString *luaS_newextlstr (lua_State *L, const char *str, size_t l) {
+  TString *ts = newextstr(L, l);
+  StrBuf *buf;
+  setsvalue2s(L, L->top, ts);  /* anchor new string */
+  L->top++;
+  buf = newstrbuf(L, l);
+  L->top--;
+  memcpy(buf->data, str, l * sizeof(char));
+  buf->data[l] = '\0';  /* ending 0 */
+  buf->used = l;
+  buf->nref = 1;
+  extbuf(ts) = buf;
+  return ts;
+}
+
+
+/*
+** Create a string with the 'l' bytes of string 'ts' starting at
+** position 'i'. A large slice of a string in a buffer is a view: it
+** shares the buffer, starting at its own offset.
+*/
+TString *luaS_sub (lua_State *L, TString *ts, size_t i, size_t l) {
+  TString *view;
+  lua_assert(i + l <= tsslen(ts));
+  if (l < LUAI_MINVIEW || !isextstr(ts))
+    return luaS_newlstr(L, getstr(ts) + i, l);
+  view = newextstr(L, l);
+  extbuf(view) = extbuf(ts);
+  extoff(view) = extoff(ts) + i;
+  extbuf(view)->nref++;
+  return view;
+}
+
+#endif
+
+#endif
+
+
 void luaS_remove (lua_State *L, TString *ts) {
   stringtable *tb = &G(L)->strt;
   TString **p = &tb->hash[lmod(ts->hash, tb->size)];
@@ -37,8 +37,59 @@
 #define eqshrstr(a,b)	check_exp((a)->tt == LUA_TSHRSTR, (a) == (b))
 
 
+#if defined(LUA_USE_APPENDSTR)
+
+/*
+** Concatenations with results at least this long keep them in
+** buffers that can grow (see 'lstring.c')
+*/
+#if !defined(LUAI_MINAPPEND)
+#define LUAI_MINAPPEND	256
+#endif
+
+#define sizeextstr	(sizeof(union UTString) + sizeof(ExtStr))
+
+/* ensures that the bytes of string 'ts' end with a '\0' */
+#define luaS_terminate(L,ts)  \
+	(getstr(ts)[tsslen(ts)] != '\0' ? luaS_detach(L, ts) : cast_void(0))
+
+LUAI_FUNC TString *luaS_append (lua_State *L, TString *a, size_t l);
+LUAI_FUNC void luaS_detach (lua_State *L, TString *ts);
+LUAI_FUNC void luaS_freeextstr (lua_State *L, TString *ts);
+LUAI_FUNC char *luaS_resizestrbuf (lua_State *L, StrBuf **pb, size_t len,
+                                                    size_t size);
+LUAI_FUNC TString *luaS_newstrbuf (lua_State *L, StrBuf *buf, size_t l);
+LUAI_FUNC void luaS_freestrbuf (lua_State *L, StrBuf *buf);
+
+#if defined(LUA_USE_STRVIEWS)
+
+/*
+** Long strings at least this long keep their bytes in buffers, and
+** slices at least this long share them (see 'lstring.c')
+*/
+#if !defined(LUAI_MINVIEW)
+#define LUAI_MINVIEW	1024
+#endif
+
+LUAI_FUNC TString *luaS_newextlstr (lua_State *L, const char *str,
+                                                  size_t l);
+LUAI_FUNC TString *luaS_sub (lua_State *L, TString *ts, size_t i,
+                                           size_t l);
+
+#endif
+
+#else
+
+#define luaS_terminate(L,ts)	cast_void(0)
+
+#endif
+
+
 LUAI_FUNC unsigned int luaS_hash (const char *str, size_t l, unsigned int seed);
 LUAI_FUNC unsigned int luaS_hashlongstr (TString *ts);
+#if defined(LUA_USE_FASTHASH)
+LUAI_FUNC int luaS_hashmode (lua_State *L, int mode);
+#endif
 LUAI_FUNC int luaS_eqlngstr (TString *a, TString *b);
 LUAI_FUNC void luaS_resize (lua_State *L, int newsize);
 LUAI_FUNC void luaS_clearcache (global_State *g);
@@ -50,11 +50,36 @@
 	(sizeof(size_t) < sizeof(int) ? MAX_SIZET : (size_t)(INT_MAX))
 
 
+#if defined(LUA_USE_STRVIEWS)
+
+/*
+** Get the bytes of string argument 'arg' without ensuring that they
+** end with a '\0' (see 'lua_tobytes'), so that a view is not copied.
+** They are valid only until other code converts the string; after
+** that, the function may use only positions in it.
+*/
+static const char *checkbytes (lua_State *L, int arg, size_t *l) {
+  const char *s = lua_tobytes(L, arg, l);
+  if (s == NULL)
+    luaL_checklstring(L, arg, l);  /* raise the error */
+  return s;
+}
+
+/* push the 'l' bytes at 's' of the string at 'idx', whose bytes are 'b' */
+#define pushslice(L,idx,b,s,l)	lua_pushsubstring(L, idx, (s) - (b), l)
+
+#else
+
+#define checkbytes(L,arg,l)	luaL_checklstring(L, arg, l)
+#define pushslice(L,idx,b,s,l)	lua_pushlstring(L, s, l)
+
+#endif
+
 
 
 static int str_len (lua_State *L) {
   size_t l;
-  luaL_checklstring(L, 1, &l);
+  checkbytes(L, 1, &l);
   lua_pushinteger(L, (lua_Integer)l);
   return 1;
 }
@@ -70,13 +95,13 @@ static lua_Integer posrelat (lua_Integer pos, size_t len) {
 
 static int str_sub (lua_State *L) {
   size_t l;
-  const char *s = luaL_checklstring(L, 1, &l);
+  const char *s = checkbytes(L, 1, &l);
   lua_Integer start = posrelat(luaL_checkinteger(L, 2), l);
   lua_Integer end = posrelat(luaL_optinteger(L, 3, -1), l);
   if (start < 1) start = 1;
   if (end > (lua_Integer)l) end = l;
   if (start <= end)
-    lua_pushlstring(L, s + start - 1, (size_t)(end - start) + 1);
+    pushslice(L, 1, s, s + start - 1, (size_t)(end - start) + 1);
   else lua_pushliteral(L, "");
   return 1;
 }
@@ -148,7 +173,7 @@ static int str_rep (lua_State *L) {
 
 static int str_byte (lua_State *L) {
   size_t l;
-  const char *s = luaL_checklstring(L, 1, &l);
+  const char *s = checkbytes(L, 1, &l);
   lua_Integer posi = posrelat(luaL_optinteger(L, 2, 1), l);
   lua_Integer pose = posrelat(luaL_optinteger(L, 3, posi), l);
   int n, i;
@@ -298,13 +323,22 @@ static const luaL_Reg stringmetamethods[] = {
 #define CAP_POSITION	(-2)
 
 
+#if defined(LUA_USE_PATCACHE)
+struct CPattern;
+#endif
+
+
 typedef struct MatchState {
   const char *src_init;  /* init of source string */
-  const char *src_end;  /* end ('\0') of source string */
+  const char *src_end;  /* end of source string */
   const char *p_end;  /* end ('\0') of pattern */
   lua_State *L;
+  int src_idx;  /* stack index of source string */
   int matchdepth;  /* control for recursive depth (to avoid C stack overflow) */
   unsigned char level;  /* total number of captures (finished or unfinished) */
+#if defined(LUA_USE_PATCACHE)
+  const struct CPattern *cp;  /* compiled pattern, if any */
+#endif
   struct {
     const char *init;
     ptrdiff_t len;
@@ -409,19 +443,23 @@ static int matchbracketclass (int c, const char *p, const char *ec) {
 }
 
 
+/* check whether char 'c' matches the single-char class 'p'-'ep' */
+static int matchitem (int c, const char *p, const char *ep) {
+  switch (*p) {
+    case '.': return 1;  /* matches any char */
+    case L_ESC: return match_class(c, uchar(*(p+1)));
+    case '[': return matchbracketclass(c, p, ep-1);
+    default:  return (uchar(*p) == c);
+  }
+}
+
+
 static int singlematch (MatchState *ms, const char *s, const char *p,
                         const char *ep) {
   if (s >= ms->src_end)
     return 0;
-  else {
-    int c = uchar(*s);
-    switch (*p) {
-      case '.': return 1;  /* matches any char */
-      case L_ESC: return match_class(c, uchar(*(p+1)));
-      case '[': return matchbracketclass(c, p, ep-1);
-      default:  return (uchar(*p) == c);
-    }
-  }
+  else
+    return matchitem(uchar(*s), p, ep);
 }
 
 
@@ -549,7 +587,8 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
             ep = classend(ms, p);  /* points to what is next */
             previous = (s == ms->src_init) ? '\0' : *(s - 1);
             if (!matchbracketclass(uchar(previous), p, ep - 1) &&
-               matchbracketclass(uchar(*s), p, ep - 1)) {
+               matchbracketclass((s < ms->src_end) ? uchar(*s) : 0,
+                                 p, ep - 1)) {
               p = ep; goto init;  /* return match(ms, s, ep); */
             }
             s = NULL;  /* match failed */
@@ -612,6 +651,531 @@ static const char *match (MatchState *ms, const char *s, const char *p) {
 
 
 
+#if defined(LUA_USE_PATCACHE)	/* { */
+
+/*
+** {======================================================
+** COMPILED PATTERNS
+** =======================================================
+*/
+
+/*
+** A pattern is compiled once into a sequence of items, with the class
+** of each single-char item as a bitmap, and the compiled pattern goes
+** to a cache of the most recently used ones, kept in an upvalue shared
+** by the functions of the library. 'cmatch' follows 'match' step by
+** step, so that it gives the same results and the same errors; a
+** pattern that 'match' would find malformed is not compiled, and
+** 'match' runs over its text as before. When a match must start with
+** some literal chars, loops look for them with 'memchr' and 'memcmp'
+** instead of trying a match at each position.
+*/
+
+/* maximum number of compiled patterns in the cache */
+#if !defined(LUAI_PATCACHE)
+#define LUAI_PATCACHE	32
+#endif
+
+/* maximum length of the literal prefix of a compiled pattern */
+#define MAXPREFIX	16
+
+/* maximum length of a pattern to be compiled */
+#define MAXCOMPILE	1000
+
+/* kinds of items */
+#define PI_END		0	/* end of pattern */
+#define PI_SINGLE	1	/* single-char class with optional suffix */
+#define PI_OPEN		2	/* start capture */
+#define PI_POSITION	3	/* position capture */
+#define PI_CLOSE	4	/* end capture */
+#define PI_EOS		5	/* '$' at the end of the pattern */
+#define PI_BALANCE	6	/* '%bxy' */
+#define PI_FRONTIER	7	/* '%f[set]' */
+#define PI_BACKREF	8	/* '%0'-'%9' */
+
+typedef struct PItem {
+  unsigned char kind;
+  unsigned char rep;  /* suffix of a single: '*', '+', '-', '?' or 0 */
+  unsigned char x, y;  /* chars of '%b'; digit of a back reference */
+  unsigned char set[32];  /* bitmap of the class of a single or frontier */
+} PItem;
+
+#define inset(pi,c)	((pi)->set[(c) >> 3] & (1u << ((c) & 7)))
+
+typedef struct CPattern {
+  char locale[32];  /* ctype locale of the classes ("" if none used) */
+  int anchor;  /* true if pattern starts with '^' */
+  size_t nprefix;  /* number of literal chars every match starts with */
+  char prefix[MAXPREFIX];
+  PItem item[1];  /* items, ending with a PI_END */
+} CPattern;
+
+typedef struct PatCache {
+  unsigned int clock;  /* counts uses of the cache */
+  struct {
+    const char *p;  /* pattern (kept alive in the user value) */
+    size_t lp;
+    CPattern *cp;  /* compiled pattern (kept alive in the user value) */
+    unsigned int used;  /* 'clock' at the last use of the entry */
+  } e[LUAI_PATCACHE];
+} PatCache;
+
+
+/* like 'classend', but returns NULL for a malformed class */
+static const char *cclassend (const char *p, const char *p_end) {
+  switch (*p++) {
+    case L_ESC: {
+      return (p == p_end) ? NULL : p+1;
+    }
+    case '[': {
+      if (*p == '^') p++;
+      do {  /* look for a ']' */
+        if (p == p_end)
+          return NULL;
+        if (*(p++) == L_ESC && p < p_end)
+          p++;  /* skip escapes (e.g. '%]') */
+      } while (*p != ']');
+      return p+1;
+    }
+    default: {
+      return p;
+    }
+  }
+}
+
+
+/*
+** Fill the bitmap of item 'pi' with the chars matched by class 'p'-'ep'.
+** Returns true if the class depends on the ctype locale.
+*/
+static int compileset (PItem *pi, const char *p, const char *ep) {
+  int c;
+  const char *q;
+  memset(pi->set, 0, sizeof(pi->set));
+  if (ep - p == 1 && *p != '.') {  /* a plain char? */
+    c = uchar(*p);
+    pi->set[c >> 3] = uchar(1u << (c & 7));
+    return 0;
+  }
+  for (c = 0; c <= UCHAR_MAX; c++) {
+    if (matchitem(c, p, ep))
+      pi->set[c >> 3] |= uchar(1u << (c & 7));
+  }
+  for (q = p; q < ep - 1; q++) {  /* look for letter classes */
+    if (*q == L_ESC) {
+      if (isalpha(uchar(*(q + 1))) && tolower(uchar(*(q + 1))) != 'z')
+        return 1;
+      q++;  /* skip escaped char */
+    }
+  }
+  return 0;
+}
+
+
+/*
+** Compile pattern 'p' (with length 'lp') into 'cp', which has room for
+** 'lp' + 1 items. Returns 0 if some item would raise an error in
+** 'match', leaving that pattern to it. Captures are checked here as
+** 'match' checks them when it reaches each item, as the captures open
+** before an item do not depend on the subject.
+*/
+static int compile (CPattern *cp, const char *p, size_t lp) {
+  const char *p_end = p + lp;
+  PItem *pi = cp->item;
+  int usesctype = 0;
+  int ncap = 0;  /* number of captures opened so far */
+  char closed[LUA_MAXCAPTURES];  /* whether each capture was closed */
+  cp->anchor = (*p == '^');
+  if (cp->anchor) p++;
+  for (; p < p_end; pi++) {
+    pi->rep = 0;
+    switch (*p) {
+      case '(': {
+        if (ncap >= LUA_MAXCAPTURES) return 0;  /* too many captures */
+        if (p + 1 < p_end && *(p + 1) == ')') {
+          pi->kind = PI_POSITION;
+          closed[ncap++] = 1;
+          p += 2;
+        }
+        else {
+          pi->kind = PI_OPEN;
+          closed[ncap++] = 0;
+          p++;
+        }
+        continue;
+      }
+      case ')': {
+        int l = ncap - 1;
+        while (l >= 0 && closed[l]) l--;  /* capture to close */
+        if (l < 0) return 0;  /* invalid pattern capture */
+        closed[l] = 1;
+        pi->kind = PI_CLOSE;
+        p++;
+        continue;
+      }
+      case '$': {
+        if (p + 1 == p_end) {
+          pi->kind = PI_EOS;
+          p++;
+          continue;
+        }
+        break;  /* else a single char */
+      }
+      case L_ESC: {
+        if (p + 1 == p_end) return 0;  /* ends with '%' */
+        switch (*(p + 1)) {
+          case 'b': {
+            if (p + 2 >= p_end - 1) return 0;  /* missing arguments */
+            pi->kind = PI_BALANCE;
+            pi->x = uchar(*(p + 2));
+            pi->y = uchar(*(p + 3));
+            p += 4;
+            continue;
+          }
+          case 'f': {
+            const char *ep;
+            p += 2;
+            if (p == p_end || *p != '[' ||
+                (ep = cclassend(p, p_end)) == NULL)
+              return 0;  /* malformed frontier */
+            pi->kind = PI_FRONTIER;
+            usesctype |= compileset(pi, p, ep);
+            p = ep;
+            continue;
+          }
+          case '0': case '1': case '2': case '3':
+          case '4': case '5': case '6': case '7':
+          case '8': case '9': {
+            int l = *(p + 1) - '1';
+            if (l < 0 || l >= ncap || !closed[l])
+              return 0;  /* invalid capture index */
+            pi->kind = PI_BACKREF;
+            pi->x = uchar(*(p + 1));
+            p += 2;
+            continue;
+          }
+          default: break;  /* a single char class */
+        }
+        break;
+      }
+      default: break;
+    }
+    {  /* single char class plus optional suffix */
+      const char *ep = cclassend(p, p_end);
+      if (ep == NULL) return 0;  /* malformed class */
+      pi->kind = PI_SINGLE;
+      usesctype |= compileset(pi, p, ep);
+      if (ep < p_end && strchr("*+-?", *ep) != NULL)
+        pi->rep = uchar(*ep++);
+      p = ep;
+    }
+  }
+  pi->kind = PI_END;
+  if (usesctype) {
+    const char *locale = setlocale(LC_CTYPE, NULL);
+    strncpy(cp->locale, (locale != NULL) ? locale : "?",
+                        sizeof(cp->locale) - 1);
+  }
+  return 1;
+}
+
+
+/* Collect the literal chars that every match of 'cp' starts with. */
+static void findprefix (CPattern *cp) {
+  const PItem *pi;
+  cp->nprefix = 0;
+  for (pi = cp->item; cp->nprefix < MAXPREFIX; pi++) {
+    if (pi->kind == PI_OPEN || pi->kind == PI_POSITION)
+      continue;  /* captures do not consume chars */
+    else if (pi->kind == PI_SINGLE && (pi->rep == 0 || pi->rep == '+')) {
+      int c, lit = -1;
+      for (c = 0; c <= UCHAR_MAX; c++) {
+        if (inset(pi, c)) {
+          if (lit >= 0) return;  /* more than one char */
+          lit = c;
+        }
+      }
+      if (lit < 0) return;  /* empty class */
+      cp->prefix[cp->nprefix++] = (char)lit;
+      if (pi->rep == '+') return;  /* other chars may repeat this one */
+    }
+    else return;
+  }
+}
+
+
+/* check whether the ctype locale is still 'locale' */
+static int samelocale (const char *locale) {
+  const char *current = setlocale(LC_CTYPE, NULL);
+  return (current != NULL &&
+          strncmp(locale, current, sizeof(((CPattern *)0)->locale) - 1) == 0);
+}
+
+
+/*
+** Get the compiled form of the pattern at index 'arg' from the cache,
+** compiling it if needed; NULL if it cannot be compiled. If 'push' is
+** true, the compiled pattern (or nil) also goes to the stack, so that
+** it stays alive even if the cache drops it.
+*/
+static const CPattern *getpattern (lua_State *L, int arg, int push) {
+  PatCache *pc = (PatCache *)lua_touserdata(L, lua_upvalueindex(1));
+  size_t lp;
+  const char *p = lua_tolstring(L, arg, &lp);
+  CPattern *cp;
+  int i, old = 0;
+  if (pc == NULL || lp > MAXCOMPILE) {  /* no cache or pattern too long? */
+    if (push) lua_pushnil(L);
+    return NULL;
+  }
+  if (++pc->clock == 0) {  /* clock wrapped around? */
+    for (i = 0; i < LUAI_PATCACHE; i++)
+      pc->e[i].used = 0;
+    pc->clock = 1;
+  }
+  for (i = 0; i < LUAI_PATCACHE; i++) {
+    if (pc->e[i].p != NULL && pc->e[i].lp == lp &&
+        (pc->e[i].p == p || memcmp(pc->e[i].p, p, lp) == 0)) {
+      cp = pc->e[i].cp;
+      if (cp->locale[0] != '\0' &&  /* uses ctype classes? */
+          !samelocale(cp->locale)) {
+        old = i;  /* locale changed; compile it again */
+        break;
+      }
+      pc->e[i].used = pc->clock;
+      if (push) {
+        lua_getiuservalue(L, lua_upvalueindex(1), 1);
+        lua_rawgeti(L, -1, 2 * i + 2);
+        lua_remove(L, -2);
+      }
+      return cp;
+    }
+    if (pc->e[i].used < pc->e[old].used)
+      old = i;  /* least recently used entry */
+  }
+  cp = (CPattern *)lua_newuserdatauv(L,
+             sizeof(CPattern) + lp * sizeof(PItem), 0);
+  memset(cp->locale, 0, sizeof(cp->locale));
+  if (!compile(cp, p, lp)) {
+    lua_pop(L, 1);
+    if (push) lua_pushnil(L);
+    return NULL;
+  }
+  findprefix(cp);
+  lua_getiuservalue(L, lua_upvalueindex(1), 1);
+  lua_pushvalue(L, arg);
+  lua_rawseti(L, -2, 2 * old + 1);  /* keep pattern */
+  lua_pushvalue(L, -2);
+  lua_rawseti(L, -2, 2 * old + 2);  /* keep compiled pattern */
+  lua_pop(L, push ? 1 : 2);
+  pc->e[old].p = p;
+  pc->e[old].lp = lp;
+  pc->e[old].cp = cp;
+  pc->e[old].used = pc->clock;
+  return cp;
+}
+
+
+static void newpatcache (lua_State *L) {
+  PatCache *pc = (PatCache *)lua_newuserdatauv(L, sizeof(PatCache), 1);
+  memset(pc, 0, sizeof(PatCache));
+  lua_createtable(L, 2 * LUAI_PATCACHE, 0);
+  lua_setiuservalue(L, -2, 1);
+}
+
+
+static const char *cmatch (MatchState *ms, const char *s, const PItem *pi);
+
+
+static const char *cmax_expand (MatchState *ms, const char *s,
+                                  const PItem *pi) {
+  ptrdiff_t i = 0;  /* counts maximum expand for item */
+  while (s + i < ms->src_end && inset(pi, uchar(*(s + i))))
+    i++;
+  /* keeps trying to match with the maximum repetitions */
+  while (i>=0) {
+    const char *res = cmatch(ms, (s+i), pi+1);
+    if (res) return res;
+    i--;  /* else didn't match; reduce 1 repetition to try again */
+  }
+  return NULL;
+}
+
+
+static const char *cmin_expand (MatchState *ms, const char *s,
+                                  const PItem *pi) {
+  for (;;) {
+    const char *res = cmatch(ms, s, pi+1);
+    if (res != NULL)
+      return res;
+    else if (s < ms->src_end && inset(pi, uchar(*s)))
+      s++;  /* try with one more repetition */
+    else return NULL;
+  }
+}
+
+
+static const char *cstart_capture (MatchState *ms, const char *s,
+                                     const PItem *pi, int what) {
+  const char *res;
+  int level = ms->level;
+  ms->capture[level].init = s;
+  ms->capture[level].len = what;
+  ms->level = level+1;
+  if ((res=cmatch(ms, s, pi)) == NULL)  /* match failed? */
+    ms->level--;  /* undo capture */
+  return res;
+}
+
+
+static const char *cend_capture (MatchState *ms, const char *s,
+                                   const PItem *pi) {
+  int l = capture_to_close(ms);
+  const char *res;
+  ms->capture[l].len = s - ms->capture[l].init;  /* close capture */
+  if ((res = cmatch(ms, s, pi)) == NULL)  /* match failed? */
+    ms->capture[l].len = CAP_UNFINISHED;  /* undo capture */
+  return res;
+}
+
+
+static const char *cmatchbalance (MatchState *ms, const char *s,
+                                    const PItem *pi) {
+  if (s >= ms->src_end || uchar(*s) != pi->x) return NULL;
+  else {
+    int cont = 1;
+    while (++s < ms->src_end) {
+      if (uchar(*s) == pi->y) {
+        if (--cont == 0) return s+1;
+      }
+      else if (uchar(*s) == pi->x) cont++;
+    }
+  }
+  return NULL;  /* string ends out of balance */
+}
+
+
+/* 'match' over a compiled pattern */
+static const char *cmatch (MatchState *ms, const char *s, const PItem *pi) {
+  if (ms->matchdepth-- == 0)
+    luaL_error(ms->L, "pattern too complex");
+  init: /* using goto's to optimize tail recursion */
+  switch (pi->kind) {
+    case PI_END: break;
+    case PI_OPEN: {
+      s = cstart_capture(ms, s, pi + 1, CAP_UNFINISHED);
+      break;
+    }
+    case PI_POSITION: {
+      s = cstart_capture(ms, s, pi + 1, CAP_POSITION);
+      break;
+    }
+    case PI_CLOSE: {
+      s = cend_capture(ms, s, pi + 1);
+      break;
+    }
+    case PI_EOS: {
+      s = (s == ms->src_end) ? s : NULL;  /* check end of string */
+      break;
+    }
+    case PI_BALANCE: {
+      s = cmatchbalance(ms, s, pi);
+      if (s != NULL) {
+        pi++; goto init;
+      }
+      break;
+    }
+    case PI_FRONTIER: {
+      int previous = (s == ms->src_init) ? 0 : uchar(*(s - 1));
+      int current = (s < ms->src_end) ? uchar(*s) : 0;
+      if (!inset(pi, previous) && inset(pi, current)) {
+        pi++; goto init;
+      }
+      s = NULL;  /* match failed */
+      break;
+    }
+    case PI_BACKREF: {
+      s = match_capture(ms, s, pi->x);
+      if (s != NULL) {
+        pi++; goto init;
+      }
+      break;
+    }
+    default: {  /* PI_SINGLE */
+      if (!(s < ms->src_end && inset(pi, uchar(*s)))) {
+        if (pi->rep == '*' || pi->rep == '?' || pi->rep == '-') {
+          pi++; goto init;  /* accept empty */
+        }
+        else  /* '+' or no suffix */
+          s = NULL;  /* fail */
+      }
+      else {  /* matched once */
+        switch (pi->rep) {
+          case '?': {  /* optional */
+            const char *res;
+            if ((res = cmatch(ms, s + 1, pi + 1)) != NULL)
+              s = res;
+            else {
+              pi++; goto init;
+            }
+            break;
+          }
+          case '+':  /* 1 or more repetitions */
+            s++;  /* 1 match already done */
+            /* FALLTHROUGH */
+          case '*':  /* 0 or more repetitions */
+            s = cmax_expand(ms, s, pi);
+            break;
+          case '-':  /* 0 or more repetitions (minimum) */
+            s = cmin_expand(ms, s, pi);
+            break;
+          default:  /* no suffix */
+            s++; pi++; goto init;
+        }
+      }
+      break;
+    }
+  }
+  ms->matchdepth++;
+  return s;
+}
+
+
+/*
+** First position from 's' where a match can start, or NULL if there
+** is none: the literal prefix of the pattern must be there.
+*/
+static const char *nextcandidate (MatchState *ms, const char *s) {
+  const CPattern *cp = ms->cp;
+  if (cp == NULL || cp->nprefix == 0)
+    return s;
+  for (;;) {
+    size_t left = ms->src_end - s;
+    if (left < cp->nprefix ||
+        (s = (const char *)memchr(s, cp->prefix[0], left - cp->nprefix + 1))
+          == NULL)
+      return NULL;
+    if (memcmp(s + 1, cp->prefix + 1, cp->nprefix - 1) == 0)
+      return s;
+    s++;
+  }
+}
+
+
+#define domatch(ms,s,p)  \
+	((ms)->cp != NULL ? cmatch(ms, s, (ms)->cp->item) : match(ms, s, p))
+
+/* }====================================================== */
+
+#else	/* }{ */
+
+#define domatch(ms,s,p)		match(ms, s, p)
+#define nextcandidate(ms,s)	(s)
+
+#endif	/* } */
+
+
+
 static const char *lmemfind (const char *s1, size_t l1,
                                const char *s2, size_t l2) {
   if (l2 == 0) return s1;  /* empty strings are everywhere */
@@ -638,7 +1202,7 @@ static void push_onecapture (MatchState *ms, int i, const char *s,
                                                     const char *e) {
   if (i >= ms->level) {
     if (i == 0)  /* ms->level == 0, too */
-      lua_pushlstring(ms->L, s, e - s);  /* add whole match */
+      pushslice(ms->L, ms->src_idx, ms->src_init, s, e - s);  /* whole match */
     else
       luaL_error(ms->L, "invalid capture index %%%d", i + 1);
   }
@@ -648,7 +1212,7 @@ static void push_onecapture (MatchState *ms, int i, const char *s,
     if (l == CAP_POSITION)
       lua_pushinteger(ms->L, (ms->capture[i].init - ms->src_init) + 1);
     else
-      lua_pushlstring(ms->L, ms->capture[i].init, l);
+      pushslice(ms->L, ms->src_idx, ms->src_init, ms->capture[i].init, l);
   }
 }
 
@@ -675,9 +1239,13 @@ static int nospecials (const char *p, size_t l) {
 }
 
 
-static void prepstate (MatchState *ms, lua_State *L,
+static void prepstate (MatchState *ms, lua_State *L, int idx,
                        const char *s, size_t ls, const char *p, size_t lp) {
   ms->L = L;
+  ms->src_idx = idx;
+#if defined(LUA_USE_PATCACHE)
+  ms->cp = NULL;
+#endif
   ms->matchdepth = MAXCCALLS;
   ms->src_init = s;
   ms->src_end = s + ls;
@@ -693,7 +1261,7 @@ static void reprepstate (MatchState *ms) {
 
 static int str_find_aux (lua_State *L, int find) {
   size_t ls, lp;
-  const char *s = luaL_checklstring(L, 1, &ls);
+  const char *s = checkbytes(L, 1, &ls);
   const char *p = luaL_checklstring(L, 2, &lp);
   lua_Integer init = posrelat(luaL_optinteger(L, 3, 1), ls);
   if (init < 1) init = 1;
@@ -718,11 +1286,16 @@ static int str_find_aux (lua_State *L, int find) {
     if (anchor) {
       p++; lp--;  /* skip anchor character */
     }
-    prepstate(&ms, L, s, ls, p, lp);
+    prepstate(&ms, L, 1, s, ls, p, lp);
+#if defined(LUA_USE_PATCACHE)
+    ms.cp = getpattern(L, 2, 0);
+#endif
     do {
       const char *res;
+      if (!anchor && (s1 = nextcandidate(&ms, s1)) == NULL)
+        break;  /* no place where a match can start */
       reprepstate(&ms);
-      if ((res=match(&ms, s1, p)) != NULL) {
+      if ((res=domatch(&ms, s1, p)) != NULL) {
         if (find) {
           lua_pushinteger(L, (s1 - s) + 1);  /* start */
           lua_pushinteger(L, res - s);   /* end */
@@ -763,8 +1336,10 @@ static int gmatch_aux (lua_State *L) {
   gm->ms.L = L;
   for (src = gm->src; src <= gm->ms.src_end; src++) {
     const char *e;
+    if ((src = nextcandidate(&gm->ms, src)) == NULL)
+      break;  /* no place where a match can start */
     reprepstate(&gm->ms);
-    if ((e = match(&gm->ms, src, gm->p)) != NULL && e != gm->lastmatch) {
+    if ((e = domatch(&gm->ms, src, gm->p)) != NULL && e != gm->lastmatch) {
       gm->src = gm->lastmatch = e;
       return push_captures(&gm->ms, src, e);
     }
@@ -780,9 +1355,17 @@ static int gmatch (lua_State *L) {
   GMatchState *gm;
   lua_settop(L, 2);  /* keep them on closure to avoid being collected */
   gm = (GMatchState *)lua_newuserdatauv(L, sizeof(GMatchState), 0);
-  prepstate(&gm->ms, L, s, ls, p, lp);
+  prepstate(&gm->ms, L, lua_upvalueindex(1), s, ls, p, lp);
   gm->src = s; gm->p = p; gm->lastmatch = NULL;
+#if defined(LUA_USE_PATCACHE)
+  if (*p != '^')  /* ('gmatch' takes '^' as a plain char) */
+    gm->ms.cp = getpattern(L, 2, 1);  /* keep it as an upvalue */
+  else
+    lua_pushnil(L);
+  lua_pushcclosure(L, gmatch_aux, 4);
+#else
   lua_pushcclosure(L, gmatch_aux, 3);
+#endif
   return 1;
 }
 
@@ -864,11 +1447,23 @@ static int str_gsub (lua_State *L) {
   if (anchor) {
     p++; lp--;  /* skip anchor character */
   }
-  prepstate(&ms, L, src, srcl, p, lp);
+  prepstate(&ms, L, 1, src, srcl, p, lp);
+#if defined(LUA_USE_PATCACHE)
+  ms.cp = getpattern(L, 2, 1);  /* keep it in the stack (before the box) */
+#endif
   while (n < max_s) {
     const char *e;
+#if defined(LUA_USE_PATCACHE)
+    if (!anchor) {  /* skip places where a match cannot start */
+      const char *c = nextcandidate(&ms, src);
+      if (c == NULL)
+        break;  /* no more matches; copy the rest of the subject */
+      luaL_addlstring(&b, src, c - src);
+      src = c;
+    }
+#endif
     reprepstate(&ms);  /* (re)prepare state for new match */
-    if ((e = match(&ms, src, p)) != NULL && e != lastmatch) {  /* match? */
+    if ((e = domatch(&ms, src, p)) != NULL && e != lastmatch) {  /* match? */
       n++;
       add_value(&ms, &b, src, e, tr);  /* add replacement to buffer */
       src = lastmatch = e;
@@ -1113,22 +1708,22 @@ static void addlenmod (char *form, const char *lenmod) {
 }
 
 
-static int str_format (lua_State *L) {
-  int top = lua_gettop(L);
-  int arg = 1;
+/*
+** Add to buffer 'b' the values after index 'arg', up to index 'top',
+** formatted by the format string at index 'arg'.
+*/
+static void addformat (lua_State *L, luaL_Buffer *b, int arg, int top) {
   size_t sfl;
   const char *strfrmt = luaL_checklstring(L, arg, &sfl);
   const char *strfrmt_end = strfrmt+sfl;
-  luaL_Buffer b;
-  luaL_buffinit(L, &b);
   while (strfrmt < strfrmt_end) {
     if (*strfrmt != L_ESC)
-      luaL_addchar(&b, *strfrmt++);
+      luaL_addchar(b, *strfrmt++);
     else if (*++strfrmt == L_ESC)
-      luaL_addchar(&b, *strfrmt++);  /* %% */
+      luaL_addchar(b, *strfrmt++);  /* %% */
     else { /* format item */
       char form[MAX_FORMAT];  /* to store the format ('%...') */
-      char *buff = luaL_prepbuffsize(&b, MAX_ITEM);  /* to put formatted item */
+      char *buff = luaL_prepbuffsize(b, MAX_ITEM);  /* to put formatted item */
       int nb = 0;  /* number of bytes in added item */
       if (++arg > top)
         luaL_argerror(L, arg, "no value");
@@ -1158,19 +1753,19 @@ static int str_format (lua_State *L) {
           break;
         }
         case 'q': {
-          addliteral(L, &b, arg);
+          addliteral(L, b, arg);
           break;
         }
         case 's': {
           size_t l;
           const char *s = luaL_tolstring(L, arg, &l);
           if (form[2] == '\0')  /* no modifiers? */
-            luaL_addvalue(&b);  /* keep entire string */
+            luaL_addvalue(b);  /* keep entire string */
           else {
             luaL_argcheck(L, l == strlen(s), arg, "string contains zeros");
             if (!strchr(form, '.') && l >= 100) {
               /* no precision and string is too long to be formatted */
-              luaL_addvalue(&b);  /* keep entire string */
+              luaL_addvalue(b);  /* keep entire string */
             }
             else {  /* format the string into 'buff' */
               nb = l_sprintf(buff, MAX_ITEM, form, s);
@@ -1180,14 +1775,22 @@ static int str_format (lua_State *L) {
           break;
         }
         default: {  /* also treat cases 'pnLlh' */
-          return luaL_error(L, "invalid option '%%%c' to 'format'",
-                               *(strfrmt - 1));
+          luaL_error(L, "invalid option '%%%c' to 'format'",
+                        *(strfrmt - 1));
         }
       }
       lua_assert(nb < MAX_ITEM);
-      luaL_addsize(&b, nb);
+      luaL_addsize(b, nb);
     }
   }
+}
+
+
+static int str_format (lua_State *L) {
+  int top = lua_gettop(L);
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  addformat(L, &b, 1, top);
   luaL_pushresult(&b);
   return 1;
 }
@@ -1427,21 +2030,21 @@ static void copywithendian (volatile char *dest, volatile const char *src,
 }
 
 
-static int str_pack (lua_State *L) {
-  luaL_Buffer b;
+/*
+** Add to buffer 'b' the values after index 'arg' packed by format
+** 'fmt', the string at index 'arg'.
+*/
+static void addpack (lua_State *L, luaL_Buffer *b, const char *fmt,
+                                   int arg) {
   Header h;
-  const char *fmt = luaL_checkstring(L, 1);  /* format string */
-  int arg = 1;  /* current argument to pack */
   size_t totalsize = 0;  /* accumulate total size of result */
   initheader(L, &h);
-  lua_pushnil(L);  /* mark to separate arguments from string buffer */
-  luaL_buffinit(L, &b);
   while (*fmt != '\0') {
     int size, ntoalign;
     KOption opt = getdetails(&h, totalsize, &fmt, &size, &ntoalign);
     totalsize += ntoalign + size;
     while (ntoalign-- > 0)
-     luaL_addchar(&b, LUAL_PACKPADBYTE);  /* fill alignment */
+     luaL_addchar(b, LUAL_PACKPADBYTE);  /* fill alignment */
     arg++;
     switch (opt) {
       case Kint: {  /* signed integers */
@@ -1450,7 +2053,7 @@ static int str_pack (lua_State *L) {
           lua_Integer lim = (lua_Integer)1 << ((size * NB) - 1);
           luaL_argcheck(L, -lim <= n && n < lim, arg, "integer overflow");
         }
-        packint(&b, (lua_Unsigned)n, h.islittle, size, (n < 0));
+        packint(b, (lua_Unsigned)n, h.islittle, size, (n < 0));
         break;
       }
       case Kuint: {  /* unsigned integers */
@@ -1458,19 +2061,19 @@ static int str_pack (lua_State *L) {
         if (size < SZINT)  /* need overflow check? */
           luaL_argcheck(L, (lua_Unsigned)n < ((lua_Unsigned)1 << (size * NB)),
                            arg, "unsigned overflow");
-        packint(&b, (lua_Unsigned)n, h.islittle, size, 0);
+        packint(b, (lua_Unsigned)n, h.islittle, size, 0);
         break;
       }
       case Kfloat: {  /* floating-point options */
         volatile Ftypes u;
-        char *buff = luaL_prepbuffsize(&b, size);
+        char *buff = luaL_prepbuffsize(b, size);
         lua_Number n = luaL_checknumber(L, arg);  /* get argument */
         if (size == sizeof(u.f)) u.f = (float)n;  /* copy it into 'u' */
         else if (size == sizeof(u.d)) u.d = (double)n;
         else u.n = n;
         /* move 'u' to final result, correcting endianness if needed */
         copywithendian(buff, u.buff, size, h.islittle);
-        luaL_addsize(&b, size);
+        luaL_addsize(b, size);
         break;
       }
       case Kchar: {  /* fixed-size string */
@@ -1478,9 +2081,9 @@ static int str_pack (lua_State *L) {
         const char *s = luaL_checklstring(L, arg, &len);
         luaL_argcheck(L, len <= (size_t)size, arg,
                          "string longer than given size");
-        luaL_addlstring(&b, s, len);  /* add string */
+        luaL_addlstring(b, s, len);  /* add string */
         while (len++ < (size_t)size)  /* pad extra space */
-          luaL_addchar(&b, LUAL_PACKPADBYTE);
+          luaL_addchar(b, LUAL_PACKPADBYTE);
         break;
       }
       case Kstring: {  /* strings with length count */
@@ -1489,8 +2092,8 @@ static int str_pack (lua_State *L) {
         luaL_argcheck(L, size >= (int)sizeof(size_t) ||
                          len < ((size_t)1 << (size * NB)),
                          arg, "string length does not fit in given size");
-        packint(&b, (lua_Unsigned)len, h.islittle, size, 0);  /* pack length */
-        luaL_addlstring(&b, s, len);
+        packint(b, (lua_Unsigned)len, h.islittle, size, 0);  /* pack length */
+        luaL_addlstring(b, s, len);
         totalsize += len;
         break;
       }
@@ -1498,17 +2101,26 @@ static int str_pack (lua_State *L) {
         size_t len;
         const char *s = luaL_checklstring(L, arg, &len);
         luaL_argcheck(L, strlen(s) == len, arg, "string contains zeros");
-        luaL_addlstring(&b, s, len);
-        luaL_addchar(&b, '\0');  /* add zero at the end */
+        luaL_addlstring(b, s, len);
+        luaL_addchar(b, '\0');  /* add zero at the end */
         totalsize += len + 1;
         break;
       }
-      case Kpadding: luaL_addchar(&b, LUAL_PACKPADBYTE);  /* FALLTHROUGH */
+      case Kpadding: luaL_addchar(b, LUAL_PACKPADBYTE);  /* FALLTHROUGH */
       case Kpaddalign: case Knop:
         arg--;  /* undo increment */
         break;
     }
   }
+}
+
+
+static int str_pack (lua_State *L) {
+  luaL_Buffer b;
+  const char *fmt = luaL_checkstring(L, 1);  /* format string */
+  lua_pushnil(L);  /* mark to separate arguments from string buffer */
+  luaL_buffinit(L, &b);
+  addpack(L, &b, fmt, 1);
   luaL_pushresult(&b);
   return 1;
 }
@@ -1636,7 +2248,228 @@ static int str_unpack (lua_State *L) {
 /* }====================================================== */
 
 
+/*
+** {======================================================
+** STRING BUFFERS
+** =======================================================
+*/
+
+/*
+** A string buffer accumulates bytes that Lua code appends to it. With
+** LUA_USE_APPENDSTR, its bytes live in a buffer of the core, so that
+** 'tostring' hands them over to a string without a copy (the buffer
+** keeps growing after the bytes of that string); otherwise 'tostring'
+** copies them.
+*/
+
+#define LUA_STRBUFFER	"string.buffer"
+
+typedef struct SBuffer {
+#if defined(LUA_USE_APPENDSTR)
+  void *h;  /* core buffer with the bytes */
+#endif
+  char *b;  /* bytes */
+  size_t n;  /* number of bytes in use */
+  size_t size;  /* room in 'b' */
+} SBuffer;
+
+
+#define tosbuffer(L)	((SBuffer *)luaL_checkudata(L, 1, LUA_STRBUFFER))
+
+
+/*
+** Give buffer 'sb' room for 'size' bytes, keeping its first 'sb->n'.
+*/
+static void resizesbuffer (lua_State *L, SBuffer *sb, size_t size) {
+#if defined(LUA_USE_APPENDSTR)
+  sb->b = lua_resizestrbuf(L, &sb->h, sb->n, size);
+#else
+  void *ud;
+  lua_Alloc allocf = lua_getallocf(L, &ud);
+  char *temp = (char *)allocf(ud, sb->b, sb->size, size);
+  if (temp == NULL && size > 0)  /* allocation error? */
+    luaL_error(L, "not enough memory for buffer allocation");
+  sb->b = temp;
+#endif
+  sb->size = size;
+}
+
+
+/*
+** Return space for 'sz' more bytes in buffer 'sb'
+*/
+static char *prepsbuffer (lua_State *L, SBuffer *sb, size_t sz) {
+  if (sb->size - sb->n < sz) {  /* not enough space? */
+    size_t newsize = sb->size * 2;  /* double buffer size */
+    if (newsize - sb->n < sz) {  /* not big enough? */
+      if (sb->n + sz < sz)  /* overflow? */
+        luaL_error(L, "buffer too large");
+      newsize = sb->n + sz;
+    }
+    resizesbuffer(L, sb, newsize);
+  }
+  return sb->b + sb->n;
+}
+
+
+static void addsbuffer (lua_State *L, SBuffer *sb, const char *s, size_t l) {
+  if (l > 0) {  /* avoid 'memcpy' when 's' can be NULL */
+    memcpy(prepsbuffer(L, sb, l), s, l * sizeof(char));
+    sb->n += l;
+  }
+}
+
+
+/*
+** Add to buffer 'sb' the contents of 'b', the auxiliary buffer where
+** 'string.format' or 'string.pack' built its result.
+*/
+static void addauxbuffer (lua_State *L, SBuffer *sb, luaL_Buffer *b,
+                                        int top) {
+  addsbuffer(L, sb, b->b, b->n);
+  lua_settop(L, top);  /* remove any box of 'b' */
+}
+
+
+static int sbuf_new (lua_State *L) {
+  lua_Integer sz = luaL_optinteger(L, 1, 0);
+  SBuffer *sb;
+  luaL_argcheck(L, sz >= 0, 1, "invalid size");
+  sb = (SBuffer *)lua_newuserdatauv(L, sizeof(SBuffer), 0);
+#if defined(LUA_USE_APPENDSTR)
+  sb->h = NULL;
+#endif
+  sb->b = NULL;
+  sb->n = sb->size = 0;
+  luaL_setmetatable(L, LUA_STRBUFFER);
+  if (sz > 0)
+    resizesbuffer(L, sb, (size_t)sz);
+  return 1;
+}
+
+
+static int sbuf_put (lua_State *L) {
+  SBuffer *sb = tosbuffer(L);
+  int top = lua_gettop(L);
+  int i;
+  for (i = 2; i <= top; i++) {
+    size_t l;
+    const char *s = luaL_checklstring(L, i, &l);
+    addsbuffer(L, sb, s, l);
+  }
+  lua_settop(L, 1);
+  return 1;  /* return buffer */
+}
+
+
+static int sbuf_putf (lua_State *L) {
+  SBuffer *sb = tosbuffer(L);
+  int top = lua_gettop(L);
+  luaL_Buffer b;
+  luaL_buffinit(L, &b);
+  addformat(L, &b, 2, top);
+  addauxbuffer(L, sb, &b, 1);
+  return 1;  /* return buffer */
+}
+
+
+static int sbuf_pack (lua_State *L) {
+  SBuffer *sb = tosbuffer(L);
+  luaL_Buffer b;
+  const char *fmt = luaL_checkstring(L, 2);  /* format string */
+  lua_pushnil(L);  /* mark to separate arguments from string buffer */
+  luaL_buffinit(L, &b);
+  addpack(L, &b, fmt, 2);
+  addauxbuffer(L, sb, &b, 1);
+  return 1;  /* return buffer */
+}
+
+
+static int sbuf_reserve (lua_State *L) {
+  SBuffer *sb = tosbuffer(L);
+  lua_Integer sz = luaL_checkinteger(L, 2);
+  luaL_argcheck(L, sz >= 0, 2, "invalid size");
+  prepsbuffer(L, sb, (size_t)sz);
+  lua_settop(L, 1);
+  return 1;  /* return buffer */
+}
+
+
+static int sbuf_reset (lua_State *L) {
+  SBuffer *sb = tosbuffer(L);
+  sb->n = 0;
+#if defined(LUA_USE_APPENDSTR)
+  if (sb->h != NULL)  /* strings may still use its bytes */
+    sb->b = lua_resizestrbuf(L, &sb->h, 0, sb->size);
+#endif
+  lua_settop(L, 1);
+  return 1;  /* return buffer */
+}
+
+
+static int sbuf_tostring (lua_State *L) {
+  SBuffer *sb = tosbuffer(L);
+#if defined(LUA_USE_APPENDSTR)
+  if (sb->h != NULL) {
+    lua_pushstrbuf(L, sb->h, sb->n);  /* no copy */
+    return 1;
+  }
+#endif
+  lua_pushlstring(L, sb->b, sb->n);
+  return 1;
+}
+
+
+static int sbuf_len (lua_State *L) {
+  SBuffer *sb = tosbuffer(L);
+  lua_pushinteger(L, (lua_Integer)sb->n);
+  return 1;
+}
+
+
+static int sbuf_gc (lua_State *L) {
+  SBuffer *sb = tosbuffer(L);
+#if defined(LUA_USE_APPENDSTR)
+  if (sb->h != NULL)
+    lua_freestrbuf(L, sb->h);
+  sb->h = NULL;
+  sb->b = NULL;
+  sb->size = 0;
+#else
+  resizesbuffer(L, sb, 0);
+#endif
+  sb->n = 0;
+  return 0;
+}
+
+
+static const luaL_Reg sbuf_meth[] = {
+  {"put", sbuf_put},
+  {"putf", sbuf_putf},
+  {"pack", sbuf_pack},
+  {"reserve", sbuf_reserve},
+  {"reset", sbuf_reset},
+  {"tostring", sbuf_tostring},
+  {"__tostring", sbuf_tostring},
+  {"__len", sbuf_len},
+  {"__gc", sbuf_gc},
+  {NULL, NULL}
+};
+
+
+static void createbuffermeta (lua_State *L) {
+  luaL_newmetatable(L, LUA_STRBUFFER);  /* metatable for string buffers */
+  lua_pushvalue(L, -1);  /* push metatable */
+  lua_setfield(L, -2, "__index");  /* metatable.__index = metatable */
+  luaL_setfuncs(L, sbuf_meth, 0);  /* add buffer methods to new metatable */
+  lua_pop(L, 1);  /* pop new metatable */
+}
+
+/* }====================================================== */
+
+
 static const luaL_Reg strlib[] = {
+  {"buffer", sbuf_new},
   {"byte", str_byte},
   {"char", str_char},
   {"dump", str_dump},
@@ -1676,8 +2509,16 @@ static void createmetatable (lua_State *L) {
 ** Open string library
 */
 LUAMOD_API int luaopen_string (lua_State *L) {
+#if defined(LUA_USE_PATCACHE)
+  luaL_checkversion(L);
+  luaL_newlibtable(L, strlib);
+  newpatcache(L);  /* cache of compiled patterns, shared as an upvalue */
+  luaL_setfuncs(L, strlib, 1);
+#else
   luaL_newlib(L, strlib);
+#endif
   createmetatable(L);
+  createbuffermeta(L);
   return 1;
 }
 
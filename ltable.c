@@ -21,10 +21,46 @@
 ** in its main position (i.e. the 'original' position that its hash gives
 ** to it), then the colliding element is in its own main position.
 ** Hence even when the load factor reaches 100%, performance remains good.
+** The array part keeps tags and values in separate vectors (see
+** 'ltable.h'), so integer keys in the array part are read and written
+** only through the functions in this module.
+** With LUA_USE_SHAPES, a table starts with a shape (see 'lobject.h')
+** instead of a hash part: its short-string keys live in the shape and
+** their values in the table's 'slots'. A table with a shape keeps its
+** hash part empty ('dummynode'), and it trades the shape for a real
+** hash part when it gets any other key out of its array part or more
+** than MAXSHAPEKEYS keys. (Removing a key just empties its slot, as it
+** would empty its node, so that adding it back reuses the slot.)
+** With LUA_USE_SWISSTABLE, the hash part is instead an open-addressing
+** table in the style of SwissTable: each node has a control byte,
+** which is either CTRL_EMPTY or the low 7 bits of the hash of its key,
+** and a search compares the control bytes of a whole group of nodes
+** (GROUPSIZE of them, with SSE2 when available) with the 7 bits of the
+** hash of the key; only matching nodes have their keys compared. Groups
+** are probed in triangular order and a search stops at a group with an
+** empty node. Keys are never removed from nodes (an entry is removed
+** by emptying its value, as in the chained scheme), so there are no
+** tombstones; the load factor is kept at most 7/8, and a table is
+** rehashed when it has no more nodes available ('growthleft').
+** With LUA_USE_INCRHASH, a large hash part that must grow is not
+** rehashed at once: it gets a new node vector twice as large and
+** keeps the old one in 'oldhash' (a table struct that is not a
+** collectable object and that uses only its hash part; its 'alimit'
+** counts the old nodes already moved). Each new key then moves the
+** next MIGRATESTEP old nodes to the new vector, so that the old one is
+** empty (and freed) long before the new one gets full. Meanwhile,
+** searches that fail in the new vector search the old one, traversals
+** visit the old nodes after the new ones, and any other resize first
+** finishes the migration.
 */
 
 #include <math.h>
 #include <limits.h>
+#include <string.h>
+
+#if defined(LUA_USE_SWISSTABLE) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include "lua.h"
 
@@ -65,8 +101,16 @@
 ** between 2^MAXHBITS and the maximum size such that, measured in bytes,
 ** it fits in a 'size_t'.
 */
+#if !defined(LUA_USE_SWISSTABLE)
 #define MAXHSIZE	luaM_limitN(1u << MAXHBITS, Node)
+#else
+/* each node also needs a control byte, and a byte is not larger
+   than a node */
+#define MAXHSIZE	(luaM_limitN(1u << MAXHBITS, Node) / 2)
+#endif
+
 
+#if !defined(LUA_USE_SWISSTABLE)
 
 #define hashpow2(t,n)		(gnode(t, lmod((n), sizenode(t))))
 
@@ -84,16 +128,82 @@
 
 #define hashpointer(t,p)	hashmod(t, point2uint(p))
 
+/* maximum number of keys in a hash part with 'n' nodes */
+#define maxload(n)	(n)
+
+#else
+
+/* control byte for an empty node */
+#define CTRL_EMPTY	0x80
+
+/* control byte after the last node of a hash part smaller than a group */
+#define CTRL_PAD	0xFF
+
+/* part of a hash that selects the first group to probe */
+#define hashgroup(h)	((h) >> 7)
+
+/* part of a hash kept in the control byte of a node */
+#define hashctrl(h)	cast_byte((h) & 0x7f)
+
+/* number of groups in the hash part of 't' */
+#define numgroups(t)	((cast_uint(sizenode(t)) + GROUPSIZE - 1) / GROUPSIZE)
+
+/* number of control bytes for a hash part with 'n' nodes */
+#define sizectrl(n)	((n) < GROUPSIZE ? GROUPSIZE : (n))
+
+/* size of a hash part (nodes followed by their control bytes) */
+#define sizehashpart(n)	((n) * sizeof(Node) + sizectrl(n))
+
+/* maximum number of keys in a hash part with 'n' nodes */
+#define maxload(n)	((n) - (n) / 8)
+
+#endif
+
 
 #define dummynode		(&dummynode_)
 
 static const Node dummynode_ = {
-  {{NULL}, LUA_TEMPTY,  /* value's value and type */
+  {EMPTYCONSTANT,  /* value's value and type */
    LUA_TNIL, 0, {NULL}}  /* key type, next, and key value */
 };
 
+#if defined(LUA_USE_SWISSTABLE)
+LUAI_DDEF const lu_byte luaH_dummyctrl[GROUPSIZE] = {
+  CTRL_EMPTY, CTRL_PAD, CTRL_PAD, CTRL_PAD, CTRL_PAD, CTRL_PAD,
+  CTRL_PAD, CTRL_PAD, CTRL_PAD, CTRL_PAD, CTRL_PAD, CTRL_PAD,
+  CTRL_PAD, CTRL_PAD, CTRL_PAD, CTRL_PAD
+};
+#endif
+
 
-static const TValue absentkey = {ABSTKEYCONSTANT};
+LUAI_DDEF const TValue luaH_absentkey = {ABSTKEYCONSTANT};
+
+#define absentkey	luaH_absentkey
+
+
+#if defined(LUA_USE_INCRHASH)
+
+/* minimum size of a hash part that grows incrementally */
+#define INCRHASHMIN	1024
+
+/* number of old nodes moved to the new hash part at each new key */
+#define MIGRATESTEP	8
+
+/* number of nodes sampled to estimate how many of them are in use */
+#define LIVESAMPLE	64
+
+/*
+** Result of a search for key 'k' that failed in the hash part of 't':
+** during an incremental resize, search the old hash part with 'f'.
+*/
+#define notfound(t,f,k)  \
+	((t)->oldhash == NULL ? &absentkey : f((t)->oldhash, k))
+
+#else
+
+#define notfound(t,f,k)		(&absentkey)
+
+#endif
 
 
 
@@ -127,6 +237,8 @@ static int l_hashfloat (lua_Number n) {
 #endif
 
 
+#if !defined(LUA_USE_SWISSTABLE)
+
 /*
 ** returns the 'main' position of an element in a table (that is,
 ** the index of its hash value). The key comes broken (tag in 'ktt'
@@ -156,10 +268,143 @@ static Node *mainposition (const Table *t, int ktt, const Value *kvl) {
 
 
 static Node *mainpositionTV (const Table *t, const TValue *key) {
+#if !defined(LUA_NANBOXING)
   return mainposition(t, rawtt(key), valraw(key));
+#else
+  Value v = luaO_nbvalue(key);
+  return mainposition(t, rawtt(key), &v);
+#endif
+}
+
+#else
+
+/*
+** Mix the bits of a hash, so that both its part kept in control bytes
+** and its part that selects a group depend on all its bits. (The
+** chained scheme needs only the low bits, and many of the raw hashes
+** below have poor high bits.)
+*/
+static unsigned int mixhash (unsigned int h) {
+  h ^= h >> 16;
+  h *= 0x85ebca6bu;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35u;
+  h ^= h >> 16;
+  return h;
+}
+
+
+static unsigned int hashint (lua_Integer i) {
+  lua_Unsigned u = l_castS2U(i);
+  return mixhash(cast_uint(u ^ (u >> 31 >> 1)));  /* fold 64-bit keys */
 }
 
 
+/*
+** returns the hash of a key. The key comes broken (tag in 'ktt' and
+** value in 'vkl') so that we can call it on keys inserted into nodes.
+*/
+static unsigned int hashkey (int ktt, const Value *kvl) {
+  switch (withvariant(ktt)) {
+    case LUA_TNUMINT:
+      return hashint(ivalueraw(*kvl));
+    case LUA_TNUMFLT:
+      return mixhash(cast_uint(l_hashfloat(fltvalueraw(*kvl))));
+    case LUA_TSHRSTR:
+      return mixhash(tsvalueraw(*kvl)->hash);
+    case LUA_TLNGSTR:
+      return mixhash(luaS_hashlongstr(tsvalueraw(*kvl)));
+    case LUA_TBOOLEAN:
+      return mixhash(cast_uint(bvalueraw(*kvl)));
+    case LUA_TLIGHTUSERDATA:
+      return mixhash(point2uint(pvalueraw(*kvl)));
+    case LUA_TLCF:
+      return mixhash(point2uint(fvalueraw(*kvl)));
+    default:
+      return mixhash(point2uint(gcvalueraw(*kvl)));
+  }
+}
+
+
+static unsigned int hashkeyTV (const TValue *key) {
+#if !defined(LUA_NANBOXING)
+  return hashkey(rawtt(key), valraw(key));
+#else
+  Value v = luaO_nbvalue(key);
+  return hashkey(rawtt(key), &v);
+#endif
+}
+
+
+/*
+** Returns a bit mask of the control bytes equal to 'c' in the group of
+** control bytes starting at 'g'.
+*/
+static unsigned int matchgroup (const lu_byte *g, lu_byte c) {
+#if defined(__SSE2__)
+  __m128i ctrl = _mm_loadu_si128(cast(const __m128i *, g));
+  __m128i eq = _mm_cmpeq_epi8(ctrl, _mm_set1_epi8(cast(char, c)));
+  return cast_uint(_mm_movemask_epi8(eq));
+#else
+  unsigned int mask = 0;
+  int i;
+  for (i = 0; i < GROUPSIZE; i++) {
+    if (g[i] == c)
+      mask |= 1u << i;
+  }
+  return mask;
+#endif
+}
+
+
+/* index of the lowest bit set in a non-zero mask */
+#if defined(__GNUC__)
+#define lowestbit(m)	__builtin_ctz(m)
+#else
+static int lowestbit (unsigned int m) {
+  int i = 0;
+  while (!(m & 1u)) {
+    m >>= 1;
+    i++;
+  }
+  return i;
+}
+#endif
+
+
+/*
+** The search for a key probes groups in the order g, g+1, g+3, g+6,
+** ... (modulo the number of groups), where 'g' comes from the hash of
+** the key. As the number of groups is a power of 2, this sequence
+** visits each group exactly once. A search for a key can stop at the
+** first group with an empty node, because an insertion would have put
+** the key there.
+*/
+#define firstgroup(t,h)		(hashgroup(h) & (numgroups(t) - 1))
+#define nextgroup(t,g,s)	(((g) + (s)) & (numgroups(t) - 1))
+#define groupctrl(t,g)		((t)->ctrl + (g) * GROUPSIZE)
+#define groupnode(t,g,i)	gnode(t, (g) * GROUPSIZE + (i))
+
+
+/*
+** Get an empty node for a new key with hash 'h'. The caller ensures
+** that there is one ('growthleft' > 0).
+*/
+static Node *getfreenode (Table *t, unsigned int h) {
+  unsigned int g = firstgroup(t, h);
+  unsigned int step = 0;
+  for (;;) {
+    unsigned int m = matchgroup(groupctrl(t, g), CTRL_EMPTY);
+    if (m != 0)
+      return groupnode(t, g, lowestbit(m));
+    lua_assert(step < numgroups(t) - 1);
+    g = nextgroup(t, g, ++step);
+  }
+}
+
+#endif
+
+
 /*
 ** Check whether key 'k1' is equal to the key in node 'n2'.
 ** This equality is raw, so there are no metamethods. Floats
@@ -245,11 +490,40 @@ static unsigned int setlimittosize (Table *t) {
 
 
 
+#if defined(LUA_USE_SHAPES)
+
+/* maximum number of keys in a shape */
+#define MAXSHAPEKEYS	16
+
+#define sizeshape(n)  \
+	(offsetof(Shape, keys) + cast_sizet(n) * sizeof(TString *))
+
+/* size of 'slots' for 'n' keys (grows in steps of 4 slots) */
+#define sizeslots(n)	(((n) + 3) & ~3)
+
+
+/*
+** Search for short string 'key' in the shape of table 't'.
+*/
+static const TValue *getfromshape (Table *t, TString *key) {
+  const Shape *s = t->shape;
+  int i;
+  for (i = 0; i < s->nkeys; i++) {
+    if (s->keys[i] == key)
+      return &t->slots[i];
+  }
+  return &absentkey;  /* not found */
+}
+
+#endif
+
+
 /*
 ** "Generic" get version. (Not that generic: not valid for integers,
 ** which may be in array part, nor for floats with integral values.)
 */
 static const TValue *getgeneric (Table *t, const TValue *key) {
+#if !defined(LUA_USE_SWISSTABLE)
   Node *n = mainpositionTV(t, key);
   for (;;) {  /* check whether 'key' is somewhere in the chain */
     if (equalkey(key, n))
@@ -257,10 +531,27 @@ static const TValue *getgeneric (Table *t, const TValue *key) {
     else {
       int nx = gnext(n);
       if (nx == 0)
-        return &absentkey;  /* not found */
+        return notfound(t, getgeneric, key);  /* not found */
       n += nx;
     }
   }
+#else
+  unsigned int h = hashkeyTV(key);
+  unsigned int g = firstgroup(t, h);
+  unsigned int step = 0;
+  for (;;) {  /* check whether 'key' is somewhere in the probed groups */
+    const lu_byte *ctrl = groupctrl(t, g);
+    unsigned int m;
+    for (m = matchgroup(ctrl, hashctrl(h)); m != 0; m &= m - 1) {
+      Node *n = groupnode(t, g, lowestbit(m));
+      if (equalkey(key, n))
+        return gval(n);  /* that's it */
+    }
+    if (matchgroup(ctrl, CTRL_EMPTY) != 0 || step == numgroups(t) - 1)
+      return notfound(t, getgeneric, key);  /* not found */
+    g = nextgroup(t, g, ++step);
+  }
+#endif
 }
 
 
@@ -288,8 +579,36 @@ static unsigned int findindex (lua_State *L, Table *t, TValue *key,
   i = ttisinteger(key) ? arrayindex(ivalue(key)) : 0;
   if (i != 0 && i <= asize)  /* is 'key' inside array part? */
     return i;  /* yes; that's the index */
+#if defined(LUA_USE_SHAPES)
+  else if (isshaped(t) && ttisshrstring(key)) {
+    const TValue *n = getfromshape(t, tsvalue(key));
+    if (unlikely(isabstkey(n)))
+      luaG_runerror(L, "invalid key to 'next'");  /* key not found */
+    i = cast_uint(n - t->slots);  /* key index in slots */
+    /* slots are numbered after array and hash elements */
+    return (i + 1) + asize + sizenode(t);
+  }
+#endif
   else {
-    const TValue *n = getgeneric(t, key);
+    const TValue *n;
+#if defined(LUA_USE_INCRHASH)
+    Table *old = t->oldhash;
+    if (old != NULL) {
+      t->oldhash = NULL;  /* search only the new hash part */
+      n = getgeneric(t, key);
+      t->oldhash = old;
+      if (isabstkey(n)) {  /* not there; must be in the old part */
+        n = getgeneric(old, key);
+        if (unlikely(isabstkey(n)))
+          luaG_runerror(L, "invalid key to 'next'");  /* key not found */
+        i = cast_int(nodefromval(n) - gnode(old, 0));
+        /* old nodes are numbered after array and new hash elements */
+        return (i + 1) + asize + sizenode(t);
+      }
+    }
+    else
+#endif
+    n = getgeneric(t, key);
     if (unlikely(isabstkey(n)))
       luaG_runerror(L, "invalid key to 'next'");  /* key not found */
     i = cast_int(nodefromval(n) - gnode(t, 0));  /* key index in hash table */
@@ -303,9 +622,9 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
   unsigned int asize = luaH_realasize(t);
   unsigned int i = findindex(L, t, s2v(key), asize);  /* find original key */
   for (; i < asize; i++) {  /* try first array part */
-    if (!isempty(&t->array[i])) {  /* a non-empty entry? */
+    if (!arrayisempty(t, i)) {  /* a non-empty entry? */
       setivalue(s2v(key), i + 1);
-      setobj2s(L, key + 1, &t->array[i]);
+      arr2obj(t, i, s2v(key + 1));
       return 1;
     }
   }
@@ -317,13 +636,43 @@ int luaH_next (lua_State *L, Table *t, StkId key) {
       return 1;
     }
   }
+#if defined(LUA_USE_INCRHASH)
+  if (t->oldhash != NULL) {
+    Table *old = t->oldhash;
+    for (i -= sizenode(t); cast_int(i) < sizenode(old); i++) {  /* old */
+      if (!isempty(gval(gnode(old, i)))) {  /* a non-empty entry? */
+        Node *n = gnode(old, i);
+        getnodekey(L, s2v(key), n);
+        setobj2s(L, key + 1, gval(n));
+        return 1;
+      }
+    }
+  }
+#endif
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(t)) {
+    const Shape *s = t->shape;
+    for (i -= sizenode(t); cast_int(i) < s->nkeys; i++) {  /* slots */
+      if (!isempty(&t->slots[i])) {  /* a non-empty entry? */
+        setsvalue2s(L, key, s->keys[i]);
+        setobj2s(L, key + 1, &t->slots[i]);
+        return 1;
+      }
+    }
+  }
+#endif
   return 0;  /* no more elements */
 }
 
 
 static void freehash (lua_State *L, Table *t) {
-  if (!isdummy(t))
+  if (!isdummy(t)) {
+#if !defined(LUA_USE_SWISSTABLE)
     luaM_freearray(L, t->node, cast_sizet(sizenode(t)));
+#else
+    luaM_freemem(L, t->node, sizehashpart(cast_sizet(sizenode(t))));
+#endif
+  }
 }
 
 
@@ -396,7 +745,7 @@ static unsigned int numusearray (const Table *t, unsigned int *nums) {
     }
     /* count elements in range (2^(lg - 1), 2^lg] */
     for (; i <= lim; i++) {
-      if (!isempty(&t->array[i-1]))
+      if (!arrayisempty(t, i - 1))
         lc++;
     }
     nums[lg] += lc;
@@ -434,15 +783,28 @@ static void setnodevector (lua_State *L, Table *t, unsigned int size) {
   if (size == 0) {  /* no elements to hash part? */
     t->node = cast(Node *, dummynode);  /* use common 'dummynode' */
     t->lsizenode = 0;
+#if !defined(LUA_USE_SWISSTABLE)
     t->lastfree = NULL;  /* signal that it is using dummy node */
+#else
+    t->ctrl = cast(lu_byte *, luaH_dummyctrl);  /* signal dummy node */
+    t->growthleft = 0;
+#endif
   }
   else {
     int i;
+#if !defined(LUA_USE_SWISSTABLE)
     int lsize = luaO_ceillog2(size);
+#else
+    int lsize = luaO_ceillog2(size + size / 7);  /* load at most 7/8 */
+#endif
     if (lsize > MAXHBITS || (1u << lsize) > MAXHSIZE)
       luaG_runerror(L, "table overflow");
     size = twoto(lsize);
+#if !defined(LUA_USE_SWISSTABLE)
     t->node = luaM_newvector(L, size, Node);
+#else
+    t->node = cast(Node *, luaM_malloc_(L, sizehashpart(size), 0));
+#endif
     for (i = 0; i < (int)size; i++) {
       Node *n = gnode(t, i);
       gnext(n) = 0;
@@ -450,7 +812,15 @@ static void setnodevector (lua_State *L, Table *t, unsigned int size) {
       setempty(gval(n));
     }
     t->lsizenode = cast_byte(lsize);
+#if !defined(LUA_USE_SWISSTABLE)
     t->lastfree = gnode(t, size);  /* all positions are free */
+#else
+    t->ctrl = cast(lu_byte *, gnode(t, size));  /* after the nodes */
+    memset(t->ctrl, CTRL_EMPTY, size);  /* all positions are free */
+    if (size < GROUPSIZE)  /* complete the only group */
+      memset(t->ctrl + size, CTRL_PAD, GROUPSIZE - size);
+    t->growthleft = maxload(size);
+#endif
   }
 }
 
@@ -468,7 +838,7 @@ static void reinsert (lua_State *L, Table *ot, Table *t) {
          already present in the table */
       TValue k;
       getnodekey(L, &k, old);
-      setobjt2t(L, luaH_set(L, t, &k), gval(old));
+      luaH_set(L, t, &k, gval(old));
     }
   }
 }
@@ -480,13 +850,364 @@ static void reinsert (lua_State *L, Table *ot, Table *t) {
 static void exchangehashpart (Table *t1, Table *t2) {
   lu_byte lsizenode = t1->lsizenode;
   Node *node = t1->node;
+#if !defined(LUA_USE_SWISSTABLE)
   Node *lastfree = t1->lastfree;
+#else
+  lu_byte *ctrl = t1->ctrl;
+  unsigned int growthleft = t1->growthleft;
+#endif
   t1->lsizenode = t2->lsizenode;
   t1->node = t2->node;
-  t1->lastfree = t2->lastfree;
   t2->lsizenode = lsizenode;
   t2->node = node;
+#if !defined(LUA_USE_SWISSTABLE)
+  t1->lastfree = t2->lastfree;
   t2->lastfree = lastfree;
+#else
+  t1->ctrl = t2->ctrl;
+  t1->growthleft = t2->growthleft;
+  t2->ctrl = ctrl;
+  t2->growthleft = growthleft;
+#endif
+}
+
+
+#if defined(LUA_USE_SIZEHINTS)
+
+/*
+** {==================================================================
+** Size hints
+** ===================================================================
+*/
+
+/*
+** Each OP_NEWTABLE keeps in its inline-cache entry the sizes reached
+** by the tables it created: the low byte has the array size and the
+** next byte the hash size, both as "floating point bytes" (see
+** 'luaO_int2fb'), and the bits above count the tables created since
+** the hint last grew. Each table remembers its creator, and 'rehash'
+** enlarges the hint whenever it grows the table, so later tables from
+** the same constructor start with these sizes. Hints are capped at
+** MAXSIZEHINT; after HINTDECAY tables without growth they are halved,
+** so a constructor whose tables became smaller stops over-allocating.
+** (If they did not, the next table grows once and restores the hint.)
+*/
+
+#define MAXSIZEHINT	(1u << 16)
+#define HINTDECAY	64u
+
+#define hintasize(h)	cast_uint(luaO_fb2int(cast_int((h) & 0xff)))
+#define hinthsize(h)	cast_uint(luaO_fb2int(cast_int(((h) >> 8) & 0xff)))
+#define hintcount(h)	((h) >> 16)
+
+
+static unsigned int mkhint (unsigned int asize, unsigned int hsize) {
+  if (asize > MAXSIZEHINT) asize = MAXSIZEHINT;
+  if (hsize > MAXSIZEHINT) hsize = MAXSIZEHINT;
+  return cast_uint(luaO_int2fb(asize)) | (cast_uint(luaO_int2fb(hsize)) << 8);
+}
+
+
+/*
+** Record in the creator of 't' the sizes 't' has after growing.
+*/
+static void feedsite (Table *t) {
+  if (t->site != NULL) {
+    unsigned int *hint = &t->site->icache[t->sitepc];
+    unsigned int asize = luaH_realasize(t);
+    unsigned int hsize = maxload(allocsizenode(t));
+    if (asize < hintasize(*hint)) asize = hintasize(*hint);
+    if (hsize < hinthsize(*hint)) hsize = hinthsize(*hint);
+    *hint = mkhint(asize, hsize);  /* (also resets the count) */
+  }
+}
+
+
+/*
+** Give the sizes for a new table 't', created by the instruction at
+** index 'pc' in 'p' with sizes 'nasize' and 'nhsize' in the
+** constructor, and make 't' report its growth to that instruction.
+*/
+void luaH_presize (lua_State *L, Table *t, Proto *p, int pc,
+                   unsigned int nasize, unsigned int nhsize) {
+  unsigned int *hint = &p->icache[pc];
+  unsigned int h = *hint;
+  t->site = p;
+  t->sitepc = pc;
+  if (h != 0) {  /* constructor has a hint? */
+    if (hintcount(h) == HINTDECAY)  /* no growth for a while? */
+      h = mkhint(hintasize(h) / 2, hinthsize(h) / 2);  /* decay */
+    else
+      h += 1u << 16;  /* count this table */
+    *hint = h;
+    if (nasize < hintasize(h)) nasize = hintasize(h);
+    if (nhsize < hinthsize(h)) nhsize = hinthsize(h);
+  }
+  if (nasize != 0 || nhsize != 0)
+    luaH_resize(L, t, nasize, nhsize);
+}
+
+/* }================================================================== */
+
+#else
+
+#define feedsite(t)	((void)0)
+
+#endif
+
+
+#if defined(LUA_USE_INCRHASH)
+
+/*
+** Move the next 'n' nodes of the old hash part of 't' to its new hash
+** part, freeing the old part when all its nodes have been moved. The
+** old part is detached from 't' while its entries are inserted, so
+** that these insertions go straight to the new part.
+*/
+static void migrate (lua_State *L, Table *t, unsigned int n) {
+  Table *old = t->oldhash;
+  unsigned int size = sizenode(old);
+  t->oldhash = NULL;
+  for (; n > 0 && old->alimit < size; n--) {
+    Node *on = gnode(old, old->alimit++);
+    if (!isempty(gval(on))) {
+      TValue k;
+      getnodekey(L, &k, on);
+      luaH_newkey(L, t, &k, gval(on));  /* (new part has room for it) */
+      setempty(gval(on));  /* entry now lives in the new part */
+    }
+  }
+  if (old->alimit < size)  /* still has nodes to move? */
+    t->oldhash = old;
+  else {
+    freehash(L, old);
+    luaM_free(L, old);
+  }
+}
+
+
+static void finishmigration (lua_State *L, Table *t) {
+  if (t->oldhash != NULL)
+    migrate(L, t, sizenode(t->oldhash));
+}
+
+
+/*
+** Check whether most nodes in the hash part of 't' hold entries,
+** looking at a sample of them. (Removed entries keep their nodes until
+** the next rehash, and a resize that does not count entries would keep
+** growing a table where entries are often removed.)
+*/
+static int mostlylive (const Table *t) {
+  unsigned int size = sizenode(t);
+  unsigned int step = size / LIVESAMPLE;
+  unsigned int i;
+  int live = 0;
+  for (i = 0; i < size; i += step) {
+    if (!isempty(gval(gnode(t, i))))
+      live++;
+  }
+  return (live > LIVESAMPLE / 2);
+}
+
+
+/*
+** Try to grow the hash part of 't' incrementally, for the new key
+** 'ek'. That needs a large hash part with most nodes in use and a key
+** that cannot go to the array part: an incremental resize does not
+** count keys, so it keeps the array part as it is. (As 't' has at most
+** 'asize + sizenode(t)' integer keys, an array larger than twice that
+** cannot be more than half full.)
+*/
+static int growincr (lua_State *L, Table *t, const TValue *ek) {
+  Table newt;  /* to keep the new hash part */
+  Table *old;
+  unsigned int size = sizenode(t);
+  if (size < INCRHASHMIN || !mostlylive(t) ||
+      (ttisinteger(ek) && arrayindex(ivalue(ek)) != 0 &&
+       arrayindex(ivalue(ek)) <= 2 * (luaH_realasize(t) + size) + 2))
+    return 0;
+  setnodevector(L, &newt, maxload(2 * size));  /* can fail; 't' is intact */
+  old = cast(Table *, luaM_realloc_(L, NULL, 0, sizeof(Table)));
+  if (unlikely(old == NULL)) {  /* allocation failed? */
+    freehash(L, &newt);  /* release new hash part */
+    luaM_error(L);
+  }
+  luaC_tablemoved(L, t);
+  old->oldhash = NULL;
+  old->alimit = 0;  /* no nodes moved yet */
+#if defined(LUA_USE_SHAPES)
+  old->shape = NULL;
+#endif
+  exchangehashpart(t, &newt);  /* 't' gets the new hash part... */
+  exchangehashpart(old, &newt);  /* ...and 'old' keeps the old one */
+  t->oldhash = old;
+  feedsite(t);
+  return 1;
+}
+
+#endif
+
+
+#if defined(LUA_USE_SHAPES)
+
+/*
+** {==================================================================
+** Shapes
+** ===================================================================
+*/
+
+/*
+** Remove a reference to shape 's'. A shape no longer used is unlinked
+** from its parent and freed, which in turn releases the parent. (The
+** root shape, in the global state, is never released.)
+*/
+static void releaseshape (lua_State *L, Shape *s) {
+  while (--s->nref == 0) {
+    Shape *p = s->parent;
+    Shape **pc = &p->child;
+    lua_assert(s->child == NULL);  /* transitions keep their parents */
+    while (*pc != s)  /* find 's' in its parent's list of transitions */
+      pc = &(*pc)->sibling;
+    *pc = s->sibling;  /* unlink it */
+    luaM_freemem(L, s, sizeshape(s->nkeys));
+    s = p;
+  }
+}
+
+
+/*
+** Get the transition from shape 's' that adds key 'key', creating it
+** if needed.
+*/
+static Shape *gettransition (lua_State *L, Shape *s, TString *key) {
+  Shape *ns;
+  int i;
+  for (ns = s->child; ns != NULL; ns = ns->sibling) {
+    if (ns->keys[s->nkeys] == key)
+      return ns;  /* transition already exists */
+  }
+  ns = cast(Shape *, luaM_malloc_(L, sizeshape(s->nkeys + 1), 0));
+  ns->parent = s;
+  ns->child = NULL;
+  ns->sibling = s->child;
+  s->child = ns;
+  s->nref++;  /* a transition keeps its parent */
+  ns->nref = 0;
+  ns->nkeys = s->nkeys + 1;
+  for (i = 0; i < s->nkeys; i++)
+    ns->keys[i] = s->keys[i];
+  ns->keys[s->nkeys] = key;
+  return ns;
+}
+
+
+/*
+** Add the absent key 'key' with value 'value' to the shape of table
+** 't'. All allocations are done before 't' changes its shape, so that
+** an error leaves the table intact.
+*/
+static void addtoshape (lua_State *L, Table *t, TString *key,
+                                                TValue *value) {
+  Shape *s = t->shape;
+  Shape *ns;
+  int n = s->nkeys;
+  if (n == t->sizeslots) {  /* no more free slots? */
+    int size = sizeslots(n + 1);
+    TValue *slots = luaM_reallocvector(L, t->slots, n, size, TValue);
+    if (unlikely(slots == NULL))
+      luaM_error(L);
+    t->slots = slots;
+    t->sizeslots = cast_byte(size);
+  }
+  ns = gettransition(L, s, key);
+  ns->nref++;
+  t->shape = ns;
+  releaseshape(L, s);  /* (cannot free it; 'ns' keeps it) */
+  setobj2t(L, &t->slots[n], value);
+}
+
+
+static void freeshape (lua_State *L, Table *t) {
+  luaM_freearray(L, t->slots, t->sizeslots);
+  releaseshape(L, t->shape);
+  t->shape = NULL;
+  t->slots = NULL;
+  t->sizeslots = 0;
+}
+
+
+/*
+** Trade the shape of table 't' for a real hash part with its keys.
+*/
+static void unshape (lua_State *L, Table *t) {
+  Shape *s = t->shape;
+  TValue *slots = t->slots;
+  unsigned int size = t->sizeslots;
+  int i;
+  Table newt;  /* to keep the new hash part */
+  luaC_tablemoved(L, t);
+  setnodevector(L, &newt, s->nkeys);  /* can fail; 't' is still intact */
+  exchangehashpart(t, &newt);  /* 't' has the new hash ('newt' the dummy) */
+  t->shape = NULL;  /* from now on, 't' uses its hash part */
+  t->slots = NULL;
+  t->sizeslots = 0;
+  for (i = 0; i < s->nkeys; i++) {
+    if (!isempty(&slots[i])) {  /* reinsert non-empty entries */
+      TValue k;
+      setsvalue(L, &k, s->keys[i]);
+      luaH_set(L, t, &k, &slots[i]);  /* (hash part has room for it) */
+    }
+  }
+  luaM_freearray(L, slots, size);
+  releaseshape(L, s);
+}
+
+/* }================================================================== */
+
+#endif
+
+
+/*
+** Allocate a new array part for 't' with 'newasize' entries, copying
+** to it the entries common with the current array part (which has
+** 'oldasize' entries). Return NULL if the allocation fails, leaving
+** the current array untouched; otherwise, the old array is freed.
+*/
+static Value *resizearray (lua_State *L, Table *t, unsigned int oldasize,
+                                                   unsigned int newasize) {
+#if !defined(LUA_NANBOXING)
+  Value *np = NULL;
+  unsigned int n = (oldasize < newasize) ? oldasize : newasize;
+  if (newasize > 0) {
+    Value *block = cast(Value *,
+                        luaM_realloc_(L, NULL, 0, arraysize(newasize)));
+    if (unlikely(block == NULL))
+      return NULL;
+    np = block + newasize;  /* values go below 'np', tags above it */
+    if (n > 0) {
+      memcpy(np - n, t->array - n, n * sizeof(Value));
+      memcpy(np, t->array, n);
+    }
+  }
+  if (oldasize > 0)
+    luaM_freemem(L, t->array - oldasize, arraysize(oldasize));
+  return np;
+#else
+  return cast(Value *, luaM_realloc_(L, t->array, arraysize(oldasize),
+                                                  arraysize(newasize)));
+#endif
+}
+
+
+static void freearray (lua_State *L, Table *t, unsigned int asize) {
+  if (asize > 0) {
+#if !defined(LUA_NANBOXING)
+    luaM_freemem(L, t->array - asize, arraysize(asize));
+#else
+    luaM_freemem(L, t->array, arraysize(asize));
+#endif
+  }
 }
 
 
@@ -507,8 +1228,23 @@ void luaH_resize (lua_State *L, Table *t, unsigned int newasize,
                                           unsigned int nhsize) {
   unsigned int i;
   Table newt;  /* to keep the new hash part */
-  unsigned int oldasize = setlimittosize(t);
-  TValue *newarray;
+  unsigned int oldasize;
+  Value *newarray;
+  luaC_tablemoved(L, t);
+#if defined(LUA_USE_INCRHASH)
+  finishmigration(L, t);  /* work with a single hash part */
+#endif
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(t)) {
+    if (nhsize <= MAXSHAPEKEYS && newasize >= luaH_realasize(t))
+      nhsize = 0;  /* keep the shape; its keys need no hash part */
+    else {
+      nhsize += t->shape->nkeys;  /* make room for the keys in the shape */
+      unshape(L, t);
+    }
+  }
+#endif
+  oldasize = setlimittosize(t);
   /* create new hash part with appropriate size into 'newt' */
   setnodevector(L, &newt, nhsize);
   if (newasize < oldasize) {  /* will array shrink? */
@@ -516,14 +1252,17 @@ void luaH_resize (lua_State *L, Table *t, unsigned int newasize,
     exchangehashpart(t, &newt);  /* and new hash */
     /* re-insert into the new hash the elements from vanishing slice */
     for (i = newasize; i < oldasize; i++) {
-      if (!isempty(&t->array[i]))
-        luaH_setint(L, t, i + 1, &t->array[i]);
+      if (!arrayisempty(t, i)) {
+        TValue aux;
+        arr2obj(t, i, &aux);
+        luaH_setint(L, t, i + 1, &aux);
+      }
     }
     t->alimit = oldasize;  /* restore current size... */
     exchangehashpart(t, &newt);  /* and hash (in case of errors) */
   }
   /* allocate new array */
-  newarray = luaM_reallocvector(L, t->array, oldasize, newasize, TValue);
+  newarray = resizearray(L, t, oldasize, newasize);
   if (unlikely(newarray == NULL && newasize > 0)) {  /* allocation failed? */
     freehash(L, &newt);  /* release new hash part */
     luaM_error(L);  /* raise error (with array unchanged) */
@@ -533,7 +1272,7 @@ void luaH_resize (lua_State *L, Table *t, unsigned int newasize,
   t->array = newarray;  /* set new array part */
   t->alimit = newasize;
   for (i = oldasize; i < newasize; i++)  /* clear new slice of the array */
-     setempty(&t->array[i]);
+     setarrayempty(t, i);
   /* re-insert elements from old hash part into new parts */
   reinsert(L, &newt, t);  /* 'newt' now has the old hash */
   freehash(L, &newt);  /* free old hash part */
@@ -541,7 +1280,7 @@ void luaH_resize (lua_State *L, Table *t, unsigned int newasize,
 
 
 void luaH_resizearray (lua_State *L, Table *t, unsigned int nasize) {
-  int nsize = allocsizenode(t);
+  int nsize = maxload(allocsizenode(t));  /* keep the same hash size */
   luaH_resize(L, t, nasize, nsize);
 }
 
@@ -554,6 +1293,11 @@ static void rehash (lua_State *L, Table *t, const TValue *ek) {
   unsigned int nums[MAXABITS + 1];
   int i;
   int totaluse;
+#if defined(LUA_USE_INCRHASH)
+  finishmigration(L, t);  /* (should not be needed) */
+  if (growincr(L, t, ek))
+    return;  /* hash part will grow incrementally */
+#endif
   for (i = 0; i <= MAXABITS; i++) nums[i] = 0;  /* reset counts */
   setlimittosize(t);
   na = numusearray(t, nums);  /* count keys in array part */
@@ -565,8 +1309,15 @@ static void rehash (lua_State *L, Table *t, const TValue *ek) {
   totaluse++;
   /* compute new size for array part */
   asize = computesizes(nums, &na);
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(t) && totaluse - na > 0) {  /* some key goes to the hash? */
+    totaluse += t->shape->nkeys;  /* hash must have room for shape keys */
+    unshape(L, t);
+  }
+#endif
   /* resize the table to new computed sizes */
   luaH_resize(L, t, asize, totaluse - na);
+  feedsite(t);
 }
 
 
@@ -584,17 +1335,64 @@ Table *luaH_new (lua_State *L) {
   t->array = NULL;
   t->alimit = 0;
   setnodevector(L, t, 0);
+#if defined(LUA_USE_INCRHASH)
+  t->oldhash = NULL;
+#endif
+#if defined(LUA_USE_SIZEHINTS)
+  t->site = NULL;
+#endif
+#if defined(LUA_USE_SHAPES)
+  t->shape = &G(L)->rootshape;  /* start with the empty shape */
+  t->shape->nref++;
+  t->slots = NULL;
+  t->sizeslots = 0;
+#endif
+#if defined(LUA_USE_CARDS)
+  t->cards = NULL;
+#endif
   return t;
 }
 
 
 void luaH_free (lua_State *L, Table *t) {
+#if defined(LUA_USE_CARDS)
+  if (t->cards != NULL)
+    luaC_freecards(L, t);  /* (before its parts, which give its size) */
+#endif
   freehash(L, t);
-  luaM_freearray(L, t->array, luaH_realasize(t));
+#if defined(LUA_USE_INCRHASH)
+  if (t->oldhash != NULL) {
+    freehash(L, t->oldhash);
+    luaM_free(L, t->oldhash);
+  }
+#endif
+  freearray(L, t, luaH_realasize(t));
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(t))
+    freeshape(L, t);
+  else if (t->slots != NULL)  /* shape released by 'luaH_releaseshape'? */
+    luaM_freearray(L, t->slots, t->sizeslots);
+#endif
   luaM_free(L, t);
 }
 
 
+#if defined(LUA_USE_SHAPES)
+/*
+** Release the shape of a dead table, keeping its slots to be freed by
+** 'luaH_free'. (The shape tree is shared by all tables, while
+** 'luaH_free' may then run in another thread; see 'lgc.c'.)
+*/
+void luaH_releaseshape (lua_State *L, Table *t) {
+  if (isshaped(t)) {
+    releaseshape(L, t->shape);
+    t->shape = NULL;
+  }
+}
+#endif
+
+
+#if !defined(LUA_USE_SWISSTABLE)
 static Node *getfreepos (Table *t) {
   if (!isdummy(t)) {
     while (t->lastfree > t->node) {
@@ -605,17 +1403,43 @@ static Node *getfreepos (Table *t) {
   }
   return NULL;  /* could not find a free place */
 }
+#endif
 
 
 
+/*
+** Returns the index (base 1) of integer key 'key' if it lives in the
+** array part of 't', 0 otherwise. If 'key' is inside 'alimit', it is
+** in the array part. Otherwise, if 'alimit' is not equal to the real
+** size of the array, key still can be in the array part. In this case,
+** try to avoid a call to 'luaH_realasize' when key is just one more
+** than the limit (so that it can be incremented without changing the
+** real size of the array).
+*/
+static unsigned int keyinarray (Table *t, lua_Integer key) {
+  if (l_castS2U(key) - 1u < t->alimit)  /* (1 <= key && key <= t->alimit)? */
+    return cast_uint(key);
+  else if (!limitequalsasize(t) &&  /* key still may be in the array part? */
+           (l_castS2U(key) == t->alimit + 1 ||
+            l_castS2U(key) - 1u < luaH_realasize(t))) {
+    t->alimit = cast_uint(key);  /* probably '#t' is here now */
+    return cast_uint(key);
+  }
+  else return 0;
+}
+
+
 /*
 ** inserts a new key into a hash table; first, check whether key's main
 ** position is free. If not, check whether colliding node is in its main
 ** position or not: if it is not, move colliding node to an empty place and
 ** put new key in its main position; otherwise (colliding node is in its main
-** position), new key goes to an empty position.
+** position), new key goes to an empty position. Integer keys inside
+** the array part are not really new: they go directly to their entries.
+** (With LUA_USE_SWISSTABLE, the new key simply goes to the first empty
+** node in its probe sequence.)
 */
-TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
+void luaH_newkey (lua_State *L, Table *t, const TValue *key, TValue *value) {
   Node *mp;
   TValue aux;
   if (unlikely(ttisnil(key)))
@@ -630,6 +1454,33 @@ TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
     else if (unlikely(luai_numisnan(f)))
       luaG_runerror(L, "table index is NaN");
   }
+#if defined(LUA_USE_STRVIEWS)
+  else if (ttislngstring(key))
+    luaS_terminate(L, tsvalue(key));  /* a view gets its own bytes */
+#endif
+  if (ttisinteger(key)) {
+    unsigned int k = keyinarray(t, ivalue(key));
+    if (k != 0) {  /* key goes to the array part? */
+      obj2arr(t, k - 1, value);
+      return;
+    }
+  }
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(t)) {
+    if (ttisshrstring(key) && t->shape->nkeys < MAXSHAPEKEYS) {
+      addtoshape(L, t, tsvalue(key), value);
+      return;
+    }
+    else if (!ttisinteger(key))
+      unshape(L, t);  /* key does not fit in a shape */
+    /* else 'rehash' will decide whether the key can go to the array */
+  }
+#endif
+#if defined(LUA_USE_INCRHASH)
+  if (t->oldhash != NULL)  /* hash part growing incrementally? */
+    migrate(L, t, MIGRATESTEP);  /* move some more old nodes */
+#endif
+#if !defined(LUA_USE_SWISSTABLE)
   mp = mainpositionTV(t, key);
   if (!isempty(gval(mp)) || isdummy(t)) {  /* main position is taken? */
     Node *othern;
@@ -637,12 +1488,14 @@ TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
     if (f == NULL) {  /* cannot find a free place? */
       rehash(L, t, key);  /* grow table */
       /* whatever called 'newkey' takes care of TM cache */
-      return luaH_set(L, t, key);  /* insert key into grown table */
+      luaH_set(L, t, key, value);  /* insert key into grown table */
+      return;
     }
     lua_assert(!isdummy(t));
     othern = mainposition(t, keytt(mp), &keyval(mp));
     if (othern != mp) {  /* is colliding node out of its main position? */
       /* yes; move colliding node into free position */
+      luaC_nodemoved(L, t, mp, f);
       while (othern + gnext(othern) != mp)  /* find previous */
         othern += gnext(othern);
       gnext(othern) = cast_int(f - othern);  /* rechain to point to 'f' */
@@ -662,43 +1515,89 @@ TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key) {
       mp = f;
     }
   }
+#else
+  if (t->growthleft == 0) {  /* no more free nodes? (or dummy node) */
+    rehash(L, t, key);  /* grow table */
+    /* whatever called 'newkey' takes care of TM cache */
+    luaH_set(L, t, key, value);  /* insert key into grown table */
+    return;
+  }
+  else {
+    unsigned int h = hashkeyTV(key);
+    mp = getfreenode(t, h);
+    t->ctrl[mp - t->node] = hashctrl(h);
+    t->growthleft--;
+  }
+#endif
   setnodekey(L, mp, key);
-  luaC_barrierback(L, obj2gco(t), key);
+  luaC_barrierslot(L, t, gval(mp), key);
   lua_assert(isempty(gval(mp)));
-  return gval(mp);
+  setobj2t(L, gval(mp), value);
 }
 
 
 /*
-** Search function for integers. If integer is inside 'alimit', get it
-** directly from the array part. Otherwise, if 'alimit' is not equal to
-** the real size of the array, key still can be in the array part. In
-** this case, try to avoid a call to 'luaH_realasize' when key is just
-** one more than the limit (so that it can be incremented without
-** changing the real size of the array).
+** Search function for integers in the hash part.
 */
-const TValue *luaH_getint (Table *t, lua_Integer key) {
-  if (l_castS2U(key) - 1u < t->alimit)  /* (1 <= key && key <= t->alimit)? */
-    return &t->array[key - 1];
-  else if (!limitequalsasize(t) &&  /* key still may be in the array part? */
-           (l_castS2U(key) == t->alimit + 1 ||
-            l_castS2U(key) - 1u < luaH_realasize(t))) {
-    t->alimit = cast_uint(key);  /* probably '#t' is here now */
-    return &t->array[key - 1];
+static const TValue *getintfromhash (Table *t, lua_Integer key) {
+#if !defined(LUA_USE_SWISSTABLE)
+  Node *n = hashint(t, key);
+  for (;;) {  /* check whether 'key' is somewhere in the chain */
+    if (keyisinteger(n) && keyival(n) == key)
+      return gval(n);  /* that's it */
+    else {
+      int nx = gnext(n);
+      if (nx == 0) break;
+      n += nx;
+    }
   }
-  else {
-    Node *n = hashint(t, key);
-    for (;;) {  /* check whether 'key' is somewhere in the chain */
+#else
+  unsigned int h = hashint(key);
+  unsigned int g = firstgroup(t, h);
+  unsigned int step = 0;
+  for (;;) {  /* check whether 'key' is somewhere in the probed groups */
+    const lu_byte *ctrl = groupctrl(t, g);
+    unsigned int m;
+    for (m = matchgroup(ctrl, hashctrl(h)); m != 0; m &= m - 1) {
+      Node *n = groupnode(t, g, lowestbit(m));
       if (keyisinteger(n) && keyival(n) == key)
         return gval(n);  /* that's it */
-      else {
-        int nx = gnext(n);
-        if (nx == 0) break;
-        n += nx;
-      }
     }
-    return &absentkey;
+    if (matchgroup(ctrl, CTRL_EMPTY) != 0 || step == numgroups(t) - 1)
+      break;
+    g = nextgroup(t, g, ++step);
+  }
+#endif
+  return notfound(t, getintfromhash, key);
+}
+
+
+/*
+** Copy the value of slot 'slot' to 'res', if it is not empty. Returns
+** true iff there was a value to copy.
+*/
+static int finishget (const TValue *slot, TValue *res) {
+  if (isempty(slot))
+    return 0;
+  setobj(cast(lua_State *, NULL), res, slot);
+  return 1;
+}
+
+
+/*
+** Search function for integers. If 't[key]' is present, copy it to
+** 'res' and return 1; otherwise, return 0 (leaving 'res' untouched).
+*/
+int luaH_getint (Table *t, lua_Integer key, TValue *res) {
+  unsigned int k = keyinarray(t, key);
+  if (k != 0) {
+    if (arrayisempty(t, k - 1))
+      return 0;
+    arr2obj(t, k - 1, res);
+    return 1;
   }
+  else
+    return finishget(getintfromhash(t, key), res);
 }
 
 
@@ -706,18 +1605,68 @@ const TValue *luaH_getint (Table *t, lua_Integer key) {
 ** search function for short strings
 */
 const TValue *luaH_getshortstr (Table *t, TString *key) {
-  Node *n = hashstr(t, key);
+#if !defined(LUA_USE_SWISSTABLE)
+  Node *n;
+#else
+  unsigned int h, g, step;
+#endif
   lua_assert(key->tt == LUA_TSHRSTR);
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(t))
+    return getfromshape(t, key);
+#endif
+#if !defined(LUA_USE_SWISSTABLE)
+  n = hashstr(t, key);
   for (;;) {  /* check whether 'key' is somewhere in the chain */
     if (keyisshrstr(n) && eqshrstr(keystrval(n), key))
       return gval(n);  /* that's it */
     else {
       int nx = gnext(n);
       if (nx == 0)
-        return &absentkey;  /* not found */
+        return notfound(t, luaH_getshortstr, key);  /* not found */
       n += nx;
     }
   }
+#else
+  h = mixhash(key->hash);
+  g = firstgroup(t, h);
+  step = 0;
+  for (;;) {  /* check whether 'key' is somewhere in the probed groups */
+    const lu_byte *ctrl = groupctrl(t, g);
+    unsigned int m;
+    for (m = matchgroup(ctrl, hashctrl(h)); m != 0; m &= m - 1) {
+      Node *n = groupnode(t, g, lowestbit(m));
+      if (keyisshrstr(n) && eqshrstr(keystrval(n), key))
+        return gval(n);  /* that's it */
+    }
+    if (matchgroup(ctrl, CTRL_EMPTY) != 0 || step == numgroups(t) - 1)
+      return notfound(t, luaH_getshortstr, key);  /* not found */
+    g = nextgroup(t, g, ++step);
+  }
+#endif
+}
+
+
+/*
+** Search function for short strings that also updates an inline
+** cache: when the key is present, 'hint' gets the index of its node.
+*/
+const TValue *luaH_getshortstrIC (Table *t, TString *key,
+                                            unsigned int *hint) {
+  const TValue *slot = luaH_getshortstr(t, key);
+#if defined(LUA_USE_INCRHASH)
+  if (t->oldhash != NULL)  /* 'slot' may be in the old hash part? */
+    return slot;  /* keep the old hint */
+#endif
+  if (!isabstkey(slot)) {
+#if defined(LUA_USE_SHAPES)
+    if (isshaped(t))
+      *hint = cast_uint(slot - t->slots);
+    else
+#endif
+    *hint = cast_uint(nodefromval(slot) - t->node);
+  }
+  return slot;
 }
 
 
@@ -733,48 +1682,159 @@ const TValue *luaH_getstr (Table *t, TString *key) {
 
 
 /*
-** main search function
+** main search function: if 't[key]' is present, copy it to 'res' and
+** return 1; otherwise, return 0.
+*/
+int luaH_get (Table *t, const TValue *key, TValue *res) {
+  const TValue *slot;
+  switch (ttypetag(key)) {
+    case LUA_TSHRSTR: slot = luaH_getshortstr(t, tsvalue(key)); break;
+    case LUA_TNUMINT: return luaH_getint(t, ivalue(key), res);
+    case LUA_TNIL: return 0;
+    case LUA_TNUMFLT: {
+      lua_Integer k;
+      if (luaV_flttointeger(fltvalue(key), &k, 0)) /* index is an integral? */
+        return luaH_getint(t, k, res);  /* use specialized version */
+      /* else... */
+    }  /* FALLTHROUGH */
+    default:
+      slot = getgeneric(t, key);
+      break;
+  }
+  return finishget(slot, res);
+}
+
+
+#if defined(LUA_USE_CARDS)
+/*
+** Position of the entry for 'key' in 't', counting the slots of the
+** array part first and then the nodes (see 'lgc.c'), or -1 if the
+** entry is not in one of them.
+*/
+int luaH_slotindex (Table *t, const TValue *key) {
+  const TValue *slot;
+  Node *n;
+  int isint = ttisinteger(key);
+  lua_Integer k = isint ? ivalue(key) : 0;
+  if (ttisfloat(key))
+    isint = luaV_flttointeger(fltvalue(key), &k, 0);
+  if (isint) {
+    unsigned int ak = keyinarray(t, k);
+    if (ak != 0)  /* key is in the array part? */
+      return cast_int(ak - 1);
+    slot = getintfromhash(t, k);
+  }
+  else if (ttisshrstring(key))
+    slot = luaH_getshortstr(t, tsvalue(key));
+  else if (ttisnil(key))
+    return -1;
+  else
+    slot = getgeneric(t, key);
+  n = nodefromval(slot);
+  if (gnode(t, 0) <= n && n < gnode(t, sizenode(t)))  /* slot is a node? */
+    return cast_int(luaH_realasize(t) + cast_uint(n - gnode(t, 0)));
+  else
+    return -1;  /* absent key, shape slot, or old hash part */
+}
+#endif
+
+
+/*
+** Assign 'value' to slot 'slot' if it is not empty. Returns NULL if
+** the assignment was done, or 'slot' itself otherwise.
+*/
+static const TValue *finishpset (const TValue *slot, TValue *value) {
+  if (isempty(slot))
+    return slot;
+  setobj2t(cast(lua_State *, NULL), cast(TValue *, slot), value);
+  return NULL;
+}
+
+
+/*
+** "Protected" set for integer keys: if 't[key]' is present, assign
+** 'value' to it and return NULL. (Only an assignment to a present entry
+** can skip the checks for '__newindex' and for a new key.) Otherwise,
+** return the empty slot for 't[key]' in the hash part, or an absent key
+** (also for empty entries in the array part), to be handed to
+** 'luaH_finishset'. Beware: the caller must take care of the GC barrier.
+*/
+const TValue *luaH_psetint (Table *t, lua_Integer key, TValue *value) {
+  unsigned int k = keyinarray(t, key);
+  if (k != 0) {
+    if (arrayisempty(t, k - 1))
+      return &absentkey;  /* 'luaH_newkey' will fill the entry */
+    obj2arr(t, k - 1, value);
+    return NULL;
+  }
+  else
+    return finishpset(getintfromhash(t, key), value);
+}
+
+
+/*
+** "Protected" set for generic keys (see 'luaH_psetint').
 */
-const TValue *luaH_get (Table *t, const TValue *key) {
+const TValue *luaH_pset (Table *t, const TValue *key, TValue *value) {
   switch (ttypetag(key)) {
-    case LUA_TSHRSTR: return luaH_getshortstr(t, tsvalue(key));
-    case LUA_TNUMINT: return luaH_getint(t, ivalue(key));
+    case LUA_TSHRSTR:
+      return finishpset(luaH_getshortstr(t, tsvalue(key)), value);
+    case LUA_TNUMINT: return luaH_psetint(t, ivalue(key), value);
     case LUA_TNIL: return &absentkey;
     case LUA_TNUMFLT: {
       lua_Integer k;
       if (luaV_flttointeger(fltvalue(key), &k, 0)) /* index is an integral? */
-        return luaH_getint(t, k);  /* use specialized version */
+        return luaH_psetint(t, k, value);  /* use specialized version */
       /* else... */
     }  /* FALLTHROUGH */
     default:
-      return getgeneric(t, key);
+      return finishpset(getgeneric(t, key), value);
   }
 }
 
 
+/*
+** Finish an assignment 't[key] = value' that a "protected" set could
+** not do: 'slot' is the empty entry for 'key' or an absent key.
+** beware: when using this function you probably need to check a GC
+** barrier and invalidate the TM cache.
+*/
+void luaH_finishset (lua_State *L, Table *t, const TValue *key,
+                                   const TValue *slot, TValue *value) {
+  if (isabstkey(slot))
+    luaH_newkey(L, t, key, value);
+  else
+    setobj2t(L, cast(TValue *, slot), value);
+}
+
+
 /*
 ** beware: when using this function you probably need to check a GC
 ** barrier and invalidate the TM cache.
 */
-TValue *luaH_set (lua_State *L, Table *t, const TValue *key) {
-  const TValue *p = luaH_get(t, key);
-  if (!isabstkey(p))
-    return cast(TValue *, p);
-  else return luaH_newkey(L, t, key);
+void luaH_set (lua_State *L, Table *t, const TValue *key, TValue *value) {
+  const TValue *slot = luaH_pset(t, key, value);
+  if (slot != NULL)
+    luaH_finishset(L, t, key, slot, value);
 }
 
 
 void luaH_setint (lua_State *L, Table *t, lua_Integer key, TValue *value) {
-  const TValue *p = luaH_getint(t, key);
-  TValue *cell;
-  if (!isabstkey(p))
-    cell = cast(TValue *, p);
-  else {
+  const TValue *slot = luaH_psetint(t, key, value);
+  if (slot != NULL) {
     TValue k;
     setivalue(&k, key);
-    cell = luaH_newkey(L, t, &k);
+    luaH_finishset(L, t, &k, slot, value);
   }
-  setobj2t(L, cell, value);
+}
+
+
+/*
+** Check whether key 'key' is absent from the hash part of 't'. (Used
+** only for keys after the array part.)
+*/
+static int hashkeyisempty (Table *t, lua_Unsigned key) {
+  return isempty(getintfromhash(t, l_castU2S(key)));
 }
 
 
@@ -800,27 +1860,27 @@ static lua_Unsigned hash_search (Table *t, lua_Unsigned j) {
       j *= 2;
     else {
       j = LUA_MAXINTEGER;
-      if (isempty(luaH_getint(t, j)))  /* t[j] not present? */
+      if (hashkeyisempty(t, j))  /* t[j] not present? */
         break;  /* 'j' now is an absent index */
       else  /* weird case */
         return j;  /* well, max integer is a boundary... */
     }
-  } while (!isempty(luaH_getint(t, j)));  /* repeat until an absent t[j] */
+  } while (!hashkeyisempty(t, j));  /* repeat until an absent t[j] */
   /* i < j  &&  t[i] present  &&  t[j] absent */
   while (j - i > 1u) {  /* do a binary search between them */
     lua_Unsigned m = (i + j) / 2;
-    if (isempty(luaH_getint(t, m))) j = m;
+    if (hashkeyisempty(t, m)) j = m;
     else i = m;
   }
   return i;
 }
 
 
-static unsigned int binsearch (const TValue *array, unsigned int i,
-                                                    unsigned int j) {
+static unsigned int binsearch (const Table *t, unsigned int i,
+                                                unsigned int j) {
   while (j - i > 1u) {  /* binary search */
     unsigned int m = (i + j) / 2;
-    if (isempty(&array[m - 1])) j = m;
+    if (arrayisempty(t, m - 1)) j = m;
     else i = m;
   }
   return i;
@@ -859,9 +1919,9 @@ static unsigned int binsearch (const TValue *array, unsigned int i,
 */
 lua_Unsigned luaH_getn (Table *t) {
   unsigned int limit = t->alimit;
-  if (limit > 0 && isempty(&t->array[limit - 1])) {
+  if (limit > 0 && arrayisempty(t, limit - 1)) {
     /* (1) there must be a boundary before 'limit' */
-    if (limit >= 2 && !isempty(&t->array[limit - 2])) {
+    if (limit >= 2 && !arrayisempty(t, limit - 2)) {
       /* 'limit - 1' is a boundary; can it be a new limit? */
       if (ispow2realasize(t) && !ispow2(limit - 1)) {
         t->alimit = limit - 1;
@@ -870,7 +1930,7 @@ lua_Unsigned luaH_getn (Table *t) {
       return limit - 1;
     }
     else {  /* must search for a boundary in [0, limit] */
-      unsigned int boundary = binsearch(t->array, 0, limit);
+      unsigned int boundary = binsearch(t, 0, limit);
       /* can this boundary represent the real size of the array? */
       if (ispow2realasize(t) && boundary > luaH_realasize(t) / 2) {
         t->alimit = boundary;  /* use it as the new limit */
@@ -882,14 +1942,14 @@ lua_Unsigned luaH_getn (Table *t) {
   /* 'limit' is zero or present in table */
   if (!limitequalsasize(t)) {
     /* (2) 'limit' > 0 and array has more elements after 'limit' */
-    if (isempty(&t->array[limit]))  /* 'limit + 1' is empty? */
+    if (arrayisempty(t, limit))  /* 'limit + 1' is empty? */
       return limit;  /* this is the boundary */
     /* else, try last element in the array */
     limit = luaH_realasize(t);
-    if (isempty(&t->array[limit - 1])) {  /* empty? */
+    if (arrayisempty(t, limit - 1)) {  /* empty? */
       /* there must be a boundary in the array after old limit,
          and it must be a valid new limit */
-      unsigned int boundary = binsearch(t->array, t->alimit, limit);
+      unsigned int boundary = binsearch(t, t->alimit, limit);
       t->alimit = boundary;
       return boundary;
     }
@@ -897,8 +1957,8 @@ lua_Unsigned luaH_getn (Table *t) {
   }
   /* (3) 'limit' is the last element and either is zero or present in table */
   lua_assert(limit == luaH_realasize(t) &&
-             (limit == 0 || !isempty(&t->array[limit - 1])));
-  if (isdummy(t) || isempty(luaH_getint(t, cast(lua_Integer, limit + 1))))
+             (limit == 0 || !arrayisempty(t, limit - 1)));
+  if (isdummy(t) || hashkeyisempty(t, limit + 1))
     return limit;  /* 'limit + 1' is absent... */
   else  /* 'limit + 1' is also present */
     return hash_search(t, limit);
@@ -909,7 +1969,11 @@ lua_Unsigned luaH_getn (Table *t) {
 #if defined(LUA_DEBUG)
 
 Node *luaH_mainposition (const Table *t, const TValue *key) {
+#if !defined(LUA_USE_SWISSTABLE)
   return mainpositionTV(t, key);
+#else
+  return groupnode(t, firstgroup(t, hashkeyTV(key)), 0);  /* first group */
+#endif
 }
 
 int luaH_isdummy (const Table *t) { return isdummy(t); }
@@ -19,30 +19,149 @@
 
 
 /* true when 't' is using 'dummynode' as its hash part */
+#if !defined(LUA_USE_SWISSTABLE)
 #define isdummy(t)		((t)->lastfree == NULL)
+#else
+/* number of control bytes compared at once by a search */
+#define GROUPSIZE	16
+
+LUAI_DDEC(const lu_byte luaH_dummyctrl[GROUPSIZE];)
+
+#define isdummy(t)		((t)->ctrl == luaH_dummyctrl)
+#endif
 
 
 /* allocated size for hash nodes */
 #define allocsizenode(t)	(isdummy(t) ? 0 : sizenode(t))
 
 
+/*
+** Next hash part of 't' to be traversed: while 't' grows incrementally,
+** its old hash part (see 'ltable.c') follows the new one.
+*/
+#if defined(LUA_USE_INCRHASH)
+#define nexthashpart(t)		((t)->oldhash)
+#else
+#define nexthashpart(t)		NULL
+#endif
+
+
 /* returns the Node, given the value of a table entry */
 #define nodefromval(v) 	cast(Node *, (v))
 
 
-LUAI_FUNC const TValue *luaH_getint (Table *t, lua_Integer key);
+#if defined(LUA_USE_SHAPES)
+
+/* true when table 't' keeps its short-string keys in a shape */
+#define isshaped(t)		((t)->shape != NULL)
+
+/*
+** true when position 'hint' of table 't' (a slot, if it has a shape,
+** or a node otherwise) holds the short-string key 'key'
+*/
+#define luaH_hintmatches(t,key,hint)  \
+	(isshaped(t)  \
+	 ? (hint) < (t)->shape->nkeys && (t)->shape->keys[hint] == (key)  \
+	 : ((hint) < cast_uint(sizenode(t)) && keyisshrstr(gnode(t, hint)) &&  \
+	    eqshrstr(keystrval(gnode(t, hint)), key)))
+
+/* value at position 'hint' of table 't' */
+#define luaH_hintslot(t,hint)  \
+	(isshaped(t) ? &(t)->slots[hint] : gval(gnode(t, hint)))
+
+#else
+
+#define isshaped(t)		0
+
+/* true when node 'hint' of table 't' holds the short-string key 'key' */
+#define luaH_hintmatches(t,key,hint)  \
+	((hint) < cast_uint(sizenode(t)) && keyisshrstr(gnode(t, hint)) &&  \
+	 eqshrstr(keystrval(gnode(t, hint)), key))
+
+#define luaH_hintslot(t,hint)	gval(gnode(t, hint))
+
+#endif
+
+
+/*
+** Access to the array part. Entries in the array part are not TValues:
+** values and tags are kept in two separate vectors, so that each entry
+** takes 'sizeof(Value) + 1' bytes instead of a padded TValue. Both
+** vectors share one block, and 'array' points to the middle of it:
+** values are stored backwards just below 'array' and tags forwards
+** just above it, so that entry 'k' (base 0) can be found without
+** knowing the size of the array. As there is no TValue to point to,
+** code outside this module copies entries with 'arr2obj'/'obj2arr'.
+*/
+#if !defined(LUA_NANBOXING)
+
+#define arrval(t,k)	((t)->array - 1 - (k))
+#define arrtag(t,k)	(cast(lu_byte *, (t)->array) + (k))
+
+#define arrayisempty(t,k)	tagisempty(*arrtag(t,k))
+#define setarrayempty(t,k)	(*arrtag(t,k) = LUA_TEMPTY)
+
+#define arr2obj(t,k,o)  \
+	(val_(o) = *arrval(t,k), settt_(o, *arrtag(t,k)))
+#define obj2arr(t,k,o)  \
+	(*arrval(t,k) = val_(o), *arrtag(t,k) = rawtt(o))
+
+/* size of an array part with 'n' entries */
+#define arraysize(n)	(cast_sizet(n) * (sizeof(Value) + 1))
+
+#else
+
+/* with NaN boxing a TValue is as small as a Value; keep it whole */
+#define arrobj(t,k)	(cast(TValue *, (t)->array) + (k))
+
+#define arrayisempty(t,k)	isempty(arrobj(t,k))
+#define setarrayempty(t,k)	setempty(arrobj(t,k))
+
+#define arr2obj(t,k,o)		(*(o) = *arrobj(t,k))
+#define obj2arr(t,k,o)		(*arrobj(t,k) = *(o))
+
+#define arraysize(n)	(cast_sizet(n) * sizeof(TValue))
+
+#endif
+
+
+/* absent key returned by lookups that fail (see 'luaV_fastgeti') */
+LUAI_DDEC(const TValue luaH_absentkey;)
+
+
+LUAI_FUNC int luaH_getint (Table *t, lua_Integer key, TValue *res);
 LUAI_FUNC void luaH_setint (lua_State *L, Table *t, lua_Integer key,
                                                     TValue *value);
 LUAI_FUNC const TValue *luaH_getshortstr (Table *t, TString *key);
+LUAI_FUNC const TValue *luaH_getshortstrIC (Table *t, TString *key,
+                                                      unsigned int *hint);
 LUAI_FUNC const TValue *luaH_getstr (Table *t, TString *key);
-LUAI_FUNC const TValue *luaH_get (Table *t, const TValue *key);
-LUAI_FUNC TValue *luaH_newkey (lua_State *L, Table *t, const TValue *key);
-LUAI_FUNC TValue *luaH_set (lua_State *L, Table *t, const TValue *key);
+LUAI_FUNC int luaH_get (Table *t, const TValue *key, TValue *res);
+#if defined(LUA_USE_CARDS)
+LUAI_FUNC int luaH_slotindex (Table *t, const TValue *key);
+#endif
+LUAI_FUNC const TValue *luaH_psetint (Table *t, lua_Integer key,
+                                                TValue *value);
+LUAI_FUNC const TValue *luaH_pset (Table *t, const TValue *key,
+                                             TValue *value);
+LUAI_FUNC void luaH_finishset (lua_State *L, Table *t, const TValue *key,
+                                       const TValue *slot, TValue *value);
+LUAI_FUNC void luaH_newkey (lua_State *L, Table *t, const TValue *key,
+                                                    TValue *value);
+LUAI_FUNC void luaH_set (lua_State *L, Table *t, const TValue *key,
+                                                 TValue *value);
 LUAI_FUNC Table *luaH_new (lua_State *L);
 LUAI_FUNC void luaH_resize (lua_State *L, Table *t, unsigned int nasize,
                                                     unsigned int nhsize);
 LUAI_FUNC void luaH_resizearray (lua_State *L, Table *t, unsigned int nasize);
+#if defined(LUA_USE_SIZEHINTS)
+LUAI_FUNC void luaH_presize (lua_State *L, Table *t, Proto *p, int pc,
+                             unsigned int nasize, unsigned int nhsize);
+#endif
 LUAI_FUNC void luaH_free (lua_State *L, Table *t);
+#if defined(LUA_USE_SHAPES)
+LUAI_FUNC void luaH_releaseshape (lua_State *L, Table *t);
+#endif
 LUAI_FUNC int luaH_next (lua_State *L, Table *t, StkId key);
 LUAI_FUNC lua_Unsigned luaH_getn (Table *t);
 LUAI_FUNC unsigned int luaH_realasize (const Table *t);
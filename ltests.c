@@ -104,6 +104,8 @@ typedef union Header {
 Memcontrol l_memcontrol =
   {0L, 0L, 0L, 0L, (~0L), {0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L, 0L}};
 
+ICachestats l_icachestats = {0L, 0L};
+
 
 static void freeblock (Memcontrol *mc, Header *block) {
   if (block) {
@@ -120,7 +122,7 @@ static void freeblock (Memcontrol *mc, Header *block) {
 }
 
 
-void *debug_realloc (void *ud, void *b, size_t oldsize, size_t size) {
+static void *realloc_ (void *ud, void *b, size_t oldsize, size_t size) {
   Memcontrol *mc = cast(Memcontrol *, ud);
   Header *block = cast(Header *, b);
   int type;
@@ -177,6 +179,27 @@ void *debug_realloc (void *ud, void *b, size_t oldsize, size_t size) {
 }
 
 
+#if defined(LUA_USE_BGSWEEP)
+/* the sweeper thread also frees blocks (see 'lgc.c') */
+#include <pthread.h>
+static pthread_mutex_t memlock = PTHREAD_MUTEX_INITIALIZER;
+#define lockmem()	pthread_mutex_lock(&memlock)
+#define unlockmem()	pthread_mutex_unlock(&memlock)
+#else
+#define lockmem()	((void)0)
+#define unlockmem()	((void)0)
+#endif
+
+
+void *debug_realloc (void *ud, void *b, size_t oldsize, size_t size) {
+  void *res;
+  lockmem();
+  res = realloc_(ud, b, oldsize, size);
+  unlockmem();
+  return res;
+}
+
+
 /* }====================================================================== */
 
 
@@ -201,6 +224,10 @@ static int testobjref1 (global_State *g, GCObject *f, GCObject *t) {
   if (isdead(g,t)) return 0;
   if (issweepphase(g))
     return 1;  /* no invariants */
+#if defined(LUA_USE_GCBUDGET)
+  else if (g->gcpartial != NULL && f == obj2gco(g->gcpartial))
+    return 1;  /* table still being traversed in parts */
+#endif
   else if (g->gckind == KGC_INC)
     return !(isblack(f) && iswhite(t));  /* basic incremental invariant */
   else {  /* generational mode */
@@ -249,20 +276,33 @@ static void checkvalref (global_State *g, GCObject *f, const TValue *t) {
 static void checktable (global_State *g, Table *h) {
   unsigned int i;
   unsigned int asize = luaH_realasize(h);
-  Node *n, *limit = gnode(h, sizenode(h));
+  const Table *hp = h;  /* hash part being checked */
+  Node *n, *limit;
   GCObject *hgc = obj2gco(h);
   checkobjref(g, hgc, h->metatable);
-  for (i = 0; i < asize; i++)
-    checkvalref(g, hgc, &h->array[i]);
-  for (n = gnode(h, 0); n < limit; n++) {
-    if (!isempty(gval(n))) {
-      TValue k;
-      getnodekey(g->mainthread, &k, n);
-      lua_assert(!keyisnil(n));
-      checkvalref(g, hgc, &k);
-      checkvalref(g, hgc, gval(n));
+  for (i = 0; i < asize; i++) {
+    TValue v;
+    arr2obj(h, i, &v);
+    checkvalref(g, hgc, &v);
+  }
+  do {  /* traverse hash part(s) */
+    for (n = gnode(hp, 0), limit = gnode(hp, sizenode(hp)); n < limit; n++) {
+      if (!isempty(gval(n))) {
+        TValue k;
+        getnodekey(g->mainthread, &k, n);
+        lua_assert(!keyisnil(n));
+        checkvalref(g, hgc, &k);
+        checkvalref(g, hgc, gval(n));
+      }
     }
+  } while ((hp = nexthashpart(hp)) != NULL);
+#if defined(LUA_USE_SHAPES)
+  if (isshaped(h)) {
+    int j;
+    for (j = 0; j < h->shape->nkeys; j++)
+      checkvalref(g, hgc, &h->slots[j]);
   }
+#endif
 }
 
 
@@ -428,7 +468,13 @@ static void checkobject (global_State *g, GCObject *o, int maybedead,
 static void checkgraylist (global_State *g, GCObject *o) {
   ((void)g);  /* better to keep it available if we need to print an object */
   while (o) {
+#if !defined(LUA_USE_CARDS)
     lua_assert(isgray(o) || getage(o) == G_TOUCHED2);
+#else  /* a table marked only in its cards stays black */
+    lua_assert(isgray(o) || getage(o) == G_TOUCHED2 ||
+               (getage(o) == G_TOUCHED1 && o->tt == LUA_TTABLE &&
+                gco2t(o)->cards != NULL));
+#endif
     switch (o->tt) {
       case LUA_TTABLE: o = gco2t(o)->gclist; break;
       case LUA_TLCL: o = gco2lcl(o)->gclist; break;
@@ -695,6 +741,19 @@ static int alloc_count (lua_State *L) {
     l_memcontrol.countlimit = luaL_checkinteger(L, 1);
   return 0;
 }
+
+
+/*
+** Returns the number of hits and misses of the inline caches; with
+** a true argument, also resets them.
+*/
+static int icache_stats (lua_State *L) {
+  lua_pushinteger(L, l_icachestats.hits);
+  lua_pushinteger(L, l_icachestats.misses);
+  if (lua_toboolean(L, 1))
+    l_icachestats.hits = l_icachestats.misses = 0;
+  return 2;
+}
   
 
 static int settrick (lua_State *L) {
@@ -818,13 +877,19 @@ static int table_query (lua_State *L) {
   if (i == -1) {
     lua_pushinteger(L, asize);
     lua_pushinteger(L, allocsizenode(t));
+#if !defined(LUA_USE_SWISSTABLE)
     lua_pushinteger(L, isdummy(t) ? 0 : t->lastfree - t->node);
+#else
+    lua_pushinteger(L, t->growthleft);
+#endif
     lua_pushinteger(L, t->alimit);
     return 4;
   }
   else if ((unsigned int)i < asize) {
+    TValue v;
+    arr2obj(t, i, &v);
     lua_pushinteger(L, i);
-    pushobject(L, &t->array[i]);
+    pushobject(L, &v);
     lua_pushnil(L);
   }
   else if ((i -= asize) < sizenode(t)) {
@@ -1675,6 +1740,7 @@ static const struct luaL_Reg tests_funcs[] = {
   {"pobj", gc_printobj},
   {"getref", getref},
   {"hash", hash_query},
+  {"icachestats", icache_stats},
   {"int2fb", int2fb_aux},
   {"log2", log2_aux},
   {"limits", get_limits},
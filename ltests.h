@@ -66,6 +66,18 @@ typedef struct Memcontrol {
 LUA_API Memcontrol l_memcontrol;
 
 
+/* statistics for the inline caches of field accesses */
+typedef struct ICachestats {
+  unsigned long hits;
+  unsigned long misses;
+} ICachestats;
+
+LUA_API ICachestats l_icachestats;
+
+#define luai_icachehit(L)	((void)L, l_icachestats.hits++)
+#define luai_icachemiss(L)	((void)L, l_icachestats.misses++)
+
+
 /*
 ** generic variable for debug tricks
 */
@@ -234,6 +234,26 @@ LUA_API void  (lua_pushboolean) (lua_State *L, int b);
 LUA_API void  (lua_pushlightuserdata) (lua_State *L, void *p);
 LUA_API int   (lua_pushthread) (lua_State *L);
 
+#if defined(LUA_USE_APPENDSTR)
+/*
+** string buffers: C code writes into a buffer and pushes prefixes of
+** it as strings, without copying them
+*/
+LUA_API char *(lua_resizestrbuf) (lua_State *L, void **b, size_t len,
+                                                 size_t size);
+LUA_API void  (lua_pushstrbuf) (lua_State *L, void *b, size_t len);
+LUA_API void  (lua_freestrbuf) (lua_State *L, void *b);
+#endif
+
+#if defined(LUA_USE_STRVIEWS)
+/*
+** string views: large substrings share the bytes of their strings
+*/
+LUA_API void  (lua_pushsubstring) (lua_State *L, int idx, size_t i,
+                                                         size_t l);
+LUA_API const char *(lua_tobytes) (lua_State *L, int idx, size_t *len);
+#endif
+
 
 /*
 ** get functions (Lua -> stack)
@@ -311,10 +331,45 @@ LUA_API int (lua_isyieldable) (lua_State *L);
 #define LUA_GCISRUNNING		9
 #define LUA_GCGEN		10
 #define LUA_GCINC		11
+#define LUA_GCMARKERS		12
+#define LUA_GCBUDGET		13
+#define LUA_GCSTATS		14
+#define LUA_GCFINBUDGET		15
+#define LUA_GCDEFERFIN		16
+#define LUA_GCRUNFIN		17
 
 LUA_API int (lua_gc) (lua_State *L, int what, ...);
 
 
+/*
+** statistics of the collector (option LUA_GCSTATS); times are in
+** nanoseconds, and a pause is the time of one call to the collector
+*/
+
+/* phases of a collection */
+#define LUA_GCPPROPAGATE	0
+#define LUA_GCPATOMIC		1
+#define LUA_GCPSWEEP		2
+#define LUA_GCPCALLFIN		3
+#define LUA_GCNPHASES		4
+
+/* pauses in bucket 'i' took less than 2^i microseconds */
+#define LUA_GCNBUCKETS		20
+
+typedef struct lua_GCStats {
+  lua_Integer phasetime[LUA_GCNPHASES];  /* total time in each phase */
+  lua_Integer phasemax[LUA_GCNPHASES];  /* longest time in one pause */
+  lua_Integer ncycles;  /* complete cycles in incremental mode */
+  lua_Integer nminor;  /* minor collections in generational mode */
+  lua_Integer nmajor;  /* major collections in generational mode */
+  lua_Integer freed;  /* total bytes freed */
+  lua_Integer lastfreed;  /* bytes freed by the last collection */
+  lua_Integer npauses;  /* number of pauses */
+  lua_Integer maxpause;  /* longest pause */
+  lua_Integer pauses[LUA_GCNBUCKETS];  /* histogram of pause times */
+} lua_GCStats;
+
+
 /*
 ** miscellaneous functions
 */
@@ -331,6 +386,14 @@ LUA_API size_t   (lua_stringtonumber) (lua_State *L, const char *s);
 LUA_API lua_Alloc (lua_getallocf) (lua_State *L, void **ud);
 LUA_API void      (lua_setallocf) (lua_State *L, lua_Alloc f, void *ud);
 
+#if defined(LUA_USE_FASTHASH)
+/* how long strings are hashed */
+#define LUA_HASHSAMPLE	0	/* by a sample of their bytes */
+#define LUA_HASHALL	1	/* by all their bytes */
+
+LUA_API int (lua_hashmode) (lua_State *L, int mode);
+#endif
+
 
 /*
 ** {==============================================================
@@ -70,6 +70,221 @@
 #endif
 
 
+/*
+@@ LUA_USE_JIT compiles hot Lua functions to native code (see 'ljit.c').
+** It needs x86-64, POSIX 'mmap', and Lua compiled as C (errors must
+** use 'longjmp'). Define it only if you want this experimental option.
+*/
+/* #define LUA_USE_JIT */
+
+#if defined(LUA_USE_JIT) && !(defined(__x86_64__) && defined(LUA_USE_POSIX))
+#undef LUA_USE_JIT	/* not available on this platform */
+#endif
+
+
+/*
+@@ LUA_USE_SHAPES lets record-like tables share "shapes" (hidden classes):
+** tables that get the same short-string keys in the same order share a
+** descriptor mapping those keys to positions in a compact vector of
+** values, instead of each having its own hash part (see 'ltable.c').
+** Define it only if you want this experimental option.
+*/
+/* #define LUA_USE_SHAPES */
+
+
+/*
+@@ LUA_USE_SWISSTABLE replaces the chained scatter table in the hash part
+** of tables with open addressing in the style of SwissTable, where a
+** search compares 7-bit hash tags of 16 nodes at a time (using SSE2,
+** when available) before comparing keys (see 'ltable.c').
+** Define it only if you want this experimental option.
+*/
+/* #define LUA_USE_SWISSTABLE */
+
+
+/*
+@@ LUA_USE_INCRHASH makes large hash parts of tables grow incrementally:
+** entries move from the old node vector to the new one a few at a time,
+** at each new key, instead of all at once (see 'ltable.c'). This avoids
+** long pauses when inserting into large tables.
+** Define it only if you want this experimental option.
+*/
+/* #define LUA_USE_INCRHASH */
+
+
+/*
+@@ LUA_USE_SIZEHINTS makes each table constructor remember how large
+** the tables it creates grow, and create the following ones already
+** with those sizes (see 'ltable.c'). This avoids most rehashes when
+** tables are built by a loop after being created empty.
+** Define it only if you want this experimental option.
+*/
+/* #define LUA_USE_SIZEHINTS */
+
+
+/*
+@@ LUA_USE_PARALLELMARK lets helper threads mark objects together with
+** the collector when it has to go through many of them at once: in
+** full collections and in the atomic phase (see 'lgc.c'). It needs
+** POSIX threads and GCC-style atomic builtins, so link with '-pthread'.
+** 'lua_gc(L, LUA_GCMARKERS, n)' sets the number of marking threads
+** (LUAI_GCMARKERS by default).
+** Define it only if you want this experimental option.
+*/
+/* #define LUA_USE_PARALLELMARK */
+
+
+/*
+@@ LUA_USE_BGSWEEP makes a background thread release the memory of the
+** dead objects found by the collector (see 'lgc.c'). It needs POSIX
+** threads and GCC-style atomic builtins, so link with '-pthread', and
+** the allocation function must be thread safe.
+** Define it only if you want this experimental option.
+*/
+/* #define LUA_USE_BGSWEEP */
+
+
+/*
+@@ LUA_USE_NURSERY makes the generational collector bump-allocate small
+** new objects in arenas, reusing the lines freed by dead objects (see
+** 'lgc.c').
+** Define it only if you want this experimental option.
+*/
+/* #define LUA_USE_NURSERY */
+
+
+/*
+@@ LUA_USE_GCBUDGET lets the incremental collector bound each step by
+** time, with option LUA_GCBUDGET of 'lua_gc' (see 'lgc.c'). It needs
+** the POSIX 'clock_gettime'.
+** Define it only if you want this experimental option.
+*/
+/* #define LUA_USE_GCBUDGET */
+
+
+/*
+@@ LUA_USE_GCSTATS lets the collector keep statistics about its phases
+** and pauses, with option LUA_GCSTATS of 'lua_gc' (see 'lgc.c'). It
+** needs the POSIX 'clock_gettime'.
+** Define it only if you want this experimental option.
+*/
+/* #define LUA_USE_GCSTATS */
+
+
+/*
+@@ LUA_USE_FINBATCH makes the collector call the finalizers of objects
+** with the same metatable in batches, under one protected call, and
+** lets the program bound by time the finalizers run in each step or
+** defer them to explicit calls (options LUA_GCFINBUDGET, LUA_GCDEFERFIN,
+** and LUA_GCRUNFIN of 'lua_gc'). It needs the POSIX 'clock_gettime'.
+** Define it only if you want this experimental option.
+*/
+/* #define LUA_USE_FINBATCH */
+
+
+/*
+@@ LUA_USE_APPENDSTR lets long strings built by concatenation share
+** buffers that grow in place, so that accumulating a string with
+** repeated concatenations takes linear time (see 'lstring.c').
+** Define it only if you want this experimental option.
+*/
+/* #define LUA_USE_APPENDSTR */
+
+
+/*
+@@ LUA_USE_STRVIEWS lets large slices of long strings share the bytes
+** of the string they come from instead of copying them (see
+** 'lstring.c'). It turns on LUA_USE_APPENDSTR, whose buffers keep the
+** shared bytes.
+** Define it only if you want this experimental option.
+*/
+/* #define LUA_USE_STRVIEWS */
+
+#if defined(LUA_USE_STRVIEWS) && !defined(LUA_USE_APPENDSTR)
+#define LUA_USE_APPENDSTR
+#endif
+
+
+/*
+@@ LUA_USE_FASTHASH makes string hashes read eight bytes at a time,
+** mixing them with the seed by multiplications, and lets 'lua_hashmode'
+** choose whether long strings are hashed by all their bytes or by a
+** sample of them (see 'lstring.c'). It needs a 64-bit integer type.
+** Define it only if you want this experimental option.
+*/
+/* #define LUA_USE_FASTHASH */
+
+#if defined(LUA_USE_FASTHASH) && !((LONG_MAX >> 31 >> 31) >= 1) && \
+    (defined(LUA_USE_C89) || !defined(LLONG_MAX))
+#undef LUA_USE_FASTHASH	/* no 64-bit integer type */
+#endif
+
+
+/*
+@@ LUA_USE_PATCACHE makes the string library compile each pattern once
+** into items with bitmaps for their classes, keep the most recently
+** used ones in a cache, and skip to the places where the literal prefix
+** of a pattern occurs (see 'lstrlib.c').
+** Define it only if you want this experimental option.
+*/
+/* #define LUA_USE_PATCACHE */
+
+
+/*
+@@ LUA_USE_CARDS makes the generational collector keep a card table for
+** each large table, so that a young collection only traverses the parts
+** of an old table written since the last collections (see 'lgc.c').
+** Define it only if you want this experimental option.
+*/
+/* #define LUA_USE_CARDS */
+
+
+/*
+@@ LUA_USE_DIRTYTHREADS makes the atomic phase of the collector skip
+** the frames of suspended coroutines that did not run since they were
+** traversed in the same cycle (see 'lgc.c').
+** Define it only if you want this experimental option.
+*/
+/* #define LUA_USE_DIRTYTHREADS */
+
+
+/*
+@@ LUA_USE_EPHEMERONMAP makes the atomic phase of the collector index
+** the pending entries of ephemeron tables by key, so that each entry is
+** visited once when its key is marked (see 'lgc.c').
+** Define it only if you want this experimental option.
+*/
+/* #define LUA_USE_EPHEMERONMAP */
+
+
+/*
+@@ LUA_USE_POOLALLOC makes 'luaL_newstate' use an allocator that keeps
+** small blocks in slabs of blocks with the same size and kind of
+** object (see 'lauxlib.c'); 'luaL_poolstats' reports its use. It has
+** no locks, so it is not used with LUA_USE_BGSWEEP.
+** Define it only if you want this experimental option.
+*/
+/* #define LUA_USE_POOLALLOC */
+
+
+/*
+@@ LUA_NANBOXING packs each Lua value in 8 bytes instead of 16: values
+** other than floats are stored in the unused NaN space of a 'double'
+** (see 'lobject.h'). It needs 64-bit pointers with 48 significant bits,
+** and it uses 'double' floats and 32-bit integers, so that all values
+** fit in a box.
+*/
+/* #define LUA_NANBOXING */
+
+#if defined(LUA_NANBOXING)
+#if !(defined(__x86_64__) || defined(__aarch64__))
+#undef LUA_NANBOXING	/* not available on this platform */
+#else
+#undef LUA_USE_JIT	/* native code assumes 16-byte values */
+#endif
+#endif
+
+
 /*
 @@ LUA_C89_NUMBERS ensures that Lua uses the largest types available for
 ** C89 ('long' and 'double'); Windows always has '__int64', so it does
@@ -113,7 +328,14 @@
 #define LUA_FLOAT_DOUBLE	2
 #define LUA_FLOAT_LONGDOUBLE	3
 
-#if defined(LUA_32BITS)		/* { */
+#if defined(LUA_NANBOXING)	/* { */
+/*
+** 32-bit integers and 'double' (integers must fit in a NaN box)
+*/
+#define LUA_INT_TYPE	LUA_INT_INT
+#define LUA_FLOAT_TYPE	LUA_FLOAT_DOUBLE
+
+#elif defined(LUA_32BITS)	/* }{ */
 /*
 ** 32-bit integers and 'float'
 */
@@ -131,6 +131,7 @@ static void LoadCode (LoadState *S, Proto *f) {
   f->code = luaM_newvectorchecked(S->L, n, Instruction);
   f->sizecode = n;
   LoadVector(S, f->code, n);
+  luaF_newicache(S->L, f);
 }
 
 
@@ -22,6 +22,7 @@
 #include "ldo.h"
 #include "lfunc.h"
 #include "lgc.h"
+#include "ljit.h"
 #include "lobject.h"
 #include "lopcodes.h"
 #include "lstate.h"
@@ -44,6 +45,25 @@
 #endif
 
 
+/*
+** By default, quicken instructions: some generic instructions rewrite
+** themselves into type-specialized variants once they run with the
+** types those variants handle (see 'quicken').
+*/
+#if !defined(LUA_USE_QUICKENING)
+#define LUA_USE_QUICKENING	1
+#endif
+
+
+/*
+** number of times an instruction can fall back from a quickened form
+** to its generic form before it stops being quickened
+*/
+#if !defined(MAXDEOPT)
+#define MAXDEOPT	8
+#endif
+
+
 
 /* limit for table tag-method chains (to avoid infinite loops) */
 #define MAXTAGLOOP	2000
@@ -81,6 +101,32 @@
 
 
 
+#if defined(LUA_USE_APPENDSTR)
+
+/*
+** Convert string 'obj' with 'luaO_str2num'. A string in a buffer may
+** not end with a '\0' (see 'lstring.c'); the byte after it belongs to
+** the buffer, so it can hold a '\0' during the conversion.
+*/
+static size_t str2num (const TValue *obj, TValue *v) {
+  TString *ts = tsvalue(obj);
+  char *s = getstr(ts);
+  size_t l = tsslen(ts);
+  char c = s[l];
+  size_t res;
+  s[l] = '\0';
+  res = luaO_str2num(s, v);
+  s[l] = c;
+  return res;
+}
+
+#else
+
+#define str2num(obj,v)	luaO_str2num(svalue(obj), v)
+
+#endif
+
+
 /*
 ** Try to convert a value to a float. The float case is already handled
 ** by the macro 'tonumber'.
@@ -92,7 +138,7 @@ int luaV_tonumber_ (const TValue *obj, lua_Number *n) {
     return 1;
   }
   else if (cvt2num(obj) &&  /* string coercible to number? */
-            luaO_str2num(svalue(obj), &v) == vslen(obj) + 1) {
+            str2num(obj, &v) == vslen(obj) + 1) {
     *n = nvalue(&v);  /* convert result of 'luaO_str2num' to a float */
     return 1;
   }
@@ -140,7 +186,7 @@ int luaV_tointegerns (const TValue *obj, lua_Integer *p, int mode) {
 */
 int luaV_tointeger (const TValue *obj, lua_Integer *p, int mode) {
   TValue v;
-  if (cvt2num(obj) && luaO_str2num(svalue(obj), &v) == vslen(obj) + 1)
+  if (cvt2num(obj) && str2num(obj, &v) == vslen(obj) + 1)
     obj = &v;  /* change string to its corresponding number */
   return luaV_tointegerns(obj, p, mode);
 }
@@ -160,8 +206,8 @@ int luaV_tointeger (const TValue *obj, lua_Integer *p, int mode) {
 ** the extreme case when the initial value is LUA_MININTEGER, in which
 ** case the LUA_MININTEGER limit would still run the loop once.
 */
-static int forlimit (const TValue *obj, lua_Integer *p, lua_Integer step,
-                     int *stopnow) {
+int luaV_forlimit (const TValue *obj, lua_Integer *p, lua_Integer step,
+                   int *stopnow) {
   *stopnow = 0;  /* usually, let loops run */
   if (ttisinteger(obj))
     *p = ivalue(obj);
@@ -186,7 +232,7 @@ static int forlimit (const TValue *obj, lua_Integer *p, lua_Integer step,
 /*
 ** Finish the table access 'val = t[key]'.
 ** if 'slot' is NULL, 't' is not a table; otherwise, 'slot' points to
-** t[k] entry (which must be empty).
+** t[k] entry (which must be empty) or to an absent key.
 */
 void luaV_finishget (lua_State *L, const TValue *t, TValue *key, StkId val,
                       const TValue *slot) {
@@ -214,10 +260,8 @@ void luaV_finishget (lua_State *L, const TValue *t, TValue *key, StkId val,
       return;
     }
     t = tm;  /* else try to access 'tm[key]' */
-    if (luaV_fastget(L, t, key, slot, luaH_get)) {  /* fast track? */
-      setobj2s(L, val, slot);  /* done */
-      return;
-    }
+    if (luaV_fastgetv(L, t, key, s2v(val), slot, luaH_get))  /* fast track? */
+      return;  /* done */
     /* else repeat (tail call 'luaV_finishget') */
   }
   luaG_runerror(L, "'__index' chain too long; possible loop");
@@ -228,8 +272,9 @@ void luaV_finishget (lua_State *L, const TValue *t, TValue *key, StkId val,
 ** Finish a table assignment 't[key] = val'.
 ** If 'slot' is NULL, 't' is not a table.  Otherwise, 'slot' points
 ** to the entry 't[key]', or to a value with an absent key if there
-** is no such entry.  (The value at 'slot' must be empty, otherwise
-** 'luaV_fastget' would have done the job.)
+** is no such entry (or if the entry is in the array part).  (The value
+** at 'slot' must be empty, otherwise the fast track would have done
+** the job.)
 */
 void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
                      TValue *val, const TValue *slot) {
@@ -241,12 +286,9 @@ void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
       lua_assert(isempty(slot));  /* slot must be empty */
       tm = fasttm(L, h->metatable, TM_NEWINDEX);  /* get metamethod */
       if (tm == NULL) {  /* no metamethod? */
-        if (isabstkey(slot))  /* no previous entry? */
-          slot = luaH_newkey(L, h, key);  /* create one */
-        /* no metamethod and (now) there is an entry with given key */
-        setobj2t(L, cast(TValue *, slot), val);  /* set its new value */
+        luaH_finishset(L, h, key, slot, val);  /* set new value */
         invalidateTMcache(h);
-        luaC_barrierback(L, obj2gco(h), val);
+        luaC_barrierkey(L, h, key, val);
         return;
       }
       /* else will try the metamethod */
@@ -262,10 +304,8 @@ void luaV_finishset (lua_State *L, const TValue *t, TValue *key,
       return;
     }
     t = tm;  /* else repeat assignment over 'tm' */
-    if (luaV_fastget(L, t, key, slot, luaH_get)) {
-      luaV_finishfastset(L, t, slot, val);
+    if (luaV_fastset(L, t, key, slot, luaH_pset, val))
       return;  /* done */
-    }
     /* else 'return luaV_finishset(L, t, key, val, slot)' (loop) */
   }
   luaG_runerror(L, "'__newindex' chain too long; possible loop");
@@ -426,8 +466,11 @@ static int LEnum (const TValue *l, const TValue *r) {
 */
 static int lessthanothers (lua_State *L, const TValue *l, const TValue *r) {
   lua_assert(!ttisnumber(l) || !ttisnumber(r));
-  if (ttisstring(l) && ttisstring(r))  /* both are strings? */
+  if (ttisstring(l) && ttisstring(r)) {  /* both are strings? */
+    luaS_terminate(L, tsvalue(l));
+    luaS_terminate(L, tsvalue(r));
     return l_strcmp(tsvalue(l), tsvalue(r)) < 0;
+  }
   else
     return luaT_callorderTM(L, l, r, TM_LT);
 }
@@ -453,8 +496,11 @@ int luaV_lessthan (lua_State *L, const TValue *l, const TValue *r) {
 */
 static int lessequalothers (lua_State *L, const TValue *l, const TValue *r) {
   lua_assert(!ttisnumber(l) || !ttisnumber(r));
-  if (ttisstring(l) && ttisstring(r))  /* both are strings? */
+  if (ttisstring(l) && ttisstring(r)) {  /* both are strings? */
+    luaS_terminate(L, tsvalue(l));
+    luaS_terminate(L, tsvalue(r));
     return l_strcmp(tsvalue(l), tsvalue(r)) <= 0;
+  }
   else
     return luaT_callorderTM(L, l, r, TM_LE);
 }
@@ -570,6 +616,14 @@ void luaV_concat (lua_State *L, int total) {
         copy2buff(top, n, buff);  /* copy strings to buffer */
         ts = luaS_newlstr(L, buff, tl);
       }
+#if defined(LUA_USE_APPENDSTR)
+      else if (tl >= LUAI_MINAPPEND && ttislngstring(s2v(top - n))) {
+        /* result starts with a long string; try to grow it in place */
+        size_t la = vslen(s2v(top - n));
+        ts = luaS_append(L, tsvalue(s2v(top - n)), tl);
+        copy2buff(top, n - 1, getstr(ts) + la);  /* copy the others */
+      }
+#endif
       else {  /* long string; copy strings directly to final result */
         ts = luaS_createlngstrobj(L, tl);
         copy2buff(top, n, getstr(ts));
@@ -724,6 +778,21 @@ static void pushclosure (lua_State *L, Proto *p, UpVal **encup, StkId base,
 }
 
 
+/*
+** Put in 'ra' a closure for prototype 'p', created inside a call to 'cl'
+** with the given 'base', reusing the cached closure of 'p' when it has
+** the right upvalues. (Used by native code; the interpreter inlines it.)
+*/
+void luaV_closure (lua_State *L, LClosure *cl, Proto *p, StkId base,
+                   StkId ra) {
+  LClosure *ncl = getcached(p, cl->upvals, base);  /* cached closure */
+  if (ncl == NULL)  /* no match? */
+    pushclosure(L, p, cl->upvals, base, ra);  /* create a new one */
+  else
+    setclLvalue2s(L, ra, ncl);  /* push cached closure */
+}
+
+
 /*
 ** finish execution of an opcode interrupted by a yield
 */
@@ -806,6 +875,9 @@ void luaV_finishOp (lua_State *L) {
 #define KC(i)	(k+GETARG_C(i))
 #define RKC(i)	((TESTARG_k(i)) ? k + GETARG_C(i) : s2v(base + GETARG_C(i)))
 
+/* inline cache of the current instruction ('pc' already incremented) */
+#define ICACHE(p)	(&(p)->icache[pc - (p)->code - 1])
+
 
 
 #define updatetrap(ci)  (trap = ci->u.l.trap)
@@ -880,6 +952,43 @@ void luaV_finishOp (lua_State *L) {
 #define vmbreak		break
 
 
+/*
+** Quickening: a generic instruction that has just run with the types
+** handled by a specialized opcode 'o' is rewritten in place into 'o'.
+** When the type guard of a quickened instruction fails, 'deoptimize'
+** rewrites it back into its generic opcode 'o' and dispatches it again
+** (without a new fetch, so hooks do not see it twice). The instruction's
+** inline-cache entry, otherwise unused by these opcodes, counts its
+** deoptimizations; after MAXDEOPT of them the instruction stays generic.
+*/
+#if LUA_USE_QUICKENING
+#define quicken(o)  \
+	{ if (*ICACHE(cl->p) < MAXDEOPT)  \
+	    SET_OPCODE(*cast(Instruction *, pc - 1), o); }
+#else
+#define quicken(o)	((void)0)
+#endif
+
+#define deoptimize(o)  \
+	{ (*ICACHE(cl->p))++;  \
+	  SET_OPCODE(*cast(Instruction *, pc - 1), o); SET_OPCODE(i, o);  \
+	  goto redispatch; }
+
+
+/*
+** Native code: a loop back edge counts towards compiling the function;
+** once it has native code, the loop goes on there (entering it at the
+** current 'pc' through 'returning').
+*/
+#if defined(LUA_USE_JIT)
+#define jitloop()  \
+	{ if (L->hookmask == 0 && luaJ_hot(L, cl->p)) {  \
+	    savepc(L); goto returning; } }
+#else
+#define jitloop()	((void)0)
+#endif
+
+
 void luaV_execute (lua_State *L, CallInfo *ci) {
   LClosure *cl;
   TValue *k;
@@ -889,19 +998,40 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
 #if LUA_USE_JUMPTABLE
 #include "ljumptab.h"
 #endif
- tailcall:
+ startfunc:
   trap = L->hookmask;
+ returning:  /* trap already set */
   cl = clLvalue(s2v(ci->func));
   k = cl->p->k;
   pc = ci->u.l.savedpc;
   if (trap) {
-    if (cl->p->is_vararg)
-      trap = 0;  /* hooks will start after PREPVARARG instruction */
-    else if (pc == cl->p->code)  /* first instruction (not resuming)? */
-      luaD_hookcall(L, ci);
+    if (pc == cl->p->code) {  /* first instruction (not resuming)? */
+      if (cl->p->is_vararg)
+        trap = 0;  /* hooks will start after PREPVARARG instruction */
+      else  /* check 'call' hook */
+        luaD_hookcall(L, ci);
+    }
     ci->u.l.trap = 1;  /* there may be other hooks */
   }
   base = ci->func + 1;
+#if defined(LUA_USE_JIT)
+  if (L->hookmask == 0 &&
+      (cl->p->jit != NULL || (pc == cl->p->code && luaJ_hot(L, cl->p)))) {
+    switch (luaJ_execute(L, ci)) {
+      case LUAJ_CALL:  /* native code called a Lua function */
+        ci = L->ci;
+        goto startfunc;
+      case LUAJ_RETURN:  /* native code returned */
+        updatetrap(ci);  /* 'luaD_poscall' can change hooks */
+        goto ret;
+      default:  /* LUAJ_EXIT: go on interpreting the function */
+        lua_assert(isLua(ci) && ci == L->ci);
+        pc = ci->u.l.savedpc;
+        trap = ci->u.l.trap;
+        base = ci->func + 1;
+    }
+  }
+#endif
   /* main loop of interpreter */
   for (;;) {
     int cond;  /* flag for conditional jumps */
@@ -911,6 +1041,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
     lua_assert(base == ci->func + 1);
     lua_assert(base <= L->top && L->top < L->stack + L->stacksize);
     lua_assert(ci->top < L->stack + L->stacksize);
+   redispatch:
     vmdispatch (GET_OPCODE(i)) {
       vmcase(OP_MOVE) {
         setobjs2s(L, ra, RB(i));
@@ -965,7 +1096,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TValue *upval = cl->upvals[GETARG_B(i)]->v;
         TValue *rc = KC(i);
         TString *key = tsvalue(rc);  /* key must be a string */
-        if (luaV_fastget(L, upval, key, slot, luaH_getshortstr)) {
+        if (luaV_fastgetIC(L, upval, key, slot, ICACHE(cl->p))) {
           setobj2s(L, ra, slot);
         }
         else
@@ -976,13 +1107,18 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         const TValue *slot;
         TValue *rb = vRB(i);
         TValue *rc = vRC(i);
-        lua_Unsigned n;
-        if (ttisinteger(rc)  /* fast track for integers? */
-            ? (n = ivalue(rc), luaV_fastgeti(L, rb, n, slot))
-            : luaV_fastget(L, rb, rc, slot, luaH_get)) {
-          setobj2s(L, ra, slot);
+        int ok;
+        if (ttisinteger(rc)) {  /* fast track for integers? */
+          /* check the array part before 'ra' (maybe 'rb') is written */
+          int inarray = ttistable(rb) &&
+                        l_castS2U(ivalue(rc)) - 1u < hvalue(rb)->alimit;
+          luaV_fastgeti(L, rb, ivalue(rc), s2v(ra), slot, ok);
+          if (ok && inarray)  /* value came from the array part? */
+            quicken(OP_GETARRAY);
         }
         else
+          ok = luaV_fastgetv(L, rb, rc, s2v(ra), slot, luaH_get);
+        if (!ok)
           Protect(luaV_finishget(L, rb, rc, ra, slot));
         vmbreak;
       }
@@ -990,10 +1126,9 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         const TValue *slot;
         TValue *rb = vRB(i);
         int c = GETARG_C(i);
-        if (luaV_fastgeti(L, rb, c, slot)) {
-          setobj2s(L, ra, slot);
-        }
-        else {
+        int ok;
+        luaV_fastgeti(L, rb, c, s2v(ra), slot, ok);
+        if (!ok) {
           TValue key;
           setivalue(&key, c);
           Protect(luaV_finishget(L, rb, &key, ra, slot));
@@ -1005,7 +1140,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TValue *rb = vRB(i);
         TValue *rc = KC(i);
         TString *key = tsvalue(rc);  /* key must be a string */
-        if (luaV_fastget(L, rb, key, slot, luaH_getshortstr)) {
+        if (luaV_fastgetIC(L, rb, key, slot, ICACHE(cl->p))) {
           setobj2s(L, ra, slot);
         }
         else
@@ -1029,13 +1164,9 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         const TValue *slot;
         TValue *rb = vRB(i);  /* key (table is in 'ra') */
         TValue *rc = RKC(i);  /* value */
-        lua_Unsigned n;
-        if (ttisinteger(rb)  /* fast track for integers? */
-            ? (n = ivalue(rb), luaV_fastgeti(L, s2v(ra), n, slot))
-            : luaV_fastget(L, s2v(ra), rb, slot, luaH_get)) {
-          luaV_finishfastset(L, s2v(ra), slot, rc);
-        }
-        else
+        if (!(ttisinteger(rb)  /* fast track for integers? */
+              ? luaV_fastseti(L, s2v(ra), ivalue(rb), slot, rc)
+              : luaV_fastset(L, s2v(ra), rb, slot, luaH_pset, rc)))
           Protect(luaV_finishset(L, s2v(ra), rb, rc, slot));
         vmbreak;
       }
@@ -1043,10 +1174,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         const TValue *slot;
         int c = GETARG_B(i);
         TValue *rc = RKC(i);
-        if (luaV_fastgeti(L, s2v(ra), c, slot)) {
-          luaV_finishfastset(L, s2v(ra), slot, rc);
-        }
-        else {
+        if (!luaV_fastseti(L, s2v(ra), c, slot, rc)) {
           TValue key;
           setivalue(&key, c);
           Protect(luaV_finishset(L, s2v(ra), &key, rc, slot));
@@ -1072,8 +1200,13 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         L->top = ci->top;  /* correct top in case of GC */
         t = luaH_new(L);  /* memory allocation */
         sethvalue2s(L, ra, t);
+#if defined(LUA_USE_SIZEHINTS)
+        luaH_presize(L, t, cl->p, cast_int(pc - cl->p->code) - 1,
+                     luaO_fb2int(b), luaO_fb2int(c));  /* idem */
+#else
         if (b != 0 || c != 0)
           luaH_resize(L, t, luaO_fb2int(b), luaO_fb2int(c));  /* idem */
+#endif
         checkGC(L, ra + 1);
         vmbreak;
       }
@@ -1083,7 +1216,9 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TValue *rc = RKC(i);
         TString *key = tsvalue(rc);  /* key must be a string */
         setobj2s(L, ra + 1, rb);
-        if (luaV_fastget(L, rb, key, slot, luaH_getstr)) {
+        if (ttisshrstring(rc)  /* common case: short-string method name? */
+            ? luaV_fastgetIC(L, rb, key, slot, ICACHE(cl->p))
+            : luaV_fastget(L, rb, key, slot, luaH_getstr)) {
           setobj2s(L, ra, slot);
         }
         else
@@ -1096,6 +1231,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         lua_Number nb;
         if (ttisinteger(rb)) {
           setivalue(s2v(ra), intop(+, ivalue(rb), ic));
+          quicken(OP_ADDIINT);
         }
         else if (tonumberns(rb, nb)) {
           setfltvalue(s2v(ra), luai_numadd(L, nb, cast_num(ic)));
@@ -1195,9 +1331,12 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         if (ttisinteger(rb) && ttisinteger(rc)) {
           lua_Integer ib = ivalue(rb); lua_Integer ic = ivalue(rc);
           setivalue(s2v(ra), intop(+, ib, ic));
+          quicken(OP_ADDINT);
         }
         else if (tonumberns(rb, nb) && tonumberns(rc, nc)) {
           setfltvalue(s2v(ra), luai_numadd(L, nb, nc));
+          if (ttisfloat(rb) && ttisfloat(rc))
+            quicken(OP_ADDFLT);
         }
         else
           Protect(luaT_trybinTM(L, rb, rc, ra, TM_ADD));
@@ -1210,9 +1349,12 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         if (ttisinteger(rb) && ttisinteger(rc)) {
           lua_Integer ib = ivalue(rb); lua_Integer ic = ivalue(rc);
           setivalue(s2v(ra), intop(-, ib, ic));
+          quicken(OP_SUBINT);
         }
         else if (tonumberns(rb, nb) && tonumberns(rc, nc)) {
           setfltvalue(s2v(ra), luai_numsub(L, nb, nc));
+          if (ttisfloat(rb) && ttisfloat(rc))
+            quicken(OP_SUBFLT);
         }
         else
           Protect(luaT_trybinTM(L, rb, rc, ra, TM_SUB));
@@ -1225,9 +1367,12 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         if (ttisinteger(rb) && ttisinteger(rc)) {
           lua_Integer ib = ivalue(rb); lua_Integer ic = ivalue(rc);
           setivalue(s2v(ra), intop(*, ib, ic));
+          quicken(OP_MULINT);
         }
         else if (tonumberns(rb, nb) && tonumberns(rc, nc)) {
           setfltvalue(s2v(ra), luai_nummul(L, nb, nc));
+          if (ttisfloat(rb) && ttisfloat(rc))
+            quicken(OP_MULFLT);
         }
         else
           Protect(luaT_trybinTM(L, rb, rc, ra, TM_MUL));
@@ -1449,6 +1594,8 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
       }
       vmcase(OP_JMP) {
         dojump(ci, i, 0);
+        if (GETARG_sJ(i) < 0)  /* loop back edge? */
+          jitloop();
         vmbreak;
       }
       vmcase(OP_EQ) {
@@ -1459,8 +1606,10 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
       }
       vmcase(OP_LT) {
         TValue *rb = vRB(i);
-        if (ttisinteger(s2v(ra)) && ttisinteger(rb))
+        if (ttisinteger(s2v(ra)) && ttisinteger(rb)) {
           cond = (ivalue(s2v(ra)) < ivalue(rb));
+          quicken(OP_LTINT);
+        }
         else if (ttisnumber(s2v(ra)) && ttisnumber(rb))
           cond = LTnum(s2v(ra), rb);
         else
@@ -1470,8 +1619,10 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
       }
       vmcase(OP_LE) {
         TValue *rb = vRB(i);
-        if (ttisinteger(s2v(ra)) && ttisinteger(rb))
+        if (ttisinteger(s2v(ra)) && ttisinteger(rb)) {
           cond = (ivalue(s2v(ra)) <= ivalue(rb));
+          quicken(OP_LEINT);
+        }
         else if (ttisnumber(s2v(ra)) && ttisnumber(rb))
           cond = LEnum(s2v(ra), rb);
         else
@@ -1557,12 +1708,19 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         vmbreak;
       }
       vmcase(OP_CALL) {
+        CallInfo *newci;
         int b = GETARG_B(i);
         int nresults = GETARG_C(i) - 1;
         if (b != 0)  /* fixed number of arguments? */
           L->top = ra + b;  /* top signals number of arguments */
         /* else previous instruction set top */
-        ProtectNT(luaD_call(L, ra, nresults));
+        savepc(L);  /* in case of errors */
+        if ((newci = luaD_precall(L, ra, nresults)) == NULL)
+          updatetrap(ci);  /* C call; nothing else to be done */
+        else {  /* Lua call: run function in this same invocation */
+          ci = newci;
+          goto startfunc;
+        }
         vmbreak;
       }
       vmcase(OP_TAILCALL) {
@@ -1592,12 +1750,12 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
           }
           ci->func -= delta;
           luaD_poscall(L, ci, cast_int(L->top - ra));
-          return;
+          goto ret;
         }
         else {  /* Lua tail call */
           ci->func -= delta;
           luaD_pretailcall(L, ci, ra, b);  /* prepare call frame */
-          goto tailcall;
+          goto startfunc;  /* execute the callee */
         }
         vmbreak;
       }
@@ -1614,12 +1772,14 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
           luaF_close(L, base);  /* there may be open upvalues */
         }
         halfProtect(luaD_poscall(L, ci, n));
-        return;
+        updatetrap(ci);  /* 'luaD_poscall' can change hooks */
+        goto ret;
       }
       vmcase(OP_RETURN0) {
         if (L->hookmask) {
           L->top = ra;
           halfProtect(luaD_poscall(L, ci, 0));  /* no hurry... */
+          trap = 1;
         }
         else {
           int nres = ci->nresults;
@@ -1628,12 +1788,13 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
           while (nres-- > 0)
             setnilvalue(s2v(L->top++));  /* all results are nil */
         }
-        return;
+        goto ret;
       }
       vmcase(OP_RETURN1) {
         if (L->hookmask) {
           L->top = ra + 1;
           halfProtect(luaD_poscall(L, ci, 1));  /* no hurry... */
+          trap = 1;
         }
         else {
           int nres = ci->nresults;
@@ -1647,7 +1808,13 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
               setnilvalue(s2v(L->top++));
           }
         }
-        return;
+       ret:  /* return from a Lua function */
+        if (ci->callstatus & CIST_FRESH)
+          return;  /* end this frame */
+        else {
+          ci = ci->previous;
+          goto returning;  /* continue running caller in this frame */
+        }
       }
       vmcase(OP_FORLOOP1) {
         lua_Integer idx = intop(+, ivalue(s2v(ra)), 1); /* increment index */
@@ -1656,6 +1823,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
           pc -= GETARG_Bx(i);  /* jump back */
           chgivalue(s2v(ra), idx);  /* update internal index... */
           setivalue(s2v(ra + 3), idx);  /* ...and external index */
+          jitloop();
         }
         updatetrap(ci);
         vmbreak;
@@ -1665,7 +1833,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         TValue *plimit = s2v(ra + 1);
         lua_Integer ilimit, initv;
         int stopnow;
-        if (unlikely(!forlimit(plimit, &ilimit, 1, &stopnow))) {
+        if (unlikely(!luaV_forlimit(plimit, &ilimit, 1, &stopnow))) {
             savestate(L, ci);  /* for the error message */
             luaG_runerror(L, "'for' limit must be a number");
         }
@@ -1684,6 +1852,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
             pc -= GETARG_Bx(i);  /* jump back */
             chgivalue(s2v(ra), idx);  /* update internal index... */
             setivalue(s2v(ra + 3), idx);  /* ...and external index */
+            jitloop();
           }
         }
         else {  /* floating loop */
@@ -1696,6 +1865,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
             pc -= GETARG_Bx(i);  /* jump back */
             chgfltvalue(s2v(ra), idx);  /* update internal index... */
             setfltvalue(s2v(ra + 3), idx);  /* ...and external index */
+            jitloop();
           }
         }
         updatetrap(ci);
@@ -1708,7 +1878,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         lua_Integer ilimit;
         int stopnow;
         if (ttisinteger(init) && ttisinteger(pstep) &&
-            forlimit(plimit, &ilimit, ivalue(pstep), &stopnow)) {
+            luaV_forlimit(plimit, &ilimit, ivalue(pstep), &stopnow)) {
           /* all values are integer */
           lua_Integer initv = (stopnow ? 0 : ivalue(init));
           setivalue(plimit, ilimit);
@@ -1749,6 +1919,7 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         if (!ttisnil(s2v(ra + 1))) {  /* continue loop? */
           setobjs2s(L, ra, ra + 1);  /* save control variable */
           pc -= GETARG_Bx(i);  /* jump back */
+          jitloop();
         }
         vmbreak;
       }
@@ -1770,9 +1941,9 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
           luaH_resizearray(L, h, last);  /* preallocate it at once */
         for (; n > 0; n--) {
           TValue *val = s2v(ra + n);
-          setobj2t(L, &h->array[last - 1], val);
+          obj2arr(h, last - 1, val);
           last--;
-          luaC_barrierback(L, obj2gco(h), val);
+          luaC_barrierindex(L, h, last, val);
         }
         vmbreak;
       }
@@ -1807,6 +1978,107 @@ void luaV_execute (lua_State *L, CallInfo *ci) {
         lua_assert(0);
         vmbreak;
       }
+      vmcase(OP_ADDINT) {
+        TValue *rb = vRB(i);
+        TValue *rc = vRC(i);
+        if (ttisinteger(rb) && ttisinteger(rc)) {
+          setivalue(s2v(ra), intop(+, ivalue(rb), ivalue(rc)));
+        }
+        else
+          deoptimize(OP_ADD);
+        vmbreak;
+      }
+      vmcase(OP_SUBINT) {
+        TValue *rb = vRB(i);
+        TValue *rc = vRC(i);
+        if (ttisinteger(rb) && ttisinteger(rc)) {
+          setivalue(s2v(ra), intop(-, ivalue(rb), ivalue(rc)));
+        }
+        else
+          deoptimize(OP_SUB);
+        vmbreak;
+      }
+      vmcase(OP_MULINT) {
+        TValue *rb = vRB(i);
+        TValue *rc = vRC(i);
+        if (ttisinteger(rb) && ttisinteger(rc)) {
+          setivalue(s2v(ra), intop(*, ivalue(rb), ivalue(rc)));
+        }
+        else
+          deoptimize(OP_MUL);
+        vmbreak;
+      }
+      vmcase(OP_ADDFLT) {
+        TValue *rb = vRB(i);
+        TValue *rc = vRC(i);
+        if (ttisfloat(rb) && ttisfloat(rc)) {
+          setfltvalue(s2v(ra), luai_numadd(L, fltvalue(rb), fltvalue(rc)));
+        }
+        else
+          deoptimize(OP_ADD);
+        vmbreak;
+      }
+      vmcase(OP_SUBFLT) {
+        TValue *rb = vRB(i);
+        TValue *rc = vRC(i);
+        if (ttisfloat(rb) && ttisfloat(rc)) {
+          setfltvalue(s2v(ra), luai_numsub(L, fltvalue(rb), fltvalue(rc)));
+        }
+        else
+          deoptimize(OP_SUB);
+        vmbreak;
+      }
+      vmcase(OP_MULFLT) {
+        TValue *rb = vRB(i);
+        TValue *rc = vRC(i);
+        if (ttisfloat(rb) && ttisfloat(rc)) {
+          setfltvalue(s2v(ra), luai_nummul(L, fltvalue(rb), fltvalue(rc)));
+        }
+        else
+          deoptimize(OP_MUL);
+        vmbreak;
+      }
+      vmcase(OP_ADDIINT) {
+        TValue *rb = vRB(i);
+        if (ttisinteger(rb)) {
+          setivalue(s2v(ra), intop(+, ivalue(rb), GETARG_sC(i)));
+        }
+        else
+          deoptimize(OP_ADDI);
+        vmbreak;
+      }
+      vmcase(OP_LTINT) {
+        TValue *rb = vRB(i);
+        if (ttisinteger(s2v(ra)) && ttisinteger(rb))
+          cond = (ivalue(s2v(ra)) < ivalue(rb));
+        else
+          deoptimize(OP_LT);
+        docondjump();
+        vmbreak;
+      }
+      vmcase(OP_LEINT) {
+        TValue *rb = vRB(i);
+        if (ttisinteger(s2v(ra)) && ttisinteger(rb))
+          cond = (ivalue(s2v(ra)) <= ivalue(rb));
+        else
+          deoptimize(OP_LE);
+        docondjump();
+        vmbreak;
+      }
+      vmcase(OP_GETARRAY) {
+        TValue *rb = vRB(i);
+        TValue *rc = vRC(i);
+        lua_Unsigned n;
+        Table *h;
+        if (ttistable(rb) && ttisinteger(rc) &&
+            (n = l_castS2U(ivalue(rc)) - 1u) < (h = hvalue(rb))->alimit &&
+            !arrayisempty(h, n)) {
+          arr2obj(h, n, s2v(ra));
+        }
+        else
+          deoptimize(OP_GETTABLE);
+        vmbreak;
+      }
     }
   }
 }
@@ -68,7 +68,8 @@
 ** return 1 with 'slot' pointing to 't[k]' (position of final result).
 ** Otherwise, return 0 (meaning it will have to check metamethod)
 ** with 'slot' pointing to an empty 't[k]' (if 't' is a table) or NULL
-** (otherwise). 'f' is the raw get function to use.
+** (otherwise). 'f' is the raw get function to use, which must be one
+** for string keys (that can live only in the hash part).
 */
 #define luaV_fastget(L,t,k,slot,f) \
   (!ttistable(t)  \
@@ -78,24 +79,88 @@
 
 
 /*
-** Special case of 'luaV_fastget' for integers, inlining the fast case
-** of 'luaH_getint'.
+** Special case of 'luaV_fastget' for short-string keys in instructions
+** with an inline cache: '*hint' is the index of the node (or the slot,
+** for a table with a shape) where the key was found last time. A hint
+** is trusted only when that position still holds the key, so it needs
+** no invalidation when 'luaH_resize' moves the key or when the
+** instruction sees a different table.
 */
-#define luaV_fastgeti(L,t,k,slot) \
+#define luaV_fastgetIC(L,t,k,slot,hint) \
   (!ttistable(t)  \
    ? (slot = NULL, 0)  /* not a table; 'slot' is NULL and result is 0 */  \
-   : (slot = (l_castS2U(k) - 1u < hvalue(t)->alimit) \
-              ? &hvalue(t)->array[k - 1] : luaH_getint(hvalue(t), k), \
+   : (slot = luaH_hintmatches(hvalue(t), k, *(hint))  \
+        ? (luai_icachehit(L), luaH_hintslot(hvalue(t), *(hint)))  \
+        : (luai_icachemiss(L), luaH_getshortstrIC(hvalue(t), k, hint)),  \
       !isempty(slot)))  /* result not empty? */
 
 
+/*
+** Fast track for 'gettable' with keys that may live in the array part
+** (where there is no slot to point to): if 't' is a table and 't[k]' is
+** present, copy it to 'res' and return 1. Otherwise, return 0 with
+** 'slot' NULL (if 't' is not a table) or pointing to an absent key.
+** 'f' is the raw get function to use.
+*/
+#define luaV_fastgetv(L,t,k,res,slot,f) \
+  (!ttistable(t)  \
+   ? (slot = NULL, 0)  /* not a table; 'slot' is NULL and result is 0 */  \
+   : (slot = &luaH_absentkey, f(hvalue(t), k, res)))
+
+
+/*
+** Special case of 'luaV_fastgetv' for integers, inlining the array case
+** of 'luaH_getint'; 'ok' gets the result. It is a statement, so that
+** 't' is read before 'res' (which may be the same stack slot) is written.
+*/
+#define luaV_fastgeti(L,t,k,res,slot,ok) \
+  { if (!ttistable(t)) { slot = NULL; ok = 0; }  \
+    else {  \
+      Table *h_ = hvalue(t);  \
+      lua_Unsigned u_ = l_castS2U(k) - 1u;  \
+      slot = &luaH_absentkey;  \
+      if (u_ < h_->alimit) {  \
+        ok = !arrayisempty(h_, u_);  \
+        if (ok) arr2obj(h_, u_, res); }  \
+      else ok = luaH_getint(h_, k, res); } }
+
+
 /*
 ** Finish a fast set operation (when fast get succeeds). In that case,
 ** 'slot' points to the place to put the value.
 */
 #define luaV_finishfastset(L,t,slot,v) \
     { setobj2t(L, cast(TValue *,slot), v); \
-      luaC_barrierback(L, gcvalue(t), v); }
+      luaC_barrierslot(L, hvalue(t), slot, v); }
+
+
+/*
+** Fast track for 'settable' with keys that may live in the array part:
+** if 't' is a table and 't[k]' is present, assign 'v' to it (with its
+** barrier) and return 1. Otherwise, return 0 with 'slot' NULL (if 't'
+** is not a table) or pointing to what 'luaH_finishset' must complete.
+** 'f' is the "protected" set function to use, for a TValue key 'k'.
+*/
+#define luaV_fastset(L,t,k,slot,f,v) \
+  (!ttistable(t)  \
+   ? (slot = NULL, 0)  /* not a table; 'slot' is NULL and result is 0 */  \
+   : ((slot = f(hvalue(t), k, v)) == NULL  \
+      ? (luaC_barrierkey(L, hvalue(t), k, v), 1) : 0))
+
+
+/*
+** Special case of 'luaV_fastset' for integers, inlining the array case
+** of 'luaH_psetint'.
+*/
+#define luaV_fastseti(L,t,k,slot,v) \
+  ((ttistable(t) && l_castS2U(k) - 1u < hvalue(t)->alimit &&  \
+    !arrayisempty(hvalue(t), l_castS2U(k) - 1u))  \
+   ? (obj2arr(hvalue(t), l_castS2U(k) - 1u, v),  \
+      luaC_barrierindex(L, hvalue(t), cast_uint(l_castS2U(k) - 1u), v), 1)  \
+   : (!ttistable(t)  \
+      ? (slot = NULL, 0)  \
+      : ((slot = luaH_psetint(hvalue(t), k, v)) == NULL  \
+         ? (luaC_barrierback(L, gcvalue(t), v), 1) : 0)))
 
 
 
@@ -118,5 +183,9 @@ LUAI_FUNC lua_Integer luaV_div (lua_State *L, lua_Integer x, lua_Integer y);
 LUAI_FUNC lua_Integer luaV_mod (lua_State *L, lua_Integer x, lua_Integer y);
 LUAI_FUNC lua_Integer luaV_shiftl (lua_Integer x, lua_Integer y);
 LUAI_FUNC void luaV_objlen (lua_State *L, StkId ra, const TValue *rb);
+LUAI_FUNC int luaV_forlimit (const TValue *obj, lua_Integer *p,
+                             lua_Integer step, int *stopnow);
+LUAI_FUNC void luaV_closure (lua_State *L, LClosure *cl, Proto *p,
+                             StkId base, StkId ra);
 
 #endif